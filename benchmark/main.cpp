@@ -0,0 +1,300 @@
+// Microbenchmarks of the hot kernels, reported as JSON and optionally compared with a baseline.
+//
+// Usage:
+//     securefs_bench --output baseline.json           # record a baseline on the release machine
+//     securefs_bench --baseline baseline.json         # fails if any kernel became slower
+#include "benchmark.h"
+#include "btree_dir.h"
+#include "case_fold.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "lite_stream.h"
+#include "myutils.h"
+#include "mystring.h"
+#include "platform.h"
+#include "streams.h"
+
+#include <json/json.h>
+#include <tclap/CmdLine.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace securefs;
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+
+// Keeps the results of the measured kernels alive
+volatile byte sink;
+
+struct Kernel
+{
+    std::string name;
+    size_t bytes_per_op;    // 0 if throughput in bytes is meaningless
+    std::function<void()> run;
+};
+
+// Runs `kernel` for batches of doubling size until one takes at least `min_seconds`, and
+// reports the best of three such batches
+Json::Value measure_kernel(const Kernel& kernel, double min_seconds)
+{
+    uint64_t iterations = 1;
+    double best_ns = 0;
+    for (int round = 0; round < 3; ++round)
+    {
+        while (true)
+        {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < iterations; ++i)
+                kernel.run();
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            if (seconds < min_seconds)
+            {
+                iterations *= 2;
+                continue;
+            }
+            double ns = seconds * 1e9 / iterations;
+            if (round == 0 || ns < best_ns)
+                best_ns = ns;
+            break;
+        }
+    }
+    Json::Value result;
+    result["ns_per_op"] = best_ns;
+    result["iterations"] = static_cast<Json::UInt64>(iterations);
+    if (kernel.bytes_per_op > 0)
+        result["mb_per_sec"] = kernel.bytes_per_op / best_ns * 1e3;
+    return result;
+}
+
+std::vector<Kernel> make_kernels()
+{
+    std::vector<Kernel> kernels;
+
+    auto name_bytes = std::make_shared<std::vector<byte>>(48);
+    generate_random(name_bytes->data(), name_bytes->size());
+    auto encoded = std::make_shared<std::string>();
+    base32_encode(name_bytes->data(), name_bytes->size(), *encoded);
+    kernels.push_back({"base32_encode", name_bytes->size(), [name_bytes]() {
+                           std::string output;
+                           base32_encode(name_bytes->data(), name_bytes->size(), output);
+                           sink ^= output[0];
+                       }});
+    kernels.push_back({"base32_decode", encoded->size(), [encoded]() {
+                           std::string output;
+                           base32_decode(encoded->data(), encoded->size(), output);
+                           sink ^= output[0];
+                       }});
+
+    auto mixed_case = std::make_shared<std::string>(
+        "Quarterly Report \xce\xa3\xce\xaf\xcf\x83\xcf\x85\xcf\x86\xce\xbf\xcf\x82 "
+        "FINAL (2).DOCX");
+    kernels.push_back({"case_fold", mixed_case->size(), [mixed_case]() {
+                           auto folded = case_fold(*mixed_case);
+                           sink ^= folded[0];
+                       }});
+
+    key_type key;
+    generate_random(key.data(), key.size());
+    auto siv = std::make_shared<AES_SIV>(key.data(), key.size());
+    auto siv_buffer
+        = std::make_shared<std::vector<byte>>(name_bytes->size() + AES_SIV::IV_SIZE);
+    kernels.push_back(
+        {"aes_siv_encrypt", name_bytes->size(), [siv, name_bytes, siv_buffer]() {
+             siv->encrypt_and_authenticate(name_bytes->data(),
+                                           name_bytes->size(),
+                                           nullptr,
+                                           0,
+                                           siv_buffer->data() + AES_SIV::IV_SIZE,
+                                           siv_buffer->data());
+             sink ^= (*siv_buffer)[0];
+         }});
+
+    kernels.push_back({"hkdf", 0, [key]() {
+                           byte output[KEY_LENGTH * 3];
+                           hkdf(key.data(),
+                                key.size(),
+                                nullptr,
+                                0,
+                                key.data(),
+                                key.size(),
+                                output,
+                                sizeof(output));
+                           sink ^= output[0];
+                       }});
+
+    auto zeros = std::make_shared<std::vector<byte>>(4096, 0);
+    kernels.push_back({"is_all_zeros", zeros->size(), [zeros]() {
+                           sink ^= static_cast<byte>(
+                               is_all_zeros(zeros->data(), zeros->size()));
+                       }});
+
+    // A full node, as written by the directories of the full format
+    auto node = std::make_shared<BtreeNode>(INVALID_PAGE, 0);
+    for (int i = 0; i < BTREE_MAX_NUM_ENTRIES; ++i)
+    {
+        DirEntry entry;
+        entry.filename = strprintf("document-%04d-final-version.txt", i);
+        generate_random(entry.id.data(), entry.id.size());
+        entry.type = FileBase::REGULAR_FILE;
+        node->mutable_entries().push_back(std::move(entry));
+    }
+    auto node_buffer = std::make_shared<std::vector<byte>>(BLOCK_SIZE);
+    node->to_buffer(node_buffer->data(), node_buffer->size());
+    kernels.push_back({"btree_node_to_buffer", BLOCK_SIZE, [node, node_buffer]() {
+                           node->to_buffer(node_buffer->data(), node_buffer->size());
+                           sink ^= (*node_buffer)[0];
+                       }});
+    kernels.push_back({"btree_node_from_buffer", BLOCK_SIZE, [node_buffer]() {
+                           BtreeNode parsed(INVALID_PAGE, 0);
+                           sink ^= static_cast<byte>(
+                               parsed.from_buffer(node_buffer->data(), node_buffer->size()));
+                       }});
+
+    // Single block writes and reads, which encrypt and decrypt one GCM message each. The
+    // underlying files are in memory, so that only the computation is measured.
+    const unsigned block_size = 4096;
+    auto block = std::make_shared<std::vector<byte>>(block_size);
+    generate_random(block->data(), block->size());
+    id_type id;
+    generate_random(id.data(), id.size());
+    MemoryOSService memory;
+    auto create = [&](const char* name) {
+        return memory.open_file_stream(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    };
+    std::shared_ptr<StreamBase> full_stream
+        = make_cryptstream_aead(
+              create("full.data"), create("full.meta"), key, key, id, true, block_size, 12)
+              .first;
+    std::shared_ptr<StreamBase> lite_stream
+        = std::make_shared<lite::AEADCryptStream>(create("lite"), key, block_size, 12);
+    for (auto&& pair :
+         {std::make_pair("full", full_stream), std::make_pair("lite", lite_stream)})
+    {
+        auto stream = pair.second;
+        stream->write(block->data(), 0, block->size());
+        kernels.push_back(
+            {strprintf("%s_block_write", pair.first), block_size, [stream, block]() {
+                 stream->write(block->data(), 0, block->size());
+             }});
+        kernels.push_back(
+            {strprintf("%s_block_read", pair.first), block_size, [stream, block]() {
+                 stream->read(block->data(), 0, block->size());
+                 sink ^= (*block)[0];
+             }});
+    }
+    return kernels;
+}
+
+Json::Value read_json_file(const std::string& path)
+{
+    auto stream = OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+    std::string buffer(stream->size(), 0);
+    stream->read(&buffer[0], 0, buffer.size());
+    Json::CharReaderBuilder builder;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    Json::Value value;
+    std::string errors;
+    if (!reader->parse(buffer.data(), buffer.data() + buffer.size(), &value, &errors))
+        throwInvalidArgumentException(
+            strprintf("Invalid JSON in %s: %s", path.c_str(), errors.c_str()));
+    return value;
+}
+
+void write_json_file(const std::string& path, const Json::Value& value)
+{
+    auto text = value.toStyledString();
+    auto stream
+        = OSService::get_default().open_file_stream(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stream->write(text.data(), 0, text.size());
+}
+
+int run(int argc, char** argv)
+{
+    TCLAP::CmdLine cmdline("Microbenchmarks of the hot kernels of securefs");
+    TCLAP::ValueArg<std::string> filter{
+        "", "filter", "Only run the kernels whose names contain this string", false, "", "string"};
+    TCLAP::ValueArg<double> min_time{
+        "", "min-time", "Minimum seconds of each timed batch", false, 0.1, "seconds"};
+    TCLAP::ValueArg<std::string> output{"",
+                                        "output",
+                                        "Also write the results to this file, e.g. to record a "
+                                        "baseline",
+                                        false,
+                                        "",
+                                        "path"};
+    TCLAP::ValueArg<std::string> baseline{
+        "",
+        "baseline",
+        "Compare the results with those stored in this file, and fail if any kernel is slower "
+        "beyond the tolerance",
+        false,
+        "",
+        "path"};
+    TCLAP::ValueArg<double> tolerance{
+        "", "tolerance", "Allowed slowdown relative to the baseline", false, 0.15, "fraction"};
+    cmdline.add(&filter);
+    cmdline.add(&min_time);
+    cmdline.add(&output);
+    cmdline.add(&baseline);
+    cmdline.add(&tolerance);
+    cmdline.parse(argc, argv);
+
+    if (min_time.getValue() <= 0)
+        throwInvalidArgumentException("The minimum time of each batch must be positive");
+    Json::Value results(Json::objectValue);
+    for (const Kernel& kernel : make_kernels())
+    {
+        if (kernel.name.find(filter.getValue()) == std::string::npos)
+            continue;
+        results[kernel.name] = measure_kernel(kernel, min_time.getValue());
+    }
+
+    int status = 0;
+    if (baseline.isSet())
+    {
+        for (const std::string& name : compare_with_baseline(
+                 results, read_json_file(baseline.getValue()), tolerance.getValue()))
+        {
+            fprintf(stderr,
+                    "Regression: %s takes %.2fx as long as the baseline\n",
+                    name.c_str(),
+                    results[name]["ratio_to_baseline"].asDouble());
+            status = 1;
+        }
+    }
+
+    fputs(results.toStyledString().c_str(), stdout);
+    if (output.isSet())
+        write_json_file(output.getValue(), results);
+    return status;
+}
+}    // namespace
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        return run(argc, argv);
+    }
+    catch (const TCLAP::ArgException& e)
+    {
+        fprintf(stderr,
+                "Error parsing arguments: %s at %s\n",
+                e.error().c_str(),
+                e.argId().c_str());
+        return 5;
+    }
+    catch (const std::exception& e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+}
@@ -0,0 +1,506 @@
+#include "aead.h"
+#include "exceptions.h"
+
+#include <cryptopp/config.h>
+#include <cryptopp/misc.h>
+
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+#include <cryptopp/cpu.h>
+#include <emmintrin.h>
+#define SECUREFS_CHACHA_SSE2 1
+// A PORTABLE_BUILD for i686 lacks SSE2 in its baseline, and the block function is only called
+// after HasSSE2()
+#if defined(__GNUC__) && !defined(__SSE2__)
+#define SECUREFS_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define SECUREFS_TARGET_SSE2
+#endif
+#else
+#define SECUREFS_CHACHA_SSE2 0
+#endif
+
+#include <algorithm>
+
+namespace securefs
+{
+const char* aead_algorithm_name(AEADAlgorithm algorithm) noexcept
+{
+    switch (algorithm)
+    {
+    case AEADAlgorithm::AES_GCM:
+        return "aes-gcm";
+    case AEADAlgorithm::CHACHA20_POLY1305:
+        return "chacha20-poly1305";
+    }
+    return "unknown";
+}
+
+AEADAlgorithm parse_aead_algorithm(const std::string& name)
+{
+    if (name == aead_algorithm_name(AEADAlgorithm::AES_GCM))
+        return AEADAlgorithm::AES_GCM;
+    if (name == aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305))
+        return AEADAlgorithm::CHACHA20_POLY1305;
+    throwInvalidArgumentException("Unknown cipher " + name);
+}
+
+std::shared_ptr<AEADContext> make_aead_context(AEADAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case AEADAlgorithm::AES_GCM:
+        return std::make_shared<AESGCMContext>();
+    case AEADAlgorithm::CHACHA20_POLY1305:
+        return std::make_shared<ChaCha20Poly1305Context>();
+    }
+    throwInvalidArgumentException("Unknown cipher");
+}
+
+namespace
+{
+    inline uint32_t rotate_left(uint32_t x, unsigned n) { return (x << n) | (x >> (32 - n)); }
+
+    inline uint32_t load_le32(const byte* p)
+    {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    inline void store_le32(byte* p, uint32_t x)
+    {
+        p[0] = static_cast<byte>(x);
+        p[1] = static_cast<byte>(x >> 8);
+        p[2] = static_cast<byte>(x >> 16);
+        p[3] = static_cast<byte>(x >> 24);
+    }
+
+    void chacha20_block(const uint32_t key[8],
+                        uint32_t counter,
+                        const uint32_t nonce[3],
+                        byte output[64])
+    {
+        uint32_t state[16] = {0x61707865,
+                              0x3320646e,
+                              0x79622d32,
+                              0x6b206574,
+                              key[0],
+                              key[1],
+                              key[2],
+                              key[3],
+                              key[4],
+                              key[5],
+                              key[6],
+                              key[7],
+                              counter,
+                              nonce[0],
+                              nonce[1],
+                              nonce[2]};
+        uint32_t x[16];
+        memcpy(x, state, sizeof(x));
+
+        for (int i = 0; i < 10; ++i)
+        {
+#define QR(a, b, c, d)                                                                             \
+    x[a] += x[b];                                                                                  \
+    x[d] = rotate_left(x[d] ^ x[a], 16);                                                           \
+    x[c] += x[d];                                                                                  \
+    x[b] = rotate_left(x[b] ^ x[c], 12);                                                           \
+    x[a] += x[b];                                                                                  \
+    x[d] = rotate_left(x[d] ^ x[a], 8);                                                            \
+    x[c] += x[d];                                                                                  \
+    x[b] = rotate_left(x[b] ^ x[c], 7)
+            /* Operate on columns. */
+            QR(0, 4, 8, 12);
+            QR(1, 5, 9, 13);
+            QR(2, 6, 10, 14);
+            QR(3, 7, 11, 15);
+
+            /* Operate on diagonals. */
+            QR(0, 5, 10, 15);
+            QR(1, 6, 11, 12);
+            QR(2, 7, 8, 13);
+            QR(3, 4, 9, 14);
+#undef QR
+        }
+
+        for (int i = 0; i < 16; ++i)
+            store_le32(output + 4 * i, x[i] + state[i]);
+        CryptoPP::SecureWipeArray(x, array_length(x));
+    }
+
+    // Poly1305 with a one-time key, as ChaCha20-Poly1305 requires (RFC 8439, section 2.5). Crypto++
+    // only ships Poly1305-AES, where the second half of the key is derived from a nonce. This is
+    // poly1305-donna-32, with the accumulator and `r` held in five 26-bit limbs.
+    class Poly1305
+    {
+        DISABLE_COPY_MOVE(Poly1305)
+
+    private:
+        static const uint32_t LIMB_MASK = 0x3ffffff;
+
+        uint32_t m_r[5], m_h[5], m_pad[4];
+        byte m_buffer[16];
+        size_t m_leftover;
+        bool m_final;
+
+        void blocks(const byte* message, size_t length)
+        {
+            const uint32_t hibit = m_final ? 0 : (1u << 24);
+            const uint32_t r0 = m_r[0], r1 = m_r[1], r2 = m_r[2], r3 = m_r[3], r4 = m_r[4];
+            const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+            uint32_t h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+            for (; length >= 16; message += 16, length -= 16)
+            {
+                h0 += load_le32(message) & LIMB_MASK;
+                h1 += (load_le32(message + 3) >> 2) & LIMB_MASK;
+                h2 += (load_le32(message + 6) >> 4) & LIMB_MASK;
+                h3 += (load_le32(message + 9) >> 6) & LIMB_MASK;
+                h4 += (load_le32(message + 12) >> 8) | hibit;
+
+                uint64_t d0 = static_cast<uint64_t>(h0) * r0 + static_cast<uint64_t>(h1) * s4
+                    + static_cast<uint64_t>(h2) * s3 + static_cast<uint64_t>(h3) * s2
+                    + static_cast<uint64_t>(h4) * s1;
+                uint64_t d1 = static_cast<uint64_t>(h0) * r1 + static_cast<uint64_t>(h1) * r0
+                    + static_cast<uint64_t>(h2) * s4 + static_cast<uint64_t>(h3) * s3
+                    + static_cast<uint64_t>(h4) * s2;
+                uint64_t d2 = static_cast<uint64_t>(h0) * r2 + static_cast<uint64_t>(h1) * r1
+                    + static_cast<uint64_t>(h2) * r0 + static_cast<uint64_t>(h3) * s4
+                    + static_cast<uint64_t>(h4) * s3;
+                uint64_t d3 = static_cast<uint64_t>(h0) * r3 + static_cast<uint64_t>(h1) * r2
+                    + static_cast<uint64_t>(h2) * r1 + static_cast<uint64_t>(h3) * r0
+                    + static_cast<uint64_t>(h4) * s4;
+                uint64_t d4 = static_cast<uint64_t>(h0) * r4 + static_cast<uint64_t>(h1) * r3
+                    + static_cast<uint64_t>(h2) * r2 + static_cast<uint64_t>(h3) * r1
+                    + static_cast<uint64_t>(h4) * r0;
+
+                // Partial reduction modulo 2^130 - 5
+                uint32_t carry = static_cast<uint32_t>(d0 >> 26);
+                h0 = static_cast<uint32_t>(d0) & LIMB_MASK;
+                d1 += carry;
+                carry = static_cast<uint32_t>(d1 >> 26);
+                h1 = static_cast<uint32_t>(d1) & LIMB_MASK;
+                d2 += carry;
+                carry = static_cast<uint32_t>(d2 >> 26);
+                h2 = static_cast<uint32_t>(d2) & LIMB_MASK;
+                d3 += carry;
+                carry = static_cast<uint32_t>(d3 >> 26);
+                h3 = static_cast<uint32_t>(d3) & LIMB_MASK;
+                d4 += carry;
+                carry = static_cast<uint32_t>(d4 >> 26);
+                h4 = static_cast<uint32_t>(d4) & LIMB_MASK;
+                h0 += carry * 5;
+                carry = h0 >> 26;
+                h0 &= LIMB_MASK;
+                h1 += carry;
+            }
+
+            m_h[0] = h0;
+            m_h[1] = h1;
+            m_h[2] = h2;
+            m_h[3] = h3;
+            m_h[4] = h4;
+        }
+
+    public:
+        explicit Poly1305(const byte key[32]) : m_leftover(0), m_final(false)
+        {
+            // Clamps `r` as the algorithm requires while splitting it into limbs
+            m_r[0] = load_le32(key) & 0x3ffffff;
+            m_r[1] = (load_le32(key + 3) >> 2) & 0x3ffff03;
+            m_r[2] = (load_le32(key + 6) >> 4) & 0x3ffc0ff;
+            m_r[3] = (load_le32(key + 9) >> 6) & 0x3f03fff;
+            m_r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+            for (size_t i = 0; i < array_length(m_pad); ++i)
+                m_pad[i] = load_le32(key + 16 + 4 * i);
+            memset(m_h, 0, sizeof(m_h));
+        }
+
+        ~Poly1305()
+        {
+            CryptoPP::SecureWipeArray(m_r, array_length(m_r));
+            CryptoPP::SecureWipeArray(m_h, array_length(m_h));
+            CryptoPP::SecureWipeArray(m_pad, array_length(m_pad));
+            CryptoPP::SecureWipeArray(m_buffer, array_length(m_buffer));
+        }
+
+        void update(const byte* message, size_t length)
+        {
+            if (m_leftover > 0)
+            {
+                size_t want = std::min(sizeof(m_buffer) - m_leftover, length);
+                memcpy(m_buffer + m_leftover, message, want);
+                message += want;
+                length -= want;
+                m_leftover += want;
+                if (m_leftover < sizeof(m_buffer))
+                    return;
+                blocks(m_buffer, sizeof(m_buffer));
+                m_leftover = 0;
+            }
+            size_t whole = length & ~static_cast<size_t>(15);
+            blocks(message, whole);
+            message += whole;
+            length -= whole;
+            if (length > 0)
+            {
+                memcpy(m_buffer, message, length);
+                m_leftover = length;
+            }
+        }
+
+        void finish(byte mac[16])
+        {
+            if (m_leftover > 0)
+            {
+                // A partial block is padded with a single one bit instead of the implicit 2^128
+                m_buffer[m_leftover] = 1;
+                memset(m_buffer + m_leftover + 1, 0, sizeof(m_buffer) - m_leftover - 1);
+                m_final = true;
+                blocks(m_buffer, sizeof(m_buffer));
+            }
+
+            uint32_t h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+            // Full carry, then reduce modulo 2^130 - 5 by computing h + 5 - 2^130
+            uint32_t carry = h1 >> 26;
+            h1 &= LIMB_MASK;
+            h2 += carry;
+            carry = h2 >> 26;
+            h2 &= LIMB_MASK;
+            h3 += carry;
+            carry = h3 >> 26;
+            h3 &= LIMB_MASK;
+            h4 += carry;
+            carry = h4 >> 26;
+            h4 &= LIMB_MASK;
+            h0 += carry * 5;
+            carry = h0 >> 26;
+            h0 &= LIMB_MASK;
+            h1 += carry;
+
+            uint32_t g0 = h0 + 5;
+            carry = g0 >> 26;
+            g0 &= LIMB_MASK;
+            uint32_t g1 = h1 + carry;
+            carry = g1 >> 26;
+            g1 &= LIMB_MASK;
+            uint32_t g2 = h2 + carry;
+            carry = g2 >> 26;
+            g2 &= LIMB_MASK;
+            uint32_t g3 = h3 + carry;
+            carry = g3 >> 26;
+            g3 &= LIMB_MASK;
+            uint32_t g4 = h4 + carry - (1u << 26);
+
+            // Selects g when it did not underflow, in constant time
+            uint32_t select = (g4 >> 31) - 1;
+            h0 = (h0 & ~select) | (g0 & select);
+            h1 = (h1 & ~select) | (g1 & select);
+            h2 = (h2 & ~select) | (g2 & select);
+            h3 = (h3 & ~select) | (g3 & select);
+            h4 = (h4 & ~select) | (g4 & select);
+
+            // Repacks into four 32-bit words and adds the second half of the key
+            uint32_t words[4] = {h0 | (h1 << 26),
+                                 (h1 >> 6) | (h2 << 20),
+                                 (h2 >> 12) | (h3 << 14),
+                                 (h3 >> 18) | (h4 << 8)};
+            uint64_t sum = 0;
+            for (size_t i = 0; i < array_length(words); ++i)
+            {
+                sum = static_cast<uint64_t>(words[i]) + m_pad[i] + (sum >> 32);
+                store_le32(mac + 4 * i, static_cast<uint32_t>(sum));
+            }
+        }
+    };
+
+#if SECUREFS_CHACHA_SSE2
+    // Computes four consecutive blocks at once, with each vector holding the same word of all four
+    SECUREFS_TARGET_SSE2 void chacha20_blocks4_sse2(const uint32_t key[8],
+                                                    uint32_t counter,
+                                                    const uint32_t nonce[3],
+                                                    byte output[256])
+    {
+        static const uint32_t constants[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+        __m128i state[16], x[16];
+        for (int i = 0; i < 4; ++i)
+            state[i] = _mm_set1_epi32(static_cast<int>(constants[i]));
+        for (int i = 0; i < 8; ++i)
+            state[4 + i] = _mm_set1_epi32(static_cast<int>(key[i]));
+        state[12] = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(counter)),
+                                  _mm_set_epi32(3, 2, 1, 0));
+        for (int i = 0; i < 3; ++i)
+            state[13 + i] = _mm_set1_epi32(static_cast<int>(nonce[i]));
+        memcpy(x, state, sizeof(x));
+
+        for (int i = 0; i < 10; ++i)
+        {
+#define ROTATE(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define QR(a, b, c, d)                                                                             \
+    x[a] = _mm_add_epi32(x[a], x[b]);                                                              \
+    x[d] = ROTATE(_mm_xor_si128(x[d], x[a]), 16);                                                  \
+    x[c] = _mm_add_epi32(x[c], x[d]);                                                              \
+    x[b] = ROTATE(_mm_xor_si128(x[b], x[c]), 12);                                                  \
+    x[a] = _mm_add_epi32(x[a], x[b]);                                                              \
+    x[d] = ROTATE(_mm_xor_si128(x[d], x[a]), 8);                                                   \
+    x[c] = _mm_add_epi32(x[c], x[d]);                                                              \
+    x[b] = ROTATE(_mm_xor_si128(x[b], x[c]), 7)
+            QR(0, 4, 8, 12);
+            QR(1, 5, 9, 13);
+            QR(2, 6, 10, 14);
+            QR(3, 7, 11, 15);
+
+            QR(0, 5, 10, 15);
+            QR(1, 6, 11, 12);
+            QR(2, 7, 8, 13);
+            QR(3, 4, 9, 14);
+#undef QR
+#undef ROTATE
+        }
+
+        // Transpose each group of four words back into the four blocks
+        for (int i = 0; i < 16; i += 4)
+        {
+            __m128i a = _mm_add_epi32(x[i], state[i]);
+            __m128i b = _mm_add_epi32(x[i + 1], state[i + 1]);
+            __m128i c = _mm_add_epi32(x[i + 2], state[i + 2]);
+            __m128i d = _mm_add_epi32(x[i + 3], state[i + 3]);
+            __m128i ab_low = _mm_unpacklo_epi32(a, b), cd_low = _mm_unpacklo_epi32(c, d);
+            __m128i ab_high = _mm_unpackhi_epi32(a, b), cd_high = _mm_unpackhi_epi32(c, d);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 4 * i),
+                             _mm_unpacklo_epi64(ab_low, cd_low));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 64 + 4 * i),
+                             _mm_unpackhi_epi64(ab_low, cd_low));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 128 + 4 * i),
+                             _mm_unpacklo_epi64(ab_high, cd_high));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 192 + 4 * i),
+                             _mm_unpackhi_epi64(ab_high, cd_high));
+        }
+    }
+#endif
+}    // namespace
+
+void ChaCha20Poly1305Context::set_key(const byte* key, size_t key_size)
+{
+    if (key_size != KEY_SIZE)
+        throwInvalidArgumentException("ChaCha20-Poly1305 requires 256-bit keys");
+    for (size_t i = 0; i < m_key.size(); ++i)
+        m_key[i] = load_le32(key + 4 * i);
+}
+
+void ChaCha20Poly1305Context::check_iv_size(size_t iv_size) const
+{
+    if (iv_size != IV_SIZE)
+        throwInvalidArgumentException("ChaCha20-Poly1305 requires 96-bit IVs");
+}
+
+void ChaCha20Poly1305Context::chacha20(
+    const byte* iv, uint32_t counter, const byte* input, byte* output, size_t length)
+{
+    const uint32_t nonce[3] = {load_le32(iv), load_le32(iv + 4), load_le32(iv + 8)};
+    CryptoPP::FixedSizeAlignedSecBlock<byte, 256> block;
+
+#if SECUREFS_CHACHA_SSE2
+    static const bool has_sse2 = CryptoPP::HasSSE2();
+    if (has_sse2)
+    {
+        for (; length >= block.size(); counter += 4)
+        {
+            chacha20_blocks4_sse2(m_key.data(), counter, nonce, block.data());
+            CryptoPP::xorbuf(output, input, block.data(), block.size());
+            input += block.size();
+            output += block.size();
+            length -= block.size();
+        }
+    }
+#endif
+
+    while (length > 0)
+    {
+        chacha20_block(m_key.data(), counter++, nonce, block.data());
+        size_t n = std::min<size_t>(length, 64);
+        CryptoPP::xorbuf(output, input, block.data(), n);
+        input += n;
+        output += n;
+        length -= n;
+    }
+}
+
+void ChaCha20Poly1305Context::compute_mac(const byte* iv,
+                                          const byte* aad,
+                                          size_t aad_size,
+                                          const byte* ciphertext,
+                                          size_t length,
+                                          byte* mac)
+{
+    CryptoPP::FixedSizeAlignedSecBlock<byte, 64> one_time_key;
+    const uint32_t nonce[3] = {load_le32(iv), load_le32(iv + 4), load_le32(iv + 8)};
+    chacha20_block(m_key.data(), 0, nonce, one_time_key.data());
+
+    Poly1305 poly(one_time_key.data());
+
+    static const byte padding[16] = {0};
+    poly.update(aad, aad_size);
+    poly.update(padding, (16 - aad_size % 16) % 16);
+    poly.update(ciphertext, length);
+    poly.update(padding, (16 - length % 16) % 16);
+
+    byte lengths[16];
+    CryptoPP::PutWord<CryptoPP::word64>(
+        false, CryptoPP::LITTLE_ENDIAN_ORDER, lengths, static_cast<CryptoPP::word64>(aad_size));
+    CryptoPP::PutWord<CryptoPP::word64>(
+        false, CryptoPP::LITTLE_ENDIAN_ORDER, lengths + 8, static_cast<CryptoPP::word64>(length));
+    poly.update(lengths, sizeof(lengths));
+    poly.finish(mac);
+}
+
+void ChaCha20Poly1305Context::encrypt(byte* output,
+                                      byte* mac,
+                                      size_t mac_size,
+                                      const byte* iv,
+                                      size_t iv_size,
+                                      const byte* aad,
+                                      size_t aad_size,
+                                      const byte* input,
+                                      size_t length)
+{
+    check_iv_size(iv_size);
+    if (mac_size > MAC_SIZE)
+        throwInvalidArgumentException("MAC too long");
+
+    chacha20(iv, 1, input, output, length);
+    byte full_mac[MAC_SIZE];
+    compute_mac(iv, aad, aad_size, output, length, full_mac);
+    memcpy(mac, full_mac, mac_size);
+}
+
+bool ChaCha20Poly1305Context::decrypt(byte* output,
+                                      const byte* mac,
+                                      size_t mac_size,
+                                      const byte* iv,
+                                      size_t iv_size,
+                                      const byte* aad,
+                                      size_t aad_size,
+                                      const byte* input,
+                                      size_t length)
+{
+    check_iv_size(iv_size);
+    if (mac_size > MAC_SIZE)
+        throwInvalidArgumentException("MAC too long");
+
+    // The MAC is over the ciphertext, so it has to be computed before the input may be overwritten
+    byte full_mac[MAC_SIZE];
+    compute_mac(iv, aad, aad_size, input, length, full_mac);
+    chacha20(iv, 1, input, output, length);
+    return CryptoPP::VerifyBufsEqual(full_mac, mac, mac_size);
+}
+
+bool ChaCha20Poly1305Context::decrypt_unverified(
+    byte* output, const byte* iv, size_t iv_size, const byte* input, size_t length)
+{
+    check_iv_size(iv_size);
+    chacha20(iv, 1, input, output, length);
+    return true;
+}
+}    // namespace securefs
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "myutils.h"
+
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/modes.h>
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace securefs
+{
+/**
+ * The authenticated ciphers available for the contents of files.
+ */
+enum class AEADAlgorithm
+{
+    AES_GCM,
+    CHACHA20_POLY1305,
+};
+
+const char* aead_algorithm_name(AEADAlgorithm algorithm) noexcept;
+
+// Throws if `name` does not name any algorithm
+AEADAlgorithm parse_aead_algorithm(const std::string& name);
+
+/**
+ * A keyed authenticated cipher, with the same calling convention as the `EncryptAndAuthenticate`
+ * and `DecryptAndVerify` of Crypto++.
+ *
+ * The contexts carry per-message state, so a single context must not be used concurrently.
+ */
+class AEADContext
+{
+    DISABLE_COPY_MOVE(AEADContext)
+
+public:
+    AEADContext() {}
+    virtual ~AEADContext() {}
+
+    virtual void set_key(const byte* key, size_t key_size) = 0;
+
+    virtual void encrypt(byte* output,
+                         byte* mac,
+                         size_t mac_size,
+                         const byte* iv,
+                         size_t iv_size,
+                         const byte* aad,
+                         size_t aad_size,
+                         const byte* input,
+                         size_t length)
+        = 0;
+
+    // Returns false if the MAC does not match. The output is filled regardless.
+    virtual bool decrypt(byte* output,
+                         const byte* mac,
+                         size_t mac_size,
+                         const byte* iv,
+                         size_t iv_size,
+                         const byte* aad,
+                         size_t aad_size,
+                         const byte* input,
+                         size_t length)
+        = 0;
+
+    /**
+     * Decrypts while neither computing nor verifying the MAC. Returns false, doing nothing, when
+     * the cipher cannot do so for the given IV size.
+     */
+    virtual bool decrypt_unverified(
+        byte* output, const byte* iv, size_t iv_size, const byte* input, size_t length)
+        = 0;
+};
+
+/**
+ * A pair of AES-GCM contexts set up with the same key, with the key schedule and the GHASH tables
+ * already computed, plus a bare AES-CTR context for decrypting without authentication.
+ */
+class AESGCMContext final : public AEADContext
+{
+public:
+    CryptoPP::GCM<CryptoPP::AES>::Encryption encryptor;
+    CryptoPP::GCM<CryptoPP::AES>::Decryption decryptor;
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption keystream;
+
+    AESGCMContext() {}
+
+    void set_key(const byte* key, size_t key_size) override
+    {
+        // The null iv is only a placeholder; it will replaced during encryption and decryption
+        const byte null_iv[16] = {0};
+        encryptor.SetKeyWithIV(key, key_size, null_iv, 12);
+        decryptor.SetKeyWithIV(key, key_size, null_iv, 12);
+        keystream.SetKeyWithIV(key, key_size, null_iv, array_length(null_iv));
+    }
+
+    void encrypt(byte* output,
+                 byte* mac,
+                 size_t mac_size,
+                 const byte* iv,
+                 size_t iv_size,
+                 const byte* aad,
+                 size_t aad_size,
+                 const byte* input,
+                 size_t length) override
+    {
+        encryptor.EncryptAndAuthenticate(output,
+                                         mac,
+                                         mac_size,
+                                         iv,
+                                         static_cast<int>(iv_size),
+                                         aad,
+                                         aad_size,
+                                         input,
+                                         length);
+    }
+
+    bool decrypt(byte* output,
+                 const byte* mac,
+                 size_t mac_size,
+                 const byte* iv,
+                 size_t iv_size,
+                 const byte* aad,
+                 size_t aad_size,
+                 const byte* input,
+                 size_t length) override
+    {
+        return decryptor.DecryptAndVerify(output,
+                                          mac,
+                                          mac_size,
+                                          iv,
+                                          static_cast<int>(iv_size),
+                                          aad,
+                                          aad_size,
+                                          input,
+                                          length);
+    }
+
+    /**
+     * With a 96-bit IV, GCM encrypts with AES-CTR starting from the IV followed by a big endian 2,
+     * so only the keystream is needed. Other IV sizes derive the initial counter through GHASH.
+     */
+    bool decrypt_unverified(
+        byte* output, const byte* iv, size_t iv_size, const byte* input, size_t length) override
+    {
+        if (iv_size != 12)
+            return false;
+        byte counter[16] = {0};
+        memcpy(counter, iv, iv_size);
+        counter[15] = 2;
+        keystream.Resynchronize(counter, array_length(counter));
+        keystream.ProcessData(output, input, length);
+        return true;
+    }
+};
+
+/**
+ * ChaCha20-Poly1305 as specified in https://tools.ietf.org/html/rfc8439, which requires 96-bit IVs.
+ *
+ * Unlike AES-GCM, it runs at the same speed with or without hardware support for AES.
+ */
+class ChaCha20Poly1305Context final : public AEADContext
+{
+public:
+    static constexpr size_t KEY_SIZE = 32, IV_SIZE = 12, MAC_SIZE = 16;
+
+private:
+    CryptoPP::FixedSizeAlignedSecBlock<uint32_t, 8> m_key;
+
+    void check_iv_size(size_t iv_size) const;
+    void compute_mac(const byte* iv,
+                     const byte* aad,
+                     size_t aad_size,
+                     const byte* ciphertext,
+                     size_t length,
+                     byte* mac);
+
+public:
+    ChaCha20Poly1305Context() {}
+
+    // Applies the keystream starting from the given block counter; exposed for testing
+    void chacha20(const byte* iv, uint32_t counter, const byte* input, byte* output, size_t length);
+
+    void set_key(const byte* key, size_t key_size) override;
+
+    void encrypt(byte* output,
+                 byte* mac,
+                 size_t mac_size,
+                 const byte* iv,
+                 size_t iv_size,
+                 const byte* aad,
+                 size_t aad_size,
+                 const byte* input,
+                 size_t length) override;
+
+    bool decrypt(byte* output,
+                 const byte* mac,
+                 size_t mac_size,
+                 const byte* iv,
+                 size_t iv_size,
+                 const byte* aad,
+                 size_t aad_size,
+                 const byte* input,
+                 size_t length) override;
+
+    bool decrypt_unverified(
+        byte* output, const byte* iv, size_t iv_size, const byte* input, size_t length) override;
+};
+
+std::shared_ptr<AEADContext> make_aead_context(AEADAlgorithm algorithm);
+}    // namespace securefs
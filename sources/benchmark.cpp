@@ -0,0 +1,320 @@
+#include "benchmark.h"
+#include "btree_dir.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "lite_stream.h"
+#include "mystring.h"
+#include "platform.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <utility>
+
+namespace securefs
+{
+void LatencyRecorder::merge(const LatencyRecorder& other)
+{
+    m_samples.insert(m_samples.end(), other.m_samples.begin(), other.m_samples.end());
+    m_bytes += other.m_bytes;
+}
+
+Json::Value LatencyRecorder::summarize(double seconds)
+{
+    std::sort(m_samples.begin(), m_samples.end());
+    auto percentile = [this](double p) -> double {
+        if (m_samples.empty())
+            return 0;
+        auto index = static_cast<size_t>(p * (m_samples.size() - 1) + 0.5);
+        return m_samples[index];
+    };
+
+    Json::Value result;
+    result["ops"] = static_cast<Json::UInt64>(m_samples.size());
+    result["seconds"] = seconds;
+    result["ops_per_sec"] = seconds > 0 ? m_samples.size() / seconds : 0.0;
+    result["mb_per_sec"] = seconds > 0 ? m_bytes / seconds / 1e6 : 0.0;
+    Json::Value& latency = result["latency_us"];
+    latency["p50"] = percentile(0.5);
+    latency["p90"] = percentile(0.9);
+    latency["p99"] = percentile(0.99);
+    latency["p999"] = percentile(0.999);
+    latency["max"] = percentile(1.0);
+    return result;
+}
+
+Json::Value LatencyRecorder::summarize()
+{
+    return summarize(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count());
+}
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Scratch files removed on destruction
+    class ScratchFiles
+    {
+        DISABLE_COPY_MOVE(ScratchFiles)
+
+    private:
+        std::shared_ptr<OSService> m_root;
+        std::vector<std::string> m_names;
+
+    public:
+        explicit ScratchFiles(const BenchmarkOptions& options)
+            : m_root(open_storage(options.directory, options.storage))
+        {
+        }
+
+        ~ScratchFiles()
+        {
+            for (const std::string& name : m_names)
+                m_root->remove_file_nothrow(name);
+        }
+
+        std::shared_ptr<FileStream> create()
+        {
+            m_names.push_back(OSService::temp_name("securefs-bench", ".tmp"));
+            return m_root->open_file_stream(m_names.back(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        }
+    };
+
+    typedef std::function<std::shared_ptr<StreamBase>(ScratchFiles&)> StreamFactory;
+
+    Json::Value
+    run_stream_workloads(const BenchmarkOptions& options, const StreamFactory& make_stream)
+    {
+        const length_type io_size = 64 << 10, random_io_size = 4096, partial_io_size = 100;
+        length_type file_size = std::max<length_type>(options.file_size, io_size);
+        file_size -= file_size % io_size;
+
+        ScratchFiles files(options);
+        auto stream = make_stream(files);
+        std::mt19937 engine(options.seed);
+        std::vector<byte> buffer(io_size);
+        generate_random(buffer.data(), buffer.size());
+        Json::Value results;
+
+        {
+            LatencyRecorder recorder;
+            for (offset_type offset = 0; offset < file_size; offset += io_size)
+                recorder.measure(io_size,
+                                 [&]() { stream->write(buffer.data(), offset, io_size); });
+            stream->flush();
+            results["sequential_write"] = recorder.summarize();
+        }
+        {
+            LatencyRecorder recorder;
+            for (offset_type offset = 0; offset < file_size; offset += io_size)
+                recorder.measure(io_size, [&]() {
+                    if (stream->read(buffer.data(), offset, io_size) != io_size)
+                        throwVFSException(EIO);
+                });
+            results["sequential_read"] = recorder.summarize();
+        }
+
+        std::uniform_int_distribution<offset_type> block_dist(0,
+                                                              file_size / random_io_size - 1);
+        auto num_random_ops = file_size / random_io_size;
+        {
+            LatencyRecorder recorder;
+            for (length_type i = 0; i < num_random_ops; ++i)
+            {
+                offset_type offset = block_dist(engine) * random_io_size;
+                recorder.measure(random_io_size,
+                                 [&]() { stream->write(buffer.data(), offset, random_io_size); });
+            }
+            stream->flush();
+            results["random_write_4k"] = recorder.summarize();
+        }
+        {
+            LatencyRecorder recorder;
+            for (length_type i = 0; i < num_random_ops; ++i)
+            {
+                offset_type offset = block_dist(engine) * random_io_size;
+                recorder.measure(random_io_size, [&]() {
+                    if (stream->read(buffer.data(), offset, random_io_size) != random_io_size)
+                        throwVFSException(EIO);
+                });
+            }
+            results["random_read_4k"] = recorder.summarize();
+        }
+        {
+            std::uniform_int_distribution<offset_type> offset_dist(0,
+                                                                   file_size - partial_io_size);
+            LatencyRecorder recorder;
+            for (length_type i = 0; i < num_random_ops; ++i)
+            {
+                offset_type offset = offset_dist(engine);
+                recorder.measure(partial_io_size,
+                                 [&]() { stream->write(buffer.data(), offset, partial_io_size); });
+            }
+            stream->flush();
+            results["partial_block_write"] = recorder.summarize();
+        }
+        return results;
+    }
+
+    Json::Value run_directory_workloads(const BenchmarkOptions& options)
+    {
+        ScratchFiles files(options);
+        key_type key;
+        id_type id;
+        generate_random(key.data(), key.size());
+        generate_random(id.data(), id.size());
+        BtreeDirectory dir(files.create(),
+                           files.create(),
+                           key,
+                           id,
+                           true,
+                           options.block_size,
+                           options.iv_size,
+                           false,
+                           0,
+                           std::shared_ptr<CipherContextCache<FileCipherContexts>>(),
+                           options.cipher);
+
+        std::mt19937 engine(options.seed);
+        std::vector<std::string> names(options.num_entries);
+        for (size_t i = 0; i < names.size(); ++i)
+            names[i] = strprintf("%08x-%zu", static_cast<unsigned>(engine()), i);
+        Json::Value results;
+
+        {
+            LatencyRecorder recorder;
+            for (const std::string& name : names)
+                recorder.measure(0, [&]() { dir.add_entry(name, id, FileBase::REGULAR_FILE); });
+            dir.flush();
+            results["insert"] = recorder.summarize();
+        }
+        {
+            std::uniform_int_distribution<size_t> index_dist(0, names.size() - 1);
+            LatencyRecorder recorder;
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                const std::string& name = names[index_dist(engine)];
+                recorder.measure(0, [&]() {
+                    id_type found;
+                    int type;
+                    if (!dir.get_entry(name, found, type))
+                        throwVFSException(ENOENT);
+                });
+            }
+            results["lookup"] = recorder.summarize();
+        }
+        return results;
+    }
+}    // namespace
+
+Json::Value run_benchmarks(const BenchmarkOptions& options)
+{
+    auto selected = [&](const char* layer) {
+        return options.layers.empty()
+            || std::find(options.layers.begin(), options.layers.end(), layer)
+            != options.layers.end();
+    };
+    for (const std::string& layer : options.layers)
+    {
+        if (layer != "full" && layer != "lite" && layer != "hmac" && layer != "btree")
+            throwInvalidArgumentException(strprintf("Unknown layer %s", layer.c_str()));
+    }
+    if (options.num_entries == 0)
+        throwInvalidArgumentException("The number of directory entries must be positive");
+
+    key_type key;
+    id_type id;
+    generate_random(key.data(), key.size());
+    generate_random(id.data(), id.size());
+
+    Json::Value report;
+    Json::Value& config = report["config"];
+    config["file_size"] = static_cast<Json::UInt64>(options.file_size);
+    config["block_size"] = options.block_size;
+    config["iv_size"] = options.iv_size;
+    config["num_entries"] = options.num_entries;
+    config["cipher"] = aead_algorithm_name(options.cipher);
+    config["seed"] = options.seed;
+    config["storage"] = options.storage.in_memory ? "memory" : "disk";
+    config["storage_latency_us"] = options.storage.latency_us;
+    config["storage_megabytes_per_second"] = options.storage.megabytes_per_second;
+
+    Json::Value& results = report["results"];
+    if (selected("full"))
+    {
+        results["full"] = run_stream_workloads(options, [&](ScratchFiles& files) {
+            return std::shared_ptr<StreamBase>(make_cryptstream_aead(files.create(),
+                                                                     files.create(),
+                                                                     key,
+                                                                     key,
+                                                                     id,
+                                                                     true,
+                                                                     options.block_size,
+                                                                     options.iv_size,
+                                                                     32,
+                                                                     options.cipher)
+                                                   .first);
+        });
+    }
+    if (selected("lite"))
+    {
+        results["lite"] = run_stream_workloads(options, [&](ScratchFiles& files) {
+            return std::make_shared<lite::AEADCryptStream>(
+                files.create(),
+                key,
+                options.block_size,
+                options.iv_size,
+                true,
+                false,
+                std::shared_ptr<CipherContextCache<AEADContext>>(),
+                options.cipher);
+        });
+    }
+    if (selected("hmac"))
+    {
+        results["hmac"] = run_stream_workloads(options, [&](ScratchFiles& files) {
+            return make_stream_hmac(key, id, files.create(), true);
+        });
+    }
+    if (selected("btree"))
+        results["btree"] = run_directory_workloads(options);
+    return report;
+}
+
+std::vector<std::string>
+compare_with_baseline(Json::Value& results, const Json::Value& baseline, double tolerance)
+{
+    if (!baseline.isObject())
+        throwInvalidArgumentException("The baseline is not a JSON object keyed by kernel name");
+    std::vector<std::string> regressed;
+    for (const std::string& name : results.getMemberNames())
+    {
+        Json::Value& result = results[name];
+        const Json::Value* reference = baseline.find(name.data(), name.data() + name.size());
+        if (!reference)
+        {
+            result["baseline"] = "missing";
+            continue;
+        }
+        // Such as the results of the storage layers, which are not comparable
+        if (!reference->isObject() || !(*reference)["ns_per_op"].isNumeric()
+            || !((*reference)["ns_per_op"].asDouble() > 0))
+        {
+            result["baseline"] = "invalid";
+            continue;
+        }
+        double ratio = result["ns_per_op"].asDouble() / (*reference)["ns_per_op"].asDouble();
+        result["ratio_to_baseline"] = ratio;
+        if (ratio > 1 + tolerance)
+        {
+            result["regressed"] = true;
+            regressed.push_back(name);
+        }
+    }
+    return regressed;
+}
+}    // namespace securefs
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "aead.h"
+#include "myutils.h"
+#include "storage.h"
+
+#include <json/json.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+/**
+ * Parameters of the in-process benchmarks, which exercise each storage layer directly on scratch
+ * files, without FUSE or the filesystem operations in between.
+ */
+struct BenchmarkOptions
+{
+    std::string directory;    // Where the scratch files are created and later removed
+    StorageOptions storage;    // Of the scratch files, which ignore `directory` if in memory
+    std::vector<std::string> layers;    // Any of "full", "lite", "hmac" and "btree"; empty for all
+    length_type file_size = 16 << 20;
+    unsigned block_size = 4096;
+    unsigned iv_size = 12;
+    unsigned num_entries = 10000;    // Of the directory workloads
+    AEADAlgorithm cipher = AEADAlgorithm::AES_GCM;
+    uint32_t seed = 0;    // Of the random offsets and names, so that runs are comparable
+};
+
+/**
+ * Collects the latency of each timed operation, and the bytes they transfer, for the summaries of
+ * the benchmarks and workloads.
+ */
+class LatencyRecorder
+{
+private:
+    std::vector<double> m_samples;    // In microseconds
+    std::chrono::steady_clock::time_point m_start;
+    length_type m_bytes;
+
+public:
+    LatencyRecorder() : m_start(std::chrono::steady_clock::now()), m_bytes(0) {}
+
+    // Times a single operation that transfers `bytes` bytes
+    template <class Func>
+    void measure(length_type bytes, Func&& func)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        m_samples.push_back(std::chrono::duration<double, std::micro>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+        m_bytes += bytes;
+    }
+
+    // Adds the operations measured by `other`, such as those of another thread
+    void merge(const LatencyRecorder& other);
+
+    /**
+     * Summarizes the operations measured so far over `seconds`, or by default the time since
+     * construction, which also counts whatever ran between them, such as the final flush.
+     */
+    Json::Value summarize(double seconds);
+    Json::Value summarize();
+};
+
+/**
+ * Runs the workloads of the selected layers and returns the results keyed by layer then by
+ * workload. Each result reports the number of operations, the elapsed seconds, the throughput in
+ * MB/s and operations per second, and percentiles of the per operation latency in microseconds.
+ *
+ * The stream layers run sequential writes and reads, random 4 KiB writes and reads, and small
+ * unaligned writes that need a read-modify-write of the block; the directory layer runs inserts
+ * and lookups.
+ */
+Json::Value run_benchmarks(const BenchmarkOptions& options);
+
+/**
+ * Annotates each kernel of `results`, as measured by securefs_bench, with its ratio to the same
+ * kernel in `baseline`, and returns the names of those slower than it by more than `tolerance`,
+ * e.g. 0.15 for 15%. Kernels absent from the baseline, or without a positive time there, are
+ * marked but never reported. Throws if `baseline` is not an object.
+ */
+std::vector<std::string>
+compare_with_baseline(Json::Value& results, const Json::Value& baseline, double tolerance);
+}    // namespace securefs
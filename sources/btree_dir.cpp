@@ -1,4 +1,5 @@
 #include "btree_dir.h"
+#include "spans.h"
 
 #include <algorithm>
 #include <assert.h>
@@ -419,6 +420,7 @@ void BtreeDirectory::adjust_children_in_cache(BtreeNode* n, uint32_t parent)
 // This function assumes that every parent node of n is already in the cache
 void BtreeDirectory::insert_and_balance(BtreeNode* n, Entry e, uint32_t additional_child, int depth)
 {
+    ScopedSpan span("BtreeDirectory::insert_and_balance");
     dir_check(depth < BTREE_MAX_DEPTH);
     auto iter = std::lower_bound(n->mutable_entries().begin(), n->mutable_entries().end(), e);
     if (additional_child != INVALID_PAGE && !n->is_leaf())
@@ -593,6 +595,7 @@ void BtreeDirectory::balance_up(BtreeNode* n, int depth)
 
 bool BtreeDirectory::remove_entry_impl(const std::string& name, id_type& id, int& type)
 {
+    ScopedSpan span("BtreeDirectory::remove_entry");
     if (name.size() > MAX_FILENAME_LENGTH)
         throwVFSException(ENAMETOOLONG);
 
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "aead.h"
+#include "myutils.h"
+#include "stats.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace securefs
+{
+const size_t kDefaultCipherCacheCapacity = 512;
+
+/**
+ * The derived keys and keyed contexts of a single file in full format.
+ */
+struct FileCipherContexts
+{
+    key_type meta_key;
+    std::shared_ptr<AEADContext> data;
+    AESGCMContext xattr;
+};
+
+/**
+ * Keeps the keyed cipher contexts of recently closed files, so that reopening them skips both the
+ * key derivation and the key schedule.
+ *
+ * The contexts carry per-message state, so each is owned by a single open file at a time. A file
+ * `take`s its contexts from the cache when opened, and `put`s them back when closed. Beyond
+ * `capacity` entries, the least recently put ones are dropped.
+ *
+ * The cache keys identify files but not master keys, so a cache must only be shared by files under
+ * the same master key.
+ */
+template <class Context>
+class CipherContextCache
+{
+    DISABLE_COPY_MOVE(CipherContextCache)
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<Context>>> list_type;
+
+    std::mutex m_mutex;
+    list_type m_entries;    // The most recently put at the front
+    std::unordered_map<std::string, typename list_type::iterator> m_index;
+    size_t m_capacity;
+
+public:
+    explicit CipherContextCache(size_t capacity = kDefaultCipherCacheCapacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    std::shared_ptr<Context> take(const std::string& key)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_index.find(key);
+        record_cache_access(CacheKind::CIPHER_CONTEXTS, it != m_index.end());
+        if (it == m_index.end())
+            return {};
+        auto result = std::move(it->second->second);
+        m_entries.erase(it->second);
+        m_index.erase(it);
+        return result;
+    }
+
+    void put(const std::string& key, std::shared_ptr<Context> context)
+    {
+        if (!context || m_capacity == 0)
+            return;
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_index.find(key);
+        if (it != m_index.end())
+        {
+            m_entries.erase(it->second);
+            m_index.erase(it);
+        }
+        m_entries.emplace_front(key, std::move(context));
+        m_index.emplace(key, m_entries.begin());
+        if (m_entries.size() > m_capacity)
+        {
+            m_index.erase(m_entries.back().first);
+            m_entries.pop_back();
+        }
+    }
+
+    size_t capacity() const noexcept { return m_capacity; }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_entries.size();
+    }
+};
+}    // namespace securefs
@@ -1,10 +1,16 @@
 #include "commands.h"
+#include "benchmark.h"
 #include "exceptions.h"
+#include "fd_pool.h"
 #include "lite_operations.h"
 #include "myutils.h"
 #include "operations.h"
 #include "platform.h"
+#include "stats.h"
+#include "storage.h"
 #include "streams.h"
+#include "trace.h"
+#include "workload.h"
 
 #include <cryptopp/cpu.h>
 #include <cryptopp/osrng.h>
@@ -14,6 +20,7 @@
 #include <tclap/CmdLine.h>
 
 #include <algorithm>
+#include <chrono>
 #include <memory>
 #include <stdexcept>
 #include <stdlib.h>
@@ -243,7 +250,11 @@ Json::Value generate_config(unsigned int version,
                             size_t pass_len,
                             unsigned block_size,
                             unsigned iv_size,
-                            unsigned rounds = 0)
+                            unsigned max_inline_size,
+                            bool aligned_blocks,
+                            AEADAlgorithm cipher,
+                            unsigned rounds = 0,
+                            unsigned scrypt_p = 1)
 {
     Json::Value config;
     config["version"] = version;
@@ -263,7 +274,7 @@ Json::Value generate_config(unsigned int version,
     }
     else if (pbkdf_algorithm == PBKDF_ALGO_SCRYPT)
     {
-        uint32_t N = rounds > 0 ? rounds : 65536, r = 8, p = 1;
+        uint32_t N = rounds > 0 ? rounds : 65536, r = 8, p = scrypt_p;
         config["iterations"] = N;
         config["scrypt_r"] = r;
         config["scrypt_p"] = p;
@@ -313,6 +324,18 @@ Json::Value generate_config(unsigned int version,
         config["block_size"] = block_size;
         config["iv_size"] = iv_size;
     }
+    if (max_inline_size > 0)
+    {
+        config["max_inline_size"] = max_inline_size;
+    }
+    if (aligned_blocks)
+    {
+        config["aligned_blocks"] = true;
+    }
+    if (cipher != AEADAlgorithm::AES_GCM)
+    {
+        config["cipher"] = aead_algorithm_name(cipher);
+    }
     return config;
 }
 
@@ -443,6 +466,10 @@ FSConfig CommandBase::read_config(FileStream* stream, const void* password, size
             value, password, pass_len, result.master_key, result.block_size, result.iv_size))
         throw_runtime_error("Invalid password");
     result.version = value["version"].asUInt();
+    result.max_inline_size = value.get("max_inline_size", 0u).asUInt();
+    result.aligned_blocks = value.get("aligned_blocks", false).asBool();
+    result.cipher = parse_aead_algorithm(
+        value.get("cipher", aead_algorithm_name(AEADAlgorithm::AES_GCM)).asString());
     return result;
 }
 
@@ -464,7 +491,8 @@ void CommandBase::write_config(FileStream* stream,
                                const FSConfig& config,
                                const void* password,
                                size_t pass_len,
-                               unsigned rounds)
+                               unsigned rounds,
+                               unsigned scrypt_p)
 {
     key_type salt;
     generate_random(salt.data(), salt.size());
@@ -476,7 +504,11 @@ void CommandBase::write_config(FileStream* stream,
                                pass_len,
                                config.block_size,
                                config.iv_size,
-                               rounds)
+                               config.max_inline_size,
+                               config.aligned_blocks,
+                               config.cipher,
+                               rounds,
+                               scrypt_p)
                    .toStyledString();
     stream->sequential_write(str.data(), str.size());
 }
@@ -515,6 +547,46 @@ static const std::string message_for_setting_pbkdf
                 PBKDF_ALGO_SCRYPT,
                 PBKDF_ALGO_PKCS5);
 
+// Times both content ciphers over a few blocks, and suggests ChaCha20-Poly1305 if it is faster
+// (typically when the processor lacks AES instructions)
+static void recommend_cipher()
+{
+    std::vector<byte> buffer(4096), mac(16), iv(12);
+    key_type key;
+    generate_random(key.data(), key.size());
+    generate_random(buffer.data(), buffer.size());
+
+    auto measure = [&](AEADAlgorithm algorithm) {
+        auto context = make_aead_context(algorithm);
+        context->set_key(key.data(), key.size());
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 256; ++i)
+        {
+            context->encrypt(buffer.data(),
+                             mac.data(),
+                             mac.size(),
+                             iv.data(),
+                             iv.size(),
+                             nullptr,
+                             0,
+                             buffer.data(),
+                             buffer.size());
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double gcm_seconds = measure(AEADAlgorithm::AES_GCM);
+    double chacha_seconds = measure(AEADAlgorithm::CHACHA20_POLY1305);
+    if (chacha_seconds < gcm_seconds)
+    {
+        fprintf(stderr,
+                "Note: %s is %.1fx as fast as %s on this machine; consider \"--cipher %s\"\n",
+                aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305),
+                gcm_seconds / chacha_seconds,
+                aead_algorithm_name(AEADAlgorithm::AES_GCM),
+                aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305));
+    }
+}
+
 class CreateCommand : public CommonCommandBase
 {
 private:
@@ -527,6 +599,15 @@ private:
         false,
         0,
         "integer"};
+    TCLAP::ValueArg<unsigned> scrypt_p{
+        "",
+        "scrypt-p",
+        "The parallelization parameter of scrypt. The key derivation runs this many independent "
+        "lanes, on as many threads as there are processors, so larger values make it costlier "
+        "for an attacker without slowing down mounting on multicore machines",
+        false,
+        1,
+        "integer"};
     TCLAP::ValueArg<unsigned int> format{
         "", "format", "The filesystem format version (1,2,3)", false, 4, "integer"};
     TCLAP::ValueArg<unsigned int> iv_size{
@@ -539,13 +620,40 @@ private:
         "alias for \"--format 3\", enables the extension where timestamp are stored and encrypted"};
     TCLAP::ValueArg<std::string> pbkdf{
         "", "pbkdf", message_for_setting_pbkdf, false, PBKDF_ALGO_SCRYPT, "string"};
+    TCLAP::ValueArg<unsigned int> max_inline_size{
+        "",
+        "max-inline-size",
+        "Store regular files and symlinks up to this many bytes inside their meta files (only for "
+        "fs format 2 and 3; 0 to disable)",
+        false,
+        0,
+        "integer"};
+    TCLAP::ValueArg<std::string> cipher{
+        "",
+        "cipher",
+        strprintf("The cipher for the contents of files, either %s (default) or %s. The latter "
+                  "requires a 12 byte IV, and is faster on processors without AES instructions",
+                  aead_algorithm_name(AEADAlgorithm::AES_GCM),
+                  aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305)),
+        false,
+        aead_algorithm_name(AEADAlgorithm::AES_GCM),
+        "string"};
+    TCLAP::SwitchArg aligned_blocks{
+        "",
+        "aligned-blocks",
+        "Store the IVs and MACs of content blocks apart from the ciphertext, so that every block "
+        "is aligned to the block size within the underlying file (only for fs format 4)"};
 
 public:
     void parse_cmdline(int argc, const char* const* argv) override
     {
         TCLAP::CmdLine cmdline(help_message());
         cmdline.add(&iv_size);
+        cmdline.add(&max_inline_size);
+        cmdline.add(&aligned_blocks);
+        cmdline.add(&cipher);
         cmdline.add(&rounds);
+        cmdline.add(&scrypt_p);
         cmdline.add(&data_dir);
         cmdline.add(&config_path);
         cmdline.add(&format);
@@ -580,6 +688,52 @@ public:
 
         unsigned format_version = store_time.isSet() ? 3 : format.getValue();
 
+        if (max_inline_size.getValue() > 0 && (format_version < 2 || format_version > 3))
+        {
+            fprintf(stderr, "Inline storage is only available for filesystem format 2 and 3\n");
+            return 1;
+        }
+
+        if (max_inline_size.getValue() > block_size.getValue())
+        {
+            fprintf(stderr, "The inline size limit cannot exceed the block size\n");
+            return 1;
+        }
+
+        if (aligned_blocks.getValue() && format_version != 4)
+        {
+            fprintf(stderr, "Aligned blocks are only available for filesystem format 4\n");
+            return 1;
+        }
+
+        if (aligned_blocks.getValue()
+            && block_size.getValue()
+                < lite::AEADCryptStream::get_header_size() + iv_size.getValue()
+                    + lite::AEADCryptStream::get_mac_size())
+        {
+            fprintf(stderr, "The block size is too small for aligned blocks\n");
+            return 1;
+        }
+
+        AEADAlgorithm content_cipher = parse_aead_algorithm(cipher.getValue());
+
+        if (content_cipher == AEADAlgorithm::CHACHA20_POLY1305
+            && (format_version == 1 || iv_size.getValue() != ChaCha20Poly1305Context::IV_SIZE))
+        {
+            fprintf(stderr,
+                    "ChaCha20-Poly1305 requires a 12 byte IV and filesystem format 2 or above\n");
+            return 1;
+        }
+
+        if (!cipher.isSet())
+            recommend_cipher();
+
+        if (scrypt_p.getValue() == 0)
+        {
+            fprintf(stderr, "The parallelization parameter of scrypt must be positive\n");
+            return 1;
+        }
+
         OSService::get_default().ensure_directory(data_dir.getValue(), 0755);
 
         FSConfig config;
@@ -589,6 +743,9 @@ public:
         config.iv_size = format_version == 1 ? 32 : iv_size.getValue();
         config.version = format_version;
         config.block_size = block_size.getValue();
+        config.max_inline_size = max_inline_size.getValue();
+        config.aligned_blocks = aligned_blocks.getValue();
+        config.cipher = content_cipher;
 
         auto config_stream
             = open_config_stream(get_real_config_path(), O_WRONLY | O_CREAT | O_EXCL);
@@ -600,7 +757,8 @@ public:
                      config,
                      password.data(),
                      password.size(),
-                     rounds.getValue());
+                     rounds.getValue(),
+                     scrypt_p.getValue());
         config_stream.reset();
 
         if (format_version < 4)
@@ -610,8 +768,11 @@ public:
             opt.root = std::make_shared<OSService>(data_dir.getValue());
             opt.master_key = config.master_key;
             opt.flags = format_version < 3 ? 0 : kOptionStoreTime;
+            if (config.cipher == AEADAlgorithm::CHACHA20_POLY1305)
+                opt.flags.value() |= kOptionChaCha20Poly1305;
             opt.block_size = config.block_size;
             opt.iv_size = config.iv_size;
+            opt.max_inline_size = config.max_inline_size;
 
             operations::FileSystemContext fs(opt);
             auto root = fs.table.create_as(fs.root_id, FileBase::DIRECTORY);
@@ -642,6 +803,15 @@ private:
         false,
         0,
         "integer"};
+    TCLAP::ValueArg<unsigned> scrypt_p{
+        "",
+        "scrypt-p",
+        "The parallelization parameter of scrypt. The key derivation runs this many independent "
+        "lanes, on as many threads as there are processors, so larger values make it costlier "
+        "for an attacker without slowing down mounting on multicore machines",
+        false,
+        1,
+        "integer"};
     TCLAP::ValueArg<std::string> pbkdf{
         "", "pbkdf", message_for_setting_pbkdf, false, PBKDF_ALGO_SCRYPT, "string"};
 
@@ -650,6 +820,7 @@ public:
     {
         TCLAP::CmdLine cmdline(help_message());
         cmdline.add(&rounds);
+        cmdline.add(&scrypt_p);
         cmdline.add(&data_dir);
         cmdline.add(&config_path);
         cmdline.parse(argc, argv);
@@ -673,7 +844,8 @@ public:
                      config,
                      new_password.data(),
                      new_password.size(),
-                     rounds.getValue());
+                     rounds.getValue(),
+                     scrypt_p.getValue());
         stream.reset();
         OSService::get_default().rename(tmp_path, original_path);
         return 0;
@@ -697,7 +869,11 @@ private:
     TCLAP::SwitchArg background{
         "b", "background", "Run securefs in the background (currently no effect on Windows)"};
     TCLAP::SwitchArg insecure{
-        "i", "insecure", "Disable all integrity verification (insecure mode)"};
+        "",
+        "insecure",
+        "Disable all integrity verification (insecure mode). Contents are decrypted without "
+        "checking their MACs and the MACs of metadata are no longer updated, so files modified in "
+        "this mode fail verification when later mounted without it"};
     TCLAP::SwitchArg noxattr{"x", "noxattr", "Disable built-in xattr support"};
     TCLAP::SwitchArg verbose{"v", "verbose", "Logs more verbose messages"};
     TCLAP::SwitchArg trace{"", "trace", "Trace all calls into `securefs` (implies --verbose)"};
@@ -715,6 +891,92 @@ private:
                                       "insensitive",
                                       "Converts the case of all filenames so "
                                       "that it works case insensitively"};
+    TCLAP::ValueArg<unsigned> max_open_fds{
+        "",
+        "max-open-fds",
+        "Maximum number of underlying file descriptors kept open; the least recently used ones "
+        "are closed and transparently reopened when needed (0 for no limit). With the lite "
+        "format, files renamed or removed while still open may become inaccessible, and a file "
+        "opened through several handles is no longer shared between them",
+        false,
+        0,
+        "integer"};
+    TCLAP::ValueArg<unsigned> dir_fd_cache{
+        "",
+        "dir-fd-cache",
+        "Number of underlying directories kept open, so that operations on their entries skip "
+        "walking the whole path (lite format only; 0 to disable). The underlying directory must "
+        "not be restructured by others while mounted",
+        false,
+        0,
+        "integer"};
+    TCLAP::SwitchArg io_uring{
+        "",
+        "io-uring",
+        "Write to the underlying files asynchronously through io_uring if the kernel supports it"};
+    TCLAP::ValueArg<std::string> stats_file{
+        "",
+        "stats-file",
+        "Write the counts and latency histograms of the filesystem operations, and the hit rates "
+        "of the caches, as JSON to this file whenever securefs receives SIGUSR1, and at unmount",
+        false,
+        "",
+        "path"};
+    TCLAP::ValueArg<unsigned> stats_top_files{
+        "",
+        "stats-top-files",
+        "Also count the I/O of each path, and list in the statistics the paths with the most "
+        "underlying traffic, up to this number. Every path ever read or written is kept in memory "
+        "(the statistics then show plaintext paths, which may contain sensitive information)",
+        false,
+        0,
+        "integer"};
+    TCLAP::ValueArg<std::string> record_trace{
+        "",
+        "record-trace",
+        "Record the filesystem calls, with their paths, offsets, sizes and latencies but not their "
+        "data, into this file, to be replayed later by the replay command (the file is not "
+        "encrypted and its plaintext paths may contain sensitive information)",
+        false,
+        "",
+        "path"};
+    TCLAP::ValueArg<std::string> span_trace{
+        "",
+        "span-trace",
+        "Whenever securefs receives SIGUSR2, start or stop tracing the phases of the filesystem "
+        "operations (path resolution, key derivation, encryption, underlying I/O) into this file, "
+        "as Chrome trace JSON viewable in chrome://tracing or Perfetto",
+        false,
+        "",
+        "path"};
+    TCLAP::ValueArg<unsigned> span_sample{
+        "",
+        "span-sample",
+        "Trace only one in this number of the filesystem operations of each thread",
+        false,
+        1,
+        "integer"};
+    TCLAP::ValueArg<unsigned> storage_latency{
+        "",
+        "storage-latency",
+        "Delay every call to the underlying directory by this many microseconds, to evaluate "
+        "securefs as if on network or cloud-synced storage",
+        false,
+        0,
+        "integer"};
+    TCLAP::ValueArg<double> storage_bandwidth{
+        "",
+        "storage-bandwidth",
+        "Limit the reads and writes of the underlying directory together to this many MB/s, to "
+        "evaluate securefs as if on network or cloud-synced storage (0 for unlimited)",
+        false,
+        0,
+        "number"};
+    TCLAP::SwitchArg readonly{
+        "",
+        "readonly",
+        "Mount the filesystem read-only and memory map the underlying files for reading. The "
+        "underlying directory must not be modified while mounted"};
 
 public:
     void parse_cmdline(int argc, const char* const* argv) override
@@ -726,7 +988,7 @@ public:
 #endif
 
         cmdline.add(&background);
-        // cmdline.add(&insecure);
+        cmdline.add(&insecure);
         cmdline.add(&verbose);
         cmdline.add(&trace);
         cmdline.add(&log);
@@ -737,6 +999,17 @@ public:
         cmdline.add(&fuse_options);
         cmdline.add(&single_threaded);
         cmdline.add(&case_insensitive);
+        cmdline.add(&max_open_fds);
+        cmdline.add(&dir_fd_cache);
+        cmdline.add(&io_uring);
+        cmdline.add(&readonly);
+        cmdline.add(&stats_file);
+        cmdline.add(&stats_top_files);
+        cmdline.add(&record_trace);
+        cmdline.add(&span_trace);
+        cmdline.add(&span_sample);
+        cmdline.add(&storage_latency);
+        cmdline.add(&storage_bandwidth);
         cmdline.parse(argc, argv);
 
         if (pass.isSet() && !pass.getValue().empty())
@@ -859,6 +1132,11 @@ public:
         }
         if (!background.getValue())
             fuse_args.push_back("-f");
+        if (readonly.getValue())
+        {
+            fuse_args.push_back("-o");
+            fuse_args.push_back("ro");
+        }
         if (fuse_options.isSet())
         {
             for (const std::string& opt : fuse_options.getValue())
@@ -895,16 +1173,62 @@ public:
         }
 
         operations::MountOptions fsopt;
-        fsopt.root = std::make_shared<OSService>(data_dir.getValue());
+        auto root = std::make_shared<OSService>(data_dir.getValue());
+        if (io_uring.getValue() && !root->enable_io_uring(256))
+        {
+            WARN_LOG("io_uring is not available; falling back to synchronous I/O");
+        }
+        if (readonly.getValue() && !root->enable_mapped_reads())
+        {
+            WARN_LOG("Memory mapped reads are not available; falling back to normal reads");
+        }
+        fsopt.root = root;
+        if (storage_latency.getValue() > 0 || storage_bandwidth.getValue() > 0)
+        {
+            fsopt.root = std::make_shared<ThrottledOSService>(
+                root,
+                std::make_shared<StorageThrottle>(
+                    std::chrono::microseconds(storage_latency.getValue()),
+                    storage_bandwidth.getValue() * 1e6));
+        }
         fsopt.block_size = config.block_size;
         fsopt.iv_size = config.iv_size;
+        fsopt.max_inline_size = config.max_inline_size;
         fsopt.version = config.version;
         fsopt.master_key = config.master_key;
         fsopt.flags = config.version < 3 ? 0 : kOptionStoreTime;
         if (insecure.getValue())
+        {
+            WARN_LOG("Integrity verification is disabled");
             fsopt.flags.value() |= kOptionNoAuthentication;
+        }
         if (case_insensitive.getValue())
             fsopt.flags.value() |= kOptionCaseFoldFileName;
+        if (config.aligned_blocks)
+            fsopt.flags.value() |= kOptionAlignedBlocks;
+        if (config.cipher == AEADAlgorithm::CHACHA20_POLY1305)
+            fsopt.flags.value() |= kOptionChaCha20Poly1305;
+        if (readonly.getValue())
+            fsopt.flags.value() |= kOptionReadOnly;
+        if (max_open_fds.getValue() > 0)
+            fsopt.fd_pool = std::make_shared<FileDescriptorPool>(max_open_fds.getValue());
+        fsopt.dir_cache_capacity = dir_fd_cache.getValue();
+        // Opened now, because the working directory changes when entering the background
+        if (stats_file.isSet())
+            fsopt.stats_stream = OSService::get_default().open_file_stream(
+                stats_file.getValue(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (span_trace.isSet())
+        {
+            fsopt.span_stream = OSService::get_default().open_file_stream(
+                span_trace.getValue(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            fsopt.span_sample_every = std::max(span_sample.getValue(), 1u);
+        }
+        if (stats_top_files.getValue() > 0)
+            enable_per_file_io_counts(stats_top_files.getValue());
+        std::shared_ptr<TraceWriter> trace_writer;
+        if (record_trace.isSet())
+            trace_writer = std::make_shared<TraceWriter>(OSService::get_default().open_file_stream(
+                record_trace.getValue(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
 
         std::shared_ptr<FileStream> lock_stream;
         DEFER(if (lock_stream) {
@@ -960,7 +1284,11 @@ public:
         {
             lite::init_fuse_operations(&operations, native_xattr);
         }
+        if (trace_writer)
+            trace_fuse_operations(&operations, trace_writer);
         recreate_logger();
+        // The filesystem switches the logger to asynchronous once running in the background
+        DEFER(if (global_logger) global_logger->stop_async());
         return fuse_main(static_cast<int>(fuse_args.size()),
                          const_cast<char**>(fuse_args.data()),
                          &operations,
@@ -1010,9 +1338,12 @@ public:
         fsopt.root->lock();
         fsopt.block_size = config.block_size;
         fsopt.iv_size = config.iv_size;
+        fsopt.max_inline_size = config.max_inline_size;
         fsopt.version = config.version;
         fsopt.master_key = config.master_key;
         fsopt.flags = 0;
+        if (config.cipher == AEADAlgorithm::CHACHA20_POLY1305)
+            fsopt.flags.value() |= kOptionChaCha20Poly1305;
 
         operations::FileSystemContext fs(fsopt);
         fix(data_dir.getValue(), &fs);
@@ -1163,15 +1494,361 @@ public:
                format_version == 1 ? 4096 : config_json["block_size"].asUInt());
         printf("Content IV size: %u bits\n",
                format_version == 1 ? 256 : config_json["iv_size"].asUInt() * 8);
+        printf("Inline storage size limit: %u bytes\n",
+               config_json.get("max_inline_size", 0u).asUInt());
+        printf("Is content block aligned: %s\n",
+               true_or_false(config_json.get("aligned_blocks", false).asBool()));
         printf("Password derivation algorithm: PBKDF2-HMAC-SHA256\n");
         printf("Password derivation iterations: %u\n", config_json["iterations"].asUInt());
         printf("Per file key generation algorithm: %s\n",
                format_version < 4 ? "HMAC-SHA256" : "AES");
-        printf("Content cipher: %s\n", format_version < 4 ? "AES-256-GCM" : "AES-128-GCM");
+        if (config_json.get("cipher", "").asString()
+            == aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305))
+            printf("Content cipher: ChaCha20-Poly1305\n");
+        else
+            printf("Content cipher: %s\n", format_version < 4 ? "AES-256-GCM" : "AES-128-GCM");
         return 0;
     }
 };
 
+// The commands that run on scratch storage, whose kind and delays are picked by the same options
+class StorageCommandBase : public CommandBase
+{
+protected:
+    TCLAP::SwitchArg memory{
+        "", "memory", "Keep the scratch data in memory, to measure the CPU cost alone"};
+    TCLAP::ValueArg<unsigned> storage_latency{
+        "",
+        "storage-latency",
+        "Delay every call to the storage by this many microseconds, to emulate network storage",
+        false,
+        0,
+        "integer"};
+    TCLAP::ValueArg<double> storage_bandwidth{
+        "",
+        "storage-bandwidth",
+        "Limit the reads and writes of the storage together to this many MB/s (0 for unlimited)",
+        false,
+        0,
+        "number"};
+
+    void add_storage_args(TCLAP::CmdLine& cmdline)
+    {
+        cmdline.add(&memory);
+        cmdline.add(&storage_latency);
+        cmdline.add(&storage_bandwidth);
+    }
+
+    StorageOptions storage_options()
+    {
+        StorageOptions options;
+        options.in_memory = memory.getValue();
+        options.latency_us = storage_latency.getValue();
+        options.megabytes_per_second = storage_bandwidth.getValue();
+        return options;
+    }
+};
+
+class BenchCommand : public StorageCommandBase
+{
+private:
+    TCLAP::ValueArg<std::string> dir{
+        "", "dir", "Directory for the scratch files of the benchmarks", false, ".", "path"};
+    TCLAP::MultiArg<std::string> layers{
+        "",
+        "layer",
+        "Only benchmark this layer: full, lite, hmac or btree (may be repeated; all by default)",
+        false,
+        "string"};
+    TCLAP::ValueArg<unsigned> file_size{
+        "", "file-size", "Size of the files of the stream benchmarks in MiB", false, 16, "integer"};
+    TCLAP::ValueArg<unsigned> entries{
+        "", "entries", "Number of entries of the directory benchmarks", false, 10000, "integer"};
+    TCLAP::ValueArg<unsigned int> iv_size{"", "iv-size", "The IV size", false, 12, "integer"};
+    TCLAP::ValueArg<unsigned int> block_size{
+        "", "block-size", "Block size for files", false, 4096, "integer"};
+    TCLAP::ValueArg<std::string> cipher{
+        "",
+        "cipher",
+        strprintf("The cipher for the contents of files, either %s (default) or %s",
+                  aead_algorithm_name(AEADAlgorithm::AES_GCM),
+                  aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305)),
+        false,
+        aead_algorithm_name(AEADAlgorithm::AES_GCM),
+        "string"};
+    TCLAP::ValueArg<uint32_t> seed{
+        "", "seed", "Seed of the random offsets and names", false, 0, "integer"};
+    TCLAP::ValueArg<std::string> output{
+        "", "output", "Also write the results to this file", false, "", "path"};
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        TCLAP::CmdLine cmdline(help_message());
+        cmdline.add(&dir);
+        cmdline.add(&layers);
+        cmdline.add(&file_size);
+        cmdline.add(&entries);
+        cmdline.add(&iv_size);
+        cmdline.add(&block_size);
+        cmdline.add(&cipher);
+        cmdline.add(&seed);
+        add_storage_args(cmdline);
+        cmdline.add(&output);
+        cmdline.parse(argc, argv);
+    }
+
+    const char* long_name() const noexcept override { return "bench"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Measure the throughput and latency of each storage layer, without FUSE, and print "
+               "them as JSON";
+    }
+
+    int execute() override
+    {
+        BenchmarkOptions options;
+        options.directory = dir.getValue();
+        options.layers = layers.getValue();
+        options.file_size = static_cast<length_type>(file_size.getValue()) << 20;
+        options.num_entries = entries.getValue();
+        options.block_size = block_size.getValue();
+        options.iv_size = iv_size.getValue();
+        options.cipher = parse_aead_algorithm(cipher.getValue());
+        options.seed = seed.getValue();
+        options.storage = storage_options();
+        write_results(run_benchmarks(options));
+        return 0;
+    }
+
+private:
+    void write_results(const Json::Value& results)
+    {
+        auto text = results.toStyledString();
+        fputs(text.c_str(), stdout);
+        if (!output.isSet())
+            return;
+        auto stream = OSService::get_default().open_file_stream(
+            output.getValue(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        stream->write(text.data(), 0, text.size());
+    }
+};
+
+class WorkloadCommand : public StorageCommandBase
+{
+private:
+    TCLAP::ValueArg<std::string> dir{
+        "", "dir", "Directory for the scratch filesystems", false, ".", "path"};
+    TCLAP::MultiArg<std::string> formats{
+        "",
+        "format",
+        "Only run on this format: full or lite (may be repeated; both by default)",
+        false,
+        "string"};
+    TCLAP::MultiArg<std::string> scenarios{
+        "",
+        "scenario",
+        "Only run this scenario: create_storm, stat_storm, sequential_copy, random_io, "
+        "readdir_tree or remove_tree (may be repeated; all by default)",
+        false,
+        "string"};
+    TCLAP::ValueArg<unsigned> threads{
+        "", "threads", "Number of threads running each scenario at once", false, 4, "integer"};
+    TCLAP::ValueArg<unsigned> files{
+        "",
+        "files",
+        "Number of files of the create and stat storms per thread",
+        false,
+        1000,
+        "integer"};
+    TCLAP::ValueArg<unsigned> copy_size{
+        "", "copy-size", "Size of the copied file per thread in MiB", false, 16, "integer"};
+    TCLAP::ValueArg<unsigned> database_size{
+        "", "database-size", "Size of the database file per thread in MiB", false, 16, "integer"};
+    TCLAP::ValueArg<unsigned> random_ops{
+        "", "random-ops", "Number of random reads and writes per thread", false, 5000, "integer"};
+    TCLAP::ValueArg<unsigned> tree_depth{
+        "", "tree-depth", "Depth of the directory trees", false, 4, "integer"};
+    TCLAP::ValueArg<unsigned> tree_fanout{
+        "",
+        "tree-fanout",
+        "Number of subdirectories, and of files, in each directory of the trees",
+        false,
+        4,
+        "integer"};
+    TCLAP::ValueArg<unsigned int> iv_size{"", "iv-size", "The IV size", false, 12, "integer"};
+    TCLAP::ValueArg<unsigned int> block_size{
+        "", "block-size", "Block size for files", false, 4096, "integer"};
+    TCLAP::ValueArg<std::string> cipher{
+        "",
+        "cipher",
+        strprintf("The cipher for the contents of files, either %s (default) or %s",
+                  aead_algorithm_name(AEADAlgorithm::AES_GCM),
+                  aead_algorithm_name(AEADAlgorithm::CHACHA20_POLY1305)),
+        false,
+        aead_algorithm_name(AEADAlgorithm::AES_GCM),
+        "string"};
+    TCLAP::SwitchArg case_insensitive{
+        "i", "insensitive", "Mount with case insensitive filenames, as mount -i does"};
+    TCLAP::ValueArg<uint32_t> seed{"", "seed", "Seed of the random offsets", false, 0, "integer"};
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        TCLAP::CmdLine cmdline(help_message());
+        cmdline.add(&dir);
+        cmdline.add(&formats);
+        cmdline.add(&scenarios);
+        cmdline.add(&threads);
+        cmdline.add(&files);
+        cmdline.add(&copy_size);
+        cmdline.add(&database_size);
+        cmdline.add(&random_ops);
+        cmdline.add(&tree_depth);
+        cmdline.add(&tree_fanout);
+        cmdline.add(&iv_size);
+        cmdline.add(&block_size);
+        cmdline.add(&cipher);
+        cmdline.add(&case_insensitive);
+        cmdline.add(&seed);
+        add_storage_args(cmdline);
+        cmdline.parse(argc, argv);
+    }
+
+    const char* long_name() const noexcept override { return "workload"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Run realistic workloads on scratch filesystems of each format, calling the "
+               "filesystem operations without FUSE, and print their throughput and latency as JSON";
+    }
+
+    int execute() override
+    {
+        WorkloadOptions options;
+        options.directory = dir.getValue();
+        options.formats = formats.getValue();
+        options.scenarios = scenarios.getValue();
+        options.num_threads = threads.getValue();
+        options.num_files = files.getValue();
+        options.copy_size = static_cast<length_type>(copy_size.getValue()) << 20;
+        options.database_size = static_cast<length_type>(database_size.getValue()) << 20;
+        options.num_random_ops = random_ops.getValue();
+        options.tree_depth = tree_depth.getValue();
+        options.tree_fanout = tree_fanout.getValue();
+        options.block_size = block_size.getValue();
+        options.iv_size = iv_size.getValue();
+        options.cipher = parse_aead_algorithm(cipher.getValue());
+        if (case_insensitive.getValue())
+            options.flags |= kOptionCaseFoldFileName;
+        options.seed = seed.getValue();
+        options.storage = storage_options();
+        fputs(run_workloads(options).toStyledString().c_str(), stdout);
+        return 0;
+    }
+};
+
+class ReplayCommand : public CommonCommandBase
+{
+private:
+    CryptoPP::AlignedSecByteBlock password;
+    TCLAP::UnlabeledValueArg<std::string> trace_file{
+        "trace", "Trace recorded by mount --record-trace", true, "", "trace"};
+    TCLAP::SwitchArg case_insensitive{"i",
+                                      "insensitive",
+                                      "Converts the case of all filenames, as when the trace was "
+                                      "recorded with this option"};
+    TCLAP::SwitchArg timed{"",
+                           "timed",
+                           "Issue each call no earlier than its recorded time since the start of "
+                           "the trace, instead of as fast as possible"};
+    TCLAP::SwitchArg serial{"",
+                            "serial",
+                            "Issue all calls in turn from one thread, instead of one thread for "
+                            "each recorded thread. Always the case for the full format"};
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        TCLAP::CmdLine cmdline(help_message());
+        cmdline.add(&data_dir);
+        cmdline.add(&trace_file);
+        cmdline.add(&config_path);
+        cmdline.add(&pass);
+        cmdline.add(&case_insensitive);
+        cmdline.add(&timed);
+        cmdline.add(&serial);
+        cmdline.parse(argc, argv);
+
+        if (pass.isSet() && !pass.getValue().empty())
+        {
+            password.resize(pass.getValue().size());
+            memcpy(password.data(), pass.getValue().data(), password.size());
+            generate_random(reinterpret_cast<byte*>(&pass.getValue()[0]), pass.getValue().size());
+        }
+        else
+        {
+            OSService::read_password_no_confirmation("Password: ", &password);
+        }
+    }
+
+    int execute() override
+    {
+        auto config_stream = open_config_stream(get_real_config_path(), O_RDONLY);
+        auto config = read_config(config_stream.get(), password.data(), password.size());
+        config_stream.reset();
+        CryptoPP::SecureWipeBuffer(password.data(), password.size());
+
+        TraceReader reader(
+            OSService::get_default().open_file_stream(trace_file.getValue(), O_RDONLY, 0));
+
+        operations::MountOptions fsopt;
+        fsopt.root = std::make_shared<OSService>(data_dir.getValue());
+        fsopt.root->lock();
+        fsopt.block_size = config.block_size;
+        fsopt.iv_size = config.iv_size;
+        fsopt.max_inline_size = config.max_inline_size;
+        fsopt.version = config.version;
+        fsopt.master_key = config.master_key;
+        fsopt.flags = config.version < 3 ? 0 : kOptionStoreTime;
+        if (case_insensitive.getValue())
+            fsopt.flags.value() |= kOptionCaseFoldFileName;
+        if (config.aligned_blocks)
+            fsopt.flags.value() |= kOptionAlignedBlocks;
+        if (config.cipher == AEADAlgorithm::CHACHA20_POLY1305)
+            fsopt.flags.value() |= kOptionChaCha20Poly1305;
+
+        struct fuse_operations operations;
+        if (config.version <= 3)
+            operations::init_fuse_operations(&operations, true);
+        else
+            lite::init_fuse_operations(&operations, true);
+        // The full format is mounted single threaded
+        ReplayOptions options;
+        options.concurrent = config.version >= 4 && !serial.getValue();
+        options.timed = timed.getValue();
+        DEFER(if (global_logger) global_logger->stop_async());
+        fputs(replay_trace(reader, operations, &fsopt, options).toStyledString().c_str(), stdout);
+        return 0;
+    }
+
+    const char* long_name() const noexcept override { return "replay"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Replay a recorded trace directly on the filesystem, without mounting it, and "
+               "print the latency of each kind of call as JSON. The filesystem is modified, so "
+               "replay on a copy";
+    }
+};
+
 int commands_main(int argc, const char* const* argv)
 {
     try
@@ -1181,7 +1858,10 @@ int commands_main(int argc, const char* const* argv)
                                                make_unique<ChangePasswordCommand>(),
                                                make_unique<FixCommand>(),
                                                make_unique<VersionCommand>(),
-                                               make_unique<InfoCommand>()};
+                                               make_unique<InfoCommand>(),
+                                               make_unique<BenchCommand>(),
+                                               make_unique<WorkloadCommand>(),
+                                               make_unique<ReplayCommand>()};
 
         auto print_usage = [&]() {
             fputs("Available subcommands:\n\n", stderr);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "aead.h"
 #include "myutils.h"
 #include "platform.h"
 
@@ -16,6 +17,9 @@ struct FSConfig
     unsigned block_size;
     unsigned iv_size;
     unsigned version;
+    unsigned max_inline_size;
+    bool aligned_blocks;
+    AEADAlgorithm cipher;
 };
 
 class CommandBase
@@ -30,7 +34,8 @@ protected:
                              const FSConfig&,
                              const void* password,
                              size_t pass_len,
-                             unsigned rounds);
+                             unsigned rounds,
+                             unsigned scrypt_p);
 
 public:
     CommandBase() {}
@@ -61,7 +61,9 @@ bool OSService::remove_directory_nothrow(StringRef path) const noexcept
     }
 }
 
-void OSService::recursive_traverse(StringRef dir, const recursive_traverse_callback& callback) const
+void OSService::recursive_traverse(StringRef dir,
+                                   const recursive_traverse_callback& callback,
+                                   const recursive_traverse_callback& directory_callback) const
 {
     auto traverser = create_traverser(dir);
     std::string name;
@@ -73,7 +75,9 @@ void OSService::recursive_traverse(StringRef dir, const recursive_traverse_callb
             continue;
         if ((S_IFMT & st.st_mode) == S_IFDIR)
         {
-            recursive_traverse(dir + "/" + name, callback);
+            recursive_traverse(dir + "/" + name, callback, directory_callback);
+            if (directory_callback)
+                directory_callback(dir, name);
         }
         else
         {
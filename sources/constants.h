@@ -3,5 +3,6 @@
 namespace securefs
 {
 const unsigned kOptionNoAuthentication = 0x1, kOptionReadOnly = 0x2, kOptionStoreTime = 0x4,
-               kOptionCaseFoldFileName = 0x8;
+               kOptionCaseFoldFileName = 0x8, kOptionAlignedBlocks = 0x10,
+               kOptionChaCha20Poly1305 = 0x20;
 }
@@ -1,16 +1,21 @@
 #include "crypto.h"
 #include "exceptions.h"
 #include "securefs_config.h"
+#include "spans.h"
 
 #include <cryptopp/aes.h>
 #include <cryptopp/gcm.h>
 #include <cryptopp/hmac.h>
+#include <cryptopp/modes.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/pwdbased.h>
 #include <cryptopp/rng.h>
 #include <cryptopp/sha.h>
 
-#if !HAS_THREAD_LOCAL
+#include <atomic>
+#include <string.h>
+
+#if !HAS_THREAD_LOCAL || !defined(WIN32)
 #include <pthread.h>
 #endif
 
@@ -187,6 +192,127 @@ void generate_random(void* buffer, size_t size)
 }
 #endif
 
+namespace
+{
+#ifndef WIN32
+    // Incremented in forked children, so that they do not hand out the same IVs as their parents
+    std::atomic<unsigned> fork_generation{0};
+
+    void register_fork_handler()
+    {
+        static int rc = pthread_atfork(nullptr, nullptr, []() { ++fork_generation; });
+        (void)rc;
+    }
+#endif
+
+    // An AES-256-CTR keystream generator, keyed from `generate_random` and rekeyed regularly, that
+    // hands out IVs from a pregenerated batch.
+    class IVGenerator
+    {
+        DISABLE_COPY_MOVE(IVGenerator)
+
+    private:
+        static const size_t BATCH_SIZE = 4096, RESEED_INTERVAL = 1 << 20;
+
+        CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption m_ctr;
+        CryptoPP::FixedSizeAlignedSecBlock<byte, BATCH_SIZE> m_batch;
+        size_t m_position, m_generated;
+#ifndef WIN32
+        unsigned m_fork_generation;
+#endif
+
+    private:
+        void reseed()
+        {
+            CryptoPP::FixedSizeAlignedSecBlock<byte, 32 + 16> seed;
+            generate_random(seed.data(), seed.size());
+            m_ctr.SetKeyWithIV(seed.data(), 32, seed.data() + 32, 16);
+            m_generated = 0;
+        }
+
+        void refill()
+        {
+            if (m_generated >= RESEED_INTERVAL)
+                reseed();
+            memset(m_batch.data(), 0, m_batch.size());
+            m_ctr.ProcessData(m_batch.data(), m_batch.data(), m_batch.size());
+            m_generated += m_batch.size();
+            m_position = 0;
+        }
+
+    public:
+        IVGenerator() : m_position(BATCH_SIZE), m_generated(0)
+        {
+#ifndef WIN32
+            register_fork_handler();
+            m_fork_generation = fork_generation.load();
+#endif
+            reseed();
+        }
+
+        void generate(byte* output, size_t size)
+        {
+#ifndef WIN32
+            if (m_fork_generation != fork_generation.load(std::memory_order_relaxed))
+            {
+                m_fork_generation = fork_generation.load();
+                reseed();
+                m_position = BATCH_SIZE;
+            }
+#endif
+            while (size > 0)
+            {
+                if (m_position >= BATCH_SIZE)
+                    refill();
+                size_t n = std::min(size, BATCH_SIZE - m_position);
+                memcpy(output, m_batch.data() + m_position, n);
+                // Bytes handed out are never kept around
+                memset(m_batch.data() + m_position, 0, n);
+                m_position += n;
+                output += n;
+                size -= n;
+            }
+        }
+    };
+}    // namespace
+
+#if HAS_THREAD_LOCAL
+static thread_local IVGenerator iv_generator;
+void generate_iv(void* buffer, size_t size)
+{
+    iv_generator.generate(static_cast<byte*>(buffer), size);
+}
+#else
+static pthread_once_t IV_GENERATOR_ONCE = PTHREAD_ONCE_INIT;
+static pthread_key_t IV_GENERATOR_KEY;
+
+void generate_iv(void* buffer, size_t size)
+{
+    int rc = pthread_once(&IV_GENERATOR_ONCE, []() {
+        int rc = pthread_key_create(&IV_GENERATOR_KEY,
+                                    [](void* p) { delete static_cast<IVGenerator*>(p); });
+        if (rc)
+            abort();
+    });
+    if (rc)
+    {
+        THROW_POSIX_EXCEPTION(rc, "pthread_once");
+    }
+    auto generator = static_cast<IVGenerator*>(pthread_getspecific(IV_GENERATOR_KEY));
+    if (!generator)
+    {
+        generator = new IVGenerator();
+        rc = pthread_setspecific(IV_GENERATOR_KEY, generator);
+        if (rc)
+        {
+            delete generator;
+            THROW_POSIX_EXCEPTION(rc, "pthread_setspecific");
+        }
+    }
+    generator->generate(static_cast<byte*>(buffer), size);
+}
+#endif
+
 void hmac_sha256_calculate(
     const void* message, size_t msg_len, const void* key, size_t key_len, void* mac, size_t mac_len)
 {
@@ -264,6 +390,7 @@ void hkdf(const void* key,
           void* output,
           size_t out_len)
 {
+    ScopedSpan span("hkdf");
     if (salt && salt_len)
     {
         byte distilled_key[32];
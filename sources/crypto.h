@@ -80,6 +80,10 @@ unsigned int pbkdf_hmac_sha256(const void* password,
 
 void generate_random(void* buffer, size_t size);
 
+// Generates random bytes for IVs and nonces. Faster than `generate_random` for small sizes, as the
+// bytes come from a per-thread batch generated by a regularly reseeded AES-CTR keystream.
+void generate_iv(void* buffer, size_t size);
+
 void libscrypt_scrypt(const uint8_t* passwd,
                       size_t passwdlen,
                       const uint8_t* salt,
@@ -88,5 +92,9 @@ void libscrypt_scrypt(const uint8_t* passwd,
                       uint32_t r,
                       uint32_t p,
                       uint8_t* buf,
-                      size_t buflen);
+                      size_t buflen,
+                      bool allow_simd = true);
+
+// Whether `libscrypt_scrypt` has vectorized kernels for the current processor.
+bool libscrypt_has_simd() noexcept;
 }    // namespace securefs
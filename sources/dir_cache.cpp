@@ -0,0 +1,77 @@
+#include "dir_cache.h"
+#include "stats.h"
+
+namespace securefs
+{
+DirectoryHandleCache::DirectoryHandleCache(size_t capacity) : m_capacity(capacity), m_generation(0)
+{
+}
+
+DirectoryHandleCache::~DirectoryHandleCache() {}
+
+std::shared_ptr<const OSService>
+DirectoryHandleCache::open(const std::shared_ptr<const OSService>& root, const std::string& path)
+{
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_index.find(path);
+        record_cache_access(CacheKind::DIRECTORY_HANDLES, it != m_index.end());
+        if (it != m_index.end())
+        {
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return it->second->second;
+        }
+        generation = m_generation;
+    }
+
+    // Opened without the lock, so that a slow storage does not stall the hits of other threads
+    auto dir = root->open_directory(path);
+    if (!dir || m_capacity == 0)
+        return dir;
+
+    std::shared_ptr<const OSService> evicted;    // Closed after the lock is released
+    std::lock_guard<std::mutex> guard(m_mutex);
+    // The directory may have been renamed or removed since the lookup
+    if (generation != m_generation)
+        return dir;
+    auto it = m_index.find(path);
+    if (it != m_index.end())
+        return it->second->second;
+    m_entries.emplace_front(path, dir);
+    m_index.emplace(path, m_entries.begin());
+    if (m_entries.size() > m_capacity)
+    {
+        evicted = std::move(m_entries.back().second);
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+    return dir;
+}
+
+void DirectoryHandleCache::invalidate(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    ++m_generation;
+    for (auto it = m_entries.begin(); it != m_entries.end();)
+    {
+        const std::string& key = it->first;
+        if (key.size() >= path.size() && key.compare(0, path.size(), path) == 0
+            && (key.size() == path.size() || key[path.size()] == '/'))
+        {
+            m_index.erase(key);
+            it = m_entries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+size_t DirectoryHandleCache::size()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_entries.size();
+}
+}    // namespace securefs
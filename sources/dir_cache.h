@@ -0,0 +1,54 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace securefs
+{
+/**
+ * Keeps the underlying directories of recently used paths open, so that operations on their
+ * entries are issued relative to them (`openat`, `fstatat`, `renameat`, ...) instead of having the
+ * kernel walk every component of the path again. Beyond `capacity` directories, the least recently
+ * used ones are closed.
+ *
+ * An open directory follows its inode rather than its path, so every directory renamed or removed
+ * must be `invalidate`d, and the underlying tree must not be restructured by others while in use.
+ * A cache must only be used with a single root.
+ */
+class DirectoryHandleCache
+{
+    DISABLE_COPY_MOVE(DirectoryHandleCache)
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const OSService>>> list_type;
+
+    std::mutex m_mutex;
+    list_type m_entries;    // The most recently used at the front
+    std::unordered_map<std::string, list_type::iterator> m_index;
+    size_t m_capacity;
+    uint64_t m_generation;    // Bumped by every invalidation, so that stale opens are not cached
+
+public:
+    explicit DirectoryHandleCache(size_t capacity);
+    ~DirectoryHandleCache();
+
+    // Returns the directory `path` under `root`, opening it on a miss. Returns null when `root`
+    // cannot open directories.
+    std::shared_ptr<const OSService> open(const std::shared_ptr<const OSService>& root,
+                                          const std::string& path);
+
+    // Forgets `path` and every directory beneath it
+    void invalidate(const std::string& path);
+
+    size_t capacity() const noexcept { return m_capacity; }
+
+    size_t size();
+};
+}    // namespace securefs
@@ -0,0 +1,429 @@
+#include "fd_pool.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "stats.h"
+
+#include <atomic>
+#include <utility>
+
+namespace securefs
+{
+class PooledFileStream final : public FileStream
+{
+    friend class FileDescriptorPool;
+
+private:
+    std::shared_ptr<FileDescriptorPool> m_pool;
+    std::shared_ptr<const OSService> m_root;
+    std::string m_path, m_full_path;
+    int m_flags;
+    unsigned m_mode;
+
+    // The following fields are guarded by the mutex of the pool
+    std::shared_ptr<FileStream> m_stream;    // Null when the descriptor has been evicted
+    std::weak_ptr<FileStream> m_evicted;     // Until its last in-flight operation finishes
+    std::weak_ptr<PooledFileStream> m_self;
+    std::list<PooledFileStream*>::iterator m_position_in_pool;
+    std::multimap<std::string, PooledFileStream*>::iterator m_position_by_path;
+    unsigned m_lock_count;
+    int m_deferred_error;    // From flushing an evicted descriptor
+    bool m_in_pool, m_registered, m_pinned, m_closed;
+
+    fuse_dev_t m_dev;
+    fuse_ino_t m_ino;
+    length_type m_optimal_block_size;
+    bool m_sparse;
+    std::atomic<offset_type> m_sequential_offset;
+
+private:
+    std::shared_ptr<FileStream> reopen()
+    {
+        auto stream
+            = m_root->open_file_stream(m_path, m_flags & ~(O_CREAT | O_EXCL | O_TRUNC), m_mode);
+        struct fuse_stat st;
+        stream->fstat(&st);
+        if (st.st_dev != m_dev || st.st_ino != m_ino)
+            throwVFSException(ESTALE);
+        return stream;
+    }
+
+    std::shared_ptr<FileStream> acquire(bool lock = false)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            if (m_closed)
+                throwVFSException(EBADF);
+            if (m_stream)
+            {
+                m_lock_count += lock;
+                m_pool->touch(this);
+                record_cache_access(CacheKind::FD_POOL, true);
+                return m_stream;
+            }
+        }
+        record_cache_access(CacheKind::FD_POOL, false);
+        // Asynchronous writes through the evicted descriptor may not have landed yet, and must be
+        // visible through the new one. Its errors are reported here rather than on its eviction.
+        std::shared_ptr<FileStream> evicted_stream;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            evicted_stream = m_evicted.lock();
+        }
+        if (evicted_stream)
+            evicted_stream->flush();
+        // Reopening is done without the lock, so that other streams are not blocked by the syscalls
+        auto reopened = reopen();
+        std::vector<FileDescriptorPool::EvictedStream> evicted;
+        std::shared_ptr<FileStream> result;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            if (m_closed)
+                throwVFSException(EBADF);
+            if (!m_stream)
+                m_stream = std::move(reopened);
+            m_lock_count += lock;
+            m_pool->touch(this);
+            m_pool->evict_excess(evicted);
+            result = m_stream;
+        }
+        m_pool->release(evicted);
+        return result;
+    }
+
+    void raise_deferred_error()
+    {
+        int error;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            error = m_deferred_error;
+            m_deferred_error = 0;
+        }
+        if (error)
+            THROW_POSIX_EXCEPTION(error, "Flushing the evicted descriptor of " + m_full_path);
+    }
+
+public:
+    explicit PooledFileStream(std::shared_ptr<FileDescriptorPool> pool,
+                              std::shared_ptr<const OSService> root,
+                              std::string path,
+                              int flags,
+                              unsigned mode)
+        : m_pool(std::move(pool))
+        , m_root(std::move(root))
+        , m_path(std::move(path))
+        , m_flags(flags)
+        , m_mode(mode)
+        , m_lock_count(0)
+        , m_deferred_error(0)
+        , m_in_pool(false)
+        , m_registered(false)
+        , m_pinned(false)
+        , m_closed(false)
+        , m_sequential_offset(0)
+    {
+        m_full_path = m_root->norm_path(m_path);
+        m_stream = m_root->open_file_stream(m_path, m_flags, m_mode);
+        struct fuse_stat st;
+        m_stream->fstat(&st);
+        m_dev = st.st_dev;
+        m_ino = st.st_ino;
+        m_sparse = m_stream->is_sparse();
+        m_optimal_block_size = m_stream->optimal_block_size();
+    }
+
+    ~PooledFileStream()
+    {
+        std::shared_ptr<FileStream> stream;
+        std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+        m_pool->forget(this);
+        if (m_registered)
+            m_pool->m_streams_by_path.erase(m_position_by_path);
+        stream.swap(m_stream);
+    }
+
+    void close() noexcept override
+    {
+        std::shared_ptr<FileStream> stream;
+        int error;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            m_closed = true;
+            m_pool->forget(this);
+            stream.swap(m_stream);
+            error = m_deferred_error;
+            m_deferred_error = 0;
+        }
+        if (error)
+            WARN_LOG("Unreported error on %s: %s",
+                     m_full_path.c_str(),
+                     OSService::stringify_system_error(error).c_str());
+        if (stream)
+            stream->close();
+    }
+
+    void lock(bool exclusive) override
+    {
+        auto stream = acquire(true);
+        try
+        {
+            stream->lock(exclusive);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            --m_lock_count;
+            throw;
+        }
+    }
+
+    void unlock() noexcept override
+    {
+        std::shared_ptr<FileStream> stream;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            stream = m_stream;
+            if (m_lock_count > 0)
+                --m_lock_count;
+        }
+        if (stream)
+            stream->unlock();
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        return acquire()->read(output, offset, length);
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        acquire()->write(input, offset, length);
+    }
+
+    // Concurrent sequential reads may return the same bytes, as they do on a shared descriptor
+    length_type sequential_read(void* output, length_type length) override
+    {
+        auto rc = read(output, m_sequential_offset.load(), length);
+        m_sequential_offset += rc;
+        return rc;
+    }
+
+    void sequential_write(const void* input, length_type length) override
+    {
+        write(input, m_sequential_offset.fetch_add(length), length);
+    }
+
+    length_type size() const override
+    {
+        return const_cast<PooledFileStream*>(this)->acquire()->size();
+    }
+
+    void flush() override
+    {
+        std::shared_ptr<FileStream> stream;
+        {
+            std::lock_guard<std::mutex> guard(m_pool->m_mutex);
+            stream = m_stream;
+        }
+        // An evicted stream has been flushed on eviction
+        if (stream)
+            stream->flush();
+        raise_deferred_error();
+    }
+
+    void resize(length_type new_length) override { acquire()->resize(new_length); }
+
+    bool is_sparse() const noexcept override { return m_sparse; }
+
+    length_type hole_length(offset_type offset) override { return acquire()->hole_length(offset); }
+
+    bool punch_hole(offset_type offset, length_type length) override
+    {
+        return acquire()->punch_hole(offset, length);
+    }
+
+    length_type optimal_block_size() const noexcept override { return m_optimal_block_size; }
+
+    void fsync() override
+    {
+        acquire()->fsync();
+        raise_deferred_error();
+    }
+
+    void utimens(const struct fuse_timespec ts[2]) override { acquire()->utimens(ts); }
+
+    void fstat(struct fuse_stat* st) override { acquire()->fstat(st); }
+
+    ssize_t listxattr(char* buffer, size_t size) override
+    {
+        return acquire()->listxattr(buffer, size);
+    }
+
+    ssize_t getxattr(const char* name, void* value, size_t size) override
+    {
+        return acquire()->getxattr(name, value, size);
+    }
+
+    void setxattr(const char* name, void* value, size_t size, int flags) override
+    {
+        acquire()->setxattr(name, value, size, flags);
+    }
+
+    void removexattr(const char* name) override { acquire()->removexattr(name); }
+};
+
+FileDescriptorPool::FileDescriptorPool(size_t capacity) : m_capacity(capacity)
+{
+    if (capacity == 0)
+        throwInvalidArgumentException("The capacity of file descriptor pool must be positive");
+}
+
+FileDescriptorPool::~FileDescriptorPool() {}
+
+void FileDescriptorPool::touch(PooledFileStream* stream)
+{
+    if (stream->m_in_pool)
+    {
+        m_open_streams.splice(m_open_streams.begin(), m_open_streams, stream->m_position_in_pool);
+    }
+    else
+    {
+        m_open_streams.push_front(stream);
+        stream->m_position_in_pool = m_open_streams.begin();
+        stream->m_in_pool = true;
+    }
+}
+
+void FileDescriptorPool::forget(PooledFileStream* stream) noexcept
+{
+    if (stream->m_in_pool)
+    {
+        m_open_streams.erase(stream->m_position_in_pool);
+        stream->m_in_pool = false;
+    }
+}
+
+void FileDescriptorPool::evict_excess(std::vector<EvictedStream>& evicted)
+{
+    if (m_open_streams.size() <= m_capacity)
+        return;
+    // The front is the stream just used, so it is never evicted
+    auto it = m_open_streams.end();
+    --it;
+    while (m_open_streams.size() > m_capacity && it != m_open_streams.begin())
+    {
+        PooledFileStream* stream = *it;
+        auto current = it--;
+        if (stream->m_lock_count > 0 || stream->m_pinned)
+            continue;
+        // The descriptor is closed once the last in-flight operation on it finishes
+        EvictedStream e;
+        e.owner = stream->m_self;
+        e.stream = std::move(stream->m_stream);
+        stream->m_evicted = e.stream;
+        evicted.push_back(std::move(e));
+        m_open_streams.erase(current);
+        stream->m_in_pool = false;
+    }
+}
+
+void FileDescriptorPool::release(std::vector<EvictedStream>& evicted) noexcept
+{
+    for (auto&& e : evicted)
+    {
+        // Writes may still be buffered or in flight, and their errors must not be lost
+        try
+        {
+            e.stream->flush();
+        }
+        catch (const std::exception& ex)
+        {
+            WARN_LOG("Flushing an evicted descriptor fails: %s", ex.what());
+            auto ebase = dynamic_cast<const ExceptionBase*>(&ex);
+            auto owner = e.owner.lock();
+            if (owner)
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                if (!owner->m_deferred_error)
+                    owner->m_deferred_error = ebase ? ebase->error_number() : EIO;
+            }
+        }
+        e.stream.reset();
+    }
+}
+
+void FileDescriptorPool::pin_path(const std::string& full_path)
+{
+    std::vector<std::shared_ptr<PooledFileStream>> evicted_streams;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (auto it = m_streams_by_path.lower_bound(full_path);
+             it != m_streams_by_path.end()
+             && it->first.compare(0, full_path.size(), full_path) == 0;
+             ++it)
+        {
+            if (it->first.size() > full_path.size() && it->first[full_path.size()] != '/')
+                continue;
+            PooledFileStream* stream = it->second;
+            if (stream->m_closed)
+                continue;
+            stream->m_pinned = true;
+            if (!stream->m_stream)
+            {
+                auto owner = stream->m_self.lock();
+                if (owner)
+                    evicted_streams.push_back(std::move(owner));
+            }
+        }
+    }
+    for (auto&& stream : evicted_streams)
+    {
+        try
+        {
+            stream->acquire();
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Reopening %s before it moves fails: %s",
+                     stream->m_full_path.c_str(),
+                     e.what());
+        }
+    }
+}
+
+size_t FileDescriptorPool::num_open_descriptors()
+{
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_open_streams.size();
+}
+
+std::shared_ptr<FileStream> FileDescriptorPool::open(std::shared_ptr<const OSService> root,
+                                                     const std::string& path,
+                                                     int flags,
+                                                     unsigned mode)
+{
+    auto stream = std::make_shared<PooledFileStream>(
+        shared_from_this(), std::move(root), path, flags, mode);
+    std::vector<EvictedStream> evicted;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        stream->m_self = stream;
+        stream->m_position_by_path = m_streams_by_path.emplace(stream->m_full_path, stream.get());
+        stream->m_registered = true;
+        touch(stream.get());
+        evict_excess(evicted);
+    }
+    release(evicted);
+    return stream;
+}
+
+std::shared_ptr<FileStream> open_file_stream(const std::shared_ptr<FileDescriptorPool>& pool,
+                                             const std::shared_ptr<const OSService>& root,
+                                             const std::string& path,
+                                             int flags,
+                                             unsigned mode)
+{
+    if (pool)
+        return pool->open(root, path, flags, mode);
+    return root->open_file_stream(path, flags, mode);
+}
+}    // namespace securefs
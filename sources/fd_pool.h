@@ -0,0 +1,86 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+class PooledFileStream;
+
+/**
+ * Bounds the number of kernel file descriptors held by the streams it opens.
+ *
+ * When more than `capacity` streams have their descriptors open, the least recently used ones are
+ * closed, and transparently reopened by path on their next access. Streams holding a lock are
+ * never evicted, since closing the descriptor would drop the lock. Errors that surface when an
+ * evicted descriptor is flushed are reported by the next `flush` or `fsync` of its stream.
+ *
+ * A path that is renamed or removed while open must be passed to `pin_path` beforehand, so that
+ * its streams keep their descriptors for good. As a safeguard against changes made behind the
+ * back of the pool, a reopened stream that does not refer to the same inode as before fails with
+ * ESTALE.
+ */
+class FileDescriptorPool : public std::enable_shared_from_this<FileDescriptorPool>
+{
+    DISABLE_COPY_MOVE(FileDescriptorPool)
+
+    friend class PooledFileStream;
+
+private:
+    struct EvictedStream
+    {
+        std::weak_ptr<PooledFileStream> owner;
+        std::shared_ptr<FileStream> stream;
+    };
+
+    std::mutex m_mutex;
+    std::list<PooledFileStream*> m_open_streams;    // The most recently used at the front
+    std::multimap<std::string, PooledFileStream*> m_streams_by_path;
+    size_t m_capacity;
+
+private:
+    // The following must be called with `m_mutex` held
+    void touch(PooledFileStream* stream);
+    void forget(PooledFileStream* stream) noexcept;
+    void evict_excess(std::vector<EvictedStream>& evicted);
+
+    // Must be called without `m_mutex` held
+    void release(std::vector<EvictedStream>& evicted) noexcept;
+
+public:
+    explicit FileDescriptorPool(size_t capacity);
+    ~FileDescriptorPool();
+
+    std::shared_ptr<FileStream> open(std::shared_ptr<const OSService> root,
+                                     const std::string& path,
+                                     int flags,
+                                     unsigned mode);
+
+    /**
+     * Keeps the descriptors of all streams opened at `full_path`, or beneath it if it is a
+     * directory, from ever being evicted. Evicted ones are reopened first. `full_path` is as
+     * returned by `OSService::norm_path`.
+     */
+    void pin_path(const std::string& full_path);
+
+    size_t capacity() const noexcept { return m_capacity; }
+
+    size_t num_open_descriptors();
+};
+
+/**
+ * Opens through `pool` if it is not null, or directly through `root` otherwise.
+ */
+std::shared_ptr<FileStream> open_file_stream(const std::shared_ptr<FileDescriptorPool>& pool,
+                                             const std::shared_ptr<const OSService>& root,
+                                             const std::string& path,
+                                             int flags,
+                                             unsigned mode);
+}    // namespace securefs
@@ -1,9 +1,12 @@
 #include "file_table.h"
 #include "btree_dir.h"
 #include "exceptions.h"
+#include "fd_pool.h"
 #include "logger.h"
 #include "myutils.h"
 #include "platform.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <limits>
@@ -18,6 +21,188 @@ namespace securefs
 {
 
 typedef std::pair<std::shared_ptr<FileStream>, std::shared_ptr<FileStream>> FileStreamPtrPair;
+
+// Opens the underlying stream on first use. Used for the data file when tiny files are stored
+// inline in the meta file, so that opening such a file costs a single descriptor. Queries that can
+// be answered by path do not force the open.
+class LazyFileStream final : public FileStream
+{
+private:
+    std::shared_ptr<FileDescriptorPool> m_fd_pool;
+    std::shared_ptr<const OSService> m_root;
+    std::string m_path;
+    int m_flags;
+    mutable std::mutex m_mutex;
+    mutable std::shared_ptr<FileStream> m_stream;
+
+private:
+    std::shared_ptr<FileStream> current() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_stream;
+    }
+
+    std::shared_ptr<FileStream> acquire() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (!m_stream)
+            m_stream = open_file_stream(m_fd_pool, m_root, m_path, m_flags, 0);
+        return m_stream;
+    }
+
+public:
+    explicit LazyFileStream(std::shared_ptr<FileDescriptorPool> fd_pool,
+                            std::shared_ptr<const OSService> root,
+                            std::string path,
+                            int flags)
+        : m_fd_pool(std::move(fd_pool))
+        , m_root(std::move(root))
+        , m_path(std::move(path))
+        , m_flags(flags)
+    {
+    }
+
+    ~LazyFileStream() { close(); }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        return acquire()->read(output, offset, length);
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        acquire()->write(input, offset, length);
+    }
+
+    length_type size() const override { return acquire()->size(); }
+
+    void flush() override
+    {
+        auto stream = current();
+        if (stream)
+            stream->flush();
+    }
+
+    void resize(length_type len) override { acquire()->resize(len); }
+
+    bool is_sparse() const noexcept override
+    {
+        auto stream = current();
+        return stream && stream->is_sparse();
+    }
+
+    length_type optimal_block_size() const noexcept override
+    {
+        auto stream = current();
+        return stream ? stream->optimal_block_size() : 1;
+    }
+
+    length_type hole_length(offset_type offset) override { return acquire()->hole_length(offset); }
+
+    bool punch_hole(offset_type offset, length_type length) override
+    {
+        return acquire()->punch_hole(offset, length);
+    }
+
+    const byte* mapped_view(offset_type offset, length_type& length) noexcept override
+    {
+        auto stream = current();
+        return stream ? stream->mapped_view(offset, length) : nullptr;
+    }
+
+    void fsync() override
+    {
+        auto stream = current();
+        if (stream)
+            stream->fsync();
+    }
+
+    void utimens(const struct fuse_timespec ts[2]) override
+    {
+        auto stream = current();
+        if (stream)
+            stream->utimens(ts);
+        else
+            m_root->utimens(m_path, ts);
+    }
+
+    void fstat(struct fuse_stat* st) override
+    {
+        auto stream = current();
+        if (stream)
+            return stream->fstat(st);
+        if (!m_root->stat(m_path, st))
+            throwVFSException(ENOENT);
+    }
+
+    void close() noexcept override
+    {
+        auto stream = current();
+        if (stream)
+            stream->close();
+    }
+
+    ssize_t listxattr(char* buffer, size_t size) override
+    {
+        return acquire()->listxattr(buffer, size);
+    }
+
+    ssize_t getxattr(const char* name, void* value, size_t size) override
+    {
+        return acquire()->getxattr(name, value, size);
+    }
+
+    void setxattr(const char* name, void* value, size_t size, int flags) override
+    {
+        acquire()->setxattr(name, value, size, flags);
+    }
+
+    void removexattr(const char* name) override { acquire()->removexattr(name); }
+
+    void lock(bool exclusive) override { acquire()->lock(exclusive); }
+
+    void unlock() noexcept override
+    {
+        auto stream = current();
+        if (stream)
+            stream->unlock();
+    }
+
+    length_type sequential_read(void* output, length_type length) override
+    {
+        return acquire()->sequential_read(output, length);
+    }
+
+    void sequential_write(const void* input, length_type length) override
+    {
+        acquire()->sequential_write(input, length);
+    }
+};
+
+// With `lazy_data`, the data file is only opened once the meta file alone cannot serve a request
+static FileStreamPtrPair open_stream_pair(const std::shared_ptr<FileDescriptorPool>& fd_pool,
+                                          const std::shared_ptr<const OSService>& root,
+                                          const std::string& filename,
+                                          const std::string& metaname,
+                                          int flags,
+                                          bool lazy_data)
+{
+    unsigned mode = (flags & O_CREAT) ? 0644 : 0;
+    std::shared_ptr<FileStream> data;
+    if (lazy_data)
+    {
+        if (flags & O_CREAT)
+            open_file_stream(fd_pool, root, filename, flags, mode)->close();
+        data = std::make_shared<LazyFileStream>(
+            fd_pool, root, filename, flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+    }
+    else
+    {
+        data = open_file_stream(fd_pool, root, filename, flags, mode);
+    }
+    return std::make_pair(std::move(data),
+                          open_file_stream(fd_pool, root, metaname, flags, mode));
+}
 class FileTableIO
 {
     DISABLE_COPY_MOVE(FileTableIO)
@@ -35,7 +220,8 @@ class FileTableIOVersion1 : public FileTableIO
 {
 private:
     std::shared_ptr<const OSService> m_root;
-    bool m_readonly;
+    std::shared_ptr<FileDescriptorPool> m_fd_pool;
+    bool m_readonly, m_lazy_data;
 
     static const size_t FIRST_LEVEL = 1, SECOND_LEVEL = 5;
 
@@ -55,8 +241,14 @@ private:
     }
 
 public:
-    explicit FileTableIOVersion1(std::shared_ptr<const OSService> root, bool readonly)
-        : m_root(root), m_readonly(readonly)
+    explicit FileTableIOVersion1(std::shared_ptr<const OSService> root,
+                                 std::shared_ptr<FileDescriptorPool> fd_pool,
+                                 bool readonly,
+                                 bool lazy_data)
+        : m_root(root)
+        , m_fd_pool(std::move(fd_pool))
+        , m_readonly(readonly)
+        , m_lazy_data(lazy_data)
     {
     }
 
@@ -66,8 +258,7 @@ public:
         calculate_paths(id, first_level_dir, second_level_dir, filename, metaname);
 
         int open_flags = m_readonly ? O_RDONLY : O_RDWR;
-        return std::make_pair(m_root->open_file_stream(filename, open_flags, 0),
-                              m_root->open_file_stream(metaname, open_flags, 0));
+        return open_stream_pair(m_fd_pool, m_root, filename, metaname, open_flags, m_lazy_data);
     }
 
     FileStreamPtrPair create(const id_type& id) override
@@ -77,8 +268,7 @@ public:
         m_root->ensure_directory(first_level_dir.c_str(), 0755);
         m_root->ensure_directory(second_level_dir.c_str(), 0755);
         int open_flags = O_RDWR | O_CREAT | O_EXCL;
-        return std::make_pair(m_root->open_file_stream(filename, open_flags, 0644),
-                              m_root->open_file_stream(metaname, open_flags, 0644));
+        return open_stream_pair(m_fd_pool, m_root, filename, metaname, open_flags, m_lazy_data);
     }
 
     void unlink(const id_type& id) noexcept override
@@ -96,7 +286,8 @@ class FileTableIOVersion2 : public FileTableIO
 {
 private:
     std::shared_ptr<const OSService> m_root;
-    bool m_readonly;
+    std::shared_ptr<FileDescriptorPool> m_fd_pool;
+    bool m_readonly, m_lazy_data;
 
     static void calculate_paths(const securefs::id_type& id,
                                 std::string& dir,
@@ -109,8 +300,14 @@ private:
     }
 
 public:
-    explicit FileTableIOVersion2(std::shared_ptr<const OSService> root, bool readonly)
-        : m_root(root), m_readonly(readonly)
+    explicit FileTableIOVersion2(std::shared_ptr<const OSService> root,
+                                 std::shared_ptr<FileDescriptorPool> fd_pool,
+                                 bool readonly,
+                                 bool lazy_data)
+        : m_root(root)
+        , m_fd_pool(std::move(fd_pool))
+        , m_readonly(readonly)
+        , m_lazy_data(lazy_data)
     {
     }
 
@@ -120,8 +317,7 @@ public:
         calculate_paths(id, dir, filename, metaname);
 
         int open_flags = m_readonly ? O_RDONLY : O_RDWR;
-        return std::make_pair(m_root->open_file_stream(filename, open_flags, 0),
-                              m_root->open_file_stream(metaname, open_flags, 0));
+        return open_stream_pair(m_fd_pool, m_root, filename, metaname, open_flags, m_lazy_data);
     }
 
     FileStreamPtrPair create(const id_type& id) override
@@ -130,8 +326,7 @@ public:
         calculate_paths(id, dir, filename, metaname);
         m_root->ensure_directory(dir, 0755);
         int open_flags = O_RDWR | O_CREAT | O_EXCL;
-        return std::make_pair(m_root->open_file_stream(filename, open_flags, 0644),
-                              m_root->open_file_stream(metaname, open_flags, 0644));
+        return open_stream_pair(m_fd_pool, m_root, filename, metaname, open_flags, m_lazy_data);
     }
 
     void unlink(const id_type& id) noexcept override
@@ -149,19 +344,22 @@ FileTable::FileTable(int version,
                      const key_type& master_key,
                      uint32_t flags,
                      unsigned block_size,
-                     unsigned iv_size)
+                     unsigned iv_size,
+                     unsigned max_inline_size,
+                     std::shared_ptr<FileDescriptorPool> fd_pool)
     : m_flags(flags), m_block_size(block_size),
-    free_pool(50), m_iv_size(iv_size), m_root(root)
+    free_pool(50), m_iv_size(iv_size), m_max_inline_size(max_inline_size), m_root(root),
+    m_cipher_cache(std::make_shared<CipherContextCache<FileCipherContexts>>())
 {
     memcpy(m_master_key.data(), master_key.data(), master_key.size());
     switch (version)
     {
     case 1:
-        m_fio.reset(new FileTableIOVersion1(root, is_readonly()));
+        m_fio.reset(new FileTableIOVersion1(root, fd_pool, is_readonly(), max_inline_size > 0));
         break;
     case 2:
     case 3:
-        m_fio.reset(new FileTableIOVersion2(root, is_readonly()));
+        m_fio.reset(new FileTableIOVersion2(root, fd_pool, is_readonly(), max_inline_size > 0));
         break;
     default:
         throwInvalidArgumentException("Unknown version");
@@ -176,6 +374,7 @@ FileTable::~FileTable()
 
 FileBase* FileTable::open_as(const id_type& id, int type)
 {
+    ScopedSpan span("FileTable::open_as");
     auto it = m_files.find(id);
     if(it == m_files.end()) {
         std::lock_guard<std::mutex> l(m_closing_lock);
@@ -200,10 +399,12 @@ FileBase* FileTable::open_as(const id_type& id, int type)
             m_files.erase(it);
         else
         {
+            record_cache_access(CacheKind::FILE_TABLE, true);
             it->second->incref();
             return it->second.get();
         }
     }
+    record_cache_access(CacheKind::FILE_TABLE, false);
 
     if(!free_pool.done()) {
         bool being_closed = false;
@@ -229,7 +430,10 @@ FileBase* FileTable::open_as(const id_type& id, int type)
                                         is_auth_enabled(),
                                         m_block_size,
                                         m_iv_size,
-                                        is_time_stored());
+                                        is_time_stored(),
+                                        m_max_inline_size,
+                                        m_cipher_cache,
+                                        get_cipher());
     fb->setref(1);
     auto result = fb.get();
     m_files.emplace(id, std::move(fb));
@@ -253,7 +457,10 @@ FileBase* FileTable::create_as(const id_type& id, int type)
                                         is_auth_enabled(),
                                         m_block_size,
                                         m_iv_size,
-                                        is_time_stored());
+                                        is_time_stored(),
+                                        m_max_inline_size,
+                                        m_cipher_cache,
+                                        get_cipher());
     fb->setref(1);
     auto result = fb.get();
     m_files.emplace(id, std::move(fb));
@@ -16,6 +16,7 @@
 namespace securefs
 {
 class FileTableIO;
+class FileDescriptorPool;
 
 class AutoClosedFileBase;
 
@@ -41,8 +42,9 @@ private:
 
     std::unique_ptr<FileTableIO> m_fio;
     uint32_t m_flags;
-    unsigned m_block_size, m_iv_size;
+    unsigned m_block_size, m_iv_size, m_max_inline_size;
     std::shared_ptr<const OSService> m_root;
+    std::shared_ptr<CipherContextCache<FileCipherContexts>> m_cipher_cache;
 
 private:
     void eject();
@@ -54,7 +56,9 @@ public:
                        const key_type& master_key,
                        uint32_t flags,
                        unsigned block_size,
-                       unsigned iv_size);
+                       unsigned iv_size,
+                       unsigned max_inline_size = 0,
+                       std::shared_ptr<FileDescriptorPool> fd_pool = {});
     ~FileTable();
     FileBase* open_as(const id_type& id, int type);
     FileBase* create_as(const id_type& id, int type);
@@ -62,6 +66,11 @@ public:
     bool is_readonly() const noexcept { return (m_flags & kOptionReadOnly) != 0; }
     bool is_auth_enabled() const noexcept { return (m_flags & kOptionNoAuthentication) == 0; }
     bool is_time_stored() const noexcept { return (m_flags & kOptionStoreTime) != 0; }
+    AEADAlgorithm get_cipher() const noexcept
+    {
+        return (m_flags & kOptionChaCha20Poly1305) ? AEADAlgorithm::CHACHA20_POLY1305
+                                                   : AEADAlgorithm::AES_GCM;
+    }
     void gc();
     void statfs(struct fuse_statvfs* fs_info) { m_root->statfs(fs_info); }
 };
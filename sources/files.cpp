@@ -73,10 +73,126 @@ The layout becomes
 
  Each time field is composed of three 32-bit integers, the first two compose the time in seconds
 since epoch, and last one is the number of nanoseconds.
+
+ When the filesystem is created with a nonzero `max_inline_size`, both layouts above are followed by
+ ----
+ inline_length
+ ----
+ inline_data (max_inline_size bytes)
+ ----
+
+ Regular files and symlinks no larger than `max_inline_size` keep their contents in `inline_data`,
+so reading them touches only the meta file. An `inline_length` of 0xFFFFFFFF means the contents are
+stored in blocks of the data file as usual. A file is moved to the data file when it grows beyond
+the limit, and stays there afterwards. Directories are never inlined.
 **/
 
 namespace securefs
 {
+/**
+ * Holds the contents of a tiny file in memory, to be persisted within the header by FileBase.
+ * Once the contents grow beyond the limit, they are moved into the block based stream, and all
+ * subsequent operations are forwarded there.
+ */
+class InlineStream : public StreamBase
+{
+private:
+    std::shared_ptr<StreamBase> m_blocks;
+    std::vector<byte> m_data;
+    length_type m_max_size;
+    bool m_inline, m_dirty;
+
+private:
+    void move_to_blocks()
+    {
+        if (!m_data.empty())
+            m_blocks->write(m_data.data(), 0, m_data.size());
+        std::vector<byte>().swap(m_data);
+        m_inline = false;
+        m_dirty = true;
+    }
+
+public:
+    explicit InlineStream(std::shared_ptr<StreamBase> blocks, length_type max_size)
+        : m_blocks(std::move(blocks)), m_max_size(max_size), m_inline(false), m_dirty(false)
+    {
+    }
+
+    bool is_inline() const noexcept { return m_inline; }
+
+    bool is_dirty() const noexcept { return m_dirty; }
+
+    void clear_dirty() noexcept { m_dirty = false; }
+
+    const std::vector<byte>& data() const noexcept { return m_data; }
+
+    void load_inline(const void* input, length_type length)
+    {
+        if (length > m_max_size)
+            throwInvalidArgumentException("Inline data exceeds the limit");
+        auto ptr = static_cast<const byte*>(input);
+        m_data.assign(ptr, ptr + length);
+        m_inline = true;
+        m_dirty = false;
+    }
+
+    void load_blocks() noexcept
+    {
+        std::vector<byte>().swap(m_data);
+        m_inline = false;
+        m_dirty = false;
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        if (!m_inline)
+            return m_blocks->read(output, offset, length);
+        if (offset >= m_data.size())
+            return 0;
+        length = std::min<length_type>(length, m_data.size() - offset);
+        memcpy(output, m_data.data() + offset, length);
+        return length;
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        if (m_inline && offset + length > m_max_size)
+            move_to_blocks();
+        if (!m_inline)
+            return m_blocks->write(input, offset, length);
+        if (length == 0)
+            return;
+        if (offset + length > m_data.size())
+            m_data.resize(offset + length, 0);
+        memcpy(m_data.data() + offset, input, length);
+        m_dirty = true;
+    }
+
+    length_type size() const override { return m_inline ? m_data.size() : m_blocks->size(); }
+
+    void flush() override { m_blocks->flush(); }
+
+    void resize(length_type new_size) override
+    {
+        if (m_inline && new_size > m_max_size)
+            move_to_blocks();
+        if (!m_inline)
+            return m_blocks->resize(new_size);
+        if (new_size != m_data.size())
+        {
+            m_data.resize(new_size, 0);
+            m_dirty = true;
+        }
+    }
+
+    bool is_sparse() const noexcept override { return !m_inline && m_blocks->is_sparse(); }
+
+    length_type optimal_block_size() const noexcept override
+    {
+        return m_blocks->optimal_block_size();
+    }
+};
+
 void FileBase::initialize_empty(uint32_t mode, uint32_t uid, uint32_t gid)
 {
     m_flags[0] = mode;
@@ -87,6 +203,14 @@ void FileBase::initialize_empty(uint32_t mode, uint32_t uid, uint32_t gid)
     m_flags[5] = static_cast<uint32_t>(-1);
     m_flags[6] = 0;
 
+    if (m_inline_stream)
+    {
+        if ((mode & S_IFMT) == S_IFDIR)
+            m_inline_stream->load_blocks();
+        else
+            m_inline_stream->load_inline(nullptr, 0);
+    }
+
     if (m_store_time)
     {
         OSService::get_current_time(m_atime);
@@ -110,62 +234,80 @@ FileBase::FileBase(std::shared_ptr<FileStream> data_stream,
                    bool check,
                    unsigned block_size,
                    unsigned iv_size,
-                   bool store_time)
+                   bool store_time,
+                   unsigned max_inline_size,
+                   std::shared_ptr<CipherContextCache<FileCipherContexts>> cipher_cache,
+                   AEADAlgorithm algorithm)
     : m_refcount(1)
     , m_header()
     , m_id(id_)
     , m_data_stream(data_stream)
     , m_meta_stream(meta_stream)
+    , m_cipher_cache(std::move(cipher_cache))
+    , m_inline_stream()
+    , m_max_inline_size(max_inline_size)
     , m_dirty(false)
     , m_check(check)
     , m_store_time(store_time)
     , m_stream()
 {
     warn_if_key_not_random(key_, __FILE__, __LINE__);
-    key_type data_key, meta_key;
-    byte generated_keys[KEY_LENGTH * 3];
-    hkdf(key_.data(),
-         key_.size(),
-         nullptr,
-         0,
-         id_.data(),
-         id_.size(),
-         generated_keys,
-         array_length(generated_keys));
-    memcpy(data_key.data(), generated_keys, KEY_LENGTH);
-    memcpy(meta_key.data(), generated_keys + KEY_LENGTH, KEY_LENGTH);
-    auto crypt = make_cryptstream_aes_gcm(std::static_pointer_cast<StreamBase>(data_stream),
-                                          std::static_pointer_cast<StreamBase>(meta_stream),
-                                          data_key,
-                                          meta_key,
-                                          id_,
-                                          check,
-                                          block_size,
-                                          iv_size,
-                                          store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE);
+    if (m_cipher_cache)
+        m_ciphers = m_cipher_cache->take(
+            std::string(reinterpret_cast<const char*>(id_.data()), id_.size()));
+    if (!m_ciphers)
+    {
+        CryptoPP::FixedSizeAlignedSecBlock<byte, KEY_LENGTH * 3> generated_keys;
+        hkdf(key_.data(),
+             key_.size(),
+             nullptr,
+             0,
+             id_.data(),
+             id_.size(),
+             generated_keys.data(),
+             generated_keys.size());
+        m_ciphers = std::make_shared<FileCipherContexts>();
+        m_ciphers->data = make_aead_context(algorithm);
+        m_ciphers->data->set_key(generated_keys.data(), KEY_LENGTH);
+        memcpy(m_ciphers->meta_key.data(), generated_keys.data() + KEY_LENGTH, KEY_LENGTH);
+        m_ciphers->xattr.set_key(generated_keys.data() + 2 * KEY_LENGTH, KEY_LENGTH);
+    }
+    auto crypt = make_cryptstream_aead(std::static_pointer_cast<StreamBase>(data_stream),
+                                       std::static_pointer_cast<StreamBase>(meta_stream),
+                                       m_ciphers->data,
+                                       m_ciphers->meta_key,
+                                       id_,
+                                       check,
+                                       block_size,
+                                       iv_size,
+                                       static_cast<unsigned>(header_size()));
     // The header size when time extension is enabled is enlarged by the space required by st_atime,
-    // st_ctime and st_mtime
+    // st_ctime and st_mtime, and further by the inline data area if enabled
 
-    m_stream = crypt.first;
     m_header = crypt.second;
+    if (m_max_inline_size > 0)
+    {
+        m_inline_stream = std::make_shared<InlineStream>(crypt.first, m_max_inline_size);
+        m_stream = m_inline_stream;
+    }
+    else
+    {
+        m_stream = crypt.first;
+    }
     read_header();
-
-    const byte null_iv[12] = {};
-    m_xattr_enc.SetKeyWithIV(
-        generated_keys + 2 * KEY_LENGTH, KEY_LENGTH, null_iv, array_length(null_iv));
-    m_xattr_dec.SetKeyWithIV(
-        generated_keys + 2 * KEY_LENGTH, KEY_LENGTH, null_iv, array_length(null_iv));
 }
 
 void FileBase::read_header()
 {
     memset(m_flags, 0xFF, sizeof(m_flags));
-    size_t header_size = m_store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE;
+    size_t header_size = this->header_size();
     auto header = make_unique_array<byte>(header_size);
     auto rc = m_header->read_header(header.get(), header_size);
     if (!rc)
     {
         set_num_free_page(0);
+        if (m_inline_stream)
+            m_inline_stream->load_inline(nullptr, 0);
     }
     else
     {
@@ -188,9 +330,25 @@ void FileBase::read_header()
             m_birthtime.tv_nsec
                 = from_little_endian<uint32_t>(&header[BTIME_OFFSET + sizeof(uint64_t)]);
         }
+        if (m_inline_stream)
+        {
+            const byte* inline_area = &header[base_header_size()];
+            auto inline_length = from_little_endian<uint32_t>(inline_area);
+            if (inline_length == NOT_INLINE)
+                m_inline_stream->load_blocks();
+            else if (inline_length > m_max_inline_size)
+                throw CorruptedMetaDataException(m_id, "Invalid length of inline data");
+            else
+                m_inline_stream->load_inline(inline_area + sizeof(uint32_t), inline_length);
+        }
     }
 }
 
+bool FileBase::is_inline() const noexcept
+{
+    return m_inline_stream && m_inline_stream->is_inline();
+}
+
 int FileBase::get_real_type() { return type_for_mode(get_mode() & S_IFMT); }
 
 void FileBase::stat(struct fuse_stat* st)
@@ -225,14 +383,30 @@ void FileBase::stat(struct fuse_stat* st)
     }
 }
 
-FileBase::~FileBase() {}
+FileBase::~FileBase()
+{
+    if (!m_cipher_cache)
+        return;
+    // Release the streams first, as they use the contexts to be handed over
+    m_stream.reset();
+    m_inline_stream.reset();
+    m_header.reset();
+    try
+    {
+        m_cipher_cache->put(std::string(reinterpret_cast<const char*>(m_id.data()), m_id.size()),
+                            std::move(m_ciphers));
+    }
+    catch (...)
+    {
+    }
+}
 
 void FileBase::flush()
 {
     this->subflush();
-    if (m_dirty)
+    if (m_dirty || (m_inline_stream && m_inline_stream->is_dirty()))
     {
-        size_t header_size = m_store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE;
+        size_t header_size = this->header_size();
         auto header = make_unique_array<byte>(header_size);
         memset(header.get(), 0, header_size);
         for (size_t i = 0; i < NUM_FLAGS; ++i)
@@ -251,6 +425,22 @@ void FileBase::flush()
             to_little_endian<uint32_t>(m_birthtime.tv_nsec,
                                        &header[BTIME_OFFSET + sizeof(uint64_t)]);
         }
+        if (m_inline_stream)
+        {
+            byte* inline_area = &header[base_header_size()];
+            if (m_inline_stream->is_inline())
+            {
+                const auto& data = m_inline_stream->data();
+                to_little_endian(static_cast<uint32_t>(data.size()), inline_area);
+                if (!data.empty())
+                    memcpy(inline_area + sizeof(uint32_t), data.data(), data.size());
+            }
+            else
+            {
+                to_little_endian(NOT_INLINE, inline_area);
+            }
+            m_inline_stream->clear_dirty();
+        }
         m_header->write_header(header.get(), header_size);
         m_dirty = false;
     }
@@ -293,7 +483,7 @@ ssize_t FileBase::getxattr(const char* name, char* value, size_t size)
     byte* mac = meta + XATTR_IV_LENGTH;
     byte* ciphertext = reinterpret_cast<byte*>(value);
 
-    bool success = m_xattr_dec.DecryptAndVerify(reinterpret_cast<byte*>(value),
+    bool success = m_ciphers->xattr.decryptor.DecryptAndVerify(reinterpret_cast<byte*>(value),
                                                 mac,
                                                 XATTR_MAC_LENGTH,
                                                 iv,
@@ -343,14 +533,14 @@ void FileBase::setxattr(const char* name, const char* value, size_t size, int fl
     byte meta[XATTR_MAC_LENGTH + XATTR_IV_LENGTH];
     byte* iv = meta;
     byte* mac = iv + XATTR_IV_LENGTH;
-    generate_random(iv, XATTR_IV_LENGTH);
+    generate_iv(iv, XATTR_IV_LENGTH);
 
     auto name_len = strlen(name);
     auto header = make_unique_array<byte>(name_len + ID_LENGTH);
     memcpy(header.get(), get_id().data(), ID_LENGTH);
     memcpy(header.get() + ID_LENGTH, name, name_len);
 
-    m_xattr_enc.EncryptAndAuthenticate(ciphertext,
+    m_ciphers->xattr.encryptor.EncryptAndAuthenticate(ciphertext,
                                        mac,
                                        XATTR_MAC_LENGTH,
                                        iv,
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "cipher_cache.h"
 #include "myutils.h"
 #include "platform.h"
 #include "streams.h"
@@ -21,6 +22,7 @@ namespace securefs
 class RegularFile;
 class Directory;
 class Symlink;
+class InlineStream;
 
 class FileBase
 {
@@ -34,6 +36,9 @@ private:
     static_assert(BTIME_OFFSET + sizeof(uint64_t) + sizeof(uint32_t) <= EXTENDED_HEADER_SIZE,
                   "Constants are wrong!");
 
+    // Marks in the inline length field that the contents live in the data file instead
+    static const uint32_t NOT_INLINE = static_cast<uint32_t>(-1);
+
 private:
     ptrdiff_t m_refcount;
     std::shared_ptr<HeaderBase> m_header;
@@ -41,11 +46,23 @@ private:
     uint32_t m_flags[NUM_FLAGS];
     fuse_timespec m_atime, m_mtime, m_ctime, m_birthtime;
     std::shared_ptr<FileStream> m_data_stream, m_meta_stream;
-    CryptoPP::GCM<CryptoPP::AES>::Encryption m_xattr_enc;
-    CryptoPP::GCM<CryptoPP::AES>::Decryption m_xattr_dec;
+    std::shared_ptr<FileCipherContexts> m_ciphers;
+    std::shared_ptr<CipherContextCache<FileCipherContexts>> m_cipher_cache;
+    std::shared_ptr<InlineStream> m_inline_stream;
+    unsigned m_max_inline_size;
     bool m_dirty, m_check, m_store_time;
 
 private:
+    size_t base_header_size() const noexcept
+    {
+        return m_store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE;
+    }
+
+    size_t header_size() const noexcept
+    {
+        return base_header_size() + (m_max_inline_size ? sizeof(uint32_t) + m_max_inline_size : 0);
+    }
+
     void read_header();
 
     [[noreturn]] void throw_invalid_cast(int to_type);
@@ -129,7 +146,10 @@ public:
                       bool check,
                       unsigned block_size,
                       unsigned iv_size,
-                      bool store_time = false);
+                      bool store_time = false,
+                      unsigned max_inline_size = 0,
+                      std::shared_ptr<CipherContextCache<FileCipherContexts>> cipher_cache = {},
+                      AEADAlgorithm algorithm = AEADAlgorithm::AES_GCM);
 
     virtual ~FileBase();
     DISABLE_COPY_MOVE(FileBase)
@@ -253,6 +273,11 @@ public:
 
     bool is_unlinked() const noexcept { return get_nlink() <= 0; }
 
+    /**
+     * Whether the contents are currently stored inside the header instead of the data file.
+     */
+    bool is_inline() const noexcept;
+
     void unlink()
     {
         auto nlink = get_nlink();
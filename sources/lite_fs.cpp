@@ -1,7 +1,11 @@
 #include "lite_fs.h"
 #include "case_fold.h"
 #include "constants.h"
+#include "dir_cache.h"
+#include "fd_pool.h"
 #include "logger.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <cryptopp/base32.h>
 
@@ -16,21 +20,126 @@ namespace lite
                const key_type& master_key,
                unsigned block_size,
                unsigned iv_size,
-               bool check)
+               bool check,
+               bool aligned,
+               std::shared_ptr<CipherContextCache<AEADContext>> session_cache,
+               AEADAlgorithm algorithm)
         : m_file_stream(file_stream)
+        , m_num_lock_holders(0)
+        , m_locked_exclusively(false)
+        , m_refcount(1)
+        , m_writable(false)
     {
         m_file_stream->lock(true);
         DEFER(m_file_stream->unlock());
-        m_crypt_stream.emplace(file_stream, master_key, block_size, iv_size, check);
+        m_crypt_stream.emplace(file_stream,
+                               master_key,
+                               block_size,
+                               iv_size,
+                               check,
+                               aligned,
+                               std::move(session_cache),
+                               algorithm);
     }
 
     File::~File() {}
 
+    void File::lock(bool exclusive)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        // A shared lock is upgraded when a writer joins, and kept until the last holder leaves
+        if (m_num_lock_holders == 0 || (exclusive && !m_locked_exclusively))
+        {
+            m_file_stream->lock(exclusive);
+            m_locked_exclusively = exclusive;
+        }
+        ++m_num_lock_holders;
+    }
+
+    void File::unlock() noexcept
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (--m_num_lock_holders > 0)
+            return;
+        m_file_stream->unlock();
+        m_locked_exclusively = false;
+    }
+
+    void FileCloser::operator()(File* fp) const noexcept
+    {
+        if (!fp)
+            return;
+        if (fp->m_table)
+            fp->m_table->release(fp);
+        else
+            delete fp;
+    }
+
+    OpenFileTable::OpenFileTable() {}
+
+    OpenFileTable::~OpenFileTable() {}
+
+    AutoClosedFile OpenFileTable::acquire(const inode_key_type& id, bool writable)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto it = m_files.find(id);
+        bool hit = it != m_files.end() && (it->second->m_writable || !writable);
+        record_cache_access(CacheKind::OPEN_FILES, hit);
+        if (!hit)
+            return {};
+        ++it->second->m_refcount;
+        return AutoClosedFile(it->second);
+    }
+
+    AutoClosedFile
+    OpenFileTable::insert(const inode_key_type& id, bool writable, AutoClosedFile file)
+    {
+        AutoClosedFile existing;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            File*& slot = m_files[id];
+            if (!slot || (writable && !slot->m_writable))
+            {
+                // A read only file replaced here stays open for the handles still referring to it
+                file->m_table = shared_from_this();
+                file->m_id = id;
+                file->m_writable = writable;
+                slot = file.get();
+                return file;
+            }
+            ++slot->m_refcount;
+            existing.reset(slot);
+        }
+        // `file` is closed after the lock is released
+        return existing;
+    }
+
+    void OpenFileTable::release(File* fp) noexcept
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (--fp->m_refcount > 0)
+                return;
+            auto it = m_files.find(fp->m_id);
+            if (it != m_files.end() && it->second == fp)
+                m_files.erase(it);
+        }
+        delete fp;
+    }
+
+    size_t OpenFileTable::size()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_files.size();
+    }
+
     void File::fstat(struct fuse_stat* stat)
     {
         m_file_stream->fstat(stat);
-        stat->st_size = AESGCMCryptStream::calculate_real_size(
-            stat->st_size, m_crypt_stream->get_block_size(), m_crypt_stream->get_iv_size());
+        stat->st_size = AEADCryptStream::calculate_real_size(stat->st_size,
+                                                             m_crypt_stream->get_block_size(),
+                                                             m_crypt_stream->get_iv_size(),
+                                                             m_crypt_stream->is_aligned());
     }
 
     FileSystem::FileSystem(std::shared_ptr<const securefs::OSService> root,
@@ -39,10 +148,18 @@ namespace lite
                            const key_type& xattr_key,
                            unsigned block_size,
                            unsigned iv_size,
-                           unsigned flags)
+                           unsigned flags,
+                           std::shared_ptr<FileDescriptorPool> fd_pool,
+                           std::shared_ptr<CipherContextCache<AEADContext>> session_cache,
+                           std::shared_ptr<DirectoryHandleCache> dir_cache,
+                           std::shared_ptr<OpenFileTable> open_files)
         : m_name_encryptor(name_key.data(), name_key.size())
         , m_content_key(content_key)
         , m_root(std::move(root))
+        , m_fd_pool(std::move(fd_pool))
+        , m_session_cache(std::move(session_cache))
+        , m_dir_cache(std::move(dir_cache))
+        , m_open_files(m_fd_pool ? nullptr : std::move(open_files))
         , m_block_size(block_size)
         , m_iv_size(iv_size)
         , m_flags(flags)
@@ -133,6 +250,7 @@ namespace lite
 
     std::string FileSystem::translate_path(StringRef path, bool preserve_leading_slash)
     {
+        ScopedSpan span("translate_path");
         if (path.empty())
         {
             return {};
@@ -161,6 +279,29 @@ namespace lite
         }
     }
 
+    std::shared_ptr<const OSService> FileSystem::locate(const std::string& path, std::string* name)
+    {
+        auto slash = path.rfind('/');
+        if (m_dir_cache && slash != std::string::npos && slash > 0)
+        {
+            try
+            {
+                auto dir = m_dir_cache->open(m_root, path.substr(0, slash));
+                if (dir)
+                {
+                    name->assign(path, slash + 1, std::string::npos);
+                    return dir;
+                }
+            }
+            catch (const std::exception&)
+            {
+                // Left for the operation on the full path to report, e.g. as a missing entry
+            }
+        }
+        *name = path;
+        return m_root;
+    }
+
     AutoClosedFile FileSystem::open(StringRef path, int flags, fuse_mode_t mode)
     {
         if (flags & O_APPEND)
@@ -176,21 +317,58 @@ namespace lite
         {
             mode |= S_IRUSR;
         }
-        auto file_stream = m_root->open_file_stream(translate_path(path, false), flags, mode);
-        AutoClosedFile fp(new File(file_stream,
-                                   m_content_key,
-                                   m_block_size,
-                                   m_iv_size,
-                                   (m_flags & kOptionNoAuthentication) == 0));
+        std::string name;
+        auto dir = locate(translate_path(path, false), &name);
+        bool writable = (flags & O_ACCMODE) != O_RDONLY;
+
+        // A shared file may be open already, so truncation is left to the `resize` below
+        auto file_stream = open_file_stream(
+            m_fd_pool, dir, name, m_open_files ? flags & ~O_TRUNC : flags, mode);
+        auto make_file = [&]() {
+            return AutoClosedFile(new File(file_stream,
+                                           m_content_key,
+                                           m_block_size,
+                                           m_iv_size,
+                                           (m_flags & kOptionNoAuthentication) == 0,
+                                           (m_flags & kOptionAlignedBlocks) != 0,
+                                           m_session_cache,
+                                           (m_flags & kOptionChaCha20Poly1305)
+                                               ? AEADAlgorithm::CHACHA20_POLY1305
+                                               : AEADAlgorithm::AES_GCM));
+        };
+        AutoClosedFile fp;
+        if (m_open_files)
+        {
+            struct fuse_stat st;
+            file_stream->fstat(&st);
+            if (st.st_ino != 0)
+            {
+                inode_key_type id(st.st_dev, st.st_ino);
+                // Exclusive creations always make a new file, so there is none to share
+                if (!((flags & O_CREAT) && (flags & O_EXCL)))
+                    fp = m_open_files->acquire(id, writable);
+                if (fp)
+                    file_stream->close();
+                else
+                    fp = m_open_files->insert(id, writable, make_file());
+            }
+        }
+        if (!fp)
+            fp = make_file();
         if (flags & O_TRUNC)
+        {
+            fp->lock();
+            DEFER(fp->unlock());
             fp->resize(0);
+        }
         return fp;
     }
 
     bool FileSystem::stat(StringRef path, struct fuse_stat* buf)
     {
-        auto enc_path = translate_path(path, false);
-        if (!m_root->stat(enc_path, buf))
+        std::string enc_path;
+        auto dir = locate(translate_path(path, false), &enc_path);
+        if (!dir->stat(enc_path, buf))
             return false;
         if (buf->st_size <= 0)
             return true;
@@ -204,7 +382,7 @@ namespace lite
             // 'buf->st_size' is the expected link size, but on NTFS volumes the link starts with
             // 'IntxLNK\1' followed by the UTF-16 encoded target.
             std::string buffer(buf->st_size, '\0');
-            ssize_t link_size = m_root->readlink(enc_path, &buffer[0], buffer.size());
+            ssize_t link_size = dir->readlink(enc_path, &buffer[0], buffer.size());
             if (link_size != buf->st_size && link_size != (buf->st_size - 8) / 2)
                 throwVFSException(EIO);
 
@@ -218,8 +396,8 @@ namespace lite
         case S_IFDIR:
             break;
         case S_IFREG:
-            buf->st_size
-                = AESGCMCryptStream::calculate_real_size(buf->st_size, m_block_size, m_iv_size);
+            buf->st_size = AEADCryptStream::calculate_real_size(
+                buf->st_size, m_block_size, m_iv_size, (m_flags & kOptionAlignedBlocks) != 0);
             break;
         default:
             throwVFSException(ENOTSUP);
@@ -229,17 +407,40 @@ namespace lite
 
     void FileSystem::mkdir(StringRef path, fuse_mode_t mode)
     {
-        m_root->mkdir(translate_path(path, false), mode);
+        std::string name;
+        locate(translate_path(path, false), &name)->mkdir(name, mode);
     }
 
     void FileSystem::rmdir(StringRef path)
     {
-        m_root->remove_directory(translate_path(path, false));
+        auto enc_path = translate_path(path, false);
+        std::string name;
+        locate(enc_path, &name)->remove_directory(name);
+        if (m_dir_cache)
+            m_dir_cache->invalidate(enc_path);
     }
 
     void FileSystem::rename(StringRef from, StringRef to)
     {
-        m_root->rename(translate_path(from, false), translate_path(to, false));
+        auto efrom = translate_path(from, false), eto = translate_path(to, false);
+        std::string from_name, to_name;
+        auto from_dir = locate(efrom, &from_name), to_dir = locate(eto, &to_name);
+        if (m_fd_pool)
+        {
+            // Open streams can no longer be reopened by path afterwards
+            m_fd_pool->pin_path(m_root->norm_path(efrom));
+            m_fd_pool->pin_path(m_root->norm_path(eto));
+        }
+        if (from_dir == to_dir)
+            from_dir->rename(from_name, to_name);
+        else
+            from_dir->rename_at(from_name, *to_dir, to_name);
+        if (m_dir_cache)
+        {
+            // Either may be a directory, the one at the destination being replaced
+            m_dir_cache->invalidate(efrom);
+            m_dir_cache->invalidate(eto);
+        }
     }
 
     void FileSystem::chmod(StringRef path, fuse_mode_t mode)
@@ -251,12 +452,14 @@ namespace lite
                      path.c_str(),
                      static_cast<unsigned>(mode));
         }
-        m_root->chmod(translate_path(path, false), mode);
+        std::string name;
+        locate(translate_path(path, false), &name)->chmod(name, mode);
     }
 
     void FileSystem::chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid)
     {
-        m_root->chown(translate_path(path, false), uid, gid);
+        std::string name;
+        locate(translate_path(path, false), &name)->chown(name, uid, gid);
     }
 
     size_t FileSystem::readlink(StringRef path, char* buf, size_t size)
@@ -267,7 +470,8 @@ namespace lite
         auto max_size = size / 5 * 8 + 32;
         auto underbuf = securefs::make_unique_array<char>(max_size);
         memset(underbuf.get(), 0, max_size);
-        m_root->readlink(translate_path(path, false), underbuf.get(), max_size - 1);
+        std::string name;
+        locate(translate_path(path, false), &name)->readlink(name, underbuf.get(), max_size - 1);
         std::string resolved = decrypt_path(m_name_encryptor, underbuf.get());
         size_t copy_size = std::min(resolved.size(), size - 1);
         memcpy(buf, resolved.data(), copy_size);
@@ -277,20 +481,36 @@ namespace lite
 
     void FileSystem::symlink(StringRef to, StringRef from)
     {
-        auto eto = translate_path(to, true), efrom = translate_path(from, false);
-        m_root->symlink(eto, efrom);
+        auto eto = translate_path(to, true);
+        std::string name;
+        locate(translate_path(from, false), &name)->symlink(eto, name);
     }
 
     void FileSystem::utimens(StringRef path, const fuse_timespec* ts)
     {
-        m_root->utimens(translate_path(path, false), ts);
+        std::string name;
+        locate(translate_path(path, false), &name)->utimens(name, ts);
     }
 
-    void FileSystem::unlink(StringRef path) { m_root->remove_file(translate_path(path, false)); }
+    void FileSystem::unlink(StringRef path)
+    {
+        auto enc_path = translate_path(path, false);
+        std::string name;
+        auto dir = locate(enc_path, &name);
+        if (m_fd_pool)
+            m_fd_pool->pin_path(m_root->norm_path(enc_path));
+        dir->remove_file(name);
+    }
 
     void FileSystem::link(StringRef src, StringRef dest)
     {
-        m_root->link(translate_path(src, false), translate_path(dest, false));
+        auto esrc = translate_path(src, false), edest = translate_path(dest, false);
+        std::string src_name, dest_name;
+        auto src_dir = locate(esrc, &src_name), dest_dir = locate(edest, &dest_name);
+        if (src_dir == dest_dir)
+            src_dir->link(src_name, dest_name);
+        else
+            src_dir->link_at(src_name, *dest_dir, dest_name);
     }
 
     void FileSystem::statvfs(struct fuse_statvfs* buf) { m_root->statfs(buf); }
@@ -301,16 +521,19 @@ namespace lite
         std::unique_ptr<DirectoryTraverser> m_underlying_traverser;
         AES_SIV m_name_encryptor;
         unsigned m_block_size, m_iv_size;
+        bool m_aligned;
 
     public:
         explicit LiteDirectoryTraverser(std::unique_ptr<DirectoryTraverser> underlying_traverser,
                                         const AES_SIV& name_encryptor,
                                         unsigned block_size,
-                                        unsigned iv_size)
+                                        unsigned iv_size,
+                                        bool aligned)
             : m_underlying_traverser(std::move(underlying_traverser))
             , m_name_encryptor(name_encryptor)
             , m_block_size(block_size)
             , m_iv_size(iv_size)
+            , m_aligned(aligned)
         {
         }
         ~LiteDirectoryTraverser() {}
@@ -363,8 +586,8 @@ namespace lite
                         continue;
                     }
                     if (stbuf)
-                        stbuf->st_size = AESGCMCryptStream::calculate_real_size(
-                            stbuf->st_size, m_block_size, m_iv_size);
+                        stbuf->st_size = AEADCryptStream::calculate_real_size(
+                            stbuf->st_size, m_block_size, m_iv_size, m_aligned);
                 }
                 catch (const std::exception& e)
                 {
@@ -386,7 +609,8 @@ namespace lite
             m_root->create_traverser(translate_path(path, false)),
             this->m_name_encryptor,
             m_block_size,
-            m_iv_size);
+            m_iv_size,
+            (m_flags & kOptionAlignedBlocks) != 0);
     }
 
 #ifdef __APPLE__
@@ -401,7 +625,7 @@ namespace lite
         try
         {
             auto iv_size = m_iv_size;
-            auto mac_size = AESGCMCryptStream::get_mac_size();
+            auto mac_size = AEADCryptStream::get_mac_size();
             auto underbuf = securefs::make_unique_array<byte>(size + iv_size + mac_size);
             ssize_t readlen = m_root->getxattr(translate_path(path, false).c_str(),
                                                name,
@@ -447,9 +671,9 @@ namespace lite
         try
         {
             auto iv_size = m_iv_size;
-            auto mac_size = AESGCMCryptStream::get_mac_size();
+            auto mac_size = AEADCryptStream::get_mac_size();
             auto underbuf = securefs::make_unique_array<byte>(size + iv_size + mac_size);
-            generate_random(underbuf.get(), iv_size);
+            generate_iv(underbuf.get(), iv_size);
             m_xattr_enc.EncryptAndAuthenticate(underbuf.get() + iv_size,
                                                underbuf.get() + iv_size + size,
                                                mac_size,
@@ -10,6 +10,7 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <utility>
 
 #include <cryptopp/aes.h>
 #include <cryptopp/gcm.h>
@@ -17,23 +18,47 @@
 
 namespace securefs
 {
+class FileDescriptorPool;
+class DirectoryHandleCache;
+
 namespace lite
 {
+    class OpenFileTable;
+    struct FileCloser;
+
+    typedef std::pair<uint64_t, uint64_t> inode_key_type;    // Device and inode number
+
     class File
     {
         DISABLE_COPY_MOVE(File)
 
+        friend class OpenFileTable;
+        friend struct FileCloser;
+
     private:
-        securefs::optional<lite::AESGCMCryptStream> m_crypt_stream;
+        securefs::optional<lite::AEADCryptStream> m_crypt_stream;
         std::shared_ptr<securefs::FileStream> m_file_stream;
+        // The underlying file is locked against other processes while any thread holds the file.
+        // Threads of this process exclude one another only by the blocks they touch.
         std::mutex m_lock;
+        size_t m_num_lock_holders;
+        bool m_locked_exclusively;
+
+        // Set once the file is shared through an `OpenFileTable`, and guarded by its mutex after
+        std::shared_ptr<OpenFileTable> m_table;
+        inode_key_type m_id;
+        size_t m_refcount;
+        bool m_writable;
 
     public:
         explicit File(std::shared_ptr<securefs::FileStream> file_stream,
                       const key_type& master_key,
                       unsigned block_size,
                       unsigned iv_size,
-                      bool check);
+                      bool check,
+                      bool aligned = false,
+                      std::shared_ptr<CipherContextCache<AEADContext>> session_cache = {},
+                      AEADAlgorithm algorithm = AEADAlgorithm::AES_GCM);
         ~File();
 
         length_type size() const { return m_crypt_stream->size(); }
@@ -51,29 +76,57 @@ namespace lite
         void fstat(struct fuse_stat* stat);
         void fsync() { m_file_stream->fsync(); }
         void utimens(const fuse_timespec ts[2]) { m_file_stream->utimens(ts); }
-        void lock(bool exclusive = true)
-        {
-            m_lock.lock();
-            try
-            {
-                m_file_stream->lock(exclusive);
-            }
-            catch (...)
-            {
-                m_lock.unlock();
-                throw;
-            }
-        }
-        void unlock() noexcept
-        {
-            m_file_stream->unlock();
-            m_lock.unlock();
-        }
+        void lock(bool exclusive = true);
+        void unlock() noexcept;
     };
 
-    class FileSystem;
+    // Drops one reference to a file, which is closed once no handle refers to it
+    struct FileCloser
+    {
+        void operator()(File* fp) const noexcept;
+    };
 
-    typedef std::unique_ptr<File> AutoClosedFile;
+    typedef std::unique_ptr<File, FileCloser> AutoClosedFile;
+
+    /**
+     * The files open in a lite format filesystem, keyed by the device and inode of their
+     * underlying files and shared by all threads. Every handle opened on the same underlying file
+     * shares one `File`, so that opening it again neither derives its session key nor takes
+     * another descriptor, and all the handles see the same cached blocks.
+     *
+     * A file opened read only is not shared with handles that write; the next such handle opens
+     * the file anew, and takes the place of the read only one in the table.
+     *
+     * The key is only sound while the shared file holds its descriptor, which keeps the inode from
+     * being freed and its number reused. A `FileDescriptorPool` may close that descriptor at any
+     * time, so a filesystem given a pool does not share files.
+     */
+    class OpenFileTable : public std::enable_shared_from_this<OpenFileTable>
+    {
+        DISABLE_COPY_MOVE(OpenFileTable)
+
+    private:
+        std::mutex m_mutex;
+        std::map<inode_key_type, File*> m_files;
+
+    public:
+        OpenFileTable();
+        ~OpenFileTable();
+
+        // Returns another handle to the file open as `id`, or null if it is not open for `writable`
+        AutoClosedFile acquire(const inode_key_type& id, bool writable);
+
+        // Shares the newly opened `file` as `id`, unless another thread has just opened the same
+        // file, in which case `file` is closed and a handle to the other one is returned
+        AutoClosedFile insert(const inode_key_type& id, bool writable, AutoClosedFile file);
+
+        // Called by `FileCloser` on shared files
+        void release(File* fp) noexcept;
+
+        size_t size();
+    };
+
+    class FileSystem;
 
     std::string encrypt_path(AES_SIV& encryptor, StringRef path);
     std::string decrypt_path(AES_SIV& decryptor, StringRef path);
@@ -101,12 +154,20 @@ namespace lite
         CryptoPP::GCM<CryptoPP::AES>::Encryption m_xattr_enc;
         CryptoPP::GCM<CryptoPP::AES>::Decryption m_xattr_dec;
         std::shared_ptr<const securefs::OSService> m_root;
+        std::shared_ptr<FileDescriptorPool> m_fd_pool;
+        std::shared_ptr<CipherContextCache<AEADContext>> m_session_cache;
+        std::shared_ptr<DirectoryHandleCache> m_dir_cache;
+        std::shared_ptr<OpenFileTable> m_open_files;
         unsigned m_block_size, m_iv_size;
         unsigned m_flags;
 
     private:
         std::string translate_path(StringRef path, bool preserve_leading_slash);
 
+        // Returns the underlying directory holding the translated `path`, and sets `name` to the
+        // path of the entry relative to it. Without a directory cache, that is the root itself.
+        std::shared_ptr<const OSService> locate(const std::string& path, std::string* name);
+
     public:
         FileSystem(std::shared_ptr<const securefs::OSService> root,
                    const key_type& name_key,
@@ -114,7 +175,11 @@ namespace lite
                    const key_type& xattr_key,
                    unsigned block_size,
                    unsigned iv_size,
-                   unsigned flags);
+                   unsigned flags,
+                   std::shared_ptr<FileDescriptorPool> fd_pool = {},
+                   std::shared_ptr<CipherContextCache<AEADContext>> session_cache = {},
+                   std::shared_ptr<DirectoryHandleCache> dir_cache = {},
+                   std::shared_ptr<OpenFileTable> open_files = {});
 
         ~FileSystem();
 
@@ -1,10 +1,13 @@
 #include "lite_operations.h"
+#include "dir_cache.h"
 #include "lite_fs.h"
 #include "lite_stream.h"
 #include "logger.h"
 #include "myutils.h"
 #include "operations.h"
 #include "platform.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <securefs_config.h>
 
@@ -21,6 +24,10 @@ namespace lite
     struct BundledContext
     {
         ::securefs::operations::MountOptions* opt;
+        // Shared by the filesystems of all threads
+        std::shared_ptr<CipherContextCache<AEADContext>> session_cache;
+        std::shared_ptr<DirectoryHandleCache> dir_cache;
+        std::shared_ptr<OpenFileTable> open_files;
 #if !HAS_THREAD_LOCAL
         ::pthread_key_t key;
 #endif
@@ -37,7 +44,8 @@ namespace lite
             return &(*opt_fs);
 #endif
 
-        auto ctx = static_cast<BundledContext*>(fuse_get_context()->private_data);
+        auto ctx
+            = static_cast<BundledContext*>(operations::current_fuse_context()->private_data);
 
 #if !HAS_THREAD_LOCAL
         auto fs = static_cast<FileSystem*>(::pthread_getspecific(ctx->key));
@@ -67,7 +75,11 @@ namespace lite
                        xattr_key,
                        ctx->opt->block_size.value(),
                        ctx->opt->iv_size.value(),
-                       ctx->opt->flags.value());
+                       ctx->opt->flags.value(),
+                       ctx->opt->fd_pool,
+                       ctx->session_cache,
+                       ctx->dir_cache,
+                       ctx->open_files);
         return &(*opt_fs);
 #else
         std::unique_ptr<FileSystem> guard(new FileSystem(ctx->opt->root,
@@ -76,7 +88,11 @@ namespace lite
                                                          xattr_key,
                                                          ctx->opt->block_size.value(),
                                                          ctx->opt->iv_size.value(),
-                                                         ctx->opt->flags.value()));
+                                                         ctx->opt->flags.value(),
+                                                         ctx->opt->fd_pool,
+                                                         ctx->session_cache,
+                                                         ctx->dir_cache,
+                                                         ctx->open_files));
         int rc = ::pthread_setspecific(ctx->key, guard.get());
         if (rc)
             THROW_POSIX_EXCEPTION(rc, "pthread_setspecific");
@@ -99,10 +115,21 @@ namespace lite
 #ifdef FSP_FUSE_CAP_READDIR_PLUS
         fsinfo->want |= (fsinfo->capable & FSP_FUSE_CAP_READDIR_PLUS);
 #endif
-        void* args = fuse_get_context()->private_data;
+        void* args = operations::current_fuse_context()->private_data;
         INFO_LOG("init");
         auto ctx = new BundledContext;
         ctx->opt = static_cast<operations::MountOptions*>(args);
+        ctx->session_cache = std::make_shared<CipherContextCache<AEADContext>>();
+        if (ctx->opt->dir_cache_capacity > 0)
+            ctx->dir_cache = std::make_shared<DirectoryHandleCache>(ctx->opt->dir_cache_capacity);
+        if (!ctx->opt->fd_pool)
+            ctx->open_files = std::make_shared<OpenFileTable>();
+        if (ctx->opt->stats_stream)
+            dump_statistics_on_signal(ctx->opt->stats_stream);
+        if (ctx->opt->span_stream)
+            toggle_span_tracing_on_signal(ctx->opt->span_stream, ctx->opt->span_sample_every);
+        if (global_logger)
+            global_logger->start_async();
 
 #if !HAS_THREAD_LOCAL
         int rc = ::pthread_key_create(&ctx->key,
@@ -115,7 +142,12 @@ namespace lite
 
     void destroy(void*)
     {
-        delete static_cast<BundledContext*>(fuse_get_context()->private_data);
+        auto ctx
+            = static_cast<BundledContext*>(operations::current_fuse_context()->private_data);
+        if (ctx->opt->stats_stream)
+            dump_statistics(ctx->opt->stats_stream.get());
+        stop_span_tracing();
+        delete ctx;
         INFO_LOG("destroy");
     }
 
@@ -136,6 +168,7 @@ namespace lite
 
     int getattr(const char* path, struct fuse_stat* st)
     {
+        OperationTimer timer(Operation::GETATTR);
         SINGLE_COMMON_PROLOGUE
         try
         {
@@ -181,6 +214,7 @@ namespace lite
                 fuse_off_t,
                 struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::READDIR);
         OPT_TRACE_WITH_PATH;
         try
         {
@@ -223,6 +257,7 @@ namespace lite
 
     int open(const char* path, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::OPEN);
         SINGLE_COMMON_PROLOGUE
         try
         {
@@ -235,10 +270,19 @@ namespace lite
 
     int release(const char* path, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::RELEASE);
+        IOAttribution attribution(path);
         TRACE_LOG("%s %s", __func__, path);
         try
         {
-            delete reinterpret_cast<File*>(info->fh);
+            // Closed even if flushing fails
+            AutoClosedFile fp(reinterpret_cast<File*>(info->fh));
+            if (!fp)
+                return -EFAULT;
+            // Asynchronous writes may fail, and must be reported before the descriptor is closed
+            fp->lock();
+            DEFER(fp->unlock());
+            fp->flush();
             return 0;
         }
         SINGLE_COMMON_EPILOGUE
@@ -247,6 +291,8 @@ namespace lite
     int
     read(const char* path, char* buf, size_t size, fuse_off_t offset, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::READ);
+        IOAttribution attribution(path);
         OPT_TRACE_WITH_PATH_OFF_LEN(offset, size);
         auto fp = reinterpret_cast<File*>(info->fh);
         if (!fp)
@@ -267,6 +313,8 @@ namespace lite
               fuse_off_t offset,
               struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::WRITE);
+        IOAttribution attribution(path);
         OPT_TRACE_WITH_PATH_OFF_LEN(offset, size);
         auto fp = reinterpret_cast<File*>(info->fh);
         if (!fp)
@@ -284,6 +332,7 @@ namespace lite
 
     int flush(const char* path, struct fuse_file_info* info)
     {
+        IOAttribution attribution(path);
         TRACE_LOG("%s %s", __func__, path);
         auto fp = reinterpret_cast<File*>(info->fh);
         if (!fp)
@@ -301,6 +350,7 @@ namespace lite
 
     int ftruncate(const char* path, fuse_off_t len, struct fuse_file_info* info)
     {
+        IOAttribution attribution(path);
         TRACE_LOG("%s %s with length=%lld", __func__, path, static_cast<long long>(len));
         auto fp = reinterpret_cast<File*>(info->fh);
         if (!fp)
@@ -435,6 +485,8 @@ namespace lite
 
     int fsync(const char* path, int, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::FSYNC);
+        IOAttribution attribution(path);
         TRACE_LOG("%s %s", __func__, path);
         auto fp = reinterpret_cast<File*>(info->fh);
         if (!fp)
@@ -452,6 +504,7 @@ namespace lite
 
     int truncate(const char* path, fuse_off_t len)
     {
+        IOAttribution attribution(path);
         if (len < 0)
             return -EINVAL;
 
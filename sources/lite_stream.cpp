@@ -1,5 +1,7 @@
 #include "lite_stream.h"
 #include "crypto.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <cryptopp/aes.h>
 #include <cryptopp/modes.h>
@@ -13,26 +15,41 @@ namespace lite
 
     static const offset_type MAX_BLOCKS = (1ULL << 31) - 1;
 
-    AESGCMCryptStream::AESGCMCryptStream(std::shared_ptr<StreamBase> stream,
-                                         const key_type& master_key,
-                                         unsigned int block_size,
-                                         unsigned iv_size,
-                                         bool check)
+    // Upper bound of blocks encrypted or decrypted together in one underlying read or write
+    static const length_type MAX_BATCH_BLOCKS = 16;
+
+    AEADCryptStream::AEADCryptStream(
+        std::shared_ptr<StreamBase> stream,
+        const key_type& master_key,
+        unsigned int block_size,
+        unsigned iv_size,
+        bool check,
+        bool aligned,
+        std::shared_ptr<CipherContextCache<AEADContext>> session_cache,
+        AEADAlgorithm algorithm)
         : BlockBasedStream(block_size)
+        , m_algorithm(algorithm)
+        , m_session_cache(std::move(session_cache))
         , m_stream(std::move(stream))
         , m_iv_size(iv_size)
         , m_check(check)
+        , m_aligned(aligned)
     {
         if (m_iv_size < 12 || m_iv_size > 32)
             throwInvalidArgumentException("IV size too small or too large");
+        if (algorithm == AEADAlgorithm::CHACHA20_POLY1305
+            && m_iv_size != ChaCha20Poly1305Context::IV_SIZE)
+            throwInvalidArgumentException("ChaCha20-Poly1305 requires 96-bit IVs");
         if (!m_stream)
             throwInvalidArgumentException("Null stream");
         if (block_size < 32)
             throwInvalidArgumentException("Block size too small");
+        if (aligned && get_blocks_per_group(block_size, iv_size) == 0)
+            throwInvalidArgumentException("Block size too small for aligned layout");
 
         warn_if_key_not_random(master_key, __FILE__, __LINE__);
 
-        CryptoPP::FixedSizeAlignedSecBlock<byte, get_header_size()> header, session_key;
+        CryptoPP::FixedSizeAlignedSecBlock<byte, get_header_size()> header;
         auto rc = m_stream->read(header.data(), 0, header.size());
 
         if (rc == 0)
@@ -45,126 +62,639 @@ namespace lite
             throwInvalidArgumentException("Underlying stream has invalid header size");
         }
 
+        warn_if_key_not_random(header, __FILE__, __LINE__);
+
+        // AES-GCM takes the encrypted header as its key. ChaCha20-Poly1305 needs twice as long a
+        // key, so the complement of the header is encrypted for the second half. The key is kept
+        // even when a cached context is reused, since the key schedule is what the cache saves.
+        m_session_key.resize(algorithm == AEADAlgorithm::AES_GCM ? get_header_size()
+                                                                 : 2 * get_header_size());
+        for (size_t i = 0; i < m_session_key.size(); ++i)
+            m_session_key[i] = i < get_header_size() ? header[i] : ~header[i - get_header_size()];
         CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption ecenc(master_key.data(), master_key.size());
-        ecenc.ProcessData(session_key.data(), header.data(), get_header_size());
+        ecenc.ProcessData(m_session_key.data(), m_session_key.data(), m_session_key.size());
+        warn_if_key_not_random(m_session_key, __FILE__, __LINE__);
+
+        std::unique_ptr<Scratch> scratch(new Scratch);
+        m_header.assign(reinterpret_cast<const char*>(header.data()), header.size());
+        if (m_session_cache)
+            scratch->session = m_session_cache->take(m_header);
+        if (!scratch->session)
+        {
+            scratch->session = make_aead_context(algorithm);
+            scratch->session->set_key(m_session_key.data(), m_session_key.size());
+        }
+        scratch->buffer.resize(get_underlying_block_size());
+        m_idle_scratch.push_back(std::move(scratch));
+    }
 
-        m_buffer.reset(new byte[get_underlying_block_size()]);
+    AEADCryptStream::~AEADCryptStream()
+    {
+        if (!m_session_cache || m_idle_scratch.empty())
+            return;
+        try
+        {
+            m_session_cache->put(m_header, std::move(m_idle_scratch.front()->session));
+        }
+        catch (...)
+        {
+        }
+    }
 
-        // The null iv is only a placeholder; it will replaced during encryption and decryption
-        const byte null_iv[12] = {0};
-        m_encryptor.SetKeyWithIV(
-            session_key.data(), session_key.size(), null_iv, array_length(null_iv));
-        m_decryptor.SetKeyWithIV(
-            session_key.data(), session_key.size(), null_iv, array_length(null_iv));
+    AEADCryptStream::ScratchLease::ScratchLease(AEADCryptStream& owner) : m_owner(owner)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_owner.m_scratch_mutex);
+            if (!m_owner.m_idle_scratch.empty())
+            {
+                m_scratch = std::move(m_owner.m_idle_scratch.back());
+                m_owner.m_idle_scratch.pop_back();
+                return;
+            }
+        }
+        // Only when another thread holds every idle one
+        m_scratch.reset(new Scratch);
+        m_scratch->session = make_aead_context(m_owner.m_algorithm);
+        m_scratch->session->set_key(m_owner.m_session_key.data(), m_owner.m_session_key.size());
+    }
 
-        warn_if_key_not_random(header, __FILE__, __LINE__);
-        warn_if_key_not_random(session_key, __FILE__, __LINE__);
+    AEADCryptStream::ScratchLease::~ScratchLease()
+    {
+        try
+        {
+            std::lock_guard<std::mutex> guard(m_owner.m_scratch_mutex);
+            m_owner.m_idle_scratch.push_back(std::move(m_scratch));
+        }
+        catch (...)
+        {
+        }
+    }
+
+    byte* AEADCryptStream::ScratchLease::buffer(length_type num_blocks)
+    {
+        auto size = num_blocks * m_owner.get_underlying_block_size();
+        if (m_scratch->buffer.size() < size)
+            m_scratch->buffer.resize(size);
+        return m_scratch->buffer.data();
+    }
+
+    length_type AEADCryptStream::read(void* output, offset_type offset, length_type length)
+    {
+        BlockRangeLock::Guard guard(m_range_lock,
+                                    offset / get_block_size(),
+                                    (offset + length + get_block_size() - 1) / get_block_size(),
+                                    false);
+        return BlockBasedStream::read(output, offset, length);
     }
 
-    AESGCMCryptStream::~AESGCMCryptStream() {}
+    void AEADCryptStream::write(const void* input, offset_type offset, length_type length)
+    {
+        while (true)
+        {
+            // A write past the end also fills the gap before it, and moves the end
+            auto end = offset + length;
+            auto current_size = size();
+            bool extending = end > current_size;
+            auto first_block
+                = (extending ? std::min(offset, current_size) : offset) / get_block_size();
+            BlockRangeLock::Guard guard(
+                m_range_lock,
+                first_block,
+                extending ? kUnboundedBlock : (end + get_block_size() - 1) / get_block_size(),
+                true);
+
+            // The end may have moved before the lock was taken
+            auto locked_size = size();
+            if (end <= locked_size
+                || (extending && first_block <= std::min(offset, locked_size) / get_block_size()))
+            {
+                return BlockBasedStream::write(input, offset, length);
+            }
+        }
+    }
 
-    void AESGCMCryptStream::flush() { m_stream->flush(); }
+    void AEADCryptStream::resize(length_type new_length)
+    {
+        BlockRangeLock::Guard guard(m_range_lock, 0, kUnboundedBlock, true);
+        BlockBasedStream::resize(new_length);
+    }
+
+    void AEADCryptStream::flush() { m_stream->flush(); }
 
-    bool AESGCMCryptStream::is_sparse() const noexcept { return m_stream->is_sparse(); }
+    bool AEADCryptStream::is_sparse() const noexcept { return m_stream->is_sparse(); }
 
-    length_type AESGCMCryptStream::read_block(offset_type block_number, void* output)
+    void AEADCryptStream::check_block_number(offset_type block_number) const
     {
         if (block_number > MAX_BLOCKS)
             throw StreamTooLongException(MAX_BLOCKS * get_block_size(),
                                          block_number * get_block_size());
+    }
 
-        length_type rc
-            = m_stream->read(m_buffer.get(),
-                             get_header_size() + get_underlying_block_size() * block_number,
-                             get_underlying_block_size());
-        if (rc <= get_mac_size() + get_iv_size())
-            return 0;
+    length_type AEADCryptStream::get_batch_length(offset_type start_block,
+                                                  length_type num_blocks) const noexcept
+    {
+        if (!m_aligned)
+            return std::min<length_type>(num_blocks, MAX_BATCH_BLOCKS);
+        // A whole group is processed at once, as its metadata and ciphertext are contiguous
+        auto blocks_per_group = get_blocks_per_group(get_block_size(), get_iv_size());
+        if (start_block % blocks_per_group == 0 && num_blocks >= blocks_per_group)
+            return blocks_per_group;
+        num_blocks = std::min<length_type>(num_blocks, MAX_BATCH_BLOCKS);
+        return std::min<length_type>(num_blocks, blocks_per_group - start_block % blocks_per_group);
+    }
 
-        if (rc > get_underlying_block_size())
-            throwInvalidArgumentException("Invalid read");
+    const byte*
+    AEADCryptStream::read_underlying(offset_type offset, length_type& length, byte* buffer)
+    {
+        if (auto mapped = m_stream->mapped_view(offset, length))
+            return mapped;
+        length = m_stream->read(buffer, offset, length);
+        return buffer;
+    }
 
-        auto out_size = rc - get_iv_size() - get_mac_size();
+    length_type AEADCryptStream::count_hole_blocks(offset_type start_block,
+                                                   length_type num_blocks)
+    {
+        if (!m_stream->is_sparse())
+            return 0;
+        if (!m_aligned)
+        {
+            auto hole = m_stream->hole_length(get_header_size()
+                                              + get_underlying_block_size() * start_block);
+            return std::min<length_type>(num_blocks, hole / get_underlying_block_size());
+        }
+        // Both the metadata and the ciphertext have to be zeros, so only whole batches are skipped
+        auto begin = get_aligned_meta_offset(start_block);
+        auto hole_end = begin + m_stream->hole_length(begin);
+        length_type count = 0;
+        while (count < num_blocks)
+        {
+            auto batch = get_batch_length(start_block + count, num_blocks - count);
+            if (get_aligned_data_offset(start_block + count + batch - 1) + get_block_size()
+                > hole_end)
+                break;
+            count += batch;
+        }
+        return count;
+    }
 
-        if (is_all_zeros(m_buffer.get(), rc))
+    void AEADCryptStream::write_underlying(const byte* buffer,
+                                           offset_type offset,
+                                           length_type length,
+                                           bool zeros)
+    {
+        if (zeros && m_stream->is_sparse())
         {
-            memset(output, 0, get_block_size());
-            return out_size;
+            auto old_size = m_stream->size();
+            if (offset >= old_size
+                || m_stream->punch_hole(offset, std::min(offset + length, old_size) - offset))
+            {
+                if (offset + length > old_size)
+                    m_stream->resize(offset + length);
+                return;
+            }
         }
+        m_stream->write(buffer, offset, length);
+    }
 
+    void AEADCryptStream::encrypt_block(AEADContext& session,
+                                        offset_type block_number,
+                                        const void* input,
+                                        length_type size,
+                                        byte* iv,
+                                        byte* ciphertext,
+                                        byte* mac)
+    {
         byte auxiliary[sizeof(std::uint32_t)];
         to_little_endian(static_cast<std::uint32_t>(block_number), auxiliary);
 
-        bool success = m_decryptor.DecryptAndVerify(static_cast<byte*>(output),
-                                                    m_buffer.get() + rc - get_mac_size(),
-                                                    get_mac_size(),
-                                                    m_buffer.get(),
-                                                    static_cast<int>(get_iv_size()),
-                                                    auxiliary,
-                                                    sizeof(auxiliary),
-                                                    m_buffer.get() + get_iv_size(),
-                                                    out_size);
+        do
+        {
+            generate_iv(iv, get_iv_size());
+        } while (is_all_zeros(iv, get_iv_size()));
+
+        add_io_count(IOCounter::BYTES_ENCRYPTED, size);
+        ScopedSpan span("encrypt_block");
+        session.encrypt(ciphertext,
+                        mac,
+                        get_mac_size(),
+                        iv,
+                        get_iv_size(),
+                        auxiliary,
+                        sizeof(auxiliary),
+                        static_cast<const byte*>(input),
+                        size);
+    }
+
+    void AEADCryptStream::decrypt_block(AEADContext& session,
+                                        offset_type block_number,
+                                        const byte* iv,
+                                        const byte* ciphertext,
+                                        length_type size,
+                                        const byte* mac,
+                                        void* output)
+    {
+        add_io_count(IOCounter::BYTES_DECRYPTED, size);
+        ScopedSpan span("decrypt_block");
+        if (!m_check
+            && session.decrypt_unverified(
+                   static_cast<byte*>(output), iv, get_iv_size(), ciphertext, size))
+            return;
+
+        byte auxiliary[sizeof(std::uint32_t)];
+        to_little_endian(static_cast<std::uint32_t>(block_number), auxiliary);
+
+        bool success = session.decrypt(static_cast<byte*>(output),
+                                       mac,
+                                       get_mac_size(),
+                                       iv,
+                                       get_iv_size(),
+                                       auxiliary,
+                                       sizeof(auxiliary),
+                                       ciphertext,
+                                       size);
 
         if (m_check && !success)
             throw LiteMessageVerificationException();
+    }
 
+    length_type AEADCryptStream::decrypt_packed_block(AEADContext& session,
+                                                      offset_type block_number,
+                                                      const byte* underlying,
+                                                      length_type underlying_size,
+                                                      void* output)
+    {
+        if (underlying_size <= get_mac_size() + get_iv_size())
+            return 0;
+
+        if (underlying_size > get_underlying_block_size())
+            throwInvalidArgumentException("Invalid read");
+
+        auto out_size = underlying_size - get_iv_size() - get_mac_size();
+
+        if (is_all_zeros(underlying, underlying_size))
+        {
+            memset(output, 0, get_block_size());
+            return out_size;
+        }
+
+        decrypt_block(session,
+                      block_number,
+                      underlying,
+                      underlying + get_iv_size(),
+                      out_size,
+                      underlying + underlying_size - get_mac_size(),
+                      output);
         return out_size;
     }
 
-    void
-    AESGCMCryptStream::write_block(offset_type block_number, const void* input, length_type size)
+    void AEADCryptStream::encrypt_packed_block(AEADContext& session,
+                                               offset_type block_number,
+                                               const void* input,
+                                               length_type size,
+                                               byte* underlying)
     {
-        if (block_number > MAX_BLOCKS)
-            throw StreamTooLongException(MAX_BLOCKS * get_block_size(),
-                                         block_number * get_block_size());
+        if (is_all_zeros(input, size))
+        {
+            memset(underlying, 0, size + get_iv_size() + get_mac_size());
+            return;
+        }
+        encrypt_block(session,
+                      block_number,
+                      input,
+                      size,
+                      underlying,
+                      underlying + get_iv_size(),
+                      underlying + get_iv_size() + size);
+    }
 
-        auto underlying_offset = block_number * get_underlying_block_size() + get_header_size();
-        auto underlying_size = size + get_iv_size() + get_mac_size();
+    length_type AEADCryptStream::read_packed_blocks(offset_type start_block,
+                                                    length_type num_blocks,
+                                                    void* output)
+    {
+        ScratchLease scratch(*this);
+        length_type rc = num_blocks * get_underlying_block_size();
+        const byte* underlying
+            = read_underlying(get_header_size() + get_underlying_block_size() * start_block,
+                              rc,
+                              scratch.buffer(num_blocks));
+
+        length_type total = 0;
+        for (length_type i = 0; i < num_blocks && i * get_underlying_block_size() < rc; ++i)
+        {
+            auto offset = i * get_underlying_block_size();
+            auto out_size
+                = decrypt_packed_block(scratch.session(),
+                                       start_block + i,
+                                       underlying + offset,
+                                       std::min(rc - offset, get_underlying_block_size()),
+                                       static_cast<byte*>(output) + i * get_block_size());
+            total += out_size;
+            if (out_size < get_block_size())
+                break;
+        }
+        return total;
+    }
 
-        if (is_all_zeros(input, size))
+    void AEADCryptStream::write_packed_blocks(offset_type start_block,
+                                              length_type num_blocks,
+                                              const void* input)
+    {
+        ScratchLease scratch(*this);
+        byte* buffer = scratch.buffer(num_blocks);
+        for (length_type i = 0; i < num_blocks; ++i)
+        {
+            encrypt_packed_block(scratch.session(),
+                                 start_block + i,
+                                 static_cast<const byte*>(input) + i * get_block_size(),
+                                 get_block_size(),
+                                 buffer + i * get_underlying_block_size());
+        }
+        auto offset = get_header_size() + get_underlying_block_size() * start_block;
+        if (!m_stream->is_sparse())
+            return m_stream->write(buffer, offset, num_blocks * get_underlying_block_size());
+
+        // Zero blocks are stored as zeros, so runs of them become holes
+        auto underlying_block_size = get_underlying_block_size();
+        length_type i = 0;
+        while (i < num_blocks)
+        {
+            bool zeros = is_all_zeros(buffer + i * underlying_block_size, underlying_block_size);
+            length_type j = i + 1;
+            while (j < num_blocks
+                   && is_all_zeros(buffer + j * underlying_block_size, underlying_block_size)
+                       == zeros)
+                ++j;
+            write_underlying(buffer + i * underlying_block_size,
+                             offset + i * underlying_block_size,
+                             (j - i) * underlying_block_size,
+                             zeros);
+            i = j;
+        }
+    }
+
+    length_type AEADCryptStream::read_aligned_blocks(offset_type start_block,
+                                                     length_type num_blocks,
+                                                     void* output)
+    {
+        ScratchLease scratch(*this);
+        auto meta_size = get_iv_size() + get_mac_size();
+        auto meta_offset = get_aligned_meta_offset(start_block);
+        auto data_offset = get_aligned_data_offset(start_block);
+        length_type data_size = num_blocks * get_block_size();
+        const byte *meta, *data;
+        length_type num_present;
+
+        // The metadata of the blocks precedes their ciphertext in the same group. Unless much
+        // ciphertext of other blocks lies in between, both are fetched with a single read.
+        length_type distance = data_offset - meta_offset;
+        if (distance - num_blocks * meta_size <= data_size)
+        {
+            length_type span = distance + data_size;
+            byte* buffer = scratch.buffer(span / get_underlying_block_size() + 1);
+            meta = read_underlying(meta_offset, span, buffer);
+            if (span <= distance)
+                return 0;
+            data = meta + distance;
+            data_size = span - distance;
+            num_present = (data_size + get_block_size() - 1) / get_block_size();
+        }
+        else
+        {
+            byte* buffer = scratch.buffer(num_blocks);
+            data = read_underlying(data_offset, data_size, buffer);
+            if (data_size == 0)
+                return 0;
+            num_present = (data_size + get_block_size() - 1) / get_block_size();
+            length_type meta_total_size = num_present * meta_size;
+            meta = read_underlying(
+                meta_offset, meta_total_size, buffer + num_blocks * get_block_size());
+            if (meta_total_size != num_present * meta_size)
+                throw LiteMessageVerificationException();
+        }
+
+        for (length_type i = 0; i < num_present; ++i)
+        {
+            auto size = std::min(get_block_size(), data_size - i * get_block_size());
+            const byte* block_meta = meta + i * meta_size;
+            const byte* block_data = data + i * get_block_size();
+            byte* block_output = static_cast<byte*>(output) + i * get_block_size();
+            if (is_all_zeros(block_meta, meta_size) && is_all_zeros(block_data, size))
+                memset(block_output, 0, get_block_size());
+            else
+                decrypt_block(scratch.session(),
+                              start_block + i,
+                              block_meta,
+                              block_data,
+                              size,
+                              block_meta + get_iv_size(),
+                              block_output);
+        }
+        return data_size;
+    }
+
+    void AEADCryptStream::write_aligned_blocks(offset_type start_block,
+                                               length_type num_blocks,
+                                               const void* input,
+                                               length_type size)
+    {
+        ScratchLease scratch(*this);
+        auto meta_size = get_iv_size() + get_mac_size();
+        // A whole group is laid out in the buffer as it is on disk, to be written at once
+        bool whole_group = num_blocks == get_blocks_per_group(get_block_size(), get_iv_size());
+        length_type meta_area_size = get_block_size() - get_header_size();
+        byte *data, *meta;
+        if (whole_group)
+        {
+            meta = scratch.buffer(num_blocks + 1);
+            data = meta + meta_area_size;
+            memset(meta + num_blocks * meta_size, 0, meta_area_size - num_blocks * meta_size);
+        }
+        else
         {
-            memset(m_buffer.get(), 0, underlying_size);
-            m_stream->write(m_buffer.get(), underlying_offset, underlying_size);
+            data = scratch.buffer(num_blocks);
+            meta = data + num_blocks * get_block_size();
+        }
+        bool all_zeros = true;
+
+        for (length_type i = 0; i < num_blocks; ++i)
+        {
+            auto block_size = std::min(get_block_size(), size - i * get_block_size());
+            const byte* block_input = static_cast<const byte*>(input) + i * get_block_size();
+            byte* block_meta = meta + i * meta_size;
+            byte* block_data = data + i * get_block_size();
+            if (is_all_zeros(block_input, block_size))
+            {
+                memset(block_meta, 0, meta_size);
+                memset(block_data, 0, block_size);
+            }
+            else
+            {
+                all_zeros = false;
+                encrypt_block(scratch.session(),
+                              start_block + i,
+                              block_input,
+                              block_size,
+                              block_meta,
+                              block_data,
+                              block_meta + get_iv_size());
+            }
+        }
+
+        if (whole_group && !(all_zeros && m_stream->is_sparse()))
+        {
+            m_stream->write(meta, get_aligned_meta_offset(start_block), meta_area_size + size);
             return;
         }
+        m_stream->write(meta, get_aligned_meta_offset(start_block), num_blocks * meta_size);
+        write_underlying(data, get_aligned_data_offset(start_block), size, all_zeros);
+    }
 
-        byte auxiliary[sizeof(std::uint32_t)];
-        to_little_endian(static_cast<std::uint32_t>(block_number), auxiliary);
+    length_type AEADCryptStream::read_block(offset_type block_number, void* output)
+    {
+        check_block_number(block_number);
+
+        if (m_aligned)
+            return read_aligned_blocks(block_number, 1, output);
+
+        ScratchLease scratch(*this);
+        length_type rc = get_underlying_block_size();
+        const byte* underlying
+            = read_underlying(get_header_size() + get_underlying_block_size() * block_number,
+                              rc,
+                              scratch.buffer(1));
+        return decrypt_packed_block(scratch.session(), block_number, underlying, rc, output);
+    }
 
-        do
+    void
+    AEADCryptStream::write_block(offset_type block_number, const void* input, length_type size)
+    {
+        check_block_number(block_number);
+
+        if (m_aligned)
+            return write_aligned_blocks(block_number, 1, input, size);
+
+        ScratchLease scratch(*this);
+        byte* buffer = scratch.buffer(1);
+        encrypt_packed_block(scratch.session(), block_number, input, size, buffer);
+        auto underlying_size = size + get_iv_size() + get_mac_size();
+        write_underlying(buffer,
+                         get_header_size() + get_underlying_block_size() * block_number,
+                         underlying_size,
+                         is_all_zeros(buffer, underlying_size));
+    }
+
+    length_type AEADCryptStream::read_blocks(offset_type start_block,
+                                             length_type num_blocks,
+                                             void* output)
+    {
+        length_type total = 0;
+        bool probe_hole = false;
+        while (num_blocks > 0)
         {
-            generate_random(m_buffer.get(), get_iv_size());
-        } while (is_all_zeros(m_buffer.get(), get_iv_size()));
+            if (probe_hole)
+            {
+                probe_hole = false;
+                auto hole_blocks = count_hole_blocks(start_block, num_blocks);
+                if (hole_blocks > 0)
+                {
+                    check_block_number(start_block + hole_blocks - 1);
+                    memset(output, 0, hole_blocks * get_block_size());
+                    total += hole_blocks * get_block_size();
+                    output = static_cast<byte*>(output) + hole_blocks * get_block_size();
+                    start_block += hole_blocks;
+                    num_blocks -= hole_blocks;
+                    continue;
+                }
+            }
+            auto batch = get_batch_length(start_block, num_blocks);
+            check_block_number(start_block + batch - 1);
+            auto rc = m_aligned ? read_aligned_blocks(start_block, batch, output)
+                                : read_packed_blocks(start_block, batch, output);
+            total += rc;
+            if (rc < batch * get_block_size())
+                break;
+            // Only a batch of zeros may have come from a hole, so dense data is never probed
+            probe_hole = num_blocks > batch && is_all_zeros(output, rc);
+            output = static_cast<byte*>(output) + rc;
+            start_block += batch;
+            num_blocks -= batch;
+        }
+        return total;
+    }
+
+    void AEADCryptStream::write_blocks(offset_type start_block,
+                                       length_type num_blocks,
+                                       const void* input)
+    {
+        while (num_blocks > 0)
+        {
+            auto batch = get_batch_length(start_block, num_blocks);
+            check_block_number(start_block + batch - 1);
+            if (m_aligned)
+                write_aligned_blocks(start_block, batch, input, batch * get_block_size());
+            else
+                write_packed_blocks(start_block, batch, input);
+            input = static_cast<const byte*>(input) + batch * get_block_size();
+            start_block += batch;
+            num_blocks -= batch;
+        }
+    }
 
-        m_encryptor.EncryptAndAuthenticate(m_buffer.get() + get_iv_size(),
-                                           m_buffer.get() + get_iv_size() + size,
-                                           get_mac_size(),
-                                           m_buffer.get(),
-                                           static_cast<int>(get_iv_size()),
-                                           auxiliary,
-                                           sizeof(auxiliary),
-                                           static_cast<const byte*>(input),
-                                           size);
+    void AEADCryptStream::adjust_aligned_logical_size(length_type length)
+    {
+        if (length == 0)
+        {
+            m_stream->resize(get_header_size());
+            return;
+        }
+        auto last_block = (length - 1) / get_block_size();
+        auto new_underlying_size = get_aligned_data_offset(last_block) + length
+            - last_block * get_block_size();
+        auto old_underlying_size = m_stream->size();
+        m_stream->resize(new_underlying_size);
+        if (new_underlying_size >= old_underlying_size)
+            return;
 
-        m_stream->write(m_buffer.get(), underlying_offset, underlying_size);
+        // The metadata of truncated blocks in the same group is still present, so clear it in case
+        // those blocks are later extended as holes
+        auto blocks_per_group = get_blocks_per_group(get_block_size(), get_iv_size());
+        auto num_stale = blocks_per_group - 1 - last_block % blocks_per_group;
+        if (num_stale == 0)
+            return;
+        std::vector<byte> zeros(num_stale * (get_iv_size() + get_mac_size()), 0);
+        m_stream->write(zeros.data(), get_aligned_meta_offset(last_block + 1), zeros.size());
     }
 
-    length_type AESGCMCryptStream::size() const
+    length_type AEADCryptStream::size() const
     {
-        return calculate_real_size(m_stream->size(), get_block_size(), get_iv_size());
+        return calculate_real_size(m_stream->size(), get_block_size(), get_iv_size(), m_aligned);
     }
 
-    void AESGCMCryptStream::adjust_logical_size(length_type length)
+    void AEADCryptStream::adjust_logical_size(length_type length)
     {
+        if (m_aligned)
+            return adjust_aligned_logical_size(length);
+
         auto new_blocks = length / get_block_size();
         auto residue = length % get_block_size();
         m_stream->resize(get_header_size() + new_blocks * get_underlying_block_size()
                          + (residue > 0 ? residue + get_iv_size() + get_mac_size() : 0));
     }
 
-    length_type AESGCMCryptStream::calculate_real_size(length_type underlying_size,
-                                                       length_type block_size,
-                                                       length_type iv_size) noexcept
+    length_type AEADCryptStream::calculate_real_size(length_type underlying_size,
+                                                     length_type block_size,
+                                                     length_type iv_size,
+                                                     bool aligned) noexcept
     {
+        if (aligned)
+        {
+            auto blocks_per_group = get_blocks_per_group(block_size, iv_size);
+            auto group_size = (blocks_per_group + 1) * block_size;
+            auto residue = underlying_size % group_size;
+            return underlying_size / group_size * blocks_per_group * block_size
+                + (residue > block_size ? residue - block_size : 0);
+        }
         auto header_size = get_header_size();
         auto underlying_block_size = block_size + iv_size + get_mac_size();
         if (underlying_size <= header_size)
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "cipher_cache.h"
+#include "range_lock.h"
 #include "streams.h"
 
 #include <cryptopp/aes.h>
@@ -8,6 +10,10 @@
 #include <cryptopp/rng.h>
 #include <cryptopp/secblock.h>
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
 namespace securefs
 {
 namespace lite
@@ -18,15 +24,67 @@ namespace lite
         std::string message() const override;
     };
 
-    class AESGCMCryptStream : public BlockBasedStream
+    /**
+     * The underlying stream starts with a 16-byte random header, from which the session key is
+     * derived.
+     *
+     * In the default layout, each block is stored as IV, ciphertext and MAC right after the
+     * previous one, so blocks are not aligned to pages of the underlying file.
+     *
+     * In the aligned layout, the underlying stream is divided into groups. Each group is one
+     * metadata block holding the IVs and MACs of the next `get_blocks_per_group()` blocks (the
+     * first 16 bytes are reserved for the header), followed by those blocks' ciphertext, each
+     * occupying exactly `block_size` bytes. Ciphertext therefore always starts at a multiple of the
+     * block size.
+     *
+     * With a `session_cache`, the keyed contexts are handed back to it on destruction, and reused
+     * by the next stream opened over the same header.
+     *
+     * Blocks are encrypted with the given `AEADAlgorithm`; the layout is the same for all of them.
+     *
+     * Reads, writes and resizes may be called from several threads at once. They lock the blocks
+     * they touch, so that those on disjoint blocks run in parallel. Writes past the end and resizes
+     * move the end of the stream, so they also lock every block after it.
+     */
+    class AEADCryptStream : public BlockBasedStream
     {
     private:
-        CryptoPP::GCM<CryptoPP::AES>::Encryption m_encryptor;
-        CryptoPP::GCM<CryptoPP::AES>::Decryption m_decryptor;
+        // What a thread needs to encrypt or decrypt a batch of blocks. The contexts carry
+        // per-message state, so threads working on the stream at once each lease their own.
+        struct Scratch
+        {
+            std::shared_ptr<AEADContext> session;
+            std::vector<byte> buffer;
+        };
+
+        class ScratchLease
+        {
+            DISABLE_COPY_MOVE(ScratchLease)
+
+        private:
+            AEADCryptStream& m_owner;
+            std::unique_ptr<Scratch> m_scratch;
+
+        public:
+            explicit ScratchLease(AEADCryptStream& owner);
+            ~ScratchLease();
+
+            AEADContext& session() const noexcept { return *m_scratch->session; }
+
+            // Returns a buffer large enough for `num_blocks` underlying blocks
+            byte* buffer(length_type num_blocks);
+        };
+
+        std::mutex m_scratch_mutex;
+        std::vector<std::unique_ptr<Scratch>> m_idle_scratch;    // Guarded by `m_scratch_mutex`
+        CryptoPP::AlignedSecByteBlock m_session_key;    // Keys the contexts of additional threads
+        AEADAlgorithm m_algorithm;
+        std::shared_ptr<CipherContextCache<AEADContext>> m_session_cache;
+        std::string m_header;
         std::shared_ptr<StreamBase> m_stream;
-        std::unique_ptr<byte[]> m_buffer;
+        BlockRangeLock m_range_lock;
         unsigned m_iv_size;
-        bool m_check;
+        bool m_check, m_aligned;
 
     public:
         length_type get_block_size() const noexcept { return m_block_size; }
@@ -42,21 +100,132 @@ namespace lite
             return get_block_size() + get_iv_size() + get_mac_size();
         }
 
+        bool is_aligned() const noexcept { return m_aligned; }
+
+    private:
+        // Number of blocks whose IV and MAC are grouped into one metadata block in aligned layout
+        static length_type
+        get_blocks_per_group(length_type block_size, length_type iv_size) noexcept
+        {
+            return (block_size - get_header_size()) / (iv_size + get_mac_size());
+        }
+
+        offset_type get_group_offset(offset_type block_number) const noexcept
+        {
+            auto blocks_per_group = get_blocks_per_group(get_block_size(), get_iv_size());
+            return block_number / blocks_per_group * (blocks_per_group + 1) * get_block_size();
+        }
+
+        offset_type get_aligned_meta_offset(offset_type block_number) const noexcept
+        {
+            auto blocks_per_group = get_blocks_per_group(get_block_size(), get_iv_size());
+            return get_group_offset(block_number) + get_header_size()
+                + block_number % blocks_per_group * (get_iv_size() + get_mac_size());
+        }
+
+        offset_type get_aligned_data_offset(offset_type block_number) const noexcept
+        {
+            auto blocks_per_group = get_blocks_per_group(get_block_size(), get_iv_size());
+            return get_group_offset(block_number)
+                + (1 + block_number % blocks_per_group) * get_block_size();
+        }
+
+        void check_block_number(offset_type block_number) const;
+
+        // Number of blocks from `start_block` that can be processed in one batch
+        length_type get_batch_length(offset_type start_block, length_type num_blocks) const
+            noexcept;
+
+        // Returns the underlying contents in place if the stream is memory mapped, or reads them
+        // into `buffer` otherwise
+        const byte* read_underlying(offset_type offset, length_type& length, byte* buffer);
+
+        // Number of whole blocks from `start_block` whose underlying storage lies in a hole, and
+        // which therefore read as zeros
+        length_type count_hole_blocks(offset_type start_block, length_type num_blocks);
+
+        // Writes `buffer` to the underlying stream, or punches a hole there instead when `zeros`
+        // and the underlying stream supports it
+        void
+        write_underlying(const byte* buffer, offset_type offset, length_type length, bool zeros);
+
+        void encrypt_block(AEADContext& session,
+                           offset_type block_number,
+                           const void* input,
+                           length_type size,
+                           byte* iv,
+                           byte* ciphertext,
+                           byte* mac);
+
+        void decrypt_block(AEADContext& session,
+                           offset_type block_number,
+                           const byte* iv,
+                           const byte* ciphertext,
+                           length_type size,
+                           const byte* mac,
+                           void* output);
+
+        length_type decrypt_packed_block(AEADContext& session,
+                                         offset_type block_number,
+                                         const byte* underlying,
+                                         length_type underlying_size,
+                                         void* output);
+
+        void encrypt_packed_block(AEADContext& session,
+                                  offset_type block_number,
+                                  const void* input,
+                                  length_type size,
+                                  byte* underlying);
+
+        length_type
+        read_packed_blocks(offset_type start_block, length_type num_blocks, void* output);
+
+        void
+        write_packed_blocks(offset_type start_block, length_type num_blocks, const void* input);
+
+        // The aligned variants require all the blocks to be within the same group. A whole group is
+        // read and written with a single call on the underlying stream.
+        length_type
+        read_aligned_blocks(offset_type start_block, length_type num_blocks, void* output);
+
+        void write_aligned_blocks(offset_type start_block,
+                                  length_type num_blocks,
+                                  const void* input,
+                                  length_type size);
+
+        void adjust_aligned_logical_size(length_type length);
+
     protected:
         length_type read_block(offset_type block_number, void* output) override;
 
         void write_block(offset_type block_number, const void* input, length_type size) override;
 
+        length_type
+        read_blocks(offset_type start_block, length_type num_blocks, void* output) override;
+
+        void
+        write_blocks(offset_type start_block, length_type num_blocks, const void* input) override;
+
         void adjust_logical_size(length_type length) override;
 
     public:
-        explicit AESGCMCryptStream(std::shared_ptr<StreamBase> stream,
-                                   const key_type& master_key,
-                                   unsigned block_size = 4096,
-                                   unsigned iv_size = 12,
-                                   bool check = true);
+        explicit AEADCryptStream(std::shared_ptr<StreamBase> stream,
+                                 const key_type& master_key,
+                                 unsigned block_size = 4096,
+                                 unsigned iv_size = 12,
+                                 bool check = true,
+                                 bool aligned = false,
+                                 std::shared_ptr<CipherContextCache<AEADContext>>
+                                     session_cache = {},
+                                 AEADAlgorithm algorithm = AEADAlgorithm::AES_GCM);
+
+        ~AEADCryptStream();
+
+        length_type read(void* output, offset_type offset, length_type length) override;
+
+        void write(const void* input, offset_type offset, length_type length) override;
 
-        ~AESGCMCryptStream();
+        void resize(length_type new_length) override;
 
         virtual length_type size() const override;
 
@@ -66,7 +235,8 @@ namespace lite
 
         static length_type calculate_real_size(length_type underlying_size,
                                                length_type block_size,
-                                               length_type iv_size) noexcept;
+                                               length_type iv_size,
+                                               bool aligned = false) noexcept;
     };
 }    // namespace lite
 }    // namespace securefs
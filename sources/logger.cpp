@@ -2,8 +2,16 @@
 #include "myutils.h"
 #include "platform.h"
 
+#include <securefs_config.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <stdarg.h>
 #include <stdio.h>
+#include <thread>
+#include <vector>
 
 #ifdef WIN32
 #include <Windows.h>
@@ -23,18 +31,302 @@ static const void* current_thread_id(void) { return (void*)(pthread_self()); }
 
 namespace securefs
 {
-void Logger::vlog(LoggingLevel level, const char* format, va_list args) noexcept
+namespace
 {
-    if (!m_fp || level < this->get_level())
-        return;
+    void time_to_tm(const fuse_timespec& time, struct tm* out)
+    {
+        time_t seconds = time.tv_sec;
+#ifdef WIN32
+        gmtime_s(out, &seconds);
+#else
+        gmtime_r(&seconds, out);
+#endif
+    }
 
-    struct tm now;
-    int now_ns = 0;
-    OSService::get_current_time_in_tm(&now, &now_ns);
+    struct LogRecord
+    {
+        static const size_t MAX_TEXT_LENGTH = 480;
 
-    flockfile(m_fp);
-    DEFER(funlockfile(m_fp));
+        uint64_t sequence;    // Orders the records of different threads
+        const void* thread_id;
+        fuse_timespec time;
+        LoggingLevel level;
+        char text[MAX_TEXT_LENGTH];
+    };
+
+    // Single producer, single consumer
+    class LogRing
+    {
+        DISABLE_COPY_MOVE(LogRing)
+
+    public:
+        static const size_t CAPACITY = 256;
+
+    private:
+        std::atomic<uint64_t> m_head, m_tail;    // Advanced by the consumer and producer
+        std::atomic<bool> m_retired;             // Set once the producer has exited
+        LogRecord m_records[CAPACITY];
+
+    public:
+        LogRing() : m_head(0), m_tail(0), m_retired(false) {}
+
+        void retire() noexcept { m_retired.store(true, std::memory_order_release); }
+
+        bool is_retired() const noexcept { return m_retired.load(std::memory_order_acquire); }
+
+        // Returns null if full
+        LogRecord* reserve() noexcept
+        {
+            auto tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_head.load(std::memory_order_acquire) >= CAPACITY)
+                return nullptr;
+            return &m_records[tail % CAPACITY];
+        }
+
+        // Returns the number of records in the ring afterwards
+        uint64_t commit() noexcept
+        {
+            auto tail = m_tail.load(std::memory_order_relaxed) + 1;
+            m_tail.store(tail, std::memory_order_release);
+            return tail - m_head.load(std::memory_order_relaxed);
+        }
+
+        // Moves all the available records into `output`
+        void drain(std::vector<LogRecord>& output)
+        {
+            auto head = m_head.load(std::memory_order_relaxed);
+            auto tail = m_tail.load(std::memory_order_acquire);
+            for (; head != tail; ++head)
+                output.push_back(m_records[head % CAPACITY]);
+            m_head.store(head, std::memory_order_release);
+        }
+    };
 
+    std::atomic<uint64_t> next_writer_id(1);
+
+#if HAS_THREAD_LOCAL
+    // Retires the ring of the thread when it exits, so that the writer frees it once drained
+    struct LocalRing
+    {
+        uint64_t writer_id = 0;
+        std::shared_ptr<LogRing> ring;
+
+        ~LocalRing()
+        {
+            if (ring)
+                ring->retire();
+        }
+    };
+    thread_local LocalRing local_ring;
+#endif
+}    // namespace
+
+class Logger::AsyncWriter
+{
+    DISABLE_COPY_MOVE(AsyncWriter)
+
+private:
+    static const unsigned IDLE_WAIT_MS = 10;
+
+    Logger* m_logger;
+    uint64_t m_id;
+    std::atomic<uint64_t> m_sequence, m_dropped;
+    uint64_t m_reported_dropped;
+    std::mutex m_mutex, m_write_mutex;
+    std::condition_variable m_cond;
+    std::vector<std::shared_ptr<LogRing>> m_rings;    // Guarded by `m_mutex`
+    std::vector<LogRecord> m_batch;                   // Guarded by `m_write_mutex`
+    std::thread m_thread;
+    std::atomic<bool> m_running;
+    bool m_stopping;    // Guarded by `m_mutex`
+
+    LogRing* get_ring()
+    {
+#if HAS_THREAD_LOCAL
+        if (local_ring.writer_id == m_id)
+            return local_ring.ring.get();
+        auto ring = std::make_shared<LogRing>();
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_rings.push_back(ring);
+        }
+        if (local_ring.ring)
+            local_ring.ring->retire();
+        local_ring.writer_id = m_id;
+        local_ring.ring = std::move(ring);
+        return local_ring.ring.get();
+#else
+        return nullptr;
+#endif
+    }
+
+    // Returns the number of records written
+    size_t write_available()
+    {
+        std::lock_guard<std::mutex> write_guard(m_write_mutex);
+        m_batch.clear();
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            for (size_t i = 0; i < m_rings.size();)
+            {
+                // Checked before draining, so that no record committed before retirement is lost
+                bool retired = m_rings[i]->is_retired();
+                m_rings[i]->drain(m_batch);
+                if (retired)
+                {
+                    m_rings[i] = std::move(m_rings.back());
+                    m_rings.pop_back();
+                }
+                else
+                    ++i;
+            }
+        }
+        std::sort(m_batch.begin(), m_batch.end(), [](const LogRecord& a, const LogRecord& b) {
+            return a.sequence < b.sequence;
+        });
+
+        auto fp = m_logger->m_fp;
+        flockfile(fp);
+        DEFER(funlockfile(fp));
+        for (const LogRecord& record : m_batch)
+        {
+            struct tm time;
+            time_to_tm(record.time, &time);
+            m_logger->begin_record(
+                record.level, record.thread_id, time, static_cast<int>(record.time.tv_nsec));
+            fputs(record.text, fp);
+            m_logger->end_record(record.level);
+        }
+        auto dropped = m_dropped.load(std::memory_order_relaxed);
+        if (dropped != m_reported_dropped)
+        {
+            struct tm time;
+            int ns;
+            OSService::get_current_time_in_tm(&time, &ns);
+            m_logger->begin_record(kLogWarning, current_thread_id(), time, ns);
+            fprintf(fp,
+                    "%llu log records were dropped because the logging thread could not keep up",
+                    static_cast<unsigned long long>(dropped - m_reported_dropped));
+            m_logger->end_record(kLogWarning);
+            m_reported_dropped = dropped;
+        }
+        if (!m_batch.empty())
+            fflush(fp);
+        return m_batch.size();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            if (write_available() > 0)
+                continue;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_stopping)
+                break;
+            m_cond.wait_for(lock, std::chrono::milliseconds(IDLE_WAIT_MS));
+        }
+        write_available();
+    }
+
+public:
+    explicit AsyncWriter(Logger* logger)
+        : m_logger(logger)
+        , m_id(next_writer_id.fetch_add(1))
+        , m_sequence(0)
+        , m_dropped(0)
+        , m_reported_dropped(0)
+        , m_running(false)
+        , m_stopping(false)
+    {
+    }
+
+    ~AsyncWriter() { stop(); }
+
+    void start()
+    {
+        if (m_thread.joinable())
+            return;
+        m_stopping = false;
+        m_thread = std::thread([this]() { run(); });
+        m_running.store(true, std::memory_order_relaxed);
+    }
+
+    // Records pushed concurrently are written out by their pushers, see `push`
+    void stop() noexcept
+    {
+        if (!m_thread.joinable())
+            return;
+        m_running.store(false, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_stopping = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+
+    // Returns false if the record should be logged synchronously instead
+    bool push(LoggingLevel level, const char* format, va_list args) noexcept
+    {
+        LogRing* ring;
+        try
+        {
+            ring = get_ring();
+        }
+        catch (...)
+        {
+            return false;
+        }
+        if (!ring)
+            return false;
+        LogRecord* record = ring->reserve();
+        if (!record)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        record->sequence = m_sequence.fetch_add(1, std::memory_order_relaxed);
+        record->thread_id = current_thread_id();
+        OSService::get_current_time(record->time);
+        record->level = level;
+        int length = vsnprintf(record->text, LogRecord::MAX_TEXT_LENGTH, format, args);
+        if (length >= static_cast<int>(LogRecord::MAX_TEXT_LENGTH))
+        {
+            static const char marker[] = "... [truncated]";
+            memcpy(record->text + LogRecord::MAX_TEXT_LENGTH - sizeof(marker),
+                   marker,
+                   sizeof(marker));
+        }
+        // Wake up the writer early rather than waiting for its next poll when filling up
+        if (ring->commit() == LogRing::CAPACITY / 2)
+            m_cond.notify_one();
+
+        // Pairs with the fence in `stop`: either the writer thread drains this record before
+        // exiting, or this thread sees that it is stopping and writes the record out itself
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_running.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                write_available();
+            }
+            catch (...)
+            {
+            }
+        }
+        return true;
+    }
+
+    uint64_t dropped_count() const noexcept { return m_dropped.load(std::memory_order_relaxed); }
+};
+
+void Logger::begin_record(LoggingLevel level,
+                          const void* thread_id,
+                          const struct tm& now,
+                          int now_ns) noexcept
+{
     if (m_console_color)
     {
         switch (level)
@@ -53,7 +345,7 @@ void Logger::vlog(LoggingLevel level, const char* format, va_list args) noexcept
     fprintf(m_fp,
             "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC]    ",
             stringify(level),
-            current_thread_id(),
+            thread_id,
             now.tm_year + 1900,
             now.tm_mon + 1,
             now.tm_mday,
@@ -61,17 +353,64 @@ void Logger::vlog(LoggingLevel level, const char* format, va_list args) noexcept
             now.tm_min,
             now.tm_sec,
             now_ns);
-    vfprintf(m_fp, format, args);
+}
 
+void Logger::end_record(LoggingLevel level) noexcept
+{
     if (m_console_color && (level == kLogWarning || level == kLogError))
     {
         m_console_color->use(Colour::Default);
     }
 
     putc('\n', m_fp);
+}
+
+void Logger::vlog(LoggingLevel level, const char* format, va_list args) noexcept
+{
+    if (!m_fp || level < this->get_level())
+        return;
+
+    if (m_async.load(std::memory_order_acquire) && m_writer->push(level, format, args))
+        return;
+
+    struct tm now;
+    int now_ns = 0;
+    OSService::get_current_time_in_tm(&now, &now_ns);
+
+    flockfile(m_fp);
+    DEFER(funlockfile(m_fp));
+
+    begin_record(level, current_thread_id(), now, now_ns);
+    vfprintf(m_fp, format, args);
+    end_record(level);
     fflush(m_fp);
 }
 
+void Logger::start_async()
+{
+#if HAS_THREAD_LOCAL
+    if (!m_fp || m_async.load())
+        return;
+    if (!m_writer)
+        m_writer.reset(new AsyncWriter(this));
+    m_writer->start();
+    m_async.store(true, std::memory_order_release);
+#endif
+}
+
+void Logger::stop_async() noexcept
+{
+    m_async.store(false, std::memory_order_release);
+    // The writer itself is kept, as other threads may still be pushing to it
+    if (m_writer)
+        m_writer->stop();
+}
+
+uint64_t Logger::dropped_count() const noexcept
+{
+    return m_writer ? m_writer->dropped_count() : 0;
+}
+
 void Logger::log(LoggingLevel level, const char* format, ...) noexcept
 {
     if (!m_fp || level < this->get_level())
@@ -83,13 +422,14 @@ void Logger::log(LoggingLevel level, const char* format, ...) noexcept
 }
 
 Logger::Logger(FILE* fp, bool close_on_exit)
-    : m_level(kLogInfo), m_fp(fp), m_close_on_exit(close_on_exit)
+    : m_level(kLogInfo), m_fp(fp), m_close_on_exit(close_on_exit), m_async(false)
 {
     m_console_color = ConsoleColourSetter::create_setter(m_fp);
 }
 
 Logger::~Logger()
 {
+    stop_async();
     if (m_close_on_exit)
         fclose(m_fp);
 }
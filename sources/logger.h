@@ -1,6 +1,7 @@
 #pragma once
 #include "platform.h"
 
+#include <atomic>
 #include <memory>
 #include <stdarg.h>
 #include <stddef.h>
@@ -41,17 +42,45 @@ class Logger
     DISABLE_COPY_MOVE(Logger)
 
 private:
+    class AsyncWriter;
+
     LoggingLevel m_level;
     FILE* m_fp;
     std::unique_ptr<ConsoleColourSetter> m_console_color;
     bool m_close_on_exit;
+    std::unique_ptr<AsyncWriter> m_writer;    // Kept until destruction once started
+    std::atomic<bool> m_async;
 
     explicit Logger(FILE* fp, bool close_on_exit);
 
+    // Write the parts around the message of a record, with the file locked
+    void begin_record(LoggingLevel level,
+                      const void* thread_id,
+                      const struct tm& time,
+                      int nanoseconds) noexcept;
+    void end_record(LoggingLevel level) noexcept;
+
 public:
     static Logger* create_stderr_logger();
     static Logger* create_file_logger(const std::string& path);
 
+    /**
+     * From now on, records are formatted on the calling thread into a ring buffer of that thread,
+     * and written out by a background thread, so that logging never waits for the file or for
+     * other threads. When a ring is full, records are dropped and counted instead. Overlong
+     * records are cut short with a marker.
+     *
+     * The writer thread does not survive `fork()`, so this must be called after daemonizing.
+     * Logging stays synchronous on platforms without `thread_local`.
+     */
+    void start_async();
+
+    // Writes out the buffered records and returns to synchronous logging
+    void stop_async() noexcept;
+
+    // Number of records dropped because their ring was full
+    uint64_t dropped_count() const noexcept;
+
     void vlog(LoggingLevel level, const char* format, va_list args) noexcept;
     void log(LoggingLevel level, const char* format, ...) noexcept
 #ifndef _MSC_VER
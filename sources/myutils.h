@@ -212,10 +212,32 @@ inline bool is_all_equal(Iterator begin, Iterator end, const T& value)
     return true;
 }
 
+// Scans whole words, OR-ing a cache line's worth together before testing, so that compilers can
+// vectorize the inner loop while nonzero data still exits early
 inline bool is_all_zeros(const void* data, size_t len)
 {
     auto bytes = static_cast<const byte*>(data);
-    return is_all_equal(bytes, bytes + len, 0);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        uint64_t acc = 0;
+        for (size_t j = 0; j < 64; j += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i + j, sizeof(word));
+            acc |= word;
+        }
+        if (acc != 0)
+            return false;
+    }
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if (word != 0)
+            return false;
+    }
+    return is_all_equal(bytes + i, bytes + len, 0);
 }
 
 template <class T>
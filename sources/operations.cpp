@@ -3,8 +3,11 @@
 #include "constants.h"
 #include "crypto.h"
 #include "platform.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <mutex>
 #include <stdio.h>
@@ -23,6 +26,19 @@ namespace operations
 {
     const char* LOCK_FILENAME = ".securefs.lock";
 
+    static std::atomic<struct fuse_context*> context_override{nullptr};
+
+    struct fuse_context* current_fuse_context() noexcept
+    {
+        auto ctx = context_override.load(std::memory_order_acquire);
+        return ctx ? ctx : fuse_get_context();
+    }
+
+    void override_fuse_context(struct fuse_context* ctx) noexcept
+    {
+        context_override.store(ctx, std::memory_order_release);
+    }
+
     MountOptions::MountOptions() {}
     MountOptions::~MountOptions() {}
 
@@ -32,10 +48,13 @@ namespace operations
                 from_cryptopp_key(opt.master_key),
                 opt.flags.value(),
                 opt.block_size.value(),
-                opt.iv_size.value())
+                opt.iv_size.value(),
+                opt.max_inline_size.value_or(0),
+                opt.fd_pool)
         , root(opt.root)
         , root_id()
         , flags(opt.flags.value())
+        , stats_stream(opt.stats_stream)
     {
         if (opt.version.value() > 3)
             throwInvalidArgumentException("This context object only works with format 1,2,3");
@@ -90,6 +109,7 @@ namespace internal
 
     FileGuard open_base_dir(FileSystemContext* fs, const char* path, std::string& last_component)
     {
+        ScopedSpan span("open_base_dir");
         std::vector<std::string> components
             = split((fs->flags & kOptionCaseFoldFileName) ? case_fold(path) : path, '/');
         std::vector<std::string> prefixes;
@@ -120,6 +140,9 @@ namespace internal
             id = cache_it->second;
             ++first_component;
         }
+        // Counted once per path, as a hit only when no parent directory has to be looked up
+        if (components.size() > 1)
+            record_cache_access(CacheKind::DIRECTORY_IDS, first_component + 1 == components.size());
 
         FileGuard result(&fs->table, fs->table.open_as(id, FileBase::DIRECTORY));
 
@@ -253,7 +276,7 @@ namespace internal
 namespace operations
 {
 #define COMMON_PROLOGUE                                                                            \
-    auto ctx = fuse_get_context();                                                                 \
+    auto ctx = current_fuse_context();                                                             \
     auto fs = internal::get_fs(ctx);                                                               \
     (void)fs;                                                                                      \
     OPT_TRACE_WITH_PATH;
@@ -266,8 +289,14 @@ namespace operations
         fsinfo->want |= FUSE_CAP_BIG_WRITES;
         fsinfo->max_write = static_cast<unsigned>(-1);
 #endif
-        auto args = static_cast<MountOptions*>(fuse_get_context()->private_data);
+        auto args = static_cast<MountOptions*>(current_fuse_context()->private_data);
         auto fs = new FileSystemContext(*args);
+        if (args->stats_stream)
+            dump_statistics_on_signal(args->stats_stream);
+        if (args->span_stream)
+            toggle_span_tracing_on_signal(args->span_stream, args->span_sample_every);
+        if (global_logger)
+            global_logger->start_async();
         TRACE_LOG("%s", __FUNCTION__);
         fputs("Filesystem mounted successfully\n", stderr);
         return fs;
@@ -277,6 +306,9 @@ namespace operations
     {
         auto fs = static_cast<FileSystemContext*>(data);
         TRACE_LOG("%s", __FUNCTION__);
+        if (fs->stats_stream)
+            dump_statistics(fs->stats_stream.get());
+        stop_span_tracing();
         delete fs;
         fputs("Filesystem unmounted successfully\n", stderr);
     }
@@ -294,6 +326,7 @@ namespace operations
 
     int getattr(const char* path, struct fuse_stat* st)
     {
+        OperationTimer timer(Operation::GETATTR);
         COMMON_PROLOGUE
 
         try
@@ -339,6 +372,7 @@ namespace operations
                 fuse_off_t,
                 struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::READDIR);
         COMMON_PROLOGUE
 
         try
@@ -387,6 +421,7 @@ namespace operations
 
     int open(const char* path, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::OPEN);
         COMMON_PROLOGUE
 
         int rdwr = info->flags & O_RDWR;
@@ -413,6 +448,8 @@ namespace operations
 
     int release(const char* path, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::RELEASE);
+        IOAttribution attribution(path);
         COMMON_PROLOGUE
 
         try
@@ -431,6 +468,8 @@ namespace operations
     int
     read(const char* path, char* buffer, size_t len, fuse_off_t off, struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::READ);
+        IOAttribution attribution(path);
         OPT_TRACE_WITH_PATH_OFF_LEN(off, len);
 
         try
@@ -449,6 +488,8 @@ namespace operations
               fuse_off_t off,
               struct fuse_file_info* info)
     {
+        OperationTimer timer(Operation::WRITE);
+        IOAttribution attribution(path);
         OPT_TRACE_WITH_PATH_OFF_LEN(off, len);
         try
         {
@@ -463,6 +504,7 @@ namespace operations
 
     int flush(const char* path, struct fuse_file_info* info)
     {
+        IOAttribution attribution(path);
         COMMON_PROLOGUE
 
         try
@@ -478,6 +520,7 @@ namespace operations
 
     int truncate(const char* path, fuse_off_t size)
     {
+        IOAttribution attribution(path);
         COMMON_PROLOGUE
 
         try
@@ -492,6 +535,7 @@ namespace operations
 
     int ftruncate(const char* path, fuse_off_t size, struct fuse_file_info* info)
     {
+        IOAttribution attribution(path);
         COMMON_PROLOGUE
 
         try
@@ -573,7 +617,7 @@ namespace operations
 
     int symlink(const char* to, const char* from)
     {
-        auto ctx = fuse_get_context();
+        auto ctx = current_fuse_context();
         auto fs = internal::get_fs(ctx);
         OPT_TRACE_WITH_TWO_PATHS(to, from);
 
@@ -608,7 +652,7 @@ namespace operations
 
     int rename(const char* src, const char* dst)
     {
-        auto ctx = fuse_get_context();
+        auto ctx = current_fuse_context();
         auto fs = internal::get_fs(ctx);
         OPT_TRACE_WITH_TWO_PATHS(src, dst);
 
@@ -652,7 +696,7 @@ namespace operations
 
     int link(const char* src, const char* dst)
     {
-        auto ctx = fuse_get_context();
+        auto ctx = current_fuse_context();
         auto fs = internal::get_fs(ctx);
         OPT_TRACE_WITH_TWO_PATHS(src, dst);
 
@@ -689,6 +733,8 @@ namespace operations
 
     int fsync(const char* path, int, struct fuse_file_info* fi)
     {
+        OperationTimer timer(Operation::FSYNC);
+        IOAttribution attribution(path);
         COMMON_PROLOGUE
 
         try
@@ -738,7 +784,7 @@ namespace operations
     static const char* APPLE_FINDER_INFO = "com.apple.FinderInfo";
 
 #define XATTR_COMMON_PROLOGUE                                                                      \
-    auto ctx = fuse_get_context();                                                                 \
+    auto ctx = current_fuse_context();                                                             \
     auto fs = internal::get_fs(ctx);                                                               \
     TRACE_LOG("%s (path=%s, name=%s)", __func__, path, name);
 
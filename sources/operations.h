@@ -66,6 +66,7 @@
 namespace securefs
 {
 class FileStream;
+class FileDescriptorPool;
 
 namespace operations
 {
@@ -78,6 +79,12 @@ namespace operations
         optional<uint32_t> flags;
         optional<unsigned> block_size;
         optional<unsigned> iv_size;
+        optional<unsigned> max_inline_size;
+        std::shared_ptr<FileDescriptorPool> fd_pool;
+        unsigned dir_cache_capacity = 0;    // Of the open directories of the lite format, if any
+        std::shared_ptr<FileStream> stats_stream;    // Where the statistics are dumped, if any
+        std::shared_ptr<FileStream> span_stream;    // Where spans are traced on SIGUSR2, if any
+        unsigned span_sample_every = 1;
 
         MountOptions();
         ~MountOptions();
@@ -110,6 +117,7 @@ namespace operations
         optional<fuse_uid_t> uid_override;
         optional<fuse_gid_t> gid_override;
         uint32_t flags;
+        std::shared_ptr<FileStream> stats_stream;
 
         explicit FileSystemContext(const MountOptions& opt);
 
@@ -118,6 +126,14 @@ namespace operations
 
     void init_fuse_operations(struct fuse_operations* opt, bool xattr);
 
+    // The context of the current FUSE call, or the one installed by `override_fuse_context`
+    struct fuse_context* current_fuse_context() noexcept;
+
+    // Makes the operations of both formats see `ctx` instead of the context given by FUSE, so that
+    // they can be called without a mount, such as when replaying a trace. It affects all threads;
+    // pass nullptr to restore.
+    void override_fuse_context(struct fuse_context* ctx) noexcept;
+
     int statfs(const char*, struct fuse_statvfs*);
 
     void* init(struct fuse_conn_info*);
@@ -140,6 +140,8 @@ std::string narrow_string(WideStringRef str);
 void windows_init(void);
 #endif
 
+class IoUring;
+
 class OSService
 {
 private:
@@ -147,6 +149,8 @@ private:
     void* m_root_handle;
 #else
     int m_dir_fd;
+    std::shared_ptr<IoUring> m_io_uring;
+    bool m_map_read_only_files;
 #endif
     std::string m_dir_name;
 
@@ -154,45 +158,70 @@ public:
     native_string_type norm_path(StringRef path) const;
 
 public:
+    // The default instance works on the current directory, as do subclasses that override all the
+    // virtual functions below
     OSService();
     explicit OSService(StringRef path);
-    ~OSService();
-    std::shared_ptr<FileStream> open_file_stream(StringRef path, int flags, unsigned mode) const;
+    virtual ~OSService();
+    virtual std::shared_ptr<FileStream>
+    open_file_stream(StringRef path, int flags, unsigned mode) const;
+
+    // Makes files subsequently opened with O_RDONLY memory mapped. They must not be modified while
+    // open. Returns false when the platform does not support it.
+    virtual bool enable_mapped_reads();
+
+    // Makes subsequently opened streams write through io_uring.
+    // Returns false, leaving the synchronous I/O in place, when the platform does not support it.
+    virtual bool enable_io_uring(unsigned queue_depth);
     bool remove_file_nothrow(StringRef path) const noexcept;
     bool remove_directory_nothrow(StringRef path) const noexcept;
-    void remove_file(StringRef path) const;
-    void remove_directory(StringRef path) const;
-
-    void rename(StringRef a, StringRef b) const;
-    void lock() const;
+    virtual void remove_file(StringRef path) const;
+    virtual void remove_directory(StringRef path) const;
+
+    virtual void rename(StringRef a, StringRef b) const;
+    // Like `rename` and `link`, with the destination relative to `dest_dir`, another directory of
+    // the same storage as returned by `open_directory`, so neither path is resolved from the root
+    virtual void rename_at(StringRef a, const OSService& dest_dir, StringRef b) const;
+    virtual void link_at(StringRef source, const OSService& dest_dir, StringRef dest) const;
+    virtual void lock() const;
     void ensure_directory(StringRef path, unsigned mode) const;
-    void mkdir(StringRef path, unsigned mode) const;
-    void statfs(struct fuse_statvfs*) const;
-    void utimens(StringRef path, const fuse_timespec ts[2]) const;
+    virtual void mkdir(StringRef path, unsigned mode) const;
+    virtual void statfs(struct fuse_statvfs*) const;
+    virtual void utimens(StringRef path, const fuse_timespec ts[2]) const;
 
     // Returns false when the path does not exist; throw exceptions on other errors
     // The ENOENT errors are too frequent so the API is redesigned
-    bool stat(StringRef path, struct fuse_stat* stat) const;
+    virtual bool stat(StringRef path, struct fuse_stat* stat) const;
 
-    void link(StringRef source, StringRef dest) const;
-    void chmod(StringRef path, fuse_mode_t mode) const;
-    void chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const;
-    ssize_t readlink(StringRef path, char* output, size_t size) const;
-    void symlink(StringRef source, StringRef dest) const;
+    virtual void link(StringRef source, StringRef dest) const;
+    virtual void chmod(StringRef path, fuse_mode_t mode) const;
+    virtual void chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const;
+    virtual ssize_t readlink(StringRef path, char* output, size_t size) const;
+    virtual void symlink(StringRef source, StringRef dest) const;
 
     typedef std::function<void(StringRef, StringRef)> recursive_traverse_callback;
-    void recursive_traverse(StringRef dir, const recursive_traverse_callback& callback) const;
+    // Calls `callback` with the parent and name of every file below `dir`, and
+    // `directory_callback`, if set, with those of every directory once its contents are done
+    void recursive_traverse(StringRef dir,
+                            const recursive_traverse_callback& callback,
+                            const recursive_traverse_callback& directory_callback
+                            = recursive_traverse_callback()) const;
 
-    std::unique_ptr<DirectoryTraverser> create_traverser(StringRef dir) const;
+    virtual std::unique_ptr<DirectoryTraverser> create_traverser(StringRef dir) const;
+
+    // Opens the directory `path` as a storage rooted there, so that operations on its entries skip
+    // walking `path` again. Returns null when the storage cannot do so.
+    virtual std::shared_ptr<const OSService> open_directory(StringRef path) const;
 
 #ifdef __APPLE__
     // These APIs, unlike all others, report errors through negative error numbers as defined in
     // <errno.h>
-    ssize_t listxattr(const char* path, char* buf, size_t size) const noexcept;
-    ssize_t getxattr(const char* path, const char* name, void* buf, size_t size) const noexcept;
-    int setxattr(const char* path, const char* name, void* buf, size_t size, int flags) const
-        noexcept;
-    int removexattr(const char* path, const char* name) const noexcept;
+    virtual ssize_t listxattr(const char* path, char* buf, size_t size) const noexcept;
+    virtual ssize_t
+    getxattr(const char* path, const char* name, void* buf, size_t size) const noexcept;
+    virtual int
+    setxattr(const char* path, const char* name, void* buf, size_t size, int flags) const noexcept;
+    virtual int removexattr(const char* path, const char* name) const noexcept;
 #endif
 public:
     static uint32_t getuid() noexcept;
@@ -209,6 +238,15 @@ public:
     static void read_password_with_confirmation(const char* prompt,
                                                 CryptoPP::AlignedSecByteBlock* output);
     static std::string stringify_system_error(int errcode);
+
+#ifndef WIN32
+    /**
+     * From now on, runs `callback` whenever the process receives `signal_number`. The callbacks of
+     * all signals run in turn on one background thread, since little is allowed inside a signal
+     * handler; their exceptions are logged. Only the first call for each signal has effect.
+     */
+    static void call_on_signal(int signal_number, std::function<void()> callback);
+#endif
 };
 
 struct Colour
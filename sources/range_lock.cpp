@@ -0,0 +1,42 @@
+#include "range_lock.h"
+
+namespace securefs
+{
+bool BlockRangeLock::conflicts(offset_type begin, offset_type end, bool exclusive) const noexcept
+{
+    for (const Range& r : m_held)
+    {
+        if ((exclusive || r.exclusive) && r.begin < end && begin < r.end)
+            return true;
+    }
+    return false;
+}
+
+BlockRangeLock::Guard::Guard(BlockRangeLock& lock,
+                             offset_type begin,
+                             offset_type end,
+                             bool exclusive)
+    : m_lock(lock), m_empty(begin >= end)
+{
+    if (m_empty)
+        return;
+    std::unique_lock<std::mutex> guard(m_lock.m_mutex);
+    m_lock.m_released.wait(guard, [&]() { return !m_lock.conflicts(begin, end, exclusive); });
+    Range range;
+    range.begin = begin;
+    range.end = end;
+    range.exclusive = exclusive;
+    m_range = m_lock.m_held.insert(m_lock.m_held.end(), range);
+}
+
+BlockRangeLock::Guard::~Guard()
+{
+    if (m_empty)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(m_lock.m_mutex);
+        m_lock.m_held.erase(m_range);
+    }
+    m_lock.m_released.notify_all();
+}
+}    // namespace securefs
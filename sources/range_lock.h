@@ -0,0 +1,56 @@
+#pragma once
+
+#include "myutils.h"
+
+#include <condition_variable>
+#include <limits>
+#include <list>
+#include <mutex>
+
+namespace securefs
+{
+// The end of a range that covers every block from its beginning onwards, including blocks not yet
+// written
+const offset_type kUnboundedBlock = std::numeric_limits<offset_type>::max();
+
+/**
+ * Locks half open ranges of blocks of a stream, shared for reading or exclusive for writing, so
+ * that operations on disjoint ranges of the same stream proceed in parallel while overlapping ones
+ * take turns.
+ */
+class BlockRangeLock
+{
+    DISABLE_COPY_MOVE(BlockRangeLock)
+
+private:
+    struct Range
+    {
+        offset_type begin, end;
+        bool exclusive;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    std::list<Range> m_held;
+
+    bool conflicts(offset_type begin, offset_type end, bool exclusive) const noexcept;
+
+public:
+    BlockRangeLock() {}
+
+    class Guard
+    {
+        DISABLE_COPY_MOVE(Guard)
+
+    private:
+        BlockRangeLock& m_lock;
+        std::list<Range>::iterator m_range;
+        bool m_empty;
+
+    public:
+        // Blocks until no range overlapping [begin, end) is held in a conflicting mode
+        explicit Guard(BlockRangeLock& lock, offset_type begin, offset_type end, bool exclusive);
+        ~Guard();
+    };
+};
+}    // namespace securefs
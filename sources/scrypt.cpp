@@ -30,6 +30,21 @@
 #include "crypto.h"
 #include "exceptions.h"
 
+#include <cryptopp/config.h>
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+#include <cryptopp/cpu.h>
+#include <emmintrin.h>
+#define SECUREFS_SCRYPT_SSE2 1
+// Lets the SSE2 mixing compile without -msse2, as it is only selected after HasSSE2()
+#if defined(__GNUC__) && !defined(__SSE2__)
+#define SECUREFS_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define SECUREFS_TARGET_SSE2
+#endif
+#else
+#define SECUREFS_SCRYPT_SSE2 0
+#endif
+
 #include <sys/types.h>
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -39,6 +54,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
 #ifdef _WIN32
 static int posix_memalign(void** p, size_t alignment, size_t size)
 {
@@ -53,26 +73,18 @@ static void posix_memalign_free(void* p) { free(p); }
 
 namespace securefs
 {
-static void blkcpy(void* dest, const void* src, size_t len)
+static void blkcpy(uint32_t* dest, const uint32_t* src, size_t len)
 {
-    auto D = static_cast<size_t*>(dest);
-    auto S = static_cast<const size_t*>(src);
-    size_t L = len / sizeof(size_t);
-    size_t i;
-
-    for (i = 0; i < L; i++)
-        D[i] = S[i];
+    memcpy(dest, src, len);
 }
 
-static void blkxor(void* dest, const void* src, size_t len)
+static void blkxor(uint32_t* dest, const uint32_t* src, size_t len)
 {
-    auto D = static_cast<size_t*>(dest);
-    auto S = static_cast<const size_t*>(src);
-    size_t L = len / sizeof(size_t);
+    size_t L = len / sizeof(uint32_t);
     size_t i;
 
     for (i = 0; i < L; i++)
-        D[i] ^= S[i];
+        dest[i] ^= src[i];
 }
 
 /**
@@ -258,6 +270,207 @@ static void smix(uint8_t* B, size_t r, uint64_t N, uint32_t* V, uint32_t* XY)
         le32enc(&B[4 * k], X[k]);
 }
 
+#if SECUREFS_SCRYPT_SSE2
+/*
+ * The SSE2 versions below keep each 64 byte salsa20 block in a shuffled order, where the four
+ * 128-bit words hold the diagonals of the 4x4 matrix rather than its rows. The column and row
+ * rounds then become lane-wise operations on whole words, with only a rotation of the words in
+ * between. smix_sse2 shuffles the input on entry and unshuffles the output on exit; integerify
+ * reads the two words it needs from their shuffled positions.
+ */
+
+SECUREFS_TARGET_SSE2 static void blkcpy_sse2(__m128i* dest, const __m128i* src, size_t len)
+{
+    size_t L = len / 16;
+    size_t i;
+
+    for (i = 0; i < L; i++)
+        dest[i] = src[i];
+}
+
+SECUREFS_TARGET_SSE2 static void blkxor_sse2(__m128i* dest, const __m128i* src, size_t len)
+{
+    size_t L = len / 16;
+    size_t i;
+
+    for (i = 0; i < L; i++)
+        dest[i] = _mm_xor_si128(dest[i], src[i]);
+}
+
+/**
+ * salsa20_8_sse2(B):
+ * Apply the salsa20/8 core to the provided block, stored in the shuffled order.
+ */
+SECUREFS_TARGET_SSE2 static void salsa20_8_sse2(__m128i B[4])
+{
+    __m128i X0, X1, X2, X3;
+    __m128i T;
+    size_t i;
+
+    X0 = B[0];
+    X1 = B[1];
+    X2 = B[2];
+    X3 = B[3];
+
+    for (i = 0; i < 8; i += 2)
+    {
+#define R(X, T, b)                                                                                 \
+    X = _mm_xor_si128(X, _mm_slli_epi32(T, b));                                                    \
+    X = _mm_xor_si128(X, _mm_srli_epi32(T, 32 - (b)))
+        /* Operate on "columns". */
+        T = _mm_add_epi32(X0, X3);
+        R(X1, T, 7);
+        T = _mm_add_epi32(X1, X0);
+        R(X2, T, 9);
+        T = _mm_add_epi32(X2, X1);
+        R(X3, T, 13);
+        T = _mm_add_epi32(X3, X2);
+        R(X0, T, 18);
+
+        /* Rearrange data. */
+        X1 = _mm_shuffle_epi32(X1, 0x93);
+        X2 = _mm_shuffle_epi32(X2, 0x4E);
+        X3 = _mm_shuffle_epi32(X3, 0x39);
+
+        /* Operate on "rows". */
+        T = _mm_add_epi32(X0, X1);
+        R(X3, T, 7);
+        T = _mm_add_epi32(X3, X0);
+        R(X2, T, 9);
+        T = _mm_add_epi32(X2, X3);
+        R(X1, T, 13);
+        T = _mm_add_epi32(X1, X2);
+        R(X0, T, 18);
+#undef R
+
+        /* Rearrange data. */
+        X1 = _mm_shuffle_epi32(X1, 0x39);
+        X2 = _mm_shuffle_epi32(X2, 0x4E);
+        X3 = _mm_shuffle_epi32(X3, 0x93);
+    }
+
+    B[0] = _mm_add_epi32(B[0], X0);
+    B[1] = _mm_add_epi32(B[1], X1);
+    B[2] = _mm_add_epi32(B[2], X2);
+    B[3] = _mm_add_epi32(B[3], X3);
+}
+
+/**
+ * blockmix_salsa8_sse2(Bin, Bout, X, r):
+ * Same as blockmix_salsa8, on blocks stored in the shuffled order.
+ */
+SECUREFS_TARGET_SSE2 static void
+blockmix_salsa8_sse2(const __m128i* Bin, __m128i* Bout, __m128i* X, size_t r)
+{
+    size_t i;
+
+    /* 1: X <-- B_{2r - 1} */
+    blkcpy_sse2(X, &Bin[8 * r - 4], 64);
+
+    /* 2: for i = 0 to 2r - 1 do */
+    for (i = 0; i < r; i++)
+    {
+        /* 3: X <-- H(X \xor B_i) */
+        blkxor_sse2(X, &Bin[i * 8], 64);
+        salsa20_8_sse2(X);
+
+        /* 4: Y_i <-- X */
+        /* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+        blkcpy_sse2(&Bout[i * 4], X, 64);
+
+        /* 3: X <-- H(X \xor B_i) */
+        blkxor_sse2(X, &Bin[i * 8 + 4], 64);
+        salsa20_8_sse2(X);
+
+        /* 4: Y_i <-- X */
+        /* 6: B' <-- (Y_0, Y_2 ... Y_{2r-2}, Y_1, Y_3 ... Y_{2r-1}) */
+        blkcpy_sse2(&Bout[(r + i) * 4], X, 64);
+    }
+}
+
+/**
+ * integerify_sse2(B, r):
+ * Same as integerify, on blocks stored in the shuffled order.
+ */
+SECUREFS_TARGET_SSE2 static uint64_t integerify_sse2(const void* B, size_t r)
+{
+    auto X = reinterpret_cast<const uint32_t*>((uintptr_t)(B) + (2 * r - 1) * 64);
+
+    return (((uint64_t)(X[13]) << 32) + X[0]);
+}
+
+/**
+ * smix_sse2(B, r, N, V, XY):
+ * Same as smix, with the same requirements, using SSE2 instructions.
+ */
+SECUREFS_TARGET_SSE2 static void
+smix_sse2(uint8_t* B, size_t r, uint64_t N, uint32_t* V, uint32_t* XY)
+{
+    __m128i* X = reinterpret_cast<__m128i*>(XY);
+    __m128i* Y = reinterpret_cast<__m128i*>(&XY[32 * r]);
+    __m128i* Z = reinterpret_cast<__m128i*>(&XY[64 * r]);
+    __m128i* V128 = reinterpret_cast<__m128i*>(V);
+    uint32_t* X32 = XY;
+    uint64_t i;
+    uint64_t j;
+    size_t k, m;
+
+    /* 1: X <-- B */
+    for (k = 0; k < 2 * r; k++)
+        for (m = 0; m < 16; m++)
+            X32[k * 16 + m] = le32dec(&B[(k * 16 + (m * 5 % 16)) * 4]);
+
+    /* 2: for i = 0 to N - 1 do */
+    for (i = 0; i < N; i += 2)
+    {
+        /* 3: V_i <-- X */
+        blkcpy_sse2(&V128[i * (8 * r)], X, 128 * r);
+
+        /* 4: X <-- H(X) */
+        blockmix_salsa8_sse2(X, Y, Z, r);
+
+        /* 3: V_i <-- X */
+        blkcpy_sse2(&V128[(i + 1) * (8 * r)], Y, 128 * r);
+
+        /* 4: X <-- H(X) */
+        blockmix_salsa8_sse2(Y, X, Z, r);
+    }
+
+    /* 6: for i = 0 to N - 1 do */
+    for (i = 0; i < N; i += 2)
+    {
+        /* 7: j <-- Integerify(X) mod N */
+        j = integerify_sse2(X, r) & (N - 1);
+
+        /* 8: X <-- H(X \xor V_j) */
+        blkxor_sse2(X, &V128[j * (8 * r)], 128 * r);
+        blockmix_salsa8_sse2(X, Y, Z, r);
+
+        /* 7: j <-- Integerify(X) mod N */
+        j = integerify_sse2(Y, r) & (N - 1);
+
+        /* 8: X <-- H(X \xor V_j) */
+        blkxor_sse2(Y, &V128[j * (8 * r)], 128 * r);
+        blockmix_salsa8_sse2(Y, X, Z, r);
+    }
+
+    /* 10: B' <-- X */
+    for (k = 0; k < 2 * r; k++)
+        for (m = 0; m < 16; m++)
+            le32enc(&B[(k * 16 + (m * 5 % 16)) * 4], X32[k * 16 + m]);
+}
+#endif
+
+bool libscrypt_has_simd() noexcept
+{
+#if SECUREFS_SCRYPT_SSE2
+    static const bool has_sse2 = CryptoPP::HasSSE2();
+    return has_sse2;
+#else
+    return false;
+#endif
+}
+
 static void libscrypt_PBKDF2_SHA256(const uint8_t* passwd,
                                     size_t passwdlen,
                                     const uint8_t* salt,
@@ -269,6 +482,69 @@ static void libscrypt_PBKDF2_SHA256(const uint8_t* passwd,
     securefs::pbkdf_hmac_sha256(passwd, passwdlen, salt, saltlen, c, 0, buf, dkLen);
 }
 
+/**
+ * The temporary storage for one smix lane.
+ */
+class ScryptScratch
+{
+    DISABLE_COPY_MOVE(ScryptScratch)
+
+private:
+    void *m_V0, *m_XY0;
+    size_t m_V_size;
+
+public:
+    uint32_t* V;
+    uint32_t* XY;
+
+    explicit ScryptScratch(size_t r, uint64_t N)
+        : m_V0(nullptr), m_XY0(nullptr), m_V_size(128 * r * N)
+    {
+        int rc;
+        if ((rc = posix_memalign(&m_XY0, 64, 256 * r + 64)) != 0)
+            THROW_POSIX_EXCEPTION(rc, "posix_memalign");
+        XY = (uint32_t*)(m_XY0);
+#ifndef MAP_ANON
+        if ((rc = posix_memalign(&m_V0, 64, m_V_size)) != 0)
+        {
+            posix_memalign_free(m_XY0);
+            THROW_POSIX_EXCEPTION(rc, "posix_memalign");
+        }
+#else
+        if ((m_V0 = mmap(NULL,
+                         m_V_size,
+                         PROT_READ | PROT_WRITE,
+#ifdef MAP_NOCORE
+                         MAP_ANON | MAP_PRIVATE | MAP_NOCORE,
+#else
+                         MAP_ANON | MAP_PRIVATE,
+#endif
+                         -1,
+                         0))
+            == MAP_FAILED)
+        {
+            int err = errno;
+            posix_memalign_free(m_XY0);
+            THROW_POSIX_EXCEPTION(err, "mmap");
+        }
+#endif
+        V = (uint32_t*)(m_V0);
+    }
+
+    ~ScryptScratch()
+    {
+#ifndef MAP_ANON
+        posix_memalign_free(m_V0);
+#else
+        munmap(m_V0, m_V_size);
+#endif
+        posix_memalign_free(m_XY0);
+    }
+};
+
+// Upper bound of the scratch memory of the lanes computed at once
+static const uint64_t SCRYPT_MEMORY_BUDGET = 1ULL << 30;
+
 /**
  * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
  * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
@@ -276,6 +552,12 @@ static void libscrypt_PBKDF2_SHA256(const uint8_t* passwd,
  * must satisfy r * p < 2^30 and buflen <= (2^32 - 1) * 32.  The parameter N
  * must be a power of 2 greater than 1.
  *
+ * The p lanes are independent, so they are computed on up to as many threads as there are
+ * processors, each with its own 128rN bytes of storage. Fewer threads are used when their storage
+ * would exceed `SCRYPT_MEMORY_BUDGET` in total, though a single lane may always exceed it.
+ *
+ * Unless `allow_simd` is false, the vectorized kernels are used where the processor supports them.
+ *
  * throws exception on error
  */
 void libscrypt_scrypt(const uint8_t* passwd,
@@ -286,13 +568,11 @@ void libscrypt_scrypt(const uint8_t* passwd,
                       uint32_t r,
                       uint32_t p,
                       uint8_t* buf,
-                      size_t buflen)
+                      size_t buflen,
+                      bool allow_simd)
 {
-    void *B0, *V0, *XY0;
+    void* B0;
     uint8_t* B;
-    uint32_t* V;
-    uint32_t* XY;
-    uint32_t i;
 
 /* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
@@ -328,41 +608,65 @@ void libscrypt_scrypt(const uint8_t* passwd,
         THROW_POSIX_EXCEPTION(rc, "posix_memalign");
     DEFER(posix_memalign_free(B0));
     B = (uint8_t*)(B0);
-    if ((rc = posix_memalign(&XY0, 64, 256 * r + 64)) != 0)
-        THROW_POSIX_EXCEPTION(rc, "posix_memalign");
-    DEFER(posix_memalign_free(XY0));
-    XY = (uint32_t*)(XY0);
-#ifndef MAP_ANON
-    if ((errno = posix_memalign(&V0, 64, 128 * r * N)) != 0)
-        THROW_POSIX_EXCEPTION(rc, "posix_memalign");
-    DEFER(posix_memalign_free(V0));
-    V = (uint32_t*)(V0);
-#endif
-#ifdef MAP_ANON
-    if ((V0 = mmap(NULL,
-                   128 * r * N,
-                   PROT_READ | PROT_WRITE,
-#ifdef MAP_NOCORE
-                   MAP_ANON | MAP_PRIVATE | MAP_NOCORE,
-#else
-                   MAP_ANON | MAP_PRIVATE,
-#endif
-                   -1,
-                   0))
-        == MAP_FAILED)
-        THROW_POSIX_EXCEPTION(errno, "mmap");
-    DEFER(munmap(V0, 128 * r * N));
-    V = (uint32_t*)(V0);
-#endif
 
     /* 1: (B_0 ... B_{p-1}) <-- PBKDF2(P, S, 1, p * MFLen) */
     libscrypt_PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, 1, B, p * 128 * r);
 
+    auto mix = smix;
+#if SECUREFS_SCRYPT_SSE2
+    if (allow_simd && libscrypt_has_simd())
+        mix = smix_sse2;
+#else
+    (void)allow_simd;
+#endif
+
     /* 2: for i = 0 to p - 1 do */
-    for (i = 0; i < p; i++)
+    // Each thread holds its own 128 * r * N bytes of scratch, so the memory bounds the parallelism
+    uint64_t max_threads_by_memory = std::max<uint64_t>(1, SCRYPT_MEMORY_BUDGET / (128 * r * N));
+    uint32_t num_threads = static_cast<uint32_t>(
+        std::min<uint64_t>({p,
+                            std::max<uint32_t>(1, std::thread::hardware_concurrency()),
+                            max_threads_by_memory}));
+    auto run_lanes = [=](uint32_t first_lane) {
+        ScryptScratch scratch(r, N);
+        for (uint32_t i = first_lane; i < p; i += num_threads)
+        {
+            /* 3: B_i <-- MF(B_i, N) */
+            mix(&B[i * 128 * r], r, N, scratch.V, scratch.XY);
+        }
+    };
+
+    if (num_threads == 1)
+    {
+        run_lanes(0);
+    }
+    else
     {
-        /* 3: B_i <-- MF(B_i, N) */
-        smix(&B[i * 128 * r], r, N, V, XY);
+        std::vector<std::exception_ptr> errors(num_threads);
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        {
+            // Started threads are joined even if starting another one fails
+            DEFER(for (auto&& t : threads) t.join());
+            for (uint32_t t = 0; t < num_threads; ++t)
+            {
+                threads.emplace_back([&errors, &run_lanes, t]() {
+                    try
+                    {
+                        run_lanes(t);
+                    }
+                    catch (...)
+                    {
+                        errors[t] = std::current_exception();
+                    }
+                });
+            }
+        }
+        for (auto&& e : errors)
+        {
+            if (e)
+                std::rethrow_exception(e);
+        }
     }
 
     /* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
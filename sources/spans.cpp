@@ -0,0 +1,215 @@
+#include "spans.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "platform.h"
+#include "streams.h"
+
+#include <securefs_config.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#if !HAS_THREAD_LOCAL
+#include <pthread.h>
+#endif
+
+namespace securefs
+{
+namespace internal
+{
+    std::atomic<bool> span_tracing_active{false};
+}
+
+namespace
+{
+    struct SpanEvent
+    {
+        const char* name;
+        uint64_t start_ns, duration_ns;
+    };
+
+    // The spans of one thread, written out together when its outermost span ends
+    struct LocalSpans
+    {
+        uint32_t thread_number = 0;
+        unsigned depth = 0;
+        unsigned outermost_count = 0;
+        bool sampled = false;
+        bool writing = false;       // The trace stream may itself be instrumented
+        uint64_t generation = 0;    // Of the trace when the outermost span began
+        std::vector<SpanEvent> events;
+    };
+
+#if HAS_THREAD_LOCAL
+    LocalSpans& local_spans()
+    {
+        thread_local LocalSpans spans;
+        return spans;
+    }
+#else
+    pthread_once_t spans_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t spans_key;
+
+    LocalSpans& local_spans()
+    {
+        int rc = pthread_once(&spans_key_once, []() {
+            int rc = pthread_key_create(&spans_key,
+                                        [](void* p) { delete static_cast<LocalSpans*>(p); });
+            if (rc)
+                abort();
+        });
+        if (rc)
+            abort();
+        auto spans = static_cast<LocalSpans*>(pthread_getspecific(spans_key));
+        if (!spans)
+        {
+            spans = new LocalSpans();
+            if (pthread_setspecific(spans_key, spans))
+                abort();
+        }
+        return *spans;
+    }
+#endif
+
+    std::atomic<uint32_t> next_thread_number{1};
+
+    std::mutex trace_mutex;
+    std::shared_ptr<StreamBase> trace_stream;
+    offset_type trace_offset = 0;
+    std::atomic<unsigned> trace_sample_every{1};
+    // Bumped on every start, so that threads drop the spans begun under a previous trace
+    std::atomic<uint64_t> trace_generation{0};
+
+    const auto clock_epoch = std::chrono::steady_clock::now();
+
+    void append_locked(const std::string& text)
+    {
+        trace_stream->write(text.data(), trace_offset, text.size());
+        trace_offset += text.size();
+    }
+}    // namespace
+
+namespace internal
+{
+    uint64_t span_clock_ns() noexcept
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                         std::chrono::steady_clock::now() - clock_epoch)
+                                         .count());
+    }
+
+    bool begin_span() noexcept
+    {
+        LocalSpans& local = local_spans();
+        if (local.writing)
+            return false;
+        if (local.depth == 0)
+        {
+            local.generation = trace_generation.load(std::memory_order_acquire);
+            local.sampled = local.outermost_count++
+                    % trace_sample_every.load(std::memory_order_relaxed)
+                == 0;
+            local.events.clear();
+        }
+        ++local.depth;
+        return true;
+    }
+
+    void end_span(const char* name, uint64_t start_ns) noexcept
+    {
+        LocalSpans& local = local_spans();
+        if (local.depth == 0)
+            return;
+        --local.depth;
+        if (!local.sampled)
+            return;
+        local.events.push_back(SpanEvent{name, start_ns, span_clock_ns() - start_ns});
+        if (local.depth > 0)
+            return;
+
+        if (local.thread_number == 0)
+            local.thread_number = next_thread_number.fetch_add(1, std::memory_order_relaxed);
+        try
+        {
+            std::string text;
+            for (const SpanEvent& e : local.events)
+            {
+                text += strprintf("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                                  "\"dur\":%.3f},\n",
+                                  e.name,
+                                  local.thread_number,
+                                  e.start_ns / 1e3,
+                                  e.duration_ns / 1e3);
+            }
+            local.events.clear();
+            local.writing = true;
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            if (trace_stream
+                && local.generation == trace_generation.load(std::memory_order_relaxed))
+                append_locked(text);
+            local.writing = false;
+        }
+        catch (const std::exception& e)
+        {
+            local.writing = false;
+            local.events.clear();
+            WARN_LOG("Failed to write spans: %s", e.what());
+        }
+    }
+}    // namespace internal
+
+void start_span_tracing(std::shared_ptr<StreamBase> stream, unsigned sample_every)
+{
+    if (!stream)
+        throwVFSException(EFAULT);
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_stream = std::move(stream);
+    trace_stream->resize(0);
+    trace_offset = 0;
+    trace_sample_every.store(std::max(sample_every, 1u), std::memory_order_relaxed);
+    trace_generation.fetch_add(1, std::memory_order_release);
+    append_locked("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    internal::span_tracing_active.store(true, std::memory_order_relaxed);
+}
+
+void stop_span_tracing()
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    internal::span_tracing_active.store(false, std::memory_order_relaxed);
+    if (!trace_stream)
+        return;
+    // A metadata event, so that the events before need no special casing of their commas
+    append_locked("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                  "\"args\":{\"name\":\"securefs\"}}\n]}\n");
+    trace_stream->flush();
+    trace_stream.reset();
+}
+
+void toggle_span_tracing_on_signal(std::shared_ptr<StreamBase> stream, unsigned sample_every)
+{
+#ifndef _WIN32
+    OSService::call_on_signal(SIGUSR2, [stream, sample_every]() {
+        if (internal::span_tracing_active.load(std::memory_order_relaxed))
+        {
+            stop_span_tracing();
+            INFO_LOG("Span tracing stopped");
+        }
+        else
+        {
+            start_span_tracing(stream, sample_every);
+            INFO_LOG("Span tracing started");
+        }
+    });
+#else
+    (void)stream;
+    (void)sample_every;
+#endif
+}
+}    // namespace securefs
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "myutils.h"
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace securefs
+{
+class StreamBase;
+
+namespace internal
+{
+    extern std::atomic<bool> span_tracing_active;
+
+    bool begin_span() noexcept;
+    void end_span(const char* name, uint64_t start_ns) noexcept;
+    uint64_t span_clock_ns() noexcept;
+}    // namespace internal
+
+/**
+ * Starts writing the timed phases marked by `ScopedSpan` to `stream`, replacing its contents, as a
+ * Chrome trace (https://chromium.googlesource.com/catapult/+/HEAD/tracing), viewable in
+ * chrome://tracing or Perfetto. Of each thread, only one in every `sample_every` outermost spans
+ * is recorded, together with the spans nested inside.
+ */
+void start_span_tracing(std::shared_ptr<StreamBase> stream, unsigned sample_every = 1);
+
+// Completes the trace being written, if any
+void stop_span_tracing();
+
+/**
+ * From now on, switches span tracing into `stream` on and off whenever the process receives
+ * SIGUSR2. Only the first call has effect. Does nothing on Windows.
+ */
+void toggle_span_tracing_on_signal(std::shared_ptr<StreamBase> stream, unsigned sample_every);
+
+/**
+ * Records its own lifetime as a span named `name`, which must be a string literal. When tracing
+ * is off, the cost is a relaxed atomic load.
+ */
+class ScopedSpan
+{
+    DISABLE_COPY_MOVE(ScopedSpan)
+
+private:
+    const char* m_name;
+    uint64_t m_start_ns;
+    bool m_active;
+
+public:
+    explicit ScopedSpan(const char* name) noexcept : m_name(name), m_start_ns(0), m_active(false)
+    {
+        if (internal::span_tracing_active.load(std::memory_order_relaxed))
+        {
+            m_active = internal::begin_span();
+            m_start_ns = internal::span_clock_ns();
+        }
+    }
+
+    ~ScopedSpan()
+    {
+        if (m_active)
+            internal::end_span(m_name, m_start_ns);
+    }
+};
+}    // namespace securefs
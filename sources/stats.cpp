@@ -0,0 +1,537 @@
+#include "stats.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <json/json.h>
+#include <securefs_config.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#if !HAS_THREAD_LOCAL
+#include <pthread.h>
+#endif
+
+namespace securefs
+{
+namespace
+{
+    struct CacheCounters
+    {
+        std::atomic<uint64_t> hits{0}, misses{0};
+
+        void merge(const CacheCounters& other) noexcept
+        {
+            hits.fetch_add(other.hits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            misses.fetch_add(other.misses.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+        }
+    };
+
+    struct IOCounts
+    {
+        std::atomic<uint64_t> values[static_cast<size_t>(IOCounter::COUNT)];
+
+        IOCounts()
+        {
+            for (auto&& v : values)
+                v.store(0, std::memory_order_relaxed);
+        }
+
+        uint64_t get(IOCounter counter) const noexcept
+        {
+            return values[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        }
+
+        void merge(const IOCounts& other) noexcept
+        {
+            for (size_t i = 0; i < array_length(values); ++i)
+                values[i].fetch_add(other.values[i].load(std::memory_order_relaxed),
+                                    std::memory_order_relaxed);
+        }
+    };
+
+    // The counters updated by one thread. Readers may load them concurrently, hence the atomics,
+    // but as only the owning thread writes, the cache lines are never contended.
+    struct StatsShard
+    {
+        LatencyHistogram operation_histograms[static_cast<size_t>(Operation::COUNT)];
+        CacheCounters cache_counters[static_cast<size_t>(CacheKind::COUNT)];
+        IOCounts io_counts;
+
+        void merge(const StatsShard& other) noexcept
+        {
+            for (size_t i = 0; i < array_length(operation_histograms); ++i)
+                operation_histograms[i].merge(other.operation_histograms[i]);
+            for (size_t i = 0; i < array_length(cache_counters); ++i)
+                cache_counters[i].merge(other.cache_counters[i]);
+            io_counts.merge(other.io_counts);
+        }
+    };
+
+    struct ShardRegistry
+    {
+        std::mutex mutex;
+        std::vector<StatsShard*> live;
+        StatsShard retired;    // The sum of the shards of exited threads
+    };
+
+    // Never destroyed, as threads may still exit after the static destructors have run
+    ShardRegistry& shard_registry()
+    {
+        static ShardRegistry* registry = new ShardRegistry();
+        return *registry;
+    }
+
+    class ShardOwner
+    {
+        DISABLE_COPY_MOVE(ShardOwner)
+
+    public:
+        StatsShard shard;
+
+        ShardOwner()
+        {
+            auto& registry = shard_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.live.push_back(&shard);
+        }
+
+        ~ShardOwner()
+        {
+            auto& registry = shard_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.retired.merge(shard);
+            registry.live.erase(std::find(registry.live.begin(), registry.live.end(), &shard));
+        }
+    };
+
+#if HAS_THREAD_LOCAL
+    StatsShard& local_shard()
+    {
+        thread_local ShardOwner owner;
+        return owner.shard;
+    }
+#else
+    pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t shard_key;
+
+    StatsShard& local_shard()
+    {
+        int rc = pthread_once(&shard_key_once, []() {
+            int rc = pthread_key_create(&shard_key,
+                                        [](void* p) { delete static_cast<ShardOwner*>(p); });
+            if (rc)
+                abort();
+        });
+        if (rc)
+            abort();
+        auto owner = static_cast<ShardOwner*>(pthread_getspecific(shard_key));
+        if (!owner)
+        {
+            owner = new ShardOwner();
+            if (pthread_setspecific(shard_key, owner))
+                abort();
+        }
+        return owner->shard;
+    }
+#endif
+
+    // Sums up the shards of all threads
+    template <class Function>
+    void for_each_shard(Function function) noexcept
+    {
+        auto& registry = shard_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        function(registry.retired);
+        for (const StatsShard* shard : registry.live)
+            function(*shard);
+    }
+
+    CacheCounters& total_cache_counters(CacheKind cache, CacheCounters& total) noexcept
+    {
+        auto index = static_cast<size_t>(cache);
+        for_each_shard([&](const StatsShard& shard) { total.merge(shard.cache_counters[index]); });
+        return total;
+    }
+
+    IOCounts& total_io_counts(IOCounts& total) noexcept
+    {
+        for_each_shard([&](const StatsShard& shard) { total.merge(shard.io_counts); });
+        return total;
+    }
+
+    std::atomic<unsigned> top_files_reported{0};
+    std::mutex file_io_counts_mutex;
+    // Owned as well by the attributions in progress, so that pruning never frees counts in use
+    std::unordered_map<std::string, std::shared_ptr<IOCounts>> file_io_counts;
+
+    // The number of paths kept per reported one. Once twice as many are counted, only the ones
+    // with the most traffic are kept, so a path may lose the counts it had before it was pruned.
+    const size_t FILES_KEPT_PER_REPORTED = 16, MIN_FILES_KEPT = 1024;
+
+    uint64_t underlying_traffic(const IOCounts& counts) noexcept
+    {
+        return counts.get(IOCounter::UNDERLYING_BYTES_READ)
+            + counts.get(IOCounter::UNDERLYING_BYTES_WRITTEN);
+    }
+
+    // Requires `file_io_counts_mutex`
+    void prune_file_io_counts(size_t kept)
+    {
+        std::vector<std::pair<uint64_t, std::string>> files;
+        files.reserve(file_io_counts.size());
+        for (auto&& pair : file_io_counts)
+            files.emplace_back(underlying_traffic(*pair.second), pair.first);
+        std::nth_element(files.begin(),
+                         files.begin() + kept,
+                         files.end(),
+                         std::greater<std::pair<uint64_t, std::string>>());
+        for (auto it = files.begin() + kept; it != files.end(); ++it)
+            file_io_counts.erase(it->second);
+    }
+
+#if HAS_THREAD_LOCAL
+    thread_local IOCounts* attributed_io_counts_value = nullptr;
+
+    IOCounts*& attributed_io_counts() noexcept { return attributed_io_counts_value; }
+#else
+    pthread_once_t attributed_key_once = PTHREAD_ONCE_INIT;
+    pthread_key_t attributed_key;
+
+    IOCounts*& attributed_io_counts() noexcept
+    {
+        int rc = pthread_once(&attributed_key_once, []() {
+            int rc = pthread_key_create(&attributed_key,
+                                        [](void* p) { delete static_cast<IOCounts**>(p); });
+            if (rc)
+                abort();
+        });
+        if (rc)
+            abort();
+        auto slot = static_cast<IOCounts**>(pthread_getspecific(attributed_key));
+        if (!slot)
+        {
+            slot = new IOCounts*(nullptr);
+            if (pthread_setspecific(attributed_key, slot))
+                abort();
+        }
+        return *slot;
+    }
+#endif
+
+    Json::Value format_io_counts(const IOCounts& counts)
+    {
+        Json::Value value;
+        for (size_t i = 0; i < static_cast<size_t>(IOCounter::COUNT); ++i)
+        {
+            auto counter = static_cast<IOCounter>(i);
+            value[io_counter_name(counter)] = static_cast<Json::UInt64>(counts.get(counter));
+        }
+        auto logical_read = counts.get(IOCounter::LOGICAL_BYTES_READ);
+        auto logical_written = counts.get(IOCounter::LOGICAL_BYTES_WRITTEN);
+        value["read_amplification"] = logical_read > 0
+            ? static_cast<double>(counts.get(IOCounter::UNDERLYING_BYTES_READ)) / logical_read
+            : 0.0;
+        value["write_amplification"] = logical_written > 0
+            ? static_cast<double>(counts.get(IOCounter::UNDERLYING_BYTES_WRITTEN))
+                / logical_written
+            : 0.0;
+        return value;
+    }
+}    // namespace
+
+const char* operation_name(Operation op) noexcept
+{
+    switch (op)
+    {
+    case Operation::GETATTR:
+        return "getattr";
+    case Operation::READ:
+        return "read";
+    case Operation::WRITE:
+        return "write";
+    case Operation::READDIR:
+        return "readdir";
+    case Operation::OPEN:
+        return "open";
+    case Operation::RELEASE:
+        return "release";
+    case Operation::FSYNC:
+        return "fsync";
+    default:
+        return "unknown";
+    }
+}
+
+const char* cache_name(CacheKind cache) noexcept
+{
+    switch (cache)
+    {
+    case CacheKind::FILE_TABLE:
+        return "file_table";
+    case CacheKind::CIPHER_CONTEXTS:
+        return "cipher_contexts";
+    case CacheKind::FD_POOL:
+        return "fd_pool";
+    case CacheKind::DIRECTORY_IDS:
+        return "directory_ids";
+    case CacheKind::DIRECTORY_HANDLES:
+        return "directory_handles";
+    case CacheKind::OPEN_FILES:
+        return "open_files";
+    default:
+        return "unknown";
+    }
+}
+
+const char* io_counter_name(IOCounter counter) noexcept
+{
+    switch (counter)
+    {
+    case IOCounter::LOGICAL_BYTES_READ:
+        return "logical_bytes_read";
+    case IOCounter::LOGICAL_BYTES_WRITTEN:
+        return "logical_bytes_written";
+    case IOCounter::UNDERLYING_BYTES_READ:
+        return "underlying_bytes_read";
+    case IOCounter::UNDERLYING_BYTES_WRITTEN:
+        return "underlying_bytes_written";
+    case IOCounter::BYTES_ENCRYPTED:
+        return "bytes_encrypted";
+    case IOCounter::BYTES_DECRYPTED:
+        return "bytes_decrypted";
+    case IOCounter::BLOCKS_REWRITTEN:
+        return "blocks_rewritten";
+    case IOCounter::META_BYTES_REHASHED:
+        return "meta_bytes_rehashed";
+    default:
+        return "unknown";
+    }
+}
+
+LatencyHistogram::LatencyHistogram() noexcept : m_count(0), m_total_ns(0), m_max_ns(0)
+{
+    for (auto&& b : m_buckets)
+        b.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) noexcept
+{
+    unsigned index = 0;
+    while (index + 1 < NUM_BUCKETS && (nanoseconds >> (index + 1)) != 0)
+        ++index;
+    m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_total_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+    uint64_t current = m_max_ns.load(std::memory_order_relaxed);
+    while (current < nanoseconds
+           && !m_max_ns.compare_exchange_weak(current, nanoseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t LatencyHistogram::percentile_ns(double p) const noexcept
+{
+    // The buckets may be updated concurrently, so sum them up rather than trusting `m_count`
+    uint64_t total = 0;
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i)
+        total += bucket(i);
+    if (total == 0)
+        return 0;
+    auto threshold = static_cast<uint64_t>(p * total);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i)
+    {
+        seen += bucket(i);
+        if (seen > threshold || seen == total)
+            return static_cast<uint64_t>(1) << (i + 1);
+    }
+    return static_cast<uint64_t>(1) << NUM_BUCKETS;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) noexcept
+{
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i)
+        m_buckets[i].fetch_add(other.bucket(i), std::memory_order_relaxed);
+    m_count.fetch_add(other.count(), std::memory_order_relaxed);
+    m_total_ns.fetch_add(other.total_ns(), std::memory_order_relaxed);
+    uint64_t other_max = other.max_ns();
+    uint64_t current = m_max_ns.load(std::memory_order_relaxed);
+    while (current < other_max
+           && !m_max_ns.compare_exchange_weak(current, other_max, std::memory_order_relaxed))
+    {
+    }
+}
+
+void record_operation(Operation op, uint64_t nanoseconds) noexcept
+{
+    local_shard().operation_histograms[static_cast<size_t>(op)].record(nanoseconds);
+}
+
+void collect_operation_histogram(Operation op, LatencyHistogram& total) noexcept
+{
+    for_each_shard([&](const StatsShard& shard) {
+        total.merge(shard.operation_histograms[static_cast<size_t>(op)]);
+    });
+}
+
+void record_cache_access(CacheKind cache, bool hit) noexcept
+{
+    auto& counters = local_shard().cache_counters[static_cast<size_t>(cache)];
+    (hit ? counters.hits : counters.misses).fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t cache_hits(CacheKind cache) noexcept
+{
+    CacheCounters total;
+    return total_cache_counters(cache, total).hits.load(std::memory_order_relaxed);
+}
+
+uint64_t cache_misses(CacheKind cache) noexcept
+{
+    CacheCounters total;
+    return total_cache_counters(cache, total).misses.load(std::memory_order_relaxed);
+}
+
+void add_io_count(IOCounter counter, uint64_t amount) noexcept
+{
+    auto index = static_cast<size_t>(counter);
+    local_shard().io_counts.values[index].fetch_add(amount, std::memory_order_relaxed);
+    IOCounts* attributed = attributed_io_counts();
+    if (attributed)
+        attributed->values[index].fetch_add(amount, std::memory_order_relaxed);
+}
+
+uint64_t io_count(IOCounter counter) noexcept
+{
+    IOCounts total;
+    return total_io_counts(total).get(counter);
+}
+
+void enable_per_file_io_counts(unsigned top_n)
+{
+    top_files_reported.store(top_n, std::memory_order_relaxed);
+}
+
+IOAttribution::IOAttribution(const char* path) : m_previous(attributed_io_counts())
+{
+    auto top_n = top_files_reported.load(std::memory_order_relaxed);
+    if (top_n == 0)
+        return;
+    std::shared_ptr<IOCounts> counts;
+    {
+        std::lock_guard<std::mutex> lock(file_io_counts_mutex);
+        auto& entry = file_io_counts[path];
+        if (!entry)
+            entry = std::make_shared<IOCounts>();
+        counts = entry;
+        auto kept = std::max<size_t>(MIN_FILES_KEPT, FILES_KEPT_PER_REPORTED * top_n);
+        if (file_io_counts.size() > 2 * kept)
+            prune_file_io_counts(kept);
+    }
+    attributed_io_counts() = counts.get();
+    m_counts = std::move(counts);
+}
+
+IOAttribution::~IOAttribution() { attributed_io_counts() = static_cast<IOCounts*>(m_previous); }
+
+std::string format_statistics()
+{
+    // Merges the shards once, so that the counters below come from a single pass
+    std::unique_ptr<StatsShard> total(new StatsShard());
+    for_each_shard([&](const StatsShard& shard) { total->merge(shard); });
+
+    Json::Value root;
+    Json::Value& operations = root["operations"];
+    for (size_t i = 0; i < static_cast<size_t>(Operation::COUNT); ++i)
+    {
+        auto op = static_cast<Operation>(i);
+        const LatencyHistogram& histogram = total->operation_histograms[i];
+        Json::Value& value = operations[operation_name(op)];
+        auto count = histogram.count();
+        value["count"] = static_cast<Json::UInt64>(count);
+        value["mean_us"] = count > 0 ? histogram.total_ns() / 1e3 / count : 0.0;
+        value["p50_us"] = histogram.percentile_ns(0.5) / 1e3;
+        value["p90_us"] = histogram.percentile_ns(0.9) / 1e3;
+        value["p99_us"] = histogram.percentile_ns(0.99) / 1e3;
+        value["max_us"] = histogram.max_ns() / 1e3;
+        // Trailing empty buckets are omitted
+        Json::Value& buckets = value["buckets"];
+        buckets = Json::Value(Json::arrayValue);
+        unsigned used = LatencyHistogram::NUM_BUCKETS;
+        while (used > 0 && histogram.bucket(used - 1) == 0)
+            --used;
+        for (unsigned b = 0; b < used; ++b)
+            buckets.append(static_cast<Json::UInt64>(histogram.bucket(b)));
+    }
+    Json::Value& caches = root["caches"];
+    for (size_t i = 0; i < static_cast<size_t>(CacheKind::COUNT); ++i)
+    {
+        auto cache = static_cast<CacheKind>(i);
+        Json::Value& value = caches[cache_name(cache)];
+        const CacheCounters& counters = total->cache_counters[i];
+        value["hits"] = static_cast<Json::UInt64>(counters.hits.load(std::memory_order_relaxed));
+        value["misses"]
+            = static_cast<Json::UInt64>(counters.misses.load(std::memory_order_relaxed));
+    }
+    root["io"] = format_io_counts(total->io_counts);
+
+    auto top_n = top_files_reported.load(std::memory_order_relaxed);
+    if (top_n > 0)
+    {
+        std::vector<std::pair<std::string, std::shared_ptr<const IOCounts>>> files;
+        {
+            std::lock_guard<std::mutex> lock(file_io_counts_mutex);
+            for (auto&& pair : file_io_counts)
+                files.emplace_back(pair.first, pair.second);
+        }
+        auto middle = files.begin() + std::min<size_t>(top_n, files.size());
+        std::partial_sort(files.begin(),
+                          middle,
+                          files.end(),
+                          [](const std::pair<std::string, std::shared_ptr<const IOCounts>>& a,
+                             const std::pair<std::string, std::shared_ptr<const IOCounts>>& b) {
+                              return underlying_traffic(*a.second)
+                                  > underlying_traffic(*b.second);
+                          });
+        Json::Value& top = root["top_files"];
+        top = Json::Value(Json::arrayValue);
+        for (auto it = files.begin(); it != middle; ++it)
+        {
+            Json::Value value = format_io_counts(*it->second);
+            value["path"] = it->first;
+            top.append(value);
+        }
+    }
+    return root.toStyledString();
+}
+
+void dump_statistics(FileStream* stream)
+{
+    // Shared by the dumps on signal and the final one on unmount, which may write the same stream
+    static std::mutex dump_mutex;
+    auto text = format_statistics();
+    std::lock_guard<std::mutex> lock(dump_mutex);
+    stream->resize(0);
+    stream->write(text.data(), 0, text.size());
+    stream->flush();
+}
+
+void dump_statistics_on_signal(std::shared_ptr<FileStream> stream)
+{
+#ifndef _WIN32
+    OSService::call_on_signal(SIGUSR1, [stream]() { dump_statistics(stream.get()); });
+#else
+    (void)stream;
+#endif
+}
+}    // namespace securefs
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "myutils.h"
+#include "spans.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+namespace securefs
+{
+class FileStream;
+
+/**
+ * The filesystem operations whose calls are counted and timed.
+ */
+enum class Operation
+{
+    GETATTR,
+    READ,
+    WRITE,
+    READDIR,
+    OPEN,
+    RELEASE,
+    FSYNC,
+    COUNT
+};
+
+/**
+ * The caches whose hits and misses are counted.
+ */
+enum class CacheKind
+{
+    FILE_TABLE,           // Full format files still open or recently closed
+    CIPHER_CONTEXTS,      // Keyed ciphers of recently closed files
+    FD_POOL,              // Underlying descriptors not yet evicted
+    DIRECTORY_IDS,        // IDs of full format parent directories, a hit if all are cached
+    DIRECTORY_HANDLES,    // Open underlying directories of lite format paths
+    OPEN_FILES,           // Lite format files already open through another handle
+    COUNT
+};
+
+/**
+ * Bytes and blocks counted at each layer, to expose the amplification between what the
+ * filesystem is asked for and what it reads, writes and authenticates underneath.
+ */
+enum class IOCounter
+{
+    LOGICAL_BYTES_READ,          // Requested from the block based streams
+    LOGICAL_BYTES_WRITTEN,
+    UNDERLYING_BYTES_READ,       // Of ciphertext and metadata, from the underlying files
+    UNDERLYING_BYTES_WRITTEN,
+    BYTES_ENCRYPTED,             // Encrypted and authenticated, by the content ciphers
+    BYTES_DECRYPTED,             // Decrypted, and verified unless the checks are disabled
+    BLOCKS_REWRITTEN,            // Partial block writes that reencrypt the whole block
+    META_BYTES_REHASHED,         // Read back to recompute the HMAC of full format metadata
+    COUNT
+};
+
+const char* operation_name(Operation op) noexcept;
+const char* cache_name(CacheKind cache) noexcept;
+const char* io_counter_name(IOCounter counter) noexcept;
+
+/**
+ * A latency histogram with power of two buckets, updated with relaxed atomics only, so that
+ * recording neither locks nor allocates. Bucket `i` counts latencies in [2^i, 2^(i+1))
+ * nanoseconds.
+ */
+class LatencyHistogram
+{
+    DISABLE_COPY_MOVE(LatencyHistogram)
+
+public:
+    static const unsigned NUM_BUCKETS = 40;
+
+private:
+    std::atomic<uint64_t> m_buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> m_count, m_total_ns, m_max_ns;
+
+public:
+    LatencyHistogram() noexcept;
+
+    void record(uint64_t nanoseconds) noexcept;
+
+    uint64_t count() const noexcept { return m_count.load(std::memory_order_relaxed); }
+
+    uint64_t total_ns() const noexcept { return m_total_ns.load(std::memory_order_relaxed); }
+
+    uint64_t max_ns() const noexcept { return m_max_ns.load(std::memory_order_relaxed); }
+
+    uint64_t bucket(unsigned i) const noexcept
+    {
+        return m_buckets[i].load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket where the given fraction of the recorded latencies falls
+    uint64_t percentile_ns(double p) const noexcept;
+
+    // Adds the latencies recorded by `other` to this one
+    void merge(const LatencyHistogram& other) noexcept;
+};
+
+// The process wide counters, which are always on. Each thread updates a shard of its own, so that
+// the counting threads never contend; reads sum up the shards of all threads, live or exited.
+void record_operation(Operation op, uint64_t nanoseconds) noexcept;
+void collect_operation_histogram(Operation op, LatencyHistogram& total) noexcept;
+void record_cache_access(CacheKind cache, bool hit) noexcept;
+uint64_t cache_hits(CacheKind cache) noexcept;
+uint64_t cache_misses(CacheKind cache) noexcept;
+void add_io_count(IOCounter counter, uint64_t amount) noexcept;
+uint64_t io_count(IOCounter counter) noexcept;
+
+/**
+ * Also keeps the I/O counts per path, and reports the `top_n` paths with the most underlying
+ * traffic. The number of paths kept grows with `top_n`; beyond it, the paths with the least
+ * traffic are dropped, so the counts of a busy path that was once dropped may be short.
+ * Zero disables the counting again.
+ */
+void enable_per_file_io_counts(unsigned top_n);
+
+/**
+ * While alive, the I/O counts added by the calling thread are attributed to `path` as well,
+ * if per file counts are enabled.
+ */
+class IOAttribution
+{
+    DISABLE_COPY_MOVE(IOAttribution)
+
+private:
+    void* m_previous;
+    std::shared_ptr<void> m_counts;
+
+public:
+    explicit IOAttribution(const char* path);
+    ~IOAttribution();
+};
+
+// A JSON snapshot of all the counters
+std::string format_statistics();
+
+// Replaces the contents of `stream` with `format_statistics()`. Concurrent dumps are serialized.
+void dump_statistics(FileStream* stream);
+
+/**
+ * From now on, dumps the statistics to `stream` whenever the process receives SIGUSR1. The dump
+ * happens on a background thread, since formatting is not allowed inside a signal handler.
+ * Only the first call has effect. Does nothing on Windows.
+ */
+void dump_statistics_on_signal(std::shared_ptr<FileStream> stream);
+
+/**
+ * Times its own lifetime into the histogram of the given operation, and as the outermost span of
+ * the phases within when span tracing is on.
+ */
+class OperationTimer
+{
+    DISABLE_COPY_MOVE(OperationTimer)
+
+private:
+    Operation m_op;
+    std::chrono::steady_clock::time_point m_start;
+    ScopedSpan m_span;
+
+public:
+    explicit OperationTimer(Operation op) noexcept
+        : m_op(op), m_start(std::chrono::steady_clock::now()), m_span(operation_name(op))
+    {
+    }
+
+    ~OperationTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        record_operation(m_op, static_cast<uint64_t>(nanoseconds));
+    }
+};
+}    // namespace securefs
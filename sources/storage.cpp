@@ -0,0 +1,962 @@
+#include "storage.h"
+#include "exceptions.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <string.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+namespace internal
+{
+    struct MemoryNode
+    {
+        const fuse_mode_t type;    // S_IFREG, S_IFDIR or S_IFLNK
+        const fuse_ino_t ino;
+        // Guarded by the mutex of the service rather than `mutex`
+        std::map<std::string, std::shared_ptr<MemoryNode>> children;
+
+        std::mutex mutex;    // Of the fields below
+        std::condition_variable lock_released;
+        fuse_mode_t permissions;
+        fuse_uid_t uid;
+        fuse_gid_t gid;
+        fuse_nlink_t nlink;
+        fuse_timespec atime, mtime, ctime;
+        std::vector<byte> data;    // Of regular files, and the target of symbolic links
+        unsigned shared_locks = 0;
+        bool exclusive_lock = false;
+
+        explicit MemoryNode(fuse_mode_t type, fuse_mode_t permissions, fuse_nlink_t nlink);
+
+        bool is_directory() const noexcept { return type == S_IFDIR; }
+
+        // The following must be called with `mutex` held
+        void touch_change() { OSService::get_current_time(ctime); }
+
+        void touch_modification()
+        {
+            OSService::get_current_time(mtime);
+            ctime = mtime;
+        }
+    };
+}    // namespace internal
+
+using internal::MemoryNode;
+
+namespace
+{
+    std::atomic<fuse_ino_t> next_memory_ino{1};
+
+    std::vector<std::string> split_path(StringRef path)
+    {
+        std::vector<std::string> components;
+        size_t start = 0;
+        while (start <= path.size())
+        {
+            size_t end = start;
+            while (end < path.size() && path[end] != '/')
+                ++end;
+            std::string component(path.data() + start, end - start);
+            if (component == "..")
+                THROW_POSIX_EXCEPTION(EINVAL, "Parent references are not supported: " + path);
+            if (!component.empty() && component != ".")
+                components.push_back(std::move(component));
+            start = end + 1;
+        }
+        return components;
+    }
+
+    void fill_stat(MemoryNode& node, struct fuse_stat* st)
+    {
+        memset(st, 0, sizeof(*st));
+        std::lock_guard<std::mutex> lock(node.mutex);
+        st->st_mode = node.type | node.permissions;
+        st->st_ino = node.ino;
+        st->st_nlink = node.nlink;
+        st->st_uid = node.uid;
+        st->st_gid = node.gid;
+        st->st_size = node.is_directory() ? 4096 : static_cast<fuse_off_t>(node.data.size());
+        st->st_blksize = 4096;
+        st->st_blocks = (st->st_size + 511) / 512;
+#ifdef __APPLE__
+        st->st_atimespec = node.atime;
+        st->st_mtimespec = node.mtime;
+        st->st_ctimespec = node.ctime;
+#else
+        st->st_atim = node.atime;
+        st->st_mtim = node.mtime;
+        st->st_ctim = node.ctime;
+#endif
+    }
+
+    // Must be called with the mutex of `node` held
+    void set_times(MemoryNode& node, const fuse_timespec ts[2])
+    {
+        fuse_timespec now;
+        OSService::get_current_time(now);
+        fuse_timespec* targets[2] = {&node.atime, &node.mtime};
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (!ts)
+            {
+                *targets[i] = now;
+                continue;
+            }
+#ifdef UTIME_OMIT
+            if (ts[i].tv_nsec == UTIME_OMIT)
+                continue;
+            if (ts[i].tv_nsec == UTIME_NOW)
+            {
+                *targets[i] = now;
+                continue;
+            }
+#endif
+            *targets[i] = ts[i];
+        }
+        node.ctime = now;
+    }
+
+    class MemoryFileStream : public FileStream
+    {
+    private:
+        std::shared_ptr<MemoryNode> m_node;
+        int m_flags;
+        offset_type m_position;
+        enum
+        {
+            UNLOCKED,
+            SHARED,
+            EXCLUSIVE
+        } m_lock;
+
+        void check_readable() const
+        {
+            if ((m_flags & O_ACCMODE) == O_WRONLY)
+                throwVFSException(EBADF);
+            if (m_node->is_directory())
+                throwVFSException(EISDIR);
+        }
+
+        void check_writable() const
+        {
+            if ((m_flags & O_ACCMODE) == O_RDONLY)
+                throwVFSException(EBADF);
+        }
+
+    public:
+        explicit MemoryFileStream(std::shared_ptr<MemoryNode> node, int flags)
+            : m_node(std::move(node)), m_flags(flags), m_position(0), m_lock(UNLOCKED)
+        {
+        }
+
+        ~MemoryFileStream() { close(); }
+
+        void close() noexcept override { unlock(); }
+
+        void lock(bool exclusive) override
+        {
+            unlock();
+            std::unique_lock<std::mutex> lock(m_node->mutex);
+            m_node->lock_released.wait(lock, [this, exclusive]() {
+                return !m_node->exclusive_lock && (!exclusive || m_node->shared_locks == 0);
+            });
+            if (exclusive)
+                m_node->exclusive_lock = true;
+            else
+                ++m_node->shared_locks;
+            m_lock = exclusive ? EXCLUSIVE : SHARED;
+        }
+
+        void unlock() noexcept override
+        {
+            if (m_lock == UNLOCKED)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(m_node->mutex);
+                if (m_lock == EXCLUSIVE)
+                    m_node->exclusive_lock = false;
+                else
+                    --m_node->shared_locks;
+            }
+            m_lock = UNLOCKED;
+            m_node->lock_released.notify_all();
+        }
+
+        void fsync() override {}
+
+        void fstat(struct fuse_stat* out) override
+        {
+            if (!out)
+                throwVFSException(EFAULT);
+            fill_stat(*m_node, out);
+        }
+
+        length_type read(void* output, offset_type offset, length_type length) override
+        {
+            check_readable();
+            std::lock_guard<std::mutex> lock(m_node->mutex);
+            const std::vector<byte>& data = m_node->data;
+            if (offset >= data.size())
+                return 0;
+            length = std::min<length_type>(length, data.size() - offset);
+            memcpy(output, data.data() + offset, length);
+            add_io_count(IOCounter::UNDERLYING_BYTES_READ, length);
+            return length;
+        }
+
+        length_type sequential_read(void* output, length_type length) override
+        {
+            auto rc = read(output, m_position, length);
+            m_position += rc;
+            return rc;
+        }
+
+        void write(const void* input, offset_type offset, length_type length) override
+        {
+            check_writable();
+            std::lock_guard<std::mutex> lock(m_node->mutex);
+            std::vector<byte>& data = m_node->data;
+            if (m_flags & O_APPEND)
+                offset = data.size();
+            if (offset + length > data.size())
+                data.resize(offset + length);
+            memcpy(data.data() + offset, input, length);
+            m_node->touch_modification();
+            add_io_count(IOCounter::UNDERLYING_BYTES_WRITTEN, length);
+        }
+
+        void sequential_write(const void* input, length_type length) override
+        {
+            write(input, m_position, length);
+            m_position += length;
+        }
+
+        void flush() override {}
+
+        void resize(length_type new_length) override
+        {
+            check_writable();
+            std::lock_guard<std::mutex> lock(m_node->mutex);
+            m_node->data.resize(new_length);
+            m_node->touch_modification();
+        }
+
+        length_type size() const override
+        {
+            std::lock_guard<std::mutex> lock(m_node->mutex);
+            return m_node->data.size();
+        }
+
+        void utimens(const struct fuse_timespec ts[2]) override
+        {
+            std::lock_guard<std::mutex> lock(m_node->mutex);
+            set_times(*m_node, ts);
+        }
+    };
+
+    class MemoryDirectoryTraverser : public DirectoryTraverser
+    {
+    private:
+        struct Entry
+        {
+            std::string name;
+            fuse_mode_t type;
+            fuse_ino_t ino;
+        };
+
+        std::vector<Entry> m_entries;
+        size_t m_index = 0;
+
+    public:
+        // Must be called with the mutex of the service held
+        explicit MemoryDirectoryTraverser(const MemoryNode& dir)
+        {
+            m_entries.push_back(Entry{".", S_IFDIR, dir.ino});
+            m_entries.push_back(Entry{"..", S_IFDIR, 0});
+            for (auto&& pair : dir.children)
+                m_entries.push_back(Entry{pair.first, pair.second->type, pair.second->ino});
+        }
+
+        bool next(std::string* name, struct fuse_stat* st) override
+        {
+            if (m_index >= m_entries.size())
+                return false;
+            const Entry& e = m_entries[m_index++];
+            if (name)
+                *name = e.name;
+            if (st)
+            {
+                st->st_mode = e.type;
+                st->st_ino = e.ino;
+            }
+            return true;
+        }
+
+        void rewind() override { m_index = 0; }
+    };
+}    // namespace
+
+MemoryNode::MemoryNode(fuse_mode_t type, fuse_mode_t permissions, fuse_nlink_t nlink)
+    : type(type)
+    , ino(next_memory_ino.fetch_add(1, std::memory_order_relaxed))
+    , permissions(permissions & 07777)
+    , uid(OSService::getuid())
+    , gid(OSService::getgid())
+    , nlink(nlink)
+{
+    OSService::get_current_time(atime);
+    mtime = atime;
+    ctime = atime;
+}
+
+MemoryOSService::MemoryOSService()
+    : m_root(std::make_shared<MemoryNode>(S_IFDIR, 0755, 2)), m_locked(false)
+{
+}
+
+MemoryOSService::~MemoryOSService() {}
+
+std::shared_ptr<MemoryNode> MemoryOSService::lookup(StringRef path) const
+{
+    std::shared_ptr<MemoryNode> node = m_root;
+    for (const std::string& component : split_path(path))
+    {
+        if (!node->is_directory())
+            THROW_POSIX_EXCEPTION(ENOTDIR, "Resolving " + path);
+        auto it = node->children.find(component);
+        if (it == node->children.end())
+            return nullptr;
+        node = it->second;
+    }
+    return node;
+}
+
+std::shared_ptr<MemoryNode> MemoryOSService::lookup_parent(StringRef path,
+                                                           std::string* name) const
+{
+    auto components = split_path(path);
+    if (components.empty())
+        THROW_POSIX_EXCEPTION(EBUSY, "The root cannot be replaced or removed");
+    std::shared_ptr<MemoryNode> node = m_root;
+    for (size_t i = 0; i + 1 < components.size(); ++i)
+    {
+        if (!node->is_directory())
+            THROW_POSIX_EXCEPTION(ENOTDIR, "Resolving " + path);
+        auto it = node->children.find(components[i]);
+        if (it == node->children.end())
+            THROW_POSIX_EXCEPTION(ENOENT, "Resolving " + path);
+        node = it->second;
+    }
+    if (!node->is_directory())
+        THROW_POSIX_EXCEPTION(ENOTDIR, "Resolving " + path);
+    *name = std::move(components.back());
+    return node;
+}
+
+std::shared_ptr<FileStream>
+MemoryOSService::open_file_stream(StringRef path, int flags, unsigned mode) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    auto parent = lookup_parent(path, &name);
+    auto it = parent->children.find(name);
+    std::shared_ptr<MemoryNode> node;
+    if (it != parent->children.end())
+    {
+        node = it->second;
+        if ((flags & O_CREAT) && (flags & O_EXCL))
+            THROW_POSIX_EXCEPTION(EEXIST, "Opening " + path);
+        if (node->type == S_IFLNK)
+            THROW_POSIX_EXCEPTION(ELOOP, "Opening " + path);
+        if (node->is_directory() && (flags & O_ACCMODE) != O_RDONLY)
+            THROW_POSIX_EXCEPTION(EISDIR, "Opening " + path);
+        if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+        {
+            std::lock_guard<std::mutex> node_lock(node->mutex);
+            node->data.clear();
+            node->touch_modification();
+        }
+    }
+    else
+    {
+        if (!(flags & O_CREAT))
+            THROW_POSIX_EXCEPTION(ENOENT, "Opening " + path);
+        node = std::make_shared<MemoryNode>(S_IFREG, mode, 1);
+        parent->children.emplace(std::move(name), node);
+        std::lock_guard<std::mutex> parent_lock(parent->mutex);
+        parent->touch_modification();
+    }
+    return std::make_shared<MemoryFileStream>(std::move(node), flags);
+}
+
+void MemoryOSService::remove_file(StringRef path) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    auto parent = lookup_parent(path, &name);
+    auto it = parent->children.find(name);
+    if (it == parent->children.end())
+        THROW_POSIX_EXCEPTION(ENOENT, "unlinking " + path);
+    if (it->second->is_directory())
+        THROW_POSIX_EXCEPTION(EISDIR, "unlinking " + path);
+    {
+        std::lock_guard<std::mutex> node_lock(it->second->mutex);
+        --it->second->nlink;
+        it->second->touch_change();
+    }
+    parent->children.erase(it);
+    std::lock_guard<std::mutex> parent_lock(parent->mutex);
+    parent->touch_modification();
+}
+
+void MemoryOSService::remove_directory(StringRef path) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    auto parent = lookup_parent(path, &name);
+    auto it = parent->children.find(name);
+    if (it == parent->children.end())
+        THROW_POSIX_EXCEPTION(ENOENT, "removing directory " + path);
+    if (!it->second->is_directory())
+        THROW_POSIX_EXCEPTION(ENOTDIR, "removing directory " + path);
+    if (!it->second->children.empty())
+        THROW_POSIX_EXCEPTION(ENOTEMPTY, "removing directory " + path);
+    {
+        std::lock_guard<std::mutex> node_lock(it->second->mutex);
+        it->second->nlink = 0;
+    }
+    parent->children.erase(it);
+    std::lock_guard<std::mutex> parent_lock(parent->mutex);
+    --parent->nlink;
+    parent->touch_modification();
+}
+
+void MemoryOSService::rename(StringRef a, StringRef b) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto message = [&]() { return "Renaming from " + a + " to " + b; };
+    std::string source_name, dest_name;
+    auto source_parent = lookup_parent(a, &source_name);
+    auto dest_parent = lookup_parent(b, &dest_name);
+    auto source_it = source_parent->children.find(source_name);
+    if (source_it == source_parent->children.end())
+        THROW_POSIX_EXCEPTION(ENOENT, message());
+    auto node = source_it->second;
+
+    auto source_components = split_path(a), dest_components = split_path(b);
+    if (dest_components.size() > source_components.size()
+        && std::equal(source_components.begin(), source_components.end(), dest_components.begin()))
+        THROW_POSIX_EXCEPTION(EINVAL, message());
+
+    auto dest_it = dest_parent->children.find(dest_name);
+    if (dest_it != dest_parent->children.end())
+    {
+        auto existing = dest_it->second;
+        if (existing == node)
+            return;
+        if (node->is_directory() && !existing->is_directory())
+            THROW_POSIX_EXCEPTION(ENOTDIR, message());
+        if (!node->is_directory() && existing->is_directory())
+            THROW_POSIX_EXCEPTION(EISDIR, message());
+        if (existing->is_directory() && !existing->children.empty())
+            THROW_POSIX_EXCEPTION(ENOTEMPTY, message());
+        {
+            std::lock_guard<std::mutex> existing_lock(existing->mutex);
+            existing->nlink = existing->is_directory() ? 0 : existing->nlink - 1;
+            existing->touch_change();
+        }
+        if (existing->is_directory())
+        {
+            std::lock_guard<std::mutex> parent_lock(dest_parent->mutex);
+            --dest_parent->nlink;
+        }
+        dest_it->second = node;
+    }
+    else
+    {
+        dest_parent->children.emplace(dest_name, node);
+    }
+    source_parent->children.erase(source_name);
+
+    for (const std::shared_ptr<MemoryNode>& parent : {source_parent, dest_parent})
+    {
+        std::lock_guard<std::mutex> parent_lock(parent->mutex);
+        if (node->is_directory())
+            parent->nlink += parent == dest_parent ? 1 : -1;
+        parent->touch_modification();
+    }
+    std::lock_guard<std::mutex> node_lock(node->mutex);
+    node->touch_change();
+}
+
+void MemoryOSService::lock() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_locked)
+        THROW_POSIX_EXCEPTION(EWOULDBLOCK, "Fail to obtain exclusive lock on the memory storage");
+    m_locked = true;
+}
+
+void MemoryOSService::mkdir(StringRef path, unsigned mode) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    auto parent = lookup_parent(path, &name);
+    if (parent->children.count(name))
+        THROW_POSIX_EXCEPTION(EEXIST, "Fail to create directory " + path);
+    parent->children.emplace(std::move(name), std::make_shared<MemoryNode>(S_IFDIR, mode, 2));
+    std::lock_guard<std::mutex> parent_lock(parent->mutex);
+    ++parent->nlink;
+    parent->touch_modification();
+}
+
+void MemoryOSService::statfs(struct fuse_statvfs* fs_info) const
+{
+    memset(fs_info, 0, sizeof(*fs_info));
+    fs_info->f_bsize = 4096;
+    fs_info->f_frsize = 4096;
+    fs_info->f_blocks = 1 << 30;
+    fs_info->f_bfree = 1 << 30;
+    fs_info->f_bavail = 1 << 30;
+    fs_info->f_files = 1 << 30;
+    fs_info->f_ffree = 1 << 30;
+    fs_info->f_favail = 1 << 30;
+    fs_info->f_namemax = 255;
+}
+
+void MemoryOSService::utimens(StringRef path, const fuse_timespec ts[2]) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(path);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, "utimens " + path);
+    std::lock_guard<std::mutex> node_lock(node->mutex);
+    set_times(*node, ts);
+}
+
+bool MemoryOSService::stat(StringRef path, struct fuse_stat* stat) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(path);
+    if (!node)
+        return false;
+    fill_stat(*node, stat);
+    return true;
+}
+
+void MemoryOSService::rename_at(StringRef a, const OSService& dest_dir, StringRef b) const
+{
+    if (&dest_dir != this)
+        THROW_POSIX_EXCEPTION(EXDEV, "Renaming from " + a + " to " + b);
+    rename(a, b);
+}
+
+void MemoryOSService::link_at(StringRef source, const OSService& dest_dir, StringRef dest) const
+{
+    if (&dest_dir != this)
+        THROW_POSIX_EXCEPTION(EXDEV, "link src=" + source + " dest=" + dest);
+    link(source, dest);
+}
+
+void MemoryOSService::link(StringRef source, StringRef dest) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto message = [&]() { return "link src=" + source + " dest=" + dest; };
+    auto node = lookup(source);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, message());
+    if (node->is_directory())
+        THROW_POSIX_EXCEPTION(EPERM, message());
+    std::string name;
+    auto parent = lookup_parent(dest, &name);
+    if (parent->children.count(name))
+        THROW_POSIX_EXCEPTION(EEXIST, message());
+    parent->children.emplace(std::move(name), node);
+    {
+        std::lock_guard<std::mutex> node_lock(node->mutex);
+        ++node->nlink;
+        node->touch_change();
+    }
+    std::lock_guard<std::mutex> parent_lock(parent->mutex);
+    parent->touch_modification();
+}
+
+void MemoryOSService::chmod(StringRef path, fuse_mode_t mode) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(path);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, "chmod " + path);
+    std::lock_guard<std::mutex> node_lock(node->mutex);
+    node->permissions = mode & 07777;
+    node->touch_change();
+}
+
+void MemoryOSService::chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(path);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, "chown " + path);
+    std::lock_guard<std::mutex> node_lock(node->mutex);
+    if (uid != static_cast<fuse_uid_t>(-1))
+        node->uid = uid;
+    if (gid != static_cast<fuse_gid_t>(-1))
+        node->gid = gid;
+    node->touch_change();
+}
+
+ssize_t MemoryOSService::readlink(StringRef path, char* output, size_t size) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(path);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, "readlink " + path);
+    if (node->type != S_IFLNK)
+        THROW_POSIX_EXCEPTION(EINVAL, "readlink " + path);
+    std::lock_guard<std::mutex> node_lock(node->mutex);
+    size = std::min(size, node->data.size());
+    memcpy(output, node->data.data(), size);
+    return static_cast<ssize_t>(size);
+}
+
+void MemoryOSService::symlink(StringRef to, StringRef from) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    auto parent = lookup_parent(from, &name);
+    if (parent->children.count(name))
+        THROW_POSIX_EXCEPTION(EEXIST, "symlink to=" + to + " and from=" + from);
+    auto node = std::make_shared<MemoryNode>(S_IFLNK, 0777, 1);
+    node->data.assign(to.data(), to.data() + to.size());
+    parent->children.emplace(std::move(name), std::move(node));
+    std::lock_guard<std::mutex> parent_lock(parent->mutex);
+    parent->touch_modification();
+}
+
+std::unique_ptr<DirectoryTraverser> MemoryOSService::create_traverser(StringRef dir) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto node = lookup(dir);
+    if (!node)
+        THROW_POSIX_EXCEPTION(ENOENT, "opendir " + dir);
+    if (!node->is_directory())
+        THROW_POSIX_EXCEPTION(ENOTDIR, "opendir " + dir);
+    return securefs::make_unique<MemoryDirectoryTraverser>(*node);
+}
+
+StorageThrottle::StorageThrottle(std::chrono::microseconds latency, double bytes_per_second)
+    : m_latency(latency), m_bytes_per_second(bytes_per_second), m_link_free(Clock::now())
+{
+}
+
+void StorageThrottle::delay(length_type bytes)
+{
+    if (m_latency.count() <= 0 && m_bytes_per_second <= 0)
+        return;
+    auto done = Clock::now() + m_latency;
+    if (m_bytes_per_second > 0 && bytes > 0)
+    {
+        auto transfer = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(bytes / m_bytes_per_second));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        done = std::max(done, m_link_free) + transfer;
+        m_link_free = done;
+    }
+    std::this_thread::sleep_until(done);
+}
+
+namespace
+{
+    class ThrottledFileStream : public FileStream
+    {
+    private:
+        std::shared_ptr<FileStream> m_stream;
+        std::shared_ptr<StorageThrottle> m_throttle;
+
+    public:
+        explicit ThrottledFileStream(std::shared_ptr<FileStream> stream,
+                                     std::shared_ptr<StorageThrottle> throttle)
+            : m_stream(std::move(stream)), m_throttle(std::move(throttle))
+        {
+        }
+
+        length_type read(void* output, offset_type offset, length_type length) override
+        {
+            m_throttle->delay(length);
+            return m_stream->read(output, offset, length);
+        }
+
+        void write(const void* input, offset_type offset, length_type length) override
+        {
+            m_throttle->delay(length);
+            m_stream->write(input, offset, length);
+        }
+
+        length_type sequential_read(void* output, length_type length) override
+        {
+            m_throttle->delay(length);
+            return m_stream->sequential_read(output, length);
+        }
+
+        void sequential_write(const void* input, length_type length) override
+        {
+            m_throttle->delay(length);
+            m_stream->sequential_write(input, length);
+        }
+
+        length_type size() const override
+        {
+            m_throttle->delay(0);
+            return m_stream->size();
+        }
+
+        void flush() override { m_stream->flush(); }
+
+        void resize(length_type new_length) override
+        {
+            m_throttle->delay(0);
+            m_stream->resize(new_length);
+        }
+
+        bool is_sparse() const noexcept override { return m_stream->is_sparse(); }
+
+        length_type optimal_block_size() const noexcept override
+        {
+            return m_stream->optimal_block_size();
+        }
+
+        length_type hole_length(offset_type offset) override
+        {
+            m_throttle->delay(0);
+            return m_stream->hole_length(offset);
+        }
+
+        bool punch_hole(offset_type offset, length_type length) override
+        {
+            m_throttle->delay(0);
+            return m_stream->punch_hole(offset, length);
+        }
+
+        void fsync() override
+        {
+            m_throttle->delay(0);
+            m_stream->fsync();
+        }
+
+        void utimens(const struct fuse_timespec ts[2]) override
+        {
+            m_throttle->delay(0);
+            m_stream->utimens(ts);
+        }
+
+        void fstat(struct fuse_stat* st) override
+        {
+            m_throttle->delay(0);
+            m_stream->fstat(st);
+        }
+
+        void close() noexcept override { m_stream->close(); }
+
+        ssize_t listxattr(char* buffer, size_t size) override
+        {
+            m_throttle->delay(0);
+            return m_stream->listxattr(buffer, size);
+        }
+
+        ssize_t getxattr(const char* name, void* value, size_t size) override
+        {
+            m_throttle->delay(0);
+            return m_stream->getxattr(name, value, size);
+        }
+
+        void setxattr(const char* name, void* value, size_t size, int flags) override
+        {
+            m_throttle->delay(0);
+            m_stream->setxattr(name, value, size, flags);
+        }
+
+        void removexattr(const char* name) override
+        {
+            m_throttle->delay(0);
+            m_stream->removexattr(name);
+        }
+
+        void lock(bool exclusive) override { m_stream->lock(exclusive); }
+
+        void unlock() noexcept override { m_stream->unlock(); }
+    };
+}    // namespace
+
+ThrottledOSService::ThrottledOSService(std::shared_ptr<const OSService> inner,
+                                       std::shared_ptr<StorageThrottle> throttle)
+    : m_inner(std::move(inner)), m_throttle(std::move(throttle))
+{
+}
+
+std::shared_ptr<FileStream>
+ThrottledOSService::open_file_stream(StringRef path, int flags, unsigned mode) const
+{
+    m_throttle->delay(0);
+    return std::make_shared<ThrottledFileStream>(m_inner->open_file_stream(path, flags, mode),
+                                                 m_throttle);
+}
+
+void ThrottledOSService::remove_file(StringRef path) const
+{
+    m_throttle->delay(0);
+    m_inner->remove_file(path);
+}
+
+void ThrottledOSService::remove_directory(StringRef path) const
+{
+    m_throttle->delay(0);
+    m_inner->remove_directory(path);
+}
+
+void ThrottledOSService::rename(StringRef a, StringRef b) const
+{
+    m_throttle->delay(0);
+    m_inner->rename(a, b);
+}
+
+void ThrottledOSService::rename_at(StringRef a, const OSService& dest_dir, StringRef b) const
+{
+    m_throttle->delay(0);
+    auto throttled = dynamic_cast<const ThrottledOSService*>(&dest_dir);
+    m_inner->rename_at(a, throttled ? *throttled->m_inner : dest_dir, b);
+}
+
+void ThrottledOSService::link_at(StringRef source, const OSService& dest_dir, StringRef dest) const
+{
+    m_throttle->delay(0);
+    auto throttled = dynamic_cast<const ThrottledOSService*>(&dest_dir);
+    m_inner->link_at(source, throttled ? *throttled->m_inner : dest_dir, dest);
+}
+
+void ThrottledOSService::lock() const { m_inner->lock(); }
+
+void ThrottledOSService::mkdir(StringRef path, unsigned mode) const
+{
+    m_throttle->delay(0);
+    m_inner->mkdir(path, mode);
+}
+
+void ThrottledOSService::statfs(struct fuse_statvfs* fs_info) const
+{
+    m_throttle->delay(0);
+    m_inner->statfs(fs_info);
+}
+
+void ThrottledOSService::utimens(StringRef path, const fuse_timespec ts[2]) const
+{
+    m_throttle->delay(0);
+    m_inner->utimens(path, ts);
+}
+
+bool ThrottledOSService::stat(StringRef path, struct fuse_stat* stat) const
+{
+    m_throttle->delay(0);
+    return m_inner->stat(path, stat);
+}
+
+void ThrottledOSService::link(StringRef source, StringRef dest) const
+{
+    m_throttle->delay(0);
+    m_inner->link(source, dest);
+}
+
+void ThrottledOSService::chmod(StringRef path, fuse_mode_t mode) const
+{
+    m_throttle->delay(0);
+    m_inner->chmod(path, mode);
+}
+
+void ThrottledOSService::chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const
+{
+    m_throttle->delay(0);
+    m_inner->chown(path, uid, gid);
+}
+
+ssize_t ThrottledOSService::readlink(StringRef path, char* output, size_t size) const
+{
+    m_throttle->delay(0);
+    return m_inner->readlink(path, output, size);
+}
+
+void ThrottledOSService::symlink(StringRef source, StringRef dest) const
+{
+    m_throttle->delay(0);
+    m_inner->symlink(source, dest);
+}
+
+std::unique_ptr<DirectoryTraverser> ThrottledOSService::create_traverser(StringRef dir) const
+{
+    m_throttle->delay(0);
+    return m_inner->create_traverser(dir);
+}
+
+std::shared_ptr<const OSService> ThrottledOSService::open_directory(StringRef path) const
+{
+    m_throttle->delay(0);
+    auto dir = m_inner->open_directory(path);
+    if (!dir)
+        return {};
+    return std::make_shared<ThrottledOSService>(std::move(dir), m_throttle);
+}
+
+#ifdef __APPLE__
+ssize_t ThrottledOSService::listxattr(const char* path, char* buf, size_t size) const noexcept
+{
+    m_throttle->delay(0);
+    return m_inner->listxattr(path, buf, size);
+}
+
+ssize_t ThrottledOSService::getxattr(const char* path,
+                                     const char* name,
+                                     void* buf,
+                                     size_t size) const noexcept
+{
+    m_throttle->delay(0);
+    return m_inner->getxattr(path, name, buf, size);
+}
+
+int ThrottledOSService::setxattr(
+    const char* path, const char* name, void* buf, size_t size, int flags) const noexcept
+{
+    m_throttle->delay(0);
+    return m_inner->setxattr(path, name, buf, size, flags);
+}
+
+int ThrottledOSService::removexattr(const char* path, const char* name) const noexcept
+{
+    m_throttle->delay(0);
+    return m_inner->removexattr(path, name);
+}
+#endif
+
+std::shared_ptr<OSService> open_storage(const std::string& directory,
+                                        const StorageOptions& options)
+{
+    std::shared_ptr<OSService> storage;
+    if (options.in_memory)
+        storage = std::make_shared<MemoryOSService>();
+    else
+        storage = std::make_shared<OSService>(directory);
+    if (options.latency_us > 0 || options.megabytes_per_second > 0)
+    {
+        storage = std::make_shared<ThrottledOSService>(
+            storage,
+            std::make_shared<StorageThrottle>(std::chrono::microseconds(options.latency_us),
+                                              options.megabytes_per_second * 1e6));
+    }
+    return storage;
+}
+}    // namespace securefs
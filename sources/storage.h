@@ -0,0 +1,169 @@
+#pragma once
+
+#include "myutils.h"
+#include "platform.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace securefs
+{
+namespace internal
+{
+    struct MemoryNode;
+}
+
+/**
+ * Storage that lives only in memory, so that benchmarks measure the CPU cost of securefs apart
+ * from any disk. It follows POSIX semantics closely enough for both formats, but symbolic links are
+ * never followed, so opening one fails with ELOOP, and there are no extended attributes.
+ */
+class MemoryOSService : public OSService
+{
+    DISABLE_COPY_MOVE(MemoryOSService)
+
+private:
+    mutable std::mutex m_mutex;    // Of the tree structure, i.e. the children of every directory
+    std::shared_ptr<internal::MemoryNode> m_root;
+    mutable bool m_locked;
+
+    // The following must be called with `m_mutex` held
+    std::shared_ptr<internal::MemoryNode> lookup(StringRef path) const;
+    std::shared_ptr<internal::MemoryNode> lookup_parent(StringRef path, std::string* name) const;
+
+public:
+    MemoryOSService();
+    ~MemoryOSService();
+
+    std::shared_ptr<FileStream>
+    open_file_stream(StringRef path, int flags, unsigned mode) const override;
+    bool enable_mapped_reads() override { return false; }
+    bool enable_io_uring(unsigned) override { return false; }
+    void remove_file(StringRef path) const override;
+    void remove_directory(StringRef path) const override;
+    void rename(StringRef a, StringRef b) const override;
+    // Only within this storage, as it has no other directories to be relative to
+    void rename_at(StringRef a, const OSService& dest_dir, StringRef b) const override;
+    void link_at(StringRef source, const OSService& dest_dir, StringRef dest) const override;
+    void lock() const override;
+    void mkdir(StringRef path, unsigned mode) const override;
+    void statfs(struct fuse_statvfs*) const override;
+    void utimens(StringRef path, const fuse_timespec ts[2]) const override;
+    bool stat(StringRef path, struct fuse_stat* stat) const override;
+    void link(StringRef source, StringRef dest) const override;
+    void chmod(StringRef path, fuse_mode_t mode) const override;
+    void chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const override;
+    ssize_t readlink(StringRef path, char* output, size_t size) const override;
+    void symlink(StringRef source, StringRef dest) const override;
+    std::unique_ptr<DirectoryTraverser> create_traverser(StringRef dir) const override;
+    // Directories are not opened by handle, so callers fall back to full paths
+    std::shared_ptr<const OSService> open_directory(StringRef) const override { return {}; }
+
+#ifdef __APPLE__
+    ssize_t listxattr(const char*, char*, size_t) const noexcept override { return -ENOTSUP; }
+    ssize_t getxattr(const char*, const char*, void*, size_t) const noexcept override
+    {
+        return -ENOTSUP;
+    }
+    int setxattr(const char*, const char*, void*, size_t, int) const noexcept override
+    {
+        return -ENOTSUP;
+    }
+    int removexattr(const char*, const char*) const noexcept override { return -ENOTSUP; }
+#endif
+};
+
+/**
+ * The delays that a `ThrottledOSService` adds. Every call waits for `latency`, and then the data
+ * it reads or writes occupies a link of `bytes_per_second` shared by all the calls, so that
+ * concurrent transfers queue up behind one another.
+ */
+class StorageThrottle
+{
+    DISABLE_COPY_MOVE(StorageThrottle)
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::chrono::microseconds m_latency;
+    double m_bytes_per_second;    // Zero for unlimited
+    std::mutex m_mutex;
+    Clock::time_point m_link_free;
+
+public:
+    explicit StorageThrottle(std::chrono::microseconds latency, double bytes_per_second);
+
+    // Blocks the caller for as long as a call transferring `bytes` bytes takes
+    void delay(length_type bytes);
+};
+
+/**
+ * Forwards to another storage after the delays of a `StorageThrottle`, to emulate network or
+ * cloud-synced directories on a local disk. Closing, locking and flushing streams are not delayed,
+ * since they stay local on such storage, and the streams are never memory mapped.
+ */
+class ThrottledOSService : public OSService
+{
+    DISABLE_COPY_MOVE(ThrottledOSService)
+
+private:
+    std::shared_ptr<const OSService> m_inner;
+    std::shared_ptr<StorageThrottle> m_throttle;
+
+public:
+    explicit ThrottledOSService(std::shared_ptr<const OSService> inner,
+                                std::shared_ptr<StorageThrottle> throttle);
+
+    std::shared_ptr<FileStream>
+    open_file_stream(StringRef path, int flags, unsigned mode) const override;
+    // Configure the inner storage before wrapping it instead
+    bool enable_mapped_reads() override { return false; }
+    bool enable_io_uring(unsigned) override { return false; }
+    void remove_file(StringRef path) const override;
+    void remove_directory(StringRef path) const override;
+    void rename(StringRef a, StringRef b) const override;
+    // `dest_dir` may be throttled as well, in which case its inner storage is the destination
+    void rename_at(StringRef a, const OSService& dest_dir, StringRef b) const override;
+    void link_at(StringRef source, const OSService& dest_dir, StringRef dest) const override;
+    void lock() const override;
+    void mkdir(StringRef path, unsigned mode) const override;
+    void statfs(struct fuse_statvfs*) const override;
+    void utimens(StringRef path, const fuse_timespec ts[2]) const override;
+    bool stat(StringRef path, struct fuse_stat* stat) const override;
+    void link(StringRef source, StringRef dest) const override;
+    void chmod(StringRef path, fuse_mode_t mode) const override;
+    void chown(StringRef path, fuse_uid_t uid, fuse_gid_t gid) const override;
+    ssize_t readlink(StringRef path, char* output, size_t size) const override;
+    void symlink(StringRef source, StringRef dest) const override;
+    std::unique_ptr<DirectoryTraverser> create_traverser(StringRef dir) const override;
+    std::shared_ptr<const OSService> open_directory(StringRef path) const override;
+
+#ifdef __APPLE__
+    ssize_t listxattr(const char* path, char* buf, size_t size) const noexcept override;
+    ssize_t
+    getxattr(const char* path, const char* name, void* buf, size_t size) const noexcept override;
+    int setxattr(const char* path, const char* name, void* buf, size_t size, int flags) const
+        noexcept override;
+    int removexattr(const char* path, const char* name) const noexcept override;
+#endif
+};
+
+/**
+ * Where benchmarks keep their files. The storage is the disk by default.
+ */
+struct StorageOptions
+{
+    bool in_memory = false;
+    unsigned latency_us = 0;
+    double megabytes_per_second = 0;    // Zero for unlimited
+};
+
+/**
+ * Returns the storage rooted at `directory`, or a fresh in-memory storage if `options.in_memory`,
+ * throttled if any delay is configured.
+ */
+std::shared_ptr<OSService> open_storage(const std::string& directory,
+                                        const StorageOptions& options);
+}    // namespace securefs
@@ -1,5 +1,8 @@
 #include "streams.h"
+#include "cipher_cache.h"
 #include "crypto.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <array>
@@ -44,7 +47,7 @@ namespace internal
         key_type m_key;
         id_type m_id;
         std::shared_ptr<StreamBase> m_stream;
-        bool is_dirty;
+        bool is_dirty, m_check;
 
         typedef CryptoPP::HMAC<CryptoPP::SHA256> hmac_calculator_type;
 
@@ -67,6 +70,7 @@ namespace internal
                 calculator.Update(buffer.data(), rc);
                 off += rc;
             }
+            add_io_count(IOCounter::META_BYTES_REHASHED, off - hmac_length);
         }
 
     public:
@@ -74,7 +78,7 @@ namespace internal
                             const id_type& id_,
                             std::shared_ptr<StreamBase> stream,
                             bool check = true)
-            : m_key(key_), m_id(id_), m_stream(std::move(stream)), is_dirty(false)
+            : m_key(key_), m_id(id_), m_stream(std::move(stream)), is_dirty(false), m_check(check)
         {
             if (!m_stream)
                 throwVFSException(EFAULT);
@@ -107,10 +111,13 @@ namespace internal
             }
         }
 
+        // Without checking, the MAC is not maintained either, as recomputing it means reading back
+        // the whole stream. Streams modified that way fail verification when later checked.
         void flush() override
         {
-            if (!is_dirty)
+            if (!is_dirty || !m_check)
                 return;
+            ScopedSpan span("HMACStream::flush");
             hmac_calculator_type calculator;
             calculator.SetKey(key().data(), key().size());
             run_mac(calculator);
@@ -160,6 +167,12 @@ std::shared_ptr<StreamBase> make_stream_hmac(const key_type& key_,
 
 length_type CryptStream::read_block(offset_type block_number, void* output)
 {
+    length_type mapped_length = m_block_size;
+    if (auto mapped = m_stream->mapped_view(block_number * m_block_size, mapped_length))
+    {
+        decrypt(block_number, mapped, output, mapped_length);
+        return mapped_length;
+    }
     auto rc = m_stream->read(output, block_number * m_block_size, m_block_size);
     if (rc == 0)
         return 0;
@@ -197,6 +210,87 @@ void CryptStream::write_block(offset_type block_number, const void* input, lengt
     m_stream->write(buffer.get(), block_number * m_block_size, length);
 }
 
+length_type
+CryptStream::read_blocks(offset_type start_block, length_type num_blocks, void* output)
+{
+    // Blocks lying wholly in a hole of a sparse underlying stream are zeros, so skip reading them.
+    // Only the start is probed, so that a read costs at most one extra query.
+    length_type hole_blocks = 0;
+    if (num_blocks > 1 && m_stream->is_sparse())
+        hole_blocks = std::min<length_type>(
+            num_blocks, m_stream->hole_length(start_block * m_block_size) / m_block_size);
+    if (hole_blocks > 0)
+    {
+        auto out = static_cast<byte*>(output);
+        memset(out, 0, hole_blocks * m_block_size);
+        // Still decrypt so that the blocks are checked to be recorded as sparse
+        for (length_type i = 0; i < hole_blocks; ++i)
+            decrypt(start_block + i,
+                    out + i * m_block_size,
+                    out + i * m_block_size,
+                    m_block_size);
+        start_block += hole_blocks;
+        num_blocks -= hole_blocks;
+        output = out + hole_blocks * m_block_size;
+        if (num_blocks == 0)
+            return hole_blocks * m_block_size;
+    }
+
+    length_type rc = num_blocks * m_block_size;
+    const byte* input = m_stream->mapped_view(start_block * m_block_size, rc);
+    if (!input)
+    {
+        rc = m_stream->read(output, start_block * m_block_size, rc);
+        input = static_cast<const byte*>(output);
+    }
+    for (length_type i = 0; i * m_block_size < rc; ++i)
+    {
+        auto offset = i * m_block_size;
+        decrypt(start_block + i,
+                input + offset,
+                static_cast<byte*>(output) + offset,
+                std::min(m_block_size, rc - offset));
+    }
+    return hole_blocks * m_block_size + rc;
+}
+
+void CryptStream::write_blocks(offset_type start_block, length_type num_blocks, const void* input)
+{
+    auto buffer = make_unique_array<byte>(num_blocks * m_block_size);
+    for (length_type i = 0; i < num_blocks; ++i)
+    {
+        auto offset = i * m_block_size;
+        encrypt(start_block + i,
+                static_cast<const byte*>(input) + offset,
+                buffer.get() + offset,
+                m_block_size);
+    }
+    m_stream->write(buffer.get(), start_block * m_block_size, num_blocks * m_block_size);
+}
+
+length_type
+BlockBasedStream::read_blocks(offset_type start_block, length_type num_blocks, void* output)
+{
+    length_type total = 0;
+    for (length_type i = 0; i < num_blocks; ++i)
+    {
+        auto rc = read_block(start_block + i, static_cast<byte*>(output) + total);
+        total += rc;
+        if (rc < m_block_size)
+            break;
+    }
+    return total;
+}
+
+void BlockBasedStream::write_blocks(offset_type start_block,
+                                    length_type num_blocks,
+                                    const void* input)
+{
+    for (length_type i = 0; i < num_blocks; ++i)
+        write_block(
+            start_block + i, static_cast<const byte*>(input) + i * m_block_size, m_block_size);
+}
+
 void BlockBasedStream::read_then_write_block(offset_type block_number,
                                              const void* input,
                                              offset_type begin,
@@ -211,18 +305,33 @@ void BlockBasedStream::read_then_write_block(offset_type block_number,
 
     CryptoPP::AlignedSecByteBlock buffer(m_block_size);
     auto rc = read_block(block_number, buffer.data());
+    if (rc > 0)
+        add_io_count(IOCounter::BLOCKS_REWRITTEN, 1);
     memcpy(buffer.data() + begin, input, end - begin);
     write_block(block_number, buffer.data(), std::max<length_type>(rc, end));
 }
 
 length_type BlockBasedStream::read(void* output, offset_type offset, length_type length)
 {
+    add_io_count(IOCounter::LOGICAL_BYTES_READ, length);
     length_type total = 0;
 
     while (length > 0)
     {
         auto block_num = offset / m_block_size;
         auto start_of_block = block_num * m_block_size;
+        if (offset == start_of_block && length >= m_block_size)
+        {
+            auto num_blocks = length / m_block_size;
+            auto rc = read_blocks(block_num, num_blocks, output);
+            total += rc;
+            if (rc < num_blocks * m_block_size)
+                return total;
+            output = static_cast<byte*>(output) + rc;
+            offset += rc;
+            length -= rc;
+            continue;
+        }
         auto begin = offset - start_of_block;
         auto end = std::min<offset_type>(m_block_size, offset + length - start_of_block);
         auto rc = read_block(block_num, output, begin, end);
@@ -243,6 +352,7 @@ void BlockBasedStream::write(const void* input, offset_type offset, length_type
     if (offset > current_size)
         unchecked_resize(current_size, offset);
 
+    add_io_count(IOCounter::LOGICAL_BYTES_WRITTEN, length);
     unchecked_write(input, offset, length);
 }
 
@@ -252,6 +362,15 @@ void BlockBasedStream::unchecked_write(const void* input, offset_type offset, le
     {
         auto block_num = offset / m_block_size;
         auto start_of_block = block_num * m_block_size;
+        if (offset == start_of_block && length >= m_block_size)
+        {
+            auto num_blocks = length / m_block_size;
+            write_blocks(block_num, num_blocks, input);
+            input = static_cast<const byte*>(input) + num_blocks * m_block_size;
+            offset += num_blocks * m_block_size;
+            length -= num_blocks * m_block_size;
+            continue;
+        }
         auto begin = offset - start_of_block;
         auto end = std::min<offset_type>(m_block_size, offset + length - start_of_block);
         read_then_write_block(block_num, input, begin, end);
@@ -294,6 +413,7 @@ void BlockBasedStream::unchecked_resize(length_type current_size, length_type ne
             memset(buffer.data(), 0, buffer.size());
             (void)read_block(block_num, buffer.data());
             write_block(block_num, buffer.data(), residue);
+            add_io_count(IOCounter::BLOCKS_REWRITTEN, 1);
         }
     }
     else
@@ -312,7 +432,7 @@ void BlockBasedStream::unchecked_resize(length_type current_size, length_type ne
 
 namespace internal
 {
-    class AESGCMCryptStream final : public CryptStream, public HeaderBase
+    class AEADCryptStream final : public CryptStream, public HeaderBase
     {
     public:
         int get_iv_size() const noexcept { return m_iv_size; }
@@ -331,8 +451,7 @@ namespace internal
         static const int64_t max_block_number = 1 << 30;
 
     private:
-        CryptoPP::GCM<CryptoPP::AES>::Encryption m_enc;
-        CryptoPP::GCM<CryptoPP::AES>::Decryption m_dec;
+        std::shared_ptr<AEADContext> m_context;
         HMACStream m_metastream;
         id_type m_id;
         unsigned m_iv_size, m_header_size;
@@ -354,26 +473,25 @@ namespace internal
         const id_type& id() const noexcept { return m_id; }
 
     public:
-        explicit AESGCMCryptStream(std::shared_ptr<StreamBase> data_stream,
-                                   std::shared_ptr<StreamBase> meta_stream,
-                                   const key_type& data_key,
-                                   const key_type& meta_key,
-                                   const id_type& id_,
-                                   bool check,
-                                   unsigned block_size,
-                                   unsigned iv_size,
-                                   unsigned header_size)
+        explicit AEADCryptStream(std::shared_ptr<StreamBase> data_stream,
+                                 std::shared_ptr<StreamBase> meta_stream,
+                                 std::shared_ptr<AEADContext> data_context,
+                                 const key_type& meta_key,
+                                 const id_type& id_,
+                                 bool check,
+                                 unsigned block_size,
+                                 unsigned iv_size,
+                                 unsigned header_size)
             : CryptStream(data_stream, block_size)
+            , m_context(std::move(data_context))
             , m_metastream(meta_key, id_, meta_stream, check)
             , m_id(id_)
             , m_iv_size(iv_size)
             , m_header_size(header_size)
             , m_check(check)
         {
-            const byte null_iv[12] = {};
-            m_enc.SetKeyWithIV(data_key.data(), data_key.size(), null_iv, array_length(null_iv));
-            m_dec.SetKeyWithIV(data_key.data(), data_key.size(), null_iv, array_length(null_iv));
-            warn_if_key_not_random(data_key, __FILE__, __LINE__);
+            if (!m_context)
+                throwInvalidArgumentException("Null cipher context");
             warn_if_key_not_random(meta_key, __FILE__, __LINE__);
         }
 
@@ -393,17 +511,19 @@ namespace internal
 
             do
             {
-                generate_random(iv, get_iv_size());
+                generate_iv(iv, get_iv_size());
             } while (is_all_zeros(iv, get_iv_size()));    // Null IVs are markers for sparse blocks
-            m_enc.EncryptAndAuthenticate(static_cast<byte*>(output),
-                                         mac,
-                                         get_mac_size(),
-                                         iv,
-                                         get_iv_size(),
-                                         id().data(),
-                                         id().size(),
-                                         static_cast<const byte*>(input),
-                                         length);
+            add_io_count(IOCounter::BYTES_ENCRYPTED, length);
+            ScopedSpan span("encrypt_block");
+            m_context->encrypt(static_cast<byte*>(output),
+                               mac,
+                               get_mac_size(),
+                               iv,
+                               get_iv_size(),
+                               id().data(),
+                               id().size(),
+                               static_cast<const byte*>(input),
+                               length);
             auto pos = meta_position_for_iv(block_number);
             m_metastream.write(buffer.get(), pos, get_meta_size());
         }
@@ -430,15 +550,24 @@ namespace internal
                 memset(output, 0, length);
                 return;
             }
-            bool success = m_dec.DecryptAndVerify(static_cast<byte*>(output),
-                                                  mac,
-                                                  get_mac_size(),
-                                                  iv,
-                                                  get_iv_size(),
-                                                  id().data(),
-                                                  id().size(),
-                                                  static_cast<const byte*>(input),
-                                                  length);
+            add_io_count(IOCounter::BYTES_DECRYPTED, length);
+            ScopedSpan span("decrypt_block");
+            if (!m_check
+                && m_context->decrypt_unverified(static_cast<byte*>(output),
+                                                 iv,
+                                                 get_iv_size(),
+                                                 static_cast<const byte*>(input),
+                                                 length))
+                return;
+            bool success = m_context->decrypt(static_cast<byte*>(output),
+                                              mac,
+                                              get_mac_size(),
+                                              iv,
+                                              get_iv_size(),
+                                              id().data(),
+                                              id().size(),
+                                              static_cast<const byte*>(input),
+                                              length);
             if (m_check && !success)
                 throw MessageVerificationException(id(), block_number * m_block_size);
         }
@@ -475,15 +604,15 @@ namespace internal
             byte* iv = buffer.get();
             byte* mac = iv + get_iv_size();
             byte* ciphertext = mac + get_mac_size();
-            m_dec.DecryptAndVerify(static_cast<byte*>(output),
-                                   mac,
-                                   get_mac_size(),
-                                   iv,
-                                   get_iv_size(),
-                                   id().data(),
-                                   id().size(),
-                                   ciphertext,
-                                   get_header_size());
+            m_context->decrypt(static_cast<byte*>(output),
+                               mac,
+                               get_mac_size(),
+                               iv,
+                               get_iv_size(),
+                               id().data(),
+                               id().size(),
+                               ciphertext,
+                               get_header_size());
             return get_header_size();
         }
 
@@ -493,17 +622,17 @@ namespace internal
             byte* iv = buffer.get();
             byte* mac = iv + get_iv_size();
             byte* ciphertext = mac + get_mac_size();
-            generate_random(iv, get_iv_size());
-
-            m_enc.EncryptAndAuthenticate(ciphertext,
-                                         mac,
-                                         get_mac_size(),
-                                         iv,
-                                         get_iv_size(),
-                                         id().data(),
-                                         id().size(),
-                                         static_cast<const byte*>(input),
-                                         get_header_size());
+            generate_iv(iv, get_iv_size());
+
+            m_context->encrypt(ciphertext,
+                               mac,
+                               get_mac_size(),
+                               iv,
+                               get_iv_size(),
+                               id().data(),
+                               id().size(),
+                               static_cast<const byte*>(input),
+                               get_header_size());
             m_metastream.write(buffer.get(), 0, get_encrypted_header_size());
         }
 
@@ -542,25 +671,51 @@ namespace internal
 }    // namespace internal
 
 std::pair<std::shared_ptr<CryptStream>, std::shared_ptr<HeaderBase>>
-make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
-                         std::shared_ptr<StreamBase> meta_stream,
-                         const key_type& data_key,
-                         const key_type& meta_key,
-                         const id_type& id_,
-                         bool check,
-                         unsigned block_size,
-                         unsigned iv_size,
-                         unsigned header_size)
+make_cryptstream_aead(std::shared_ptr<StreamBase> data_stream,
+                      std::shared_ptr<StreamBase> meta_stream,
+                      const key_type& data_key,
+                      const key_type& meta_key,
+                      const id_type& id_,
+                      bool check,
+                      unsigned block_size,
+                      unsigned iv_size,
+                      unsigned header_size,
+                      AEADAlgorithm algorithm)
+{
+    warn_if_key_not_random(data_key, __FILE__, __LINE__);
+    auto data_context = make_aead_context(algorithm);
+    data_context->set_key(data_key.data(), data_key.size());
+    return make_cryptstream_aead(std::move(data_stream),
+                                 std::move(meta_stream),
+                                 std::move(data_context),
+                                 meta_key,
+                                 id_,
+                                 check,
+                                 block_size,
+                                 iv_size,
+                                 header_size);
+}
+
+std::pair<std::shared_ptr<CryptStream>, std::shared_ptr<HeaderBase>>
+make_cryptstream_aead(std::shared_ptr<StreamBase> data_stream,
+                      std::shared_ptr<StreamBase> meta_stream,
+                      std::shared_ptr<AEADContext> data_context,
+                      const key_type& meta_key,
+                      const id_type& id_,
+                      bool check,
+                      unsigned block_size,
+                      unsigned iv_size,
+                      unsigned header_size)
 {
-    auto stream = std::make_shared<internal::AESGCMCryptStream>(std::move(data_stream),
-                                                                std::move(meta_stream),
-                                                                data_key,
-                                                                meta_key,
-                                                                id_,
-                                                                check,
-                                                                block_size,
-                                                                iv_size,
-                                                                header_size);
+    auto stream = std::make_shared<internal::AEADCryptStream>(std::move(data_stream),
+                                                              std::move(meta_stream),
+                                                              std::move(data_context),
+                                                              meta_key,
+                                                              id_,
+                                                              check,
+                                                              block_size,
+                                                              iv_size,
+                                                              header_size);
     return {stream, stream};
 }
 }    // namespace securefs
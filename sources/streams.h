@@ -1,4 +1,5 @@
 #pragma once
+#include "aead.h"
 #include "exceptions.h"
 #include "myutils.h"
 
@@ -50,6 +51,41 @@ public:
      * Certain streams are more efficient when reads and writes are aligned to blocks
      */
     virtual length_type optimal_block_size() const noexcept { return 1; }
+
+    /**
+     * Returns the number of bytes from `offset` that are known to lie in a hole, i.e. occupy no
+     * storage and read as zeros; or 0 if there is data at `offset` or the stream cannot tell.
+     * Allows readers of sparse streams to skip over holes without reading them.
+     */
+    virtual length_type hole_length(offset_type offset)
+    {
+        (void)offset;
+        return 0;
+    }
+
+    /**
+     * Releases the storage of the given range so that it reads as zeros, without changing the
+     * size. Returns false, doing nothing, if the stream does not support it.
+     */
+    virtual bool punch_hole(offset_type offset, length_type length)
+    {
+        (void)offset;
+        (void)length;
+        return false;
+    }
+
+    /**
+     * Returns a pointer to the contents at `offset`, valid as long as the stream lives, with
+     * `length` reduced to the number of bytes available there; or null if the stream is not memory
+     * mapped or `offset` is beyond the end.
+     * Allows callers to consume the data in place without reading it into a buffer.
+     */
+    virtual const byte* mapped_view(offset_type offset, length_type& length) noexcept
+    {
+        (void)offset;
+        (void)length;
+        return nullptr;
+    }
 };
 
 /**
@@ -92,6 +128,13 @@ protected:
     virtual void write_block(offset_type block_number, const void* input, length_type length) = 0;
     virtual void adjust_logical_size(length_type length) = 0;
 
+    // Read and write runs of consecutive full blocks. The default implementations simply loop over
+    // the single block versions; subclasses may override them to batch the underlying I/O.
+    // Reading stops at the first block that is not full, and returns the total bytes read.
+    virtual length_type
+    read_blocks(offset_type start_block, length_type num_blocks, void* output);
+    virtual void write_blocks(offset_type start_block, length_type num_blocks, const void* input);
+
 private:
     length_type
     read_block(offset_type block_number, void* output, offset_type begin, offset_type end);
@@ -144,6 +187,10 @@ protected:
 private:
     length_type read_block(offset_type block_number, void* output) override;
     void write_block(offset_type block_number, const void* input, length_type length) override;
+    length_type
+    read_blocks(offset_type start_block, length_type num_blocks, void* output) override;
+    void
+    write_blocks(offset_type start_block, length_type num_blocks, const void* input) override;
 
 public:
     explicit CryptStream(std::shared_ptr<StreamBase> stream, length_type block_size)
@@ -160,19 +207,36 @@ public:
 };
 
 /**
- * AESGCMCryptStream is both a CryptStream and a HeaderBase.
+ * AEADCryptStream is both a CryptStream and a HeaderBase. The contents and the header are
+ * encrypted with the given `AEADAlgorithm`.
  *
  * Returns a pair because the client does not need to know whether the two interfaces are
  * implemented by the same class.
  */
 std::pair<std::shared_ptr<CryptStream>, std::shared_ptr<HeaderBase>>
-make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
-                         std::shared_ptr<StreamBase> meta_stream,
-                         const key_type& data_key,
-                         const key_type& meta_key,
-                         const id_type& id_,
-                         bool check,
-                         unsigned block_size,
-                         unsigned iv_size,
-                         unsigned header_size = 32);
+make_cryptstream_aead(std::shared_ptr<StreamBase> data_stream,
+                      std::shared_ptr<StreamBase> meta_stream,
+                      const key_type& data_key,
+                      const key_type& meta_key,
+                      const id_type& id_,
+                      bool check,
+                      unsigned block_size,
+                      unsigned iv_size,
+                      unsigned header_size = 32,
+                      AEADAlgorithm algorithm = AEADAlgorithm::AES_GCM);
+
+/**
+ * Same as above, but with the data key already set up in `data_context`, which the stream uses
+ * exclusively while it lives.
+ */
+std::pair<std::shared_ptr<CryptStream>, std::shared_ptr<HeaderBase>>
+make_cryptstream_aead(std::shared_ptr<StreamBase> data_stream,
+                      std::shared_ptr<StreamBase> meta_stream,
+                      std::shared_ptr<AEADContext> data_context,
+                      const key_type& meta_key,
+                      const id_type& id_,
+                      bool check,
+                      unsigned block_size,
+                      unsigned iv_size,
+                      unsigned header_size = 32);
 }    // namespace securefs
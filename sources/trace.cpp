@@ -0,0 +1,1078 @@
+#include "trace.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "logger.h"
+#include "operations.h"
+#include "platform.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+
+namespace securefs
+{
+namespace
+{
+    const char TRACE_MAGIC[8] = {'S', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+    const unsigned TRACE_VERSION = 1;
+    const size_t TRACE_BUFFER_SIZE = 64 << 10;
+
+    void append_varint(std::vector<byte>& buffer, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<byte>(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<byte>(value));
+    }
+
+    void append_string(std::vector<byte>& buffer, const std::string& str)
+    {
+        append_varint(buffer, str.size());
+        buffer.insert(buffer.end(), str.begin(), str.end());
+    }
+
+    // Maps small negative numbers to small unsigned ones
+    uint64_t zigzag_encode(int32_t value)
+    {
+        auto extended = static_cast<int64_t>(value);
+        return (static_cast<uint64_t>(extended) << 1) ^ static_cast<uint64_t>(extended >> 63);
+    }
+
+    int32_t zigzag_decode(uint64_t value)
+    {
+        return static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+    }
+}    // namespace
+
+const char* trace_op_name(TraceOp op) noexcept
+{
+    switch (op)
+    {
+    case TraceOp::GETATTR:
+        return "getattr";
+    case TraceOp::READLINK:
+        return "readlink";
+    case TraceOp::MKDIR:
+        return "mkdir";
+    case TraceOp::UNLINK:
+        return "unlink";
+    case TraceOp::RMDIR:
+        return "rmdir";
+    case TraceOp::SYMLINK:
+        return "symlink";
+    case TraceOp::RENAME:
+        return "rename";
+    case TraceOp::LINK:
+        return "link";
+    case TraceOp::CHMOD:
+        return "chmod";
+    case TraceOp::CHOWN:
+        return "chown";
+    case TraceOp::TRUNCATE:
+        return "truncate";
+    case TraceOp::OPEN:
+        return "open";
+    case TraceOp::READ:
+        return "read";
+    case TraceOp::WRITE:
+        return "write";
+    case TraceOp::STATFS:
+        return "statfs";
+    case TraceOp::FLUSH:
+        return "flush";
+    case TraceOp::RELEASE:
+        return "release";
+    case TraceOp::FSYNC:
+        return "fsync";
+    case TraceOp::OPENDIR:
+        return "opendir";
+    case TraceOp::READDIR:
+        return "readdir";
+    case TraceOp::RELEASEDIR:
+        return "releasedir";
+    case TraceOp::FSYNCDIR:
+        return "fsyncdir";
+    case TraceOp::CREATE:
+        return "create";
+    case TraceOp::FTRUNCATE:
+        return "ftruncate";
+    case TraceOp::UTIMENS:
+        return "utimens";
+    case TraceOp::GETXATTR:
+        return "getxattr";
+    case TraceOp::SETXATTR:
+        return "setxattr";
+    case TraceOp::LISTXATTR:
+        return "listxattr";
+    case TraceOp::REMOVEXATTR:
+        return "removexattr";
+    default:
+        return "unknown";
+    }
+}
+
+TraceWriter::TraceWriter(std::shared_ptr<StreamBase> stream)
+    : m_stream(std::move(stream)), m_offset(0)
+{
+    m_buffer.reserve(TRACE_BUFFER_SIZE);
+    m_buffer.insert(m_buffer.end(), TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC));
+    append_varint(m_buffer, TRACE_VERSION);
+}
+
+TraceWriter::~TraceWriter()
+{
+    try
+    {
+        flush();
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to flush the trace: %s", e.what());
+    }
+}
+
+void TraceWriter::flush_buffer()
+{
+    m_stream->write(m_buffer.data(), m_offset, m_buffer.size());
+    m_offset += m_buffer.size();
+    m_buffer.clear();
+}
+
+void TraceWriter::append(const TraceRecord& record)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_buffer.push_back(static_cast<byte>(record.op));
+    append_varint(m_buffer, zigzag_encode(record.result));
+    append_varint(m_buffer, record.thread);
+    append_varint(m_buffer, record.start_ns);
+    append_varint(m_buffer, record.duration_ns);
+    append_varint(m_buffer, record.offset);
+    append_varint(m_buffer, record.size);
+    append_varint(m_buffer, record.fh);
+    append_varint(m_buffer, record.mode);
+    append_varint(m_buffer, record.flags);
+    append_string(m_buffer, record.path);
+    append_string(m_buffer, record.path2);
+    if (m_buffer.size() >= TRACE_BUFFER_SIZE)
+        flush_buffer();
+}
+
+void TraceWriter::flush()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_buffer();
+    m_stream->flush();
+}
+
+TraceReader::TraceReader(std::shared_ptr<StreamBase> stream)
+    : m_stream(std::move(stream)), m_position(0), m_offset(0)
+{
+    byte magic[sizeof(TRACE_MAGIC)];
+    for (byte& b : magic)
+    {
+        if (!fill())
+            throwInvalidArgumentException("The file is not a trace of securefs");
+        b = read_byte();
+    }
+    if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+        throwInvalidArgumentException("The file is not a trace of securefs");
+    auto version = read_varint();
+    if (version != TRACE_VERSION)
+        throwInvalidArgumentException(
+            strprintf("Unsupported trace version %llu", static_cast<unsigned long long>(version)));
+}
+
+bool TraceReader::fill()
+{
+    if (m_position < m_buffer.size())
+        return true;
+    m_buffer.resize(TRACE_BUFFER_SIZE);
+    auto rc = m_stream->read(m_buffer.data(), m_offset, m_buffer.size());
+    m_buffer.resize(rc);
+    m_offset += rc;
+    m_position = 0;
+    return rc > 0;
+}
+
+byte TraceReader::read_byte()
+{
+    if (!fill())
+        throwInvalidArgumentException("The trace is truncated");
+    return m_buffer[m_position++];
+}
+
+uint64_t TraceReader::read_varint()
+{
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        byte b = read_byte();
+        value |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return value;
+    }
+    throwInvalidArgumentException("The trace contains an invalid integer");
+}
+
+std::string TraceReader::read_string()
+{
+    auto size = read_varint();
+    std::string result;
+    result.reserve(size);
+    for (uint64_t i = 0; i < size; ++i)
+        result.push_back(static_cast<char>(read_byte()));
+    return result;
+}
+
+bool TraceReader::next(TraceRecord* record)
+{
+    if (!fill())
+        return false;
+    byte op = read_byte();
+    if (op >= static_cast<byte>(TraceOp::COUNT))
+        throwInvalidArgumentException(strprintf("Unknown operation %u in the trace", op));
+    record->op = static_cast<TraceOp>(op);
+    record->result = zigzag_decode(read_varint());
+    record->thread = static_cast<uint32_t>(read_varint());
+    record->start_ns = read_varint();
+    record->duration_ns = read_varint();
+    record->offset = read_varint();
+    record->size = read_varint();
+    record->fh = read_varint();
+    record->mode = static_cast<uint32_t>(read_varint());
+    record->flags = static_cast<uint32_t>(read_varint());
+    record->path = read_string();
+    record->path2 = read_string();
+    return true;
+}
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct fuse_operations traced_operations;
+    std::shared_ptr<TraceWriter> trace_writer;
+    Clock::time_point trace_epoch;
+
+    uint64_t nanoseconds_between(Clock::time_point start, Clock::time_point end)
+    {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    // Records one call into the trace when finished
+    class TraceSpan
+    {
+    private:
+        TraceRecord m_record;
+        Clock::time_point m_start;
+
+    public:
+        explicit TraceSpan(TraceOp op, const char* path, const char* path2 = nullptr)
+        {
+            m_record.op = op;
+            m_record.thread = static_cast<uint32_t>(
+                std::hash<std::thread::id>()(std::this_thread::get_id()));
+            m_record.path = path;
+            if (path2)
+                m_record.path2 = path2;
+            m_start = Clock::now();
+        }
+
+        TraceRecord& record() noexcept { return m_record; }
+
+        int finish(int rc, const struct fuse_file_info* info = nullptr) noexcept
+        {
+            auto end = Clock::now();
+            m_record.start_ns = nanoseconds_between(trace_epoch, m_start);
+            m_record.duration_ns = nanoseconds_between(m_start, end);
+            m_record.result = rc;
+            if (info)
+                m_record.fh = info->fh;
+            try
+            {
+                trace_writer->append(m_record);
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to record %s into the trace: %s",
+                         trace_op_name(m_record.op),
+                         e.what());
+            }
+            return rc;
+        }
+    };
+
+    void traced_destroy(void* data)
+    {
+        traced_operations.destroy(data);
+        try
+        {
+            trace_writer->flush();
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Failed to flush the trace: %s", e.what());
+        }
+    }
+
+    int traced_getattr(const char* path, struct fuse_stat* st)
+    {
+        TraceSpan span(TraceOp::GETATTR, path);
+        return span.finish(traced_operations.getattr(path, st));
+    }
+
+    int traced_readlink(const char* path, char* buf, size_t size)
+    {
+        TraceSpan span(TraceOp::READLINK, path);
+        span.record().size = size;
+        return span.finish(traced_operations.readlink(path, buf, size));
+    }
+
+    int traced_mkdir(const char* path, fuse_mode_t mode)
+    {
+        TraceSpan span(TraceOp::MKDIR, path);
+        span.record().mode = mode;
+        return span.finish(traced_operations.mkdir(path, mode));
+    }
+
+    int traced_unlink(const char* path)
+    {
+        TraceSpan span(TraceOp::UNLINK, path);
+        return span.finish(traced_operations.unlink(path));
+    }
+
+    int traced_rmdir(const char* path)
+    {
+        TraceSpan span(TraceOp::RMDIR, path);
+        return span.finish(traced_operations.rmdir(path));
+    }
+
+    int traced_symlink(const char* to, const char* from)
+    {
+        TraceSpan span(TraceOp::SYMLINK, to, from);
+        return span.finish(traced_operations.symlink(to, from));
+    }
+
+    int traced_rename(const char* src, const char* dst)
+    {
+        TraceSpan span(TraceOp::RENAME, src, dst);
+        return span.finish(traced_operations.rename(src, dst));
+    }
+
+    int traced_link(const char* src, const char* dst)
+    {
+        TraceSpan span(TraceOp::LINK, src, dst);
+        return span.finish(traced_operations.link(src, dst));
+    }
+
+    int traced_chmod(const char* path, fuse_mode_t mode)
+    {
+        TraceSpan span(TraceOp::CHMOD, path);
+        span.record().mode = mode;
+        return span.finish(traced_operations.chmod(path, mode));
+    }
+
+    int traced_chown(const char* path, fuse_uid_t uid, fuse_gid_t gid)
+    {
+        TraceSpan span(TraceOp::CHOWN, path);
+        span.record().offset = uid;
+        span.record().size = gid;
+        return span.finish(traced_operations.chown(path, uid, gid));
+    }
+
+    int traced_truncate(const char* path, fuse_off_t size)
+    {
+        TraceSpan span(TraceOp::TRUNCATE, path);
+        span.record().offset = size;
+        return span.finish(traced_operations.truncate(path, size));
+    }
+
+    int traced_open(const char* path, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::OPEN, path);
+        span.record().flags = info->flags;
+        return span.finish(traced_operations.open(path, info), info);
+    }
+
+    int traced_read(
+        const char* path, char* buf, size_t size, fuse_off_t offset, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::READ, path);
+        span.record().offset = offset;
+        span.record().size = size;
+        return span.finish(traced_operations.read(path, buf, size, offset, info), info);
+    }
+
+    int traced_write(const char* path,
+                     const char* buf,
+                     size_t size,
+                     fuse_off_t offset,
+                     struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::WRITE, path);
+        span.record().offset = offset;
+        span.record().size = size;
+        return span.finish(traced_operations.write(path, buf, size, offset, info), info);
+    }
+
+    int traced_statfs(const char* path, struct fuse_statvfs* buf)
+    {
+        TraceSpan span(TraceOp::STATFS, path);
+        return span.finish(traced_operations.statfs(path, buf));
+    }
+
+    int traced_flush(const char* path, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::FLUSH, path);
+        return span.finish(traced_operations.flush(path, info), info);
+    }
+
+    int traced_release(const char* path, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::RELEASE, path);
+        return span.finish(traced_operations.release(path, info), info);
+    }
+
+    int traced_fsync(const char* path, int isdatasync, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::FSYNC, path);
+        span.record().flags = isdatasync;
+        return span.finish(traced_operations.fsync(path, isdatasync, info), info);
+    }
+
+    int traced_opendir(const char* path, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::OPENDIR, path);
+        return span.finish(traced_operations.opendir(path, info), info);
+    }
+
+    int traced_readdir(const char* path,
+                       void* buf,
+                       fuse_fill_dir_t filler,
+                       fuse_off_t offset,
+                       struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::READDIR, path);
+        span.record().offset = offset;
+        return span.finish(traced_operations.readdir(path, buf, filler, offset, info), info);
+    }
+
+    int traced_releasedir(const char* path, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::RELEASEDIR, path);
+        return span.finish(traced_operations.releasedir(path, info), info);
+    }
+
+    int traced_fsyncdir(const char* path, int isdatasync, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::FSYNCDIR, path);
+        span.record().flags = isdatasync;
+        return span.finish(traced_operations.fsyncdir(path, isdatasync, info), info);
+    }
+
+    int traced_create(const char* path, fuse_mode_t mode, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::CREATE, path);
+        span.record().mode = mode;
+        span.record().flags = info->flags;
+        return span.finish(traced_operations.create(path, mode, info), info);
+    }
+
+    int traced_ftruncate(const char* path, fuse_off_t size, struct fuse_file_info* info)
+    {
+        TraceSpan span(TraceOp::FTRUNCATE, path);
+        span.record().offset = size;
+        return span.finish(traced_operations.ftruncate(path, size, info), info);
+    }
+
+    int traced_utimens(const char* path, const struct fuse_timespec ts[2])
+    {
+        TraceSpan span(TraceOp::UTIMENS, path);
+        return span.finish(traced_operations.utimens(path, ts));
+    }
+
+    // Like the handlers, only wired on macOS, whose attribute calls take an extra position
+#ifdef __APPLE__
+    int traced_getxattr(
+        const char* path, const char* name, char* value, size_t size, uint32_t position)
+    {
+        TraceSpan span(TraceOp::GETXATTR, path, name);
+        span.record().size = size;
+        span.record().offset = position;
+        return span.finish(traced_operations.getxattr(path, name, value, size, position));
+    }
+
+    int traced_setxattr(const char* path,
+                        const char* name,
+                        const char* value,
+                        size_t size,
+                        int flags,
+                        uint32_t position)
+    {
+        TraceSpan span(TraceOp::SETXATTR, path, name);
+        span.record().size = size;
+        span.record().flags = static_cast<uint32_t>(flags);
+        span.record().offset = position;
+        return span.finish(traced_operations.setxattr(path, name, value, size, flags, position));
+    }
+
+    int traced_listxattr(const char* path, char* list, size_t size)
+    {
+        TraceSpan span(TraceOp::LISTXATTR, path);
+        span.record().size = size;
+        return span.finish(traced_operations.listxattr(path, list, size));
+    }
+
+    int traced_removexattr(const char* path, const char* name)
+    {
+        TraceSpan span(TraceOp::REMOVEXATTR, path, name);
+        return span.finish(traced_operations.removexattr(path, name));
+    }
+#endif
+}    // namespace
+
+void trace_fuse_operations(struct fuse_operations* ops, std::shared_ptr<TraceWriter> writer)
+{
+    if (trace_writer)
+        throwInvalidArgumentException("Only one set of operations can be traced per process");
+    traced_operations = *ops;
+    trace_writer = std::move(writer);
+    trace_epoch = Clock::now();
+
+#define SECUREFS_TRACE_OPERATION(name)                                                             \
+    if (ops->name)                                                                                 \
+        ops->name = &traced_##name;
+
+    SECUREFS_TRACE_OPERATION(destroy)
+    SECUREFS_TRACE_OPERATION(getattr)
+    SECUREFS_TRACE_OPERATION(readlink)
+    SECUREFS_TRACE_OPERATION(mkdir)
+    SECUREFS_TRACE_OPERATION(unlink)
+    SECUREFS_TRACE_OPERATION(rmdir)
+    SECUREFS_TRACE_OPERATION(symlink)
+    SECUREFS_TRACE_OPERATION(rename)
+    SECUREFS_TRACE_OPERATION(link)
+    SECUREFS_TRACE_OPERATION(chmod)
+    SECUREFS_TRACE_OPERATION(chown)
+    SECUREFS_TRACE_OPERATION(truncate)
+    SECUREFS_TRACE_OPERATION(open)
+    SECUREFS_TRACE_OPERATION(read)
+    SECUREFS_TRACE_OPERATION(write)
+    SECUREFS_TRACE_OPERATION(statfs)
+    SECUREFS_TRACE_OPERATION(flush)
+    SECUREFS_TRACE_OPERATION(release)
+    SECUREFS_TRACE_OPERATION(fsync)
+    SECUREFS_TRACE_OPERATION(opendir)
+    SECUREFS_TRACE_OPERATION(readdir)
+    SECUREFS_TRACE_OPERATION(releasedir)
+    SECUREFS_TRACE_OPERATION(fsyncdir)
+    SECUREFS_TRACE_OPERATION(create)
+    SECUREFS_TRACE_OPERATION(ftruncate)
+    SECUREFS_TRACE_OPERATION(utimens)
+#ifdef __APPLE__
+    SECUREFS_TRACE_OPERATION(getxattr)
+    SECUREFS_TRACE_OPERATION(setxattr)
+    SECUREFS_TRACE_OPERATION(listxattr)
+    SECUREFS_TRACE_OPERATION(removexattr)
+#endif
+
+#undef SECUREFS_TRACE_OPERATION
+}
+
+namespace
+{
+    const size_t NO_DEPENDENCY = static_cast<size_t>(-1);
+
+    struct ReplayCounters
+    {
+        LatencyHistogram latencies;
+        uint64_t errors = 0, mismatches = 0, recorded_total_ns = 0;
+    };
+
+    struct ReplayHandle
+    {
+        uint64_t fh;
+        bool is_directory;
+        std::string path;
+    };
+
+    struct ReplayStep
+    {
+        TraceRecord record;
+        size_t depends_on = NO_DEPENDENCY;    // The previous step on the same handle
+        bool skipped = false;                 // Uses a handle opened before the recording
+    };
+
+    // The state shared by the workers of one replay
+    struct ReplayState
+    {
+        const struct fuse_operations* ops;
+        std::vector<ReplayStep> steps;
+        bool timed;
+        Clock::time_point start;
+
+        std::mutex mutex;
+        std::condition_variable step_done;
+        std::vector<char> done;                               // Guarded by `mutex`
+        std::unordered_map<uint64_t, ReplayHandle> handles;    // Guarded by `mutex`
+        std::atomic<uint64_t> num_replayed{0}, num_skipped{0};
+    };
+
+    struct ReplayWorker
+    {
+        std::vector<size_t> steps;
+        ReplayCounters counters[static_cast<size_t>(TraceOp::COUNT)];
+        std::vector<byte> buffer, payload;
+        std::exception_ptr error;
+    };
+
+    bool opens_handle(TraceOp op)
+    {
+        return op == TraceOp::OPEN || op == TraceOp::CREATE || op == TraceOp::OPENDIR;
+    }
+
+    bool releases_handle(TraceOp op)
+    {
+        return op == TraceOp::RELEASE || op == TraceOp::RELEASEDIR;
+    }
+
+    bool needs_handle(TraceOp op)
+    {
+        switch (op)
+        {
+        case TraceOp::READ:
+        case TraceOp::WRITE:
+        case TraceOp::FLUSH:
+        case TraceOp::RELEASE:
+        case TraceOp::FSYNC:
+        case TraceOp::READDIR:
+        case TraceOp::RELEASEDIR:
+        case TraceOp::FSYNCDIR:
+        case TraceOp::FTRUNCATE:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Chains the steps on each recorded handle, so that they are replayed in their recorded order
+    // even when issued by different workers
+    void link_handle_steps(std::vector<ReplayStep>& steps)
+    {
+        std::unordered_map<uint64_t, size_t> last_step;    // On each recorded handle
+        std::unordered_map<uint64_t, bool> open;
+        for (size_t i = 0; i < steps.size(); ++i)
+        {
+            ReplayStep& step = steps[i];
+            TraceOp op = step.record.op;
+            bool opening = opens_handle(op) && step.record.result >= 0;
+            if (!opening && !needs_handle(op))
+                continue;
+            uint64_t fh = step.record.fh;
+            if (!opening && !open[fh])
+            {
+                step.skipped = true;
+                continue;
+            }
+            auto it = last_step.find(fh);
+            if (it != last_step.end())
+                step.depends_on = it->second;
+            last_step[fh] = i;
+            open[fh] = opening || !releases_handle(op);
+        }
+    }
+
+    int discard_entry(void*, const char*, const struct fuse_stat*, fuse_off_t) { return 0; }
+
+    int replay_call(const struct fuse_operations& ops,
+                    const TraceRecord& record,
+                    struct fuse_file_info* info,
+                    std::vector<byte>& buffer,
+                    const std::vector<byte>& payload)
+    {
+        const char* path = record.path.c_str();
+        int rc = -ENOSYS;
+        switch (record.op)
+        {
+        case TraceOp::GETATTR:
+        {
+            struct fuse_stat st;
+            if (ops.getattr)
+                rc = ops.getattr(path, &st);
+            break;
+        }
+        case TraceOp::READLINK:
+            if (ops.readlink)
+                rc = ops.readlink(path, reinterpret_cast<char*>(buffer.data()), record.size);
+            break;
+        case TraceOp::MKDIR:
+            if (ops.mkdir)
+                rc = ops.mkdir(path, record.mode);
+            break;
+        case TraceOp::UNLINK:
+            if (ops.unlink)
+                rc = ops.unlink(path);
+            break;
+        case TraceOp::RMDIR:
+            if (ops.rmdir)
+                rc = ops.rmdir(path);
+            break;
+        case TraceOp::SYMLINK:
+            if (ops.symlink)
+                rc = ops.symlink(path, record.path2.c_str());
+            break;
+        case TraceOp::RENAME:
+            if (ops.rename)
+                rc = ops.rename(path, record.path2.c_str());
+            break;
+        case TraceOp::LINK:
+            if (ops.link)
+                rc = ops.link(path, record.path2.c_str());
+            break;
+        case TraceOp::CHMOD:
+            if (ops.chmod)
+                rc = ops.chmod(path, record.mode);
+            break;
+        case TraceOp::CHOWN:
+            if (ops.chown)
+                rc = ops.chown(path,
+                               static_cast<fuse_uid_t>(record.offset),
+                               static_cast<fuse_gid_t>(record.size));
+            break;
+        case TraceOp::TRUNCATE:
+            if (ops.truncate)
+                rc = ops.truncate(path, static_cast<fuse_off_t>(record.offset));
+            break;
+        case TraceOp::OPEN:
+            if (ops.open)
+                rc = ops.open(path, info);
+            break;
+        case TraceOp::READ:
+            if (ops.read)
+                rc = ops.read(path,
+                              reinterpret_cast<char*>(buffer.data()),
+                              record.size,
+                              static_cast<fuse_off_t>(record.offset),
+                              info);
+            break;
+        case TraceOp::WRITE:
+            if (ops.write)
+                rc = ops.write(path,
+                               reinterpret_cast<const char*>(payload.data()),
+                               record.size,
+                               static_cast<fuse_off_t>(record.offset),
+                               info);
+            break;
+        case TraceOp::STATFS:
+        {
+            struct fuse_statvfs st;
+            if (ops.statfs)
+                rc = ops.statfs(path, &st);
+            break;
+        }
+        case TraceOp::FLUSH:
+            if (ops.flush)
+                rc = ops.flush(path, info);
+            break;
+        case TraceOp::RELEASE:
+            if (ops.release)
+                rc = ops.release(path, info);
+            break;
+        case TraceOp::FSYNC:
+            if (ops.fsync)
+                rc = ops.fsync(path, static_cast<int>(record.flags), info);
+            break;
+        case TraceOp::OPENDIR:
+            if (ops.opendir)
+                rc = ops.opendir(path, info);
+            break;
+        case TraceOp::READDIR:
+            if (ops.readdir)
+                rc = ops.readdir(
+                    path, nullptr, &discard_entry, static_cast<fuse_off_t>(record.offset), info);
+            break;
+        case TraceOp::RELEASEDIR:
+            if (ops.releasedir)
+                rc = ops.releasedir(path, info);
+            break;
+        case TraceOp::FSYNCDIR:
+            if (ops.fsyncdir)
+                rc = ops.fsyncdir(path, static_cast<int>(record.flags), info);
+            break;
+        case TraceOp::CREATE:
+            if (ops.create)
+                rc = ops.create(path, record.mode, info);
+            break;
+        case TraceOp::FTRUNCATE:
+            if (ops.ftruncate)
+                rc = ops.ftruncate(path, static_cast<fuse_off_t>(record.offset), info);
+            break;
+        case TraceOp::UTIMENS:
+        {
+            struct fuse_timespec ts[2];
+            OSService::get_current_time(ts[0]);
+            ts[1] = ts[0];
+            if (ops.utimens)
+                rc = ops.utimens(path, ts);
+            break;
+        }
+#ifdef __APPLE__
+        case TraceOp::GETXATTR:
+            if (ops.getxattr)
+                rc = ops.getxattr(path,
+                                  record.path2.c_str(),
+                                  reinterpret_cast<char*>(buffer.data()),
+                                  record.size,
+                                  static_cast<uint32_t>(record.offset));
+            break;
+        case TraceOp::SETXATTR:
+            if (ops.setxattr)
+                rc = ops.setxattr(path,
+                                  record.path2.c_str(),
+                                  reinterpret_cast<const char*>(payload.data()),
+                                  record.size,
+                                  static_cast<int>(record.flags),
+                                  static_cast<uint32_t>(record.offset));
+            break;
+        case TraceOp::LISTXATTR:
+            if (ops.listxattr)
+                rc = ops.listxattr(path, reinterpret_cast<char*>(buffer.data()), record.size);
+            break;
+        case TraceOp::REMOVEXATTR:
+            if (ops.removexattr)
+                rc = ops.removexattr(path, record.path2.c_str());
+            break;
+#endif
+        default:
+            break;
+        }
+        return rc;
+    }
+
+    void release_replayed_handle(const struct fuse_operations& ops, const ReplayHandle& handle)
+    {
+        struct fuse_file_info info;
+        memset(&info, 0, sizeof(info));
+        info.fh = handle.fh;
+        if (handle.is_directory && ops.releasedir)
+            ops.releasedir(handle.path.c_str(), &info);
+        else if (!handle.is_directory && ops.release)
+            ops.release(handle.path.c_str(), &info);
+    }
+
+    void replay_step(ReplayState& state, ReplayWorker& worker, size_t index)
+    {
+        const ReplayStep& step = state.steps[index];
+        const TraceRecord& record = step.record;
+        struct fuse_file_info info;
+        memset(&info, 0, sizeof(info));
+        info.flags = static_cast<int>(record.flags);
+
+        if (step.skipped)
+        {
+            ++state.num_skipped;
+            return;
+        }
+        if (needs_handle(record.op))
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            if (step.depends_on != NO_DEPENDENCY)
+                state.step_done.wait(lock, [&]() { return state.done[step.depends_on] != 0; });
+            auto it = state.handles.find(record.fh);
+            // The opening failed during the replay
+            if (it == state.handles.end())
+            {
+                ++state.num_skipped;
+                return;
+            }
+            info.fh = it->second.fh;
+        }
+        else if (step.depends_on != NO_DEPENDENCY)
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.step_done.wait(lock, [&]() { return state.done[step.depends_on] != 0; });
+        }
+
+        switch (record.op)
+        {
+        case TraceOp::READ:
+        case TraceOp::READLINK:
+        case TraceOp::GETXATTR:
+        case TraceOp::LISTXATTR:
+            worker.buffer.resize(std::max<size_t>(worker.buffer.size(), record.size));
+            break;
+        case TraceOp::WRITE:
+        case TraceOp::SETXATTR:
+            if (worker.payload.size() < record.size)
+            {
+                worker.payload.resize(record.size);
+                generate_random(worker.payload.data(), worker.payload.size());
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (state.timed)
+            std::this_thread::sleep_until(state.start + std::chrono::nanoseconds(record.start_ns));
+        auto start = Clock::now();
+        int rc = replay_call(*state.ops, record, &info, worker.buffer, worker.payload);
+        auto elapsed = nanoseconds_between(start, Clock::now());
+        ++state.num_replayed;
+
+        ReplayCounters& c = worker.counters[static_cast<size_t>(record.op)];
+        c.latencies.record(elapsed);
+        c.recorded_total_ns += record.duration_ns;
+        if (rc < 0)
+            ++c.errors;
+        if ((rc < 0) != (record.result < 0))
+            ++c.mismatches;
+
+        if (rc >= 0 && opens_handle(record.op))
+        {
+            ReplayHandle handle{info.fh, record.op == TraceOp::OPENDIR, record.path};
+            // Nothing in the trace refers to a handle whose opening failed when recorded
+            if (record.result < 0)
+            {
+                release_replayed_handle(*state.ops, handle);
+                return;
+            }
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.handles[record.fh] = std::move(handle);
+        }
+        else if (releases_handle(record.op))
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.handles.erase(record.fh);
+        }
+    }
+
+    void run_replay_worker(ReplayState& state, ReplayWorker& worker)
+    {
+        for (size_t index : worker.steps)
+        {
+            try
+            {
+                replay_step(state, worker, index);
+            }
+            catch (...)
+            {
+                if (!worker.error)
+                    worker.error = std::current_exception();
+            }
+            // Marked even on failure, lest the workers waiting on this step hang
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                state.done[index] = 1;
+            }
+            state.step_done.notify_all();
+        }
+    }
+}    // namespace
+
+Json::Value replay_trace(TraceReader& reader,
+                         const struct fuse_operations& ops,
+                         void* mount_options,
+                         const ReplayOptions& options)
+{
+    ReplayState state;
+    state.ops = &ops;
+    state.timed = options.timed;
+    {
+        ReplayStep step;
+        while (reader.next(&step.record))
+            state.steps.push_back(step);
+    }
+    link_handle_steps(state.steps);
+    state.done.assign(state.steps.size(), 0);
+
+    // Ordered by the recorded thread, so that the workers are the same on every replay
+    std::map<uint32_t, std::unique_ptr<ReplayWorker>> workers;
+    for (size_t i = 0; i < state.steps.size(); ++i)
+    {
+        auto& worker = workers[options.concurrent ? state.steps[i].record.thread : 0];
+        if (!worker)
+            worker.reset(new ReplayWorker());
+        worker->steps.push_back(i);
+    }
+
+    struct fuse_context context;
+    memset(&context, 0, sizeof(context));
+    context.uid = OSService::getuid();
+    context.gid = OSService::getgid();
+    context.umask = 022;
+    context.private_data = mount_options;
+    operations::override_fuse_context(&context);
+    DEFER(operations::override_fuse_context(nullptr));
+
+    struct fuse_conn_info conn;
+    memset(&conn, 0, sizeof(conn));
+    if (ops.init)
+        context.private_data = ops.init(&conn);
+
+    state.start = Clock::now();
+    std::vector<std::thread> threads;
+    for (auto&& pair : workers)
+    {
+        ReplayWorker* worker = pair.second.get();
+        threads.emplace_back([&state, worker]() { run_replay_worker(state, *worker); });
+    }
+    for (auto&& t : threads)
+        t.join();
+
+    // Files still open at the end of the recording
+    for (auto&& pair : state.handles)
+        release_replayed_handle(ops, pair.second);
+    if (ops.destroy)
+        ops.destroy(context.private_data);
+
+    for (auto&& pair : workers)
+    {
+        if (pair.second->error)
+            std::rethrow_exception(pair.second->error);
+    }
+
+    Json::Value report;
+    report["replayed"] = static_cast<Json::UInt64>(state.num_replayed.load());
+    report["skipped"] = static_cast<Json::UInt64>(state.num_skipped.load());
+    report["workers"] = static_cast<Json::UInt64>(workers.size());
+    Json::Value& results = report["operations"];
+    results = Json::Value(Json::objectValue);
+    for (size_t i = 0; i < static_cast<size_t>(TraceOp::COUNT); ++i)
+    {
+        ReplayCounters c;
+        for (auto&& pair : workers)
+        {
+            const ReplayCounters& part = pair.second->counters[i];
+            c.latencies.merge(part.latencies);
+            c.errors += part.errors;
+            c.mismatches += part.mismatches;
+            c.recorded_total_ns += part.recorded_total_ns;
+        }
+        auto count = c.latencies.count();
+        if (count == 0)
+            continue;
+        Json::Value& value = results[trace_op_name(static_cast<TraceOp>(i))];
+        value["count"] = static_cast<Json::UInt64>(count);
+        value["errors"] = static_cast<Json::UInt64>(c.errors);
+        value["mismatches"] = static_cast<Json::UInt64>(c.mismatches);
+        value["mean_us"] = c.latencies.total_ns() / 1e3 / count;
+        value["p50_us"] = c.latencies.percentile_ns(0.5) / 1e3;
+        value["p90_us"] = c.latencies.percentile_ns(0.9) / 1e3;
+        value["p99_us"] = c.latencies.percentile_ns(0.99) / 1e3;
+        value["max_us"] = c.latencies.max_ns() / 1e3;
+        value["recorded_mean_us"] = c.recorded_total_ns / 1e3 / count;
+    }
+    return report;
+}
+}    // namespace securefs
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "myutils.h"
+#include "streams.h"
+
+#include <json/json.h>
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct fuse_operations;
+
+namespace securefs
+{
+/**
+ * The FUSE calls that are recorded into traces. The values are stored in trace files, so new ones
+ * must be appended.
+ */
+enum class TraceOp : uint8_t
+{
+    GETATTR,
+    READLINK,
+    MKDIR,
+    UNLINK,
+    RMDIR,
+    SYMLINK,
+    RENAME,
+    LINK,
+    CHMOD,
+    CHOWN,
+    TRUNCATE,
+    OPEN,
+    READ,
+    WRITE,
+    STATFS,
+    FLUSH,
+    RELEASE,
+    FSYNC,
+    OPENDIR,
+    READDIR,
+    RELEASEDIR,
+    FSYNCDIR,
+    CREATE,
+    FTRUNCATE,
+    UTIMENS,
+    GETXATTR,
+    SETXATTR,
+    LISTXATTR,
+    REMOVEXATTR,
+    COUNT
+};
+
+const char* trace_op_name(TraceOp op) noexcept;
+
+/**
+ * One completed FUSE call. The data read or written is not recorded, only its size.
+ */
+struct TraceRecord
+{
+    TraceOp op = TraceOp::GETATTR;
+    int32_t result = 0;    // Returned by the handler; negated errno on failure
+    uint32_t thread = 0;    // Distinguishes the calling threads within a trace
+    uint64_t start_ns = 0;    // Since the recording started
+    uint64_t duration_ns = 0;
+    uint64_t offset = 0;    // Of reads and writes; the new length of truncations; the uid of chown
+                            // and the position of extended attributes, where macOS passes one
+    uint64_t size = 0;    // Of reads, writes, readlink and extended attributes; the gid of chown
+    uint64_t fh = 0;    // Of the open file or directory, after the call
+    uint32_t mode = 0;    // Of mkdir, create and chmod
+    uint32_t flags = 0;    // Of open, create and setxattr; isdatasync of fsync and fsyncdir
+    std::string path;
+    std::string path2;    // The new path of rename, link and symlink; the name of an attribute
+};
+
+/**
+ * Appends records to a trace in a compact binary format: a magic header, then each record as
+ * variable length integers followed by its paths. Safe to call from multiple threads.
+ */
+class TraceWriter
+{
+    DISABLE_COPY_MOVE(TraceWriter)
+
+private:
+    std::mutex m_mutex;
+    std::shared_ptr<StreamBase> m_stream;
+    std::vector<byte> m_buffer;
+    offset_type m_offset;
+
+    void flush_buffer();
+
+public:
+    explicit TraceWriter(std::shared_ptr<StreamBase> stream);
+    ~TraceWriter();
+
+    void append(const TraceRecord& record);
+    void flush();
+};
+
+class TraceReader
+{
+    DISABLE_COPY_MOVE(TraceReader)
+
+private:
+    std::shared_ptr<StreamBase> m_stream;
+    std::vector<byte> m_buffer;
+    size_t m_position;
+    offset_type m_offset;
+
+    bool fill();
+    byte read_byte();
+    uint64_t read_varint();
+    std::string read_string();
+
+public:
+    // Throws if the stream does not start with the header of a trace
+    explicit TraceReader(std::shared_ptr<StreamBase> stream);
+
+    // Returns false at the end of the trace
+    bool next(TraceRecord* record);
+};
+
+/**
+ * Wraps every operation in `ops` that has a `TraceOp` so that its calls are appended to `writer`.
+ * Only one set of operations may be traced per process. The writer is flushed when the
+ * filesystem is destroyed.
+ */
+void trace_fuse_operations(struct fuse_operations* ops, std::shared_ptr<TraceWriter> writer);
+
+struct ReplayOptions
+{
+    // One worker per recorded thread, each issuing the calls of that thread in order; otherwise
+    // all the calls run in turn on a single worker, as the full format requires
+    bool concurrent = true;
+    // Each call is issued no earlier than its recorded start, relative to the start of the replay;
+    // otherwise as fast as possible
+    bool timed = false;
+};
+
+/**
+ * Calls the handlers in `ops` directly, without FUSE. `mount_options` is passed to `init` as the
+ * private data of a synthetic FUSE context. The whole trace is loaded first. Writes carry random
+ * data of the recorded size, and the handles of files opened before the recording started are
+ * unknown, so the calls on them are skipped.
+ *
+ * The calls on the same handle, from its opening to its release, keep their recorded order across
+ * workers. Other calls are only ordered within their worker, so calls that raced during the
+ * recording may still come out differently.
+ *
+ * Returns the number of replayed and skipped records and of workers, and for each kind of call
+ * its count, errors, results that disagree with the recorded ones in success or failure, and the
+ * latency percentiles in microseconds next to the mean recorded latency.
+ */
+Json::Value replay_trace(TraceReader& reader,
+                         const struct fuse_operations& ops,
+                         void* mount_options,
+                         const ReplayOptions& options = ReplayOptions());
+}    // namespace securefs
@@ -3,22 +3,32 @@
 #include "exceptions.h"
 #include "logger.h"
 #include "platform.h"
+#include "spans.h"
+#include "stats.h"
 #include "streams.h"
 
 #include <securefs_config.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <limits>
 #include <locale.h>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <cxxabi.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -33,11 +43,17 @@
 #include <sys/xattr.h>
 #endif
 
+#if HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
 namespace securefs
 {
-class UnixFileStream final : public FileStream
+class UnixFileStream : public FileStream
 {
-private:
+protected:
     int m_fd;
 
 public:
@@ -88,9 +104,11 @@ public:
 
     length_type read(void* output, offset_type offset, length_type length) override
     {
+        ScopedSpan span("pread");
         auto rc = ::pread(m_fd, output, length, offset);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "pread");
+        add_io_count(IOCounter::UNDERLYING_BYTES_READ, rc);
         return static_cast<length_type>(rc);
     }
 
@@ -99,14 +117,17 @@ public:
         auto rc = ::read(m_fd, output, length);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "read");
+        add_io_count(IOCounter::UNDERLYING_BYTES_READ, rc);
         return static_cast<length_type>(rc);
     }
 
     void write(const void* input, offset_type offset, length_type length) override
     {
+        ScopedSpan span("pwrite");
         auto rc = ::pwrite(m_fd, input, length, offset);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "pwrite");
+        add_io_count(IOCounter::UNDERLYING_BYTES_WRITTEN, rc);
         if (static_cast<length_type>(rc) != length)
             throwVFSException(EIO);
     }
@@ -116,6 +137,7 @@ public:
         auto rc = ::write(m_fd, input, length);
         if (rc < 0)
             THROW_POSIX_EXCEPTION(errno, "write");
+        add_io_count(IOCounter::UNDERLYING_BYTES_WRITTEN, rc);
         if (static_cast<length_type>(rc) != length)
             throwVFSException(EIO);
     }
@@ -139,6 +161,44 @@ public:
 
     bool is_sparse() const noexcept override { return true; }
 
+    length_type hole_length(offset_type offset) override
+    {
+#ifdef SEEK_DATA
+        off_t rc = ::lseek(m_fd, static_cast<off_t>(offset), SEEK_DATA);
+        if (rc >= 0)
+            return static_cast<length_type>(rc) - offset;
+        if (errno == ENXIO)
+        {
+            // No more data after `offset`, so either it is beyond the end or the rest is a hole
+            auto total = size();
+            return total > offset ? total - offset : 0;
+        }
+#else
+        (void)offset;
+#endif
+        return 0;
+    }
+
+    bool punch_hole(offset_type offset, length_type length) override
+    {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (length == 0)
+            return true;
+        int rc = ::fallocate(m_fd,
+                             FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                             static_cast<off_t>(offset),
+                             static_cast<off_t>(length));
+        if (rc == 0)
+            return true;
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            THROW_POSIX_EXCEPTION(errno, "fallocate");
+#else
+        (void)offset;
+        (void)length;
+#endif
+        return false;
+    }
+
     void utimens(const struct fuse_timespec ts[2]) override
     {
 #if HAS_FUTIMENS
@@ -199,6 +259,744 @@ public:
 #endif
 };
 
+/**
+ * A mapped file may still be truncated behind our back, by another process, after which touching
+ * its pages past the new end raises SIGBUS. The handler below replaces those pages with zeros, so
+ * that the faulting access completes, and flags the region so that its stream stops using it.
+ */
+struct MappedRegion
+{
+    std::atomic<uintptr_t> begin, end;
+    std::atomic<bool> faulted;
+};
+
+static const size_t MAX_MAPPED_REGIONS = 1024;
+static MappedRegion mapped_regions[MAX_MAPPED_REGIONS];
+static uintptr_t mapped_page_size;
+static struct sigaction previous_sigbus_action;    // Of the host process or a sanitizer
+
+static void handle_sigbus(int signum, siginfo_t* info, void* context)
+{
+    auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (MappedRegion& region : mapped_regions)
+    {
+        uintptr_t begin = region.begin.load(), end = region.end.load();
+        if (begin == 0 || address < begin || address >= end)
+            continue;
+        uintptr_t page = address & ~(mapped_page_size - 1);
+        void* rc = ::mmap(reinterpret_cast<void*>(page),
+                          end - page,
+                          PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                          -1,
+                          0);
+        if (rc == MAP_FAILED)
+            break;
+        region.faulted.store(true);
+        return;
+    }
+    // Not ours, so it is handed to whoever handled SIGBUS before us
+    if ((previous_sigbus_action.sa_flags & SA_SIGINFO) && previous_sigbus_action.sa_sigaction)
+        return previous_sigbus_action.sa_sigaction(signum, info, context);
+    if (previous_sigbus_action.sa_handler != SIG_DFL
+        && previous_sigbus_action.sa_handler != SIG_IGN)
+        return previous_sigbus_action.sa_handler(signum);
+    // The fault is then raised again with the previous disposition
+    ::sigaction(SIGBUS, &previous_sigbus_action, nullptr);
+}
+
+// Returns null if the region cannot be guarded, in which case it must not be mapped
+static MappedRegion* register_mapped_region()
+{
+    static std::once_flag installed;
+    static bool guarded = false;
+    std::call_once(installed, []() {
+        mapped_page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &handle_sigbus;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        guarded = ::sigaction(SIGBUS, &action, &previous_sigbus_action) == 0;
+    });
+    if (!guarded)
+        return nullptr;
+    for (MappedRegion& region : mapped_regions)
+    {
+        uintptr_t expected = 0;
+        // Claimed with a placeholder, as the address is only known once mapped
+        if (region.begin.compare_exchange_strong(expected, 1))
+        {
+            region.faulted.store(false);
+            return &region;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * A stream over a file that is not modified while it is open, such as in a read-only mount.
+ *
+ * The whole file is mapped into memory at opening, so reads need no syscalls, and block based
+ * readers can decrypt straight from the mapping through `mapped_view`. The kernel is advised of
+ * the access pattern observed so far, so that it reads ahead for sequential scans but not for
+ * random accesses.
+ *
+ * Should the file be truncated anyway, the stream falls back to `pread` from then on. A view
+ * handed out earlier reads zeros past the new end, instead of crashing the process. Files that
+ * cannot be mapped at all, such as on some network filesystems, are read with `pread` throughout.
+ */
+class MappedFileStream final : public UnixFileStream
+{
+private:
+    static const unsigned SEQUENTIAL_THRESHOLD = 4;
+
+    MappedRegion* m_region;
+    const byte* m_data;
+    length_type m_size;
+    // Updated by concurrent readers without a lock; interleaved reads only blur the heuristic
+    std::atomic<offset_type> m_next_offset;
+    std::atomic<unsigned> m_sequential_reads;
+    std::atomic<int> m_advice;
+
+private:
+    void advise(offset_type offset, length_type length) noexcept
+    {
+        unsigned sequential_reads = 0;
+        if (m_next_offset.exchange(offset + length, std::memory_order_relaxed) == offset)
+            sequential_reads = m_sequential_reads.fetch_add(1, std::memory_order_relaxed) + 1;
+        else
+            m_sequential_reads.store(0, std::memory_order_relaxed);
+
+        int advice;
+        if (sequential_reads >= SEQUENTIAL_THRESHOLD)
+            advice = MADV_SEQUENTIAL;
+        else if (sequential_reads == 0)
+            advice = MADV_RANDOM;
+        else
+            return;
+        // Only the thread that changes the advice tells the kernel. Only a hint, so failures are
+        // harmless.
+        if (m_advice.exchange(advice, std::memory_order_relaxed) != advice)
+            (void)::madvise(const_cast<byte*>(m_data), m_size, advice);
+    }
+
+    length_type clip(offset_type offset, length_type length) const noexcept
+    {
+        if (offset >= m_size)
+            return 0;
+        return std::min<length_type>(length, m_size - offset);
+    }
+
+    bool is_mapped() const noexcept { return m_data && !m_region->faulted.load(); }
+
+public:
+    explicit MappedFileStream(int fd)
+        : UnixFileStream(fd)
+        , m_region(nullptr)
+        , m_data(nullptr)
+        , m_size(0)
+        , m_next_offset(0)
+        , m_sequential_reads(0)
+        , m_advice(MADV_NORMAL)
+    {
+        struct stat st;
+        UnixFileStream::fstat(&st);
+        m_size = static_cast<length_type>(st.st_size);
+        if (m_size == 0)
+            return;
+        // Too large for the address space, such as on 32-bit systems
+        if (m_size > std::numeric_limits<size_t>::max())
+            return;
+        m_region = register_mapped_region();
+        if (!m_region)
+            return;
+        void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (data == MAP_FAILED)
+        {
+            // Such as ENODEV on filesystems that cannot be mapped, so reads fall back to `pread`
+            VERBOSE_LOG("mmap of a read-only file fails, falling back to pread: %s",
+                        OSService::stringify_system_error(errno).c_str());
+            m_region->begin.store(0);
+            m_region = nullptr;
+            return;
+        }
+        m_data = static_cast<const byte*>(data);
+        m_region->end.store(reinterpret_cast<uintptr_t>(m_data) + m_size);
+        m_region->begin.store(reinterpret_cast<uintptr_t>(m_data));
+    }
+
+    ~MappedFileStream()
+    {
+        if (!m_data)
+            return;
+        m_region->end.store(0);
+        m_region->begin.store(0);
+        ::munmap(const_cast<byte*>(m_data), m_size);
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        if (!is_mapped())
+            return UnixFileStream::read(output, offset, length);
+        length = clip(offset, length);
+        if (length == 0)
+            return 0;
+        advise(offset, length);
+        memcpy(output, m_data + offset, length);
+        // The zeros put in place of truncated pages are not the contents
+        if (m_region->faulted.load())
+            return UnixFileStream::read(output, offset, length);
+        add_io_count(IOCounter::UNDERLYING_BYTES_READ, length);
+        return length;
+    }
+
+    const byte* mapped_view(offset_type offset, length_type& length) noexcept override
+    {
+        if (!is_mapped())
+            return nullptr;
+        length = clip(offset, length);
+        if (length == 0)
+            return nullptr;
+        advise(offset, length);
+        add_io_count(IOCounter::UNDERLYING_BYTES_READ, length);
+        return m_data + offset;
+    }
+
+    void write(const void*, offset_type, length_type) override { throwVFSException(EROFS); }
+
+    void sequential_write(const void*, length_type) override { throwVFSException(EROFS); }
+
+    void resize(length_type) override { throwVFSException(EROFS); }
+
+    bool punch_hole(offset_type, length_type) override { throwVFSException(EROFS); }
+
+    length_type size() const override { return is_mapped() ? m_size : UnixFileStream::size(); }
+};
+
+#if HAS_IO_URING
+/**
+ * A minimal io_uring submission/completion queue pair, shared by all streams of a mount.
+ *
+ * Writes are queued into the submission ring and only handed to the kernel in batches, either when
+ * enough of them accumulate or when someone waits for completions. Thus a run of block writes costs
+ * a single syscall instead of one `pwrite` each.
+ *
+ * All members except `create` must be called with `mutex()` held.
+ */
+class IoUring
+{
+    DISABLE_COPY_MOVE(IoUring)
+
+public:
+    struct Request
+    {
+        std::vector<byte> buffer;
+        struct iovec iov;
+        offset_type offset;
+        int result;
+        bool done;
+
+        explicit Request(const void* input, offset_type offset, length_type length)
+            : buffer(static_cast<const byte*>(input), static_cast<const byte*>(input) + length)
+            , offset(offset)
+            , result(0)
+            , done(false)
+        {
+            iov.iov_base = buffer.data();
+            iov.iov_len = buffer.size();
+        }
+
+        bool overlaps(offset_type off, length_type len) const noexcept
+        {
+            return off < offset + buffer.size() && offset < off + len;
+        }
+    };
+
+private:
+    static const unsigned SUBMIT_BATCH = 16;
+
+    int m_fd;
+    void *m_sq_ring, *m_cq_ring;
+    size_t m_sq_ring_size, m_cq_ring_size, m_sqes_size;
+    io_uring_sqe* m_sqes;
+    unsigned *m_sq_tail, *m_sq_mask, *m_sq_array;
+    unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+    io_uring_cqe* m_cqes;
+    unsigned m_capacity, m_in_flight, m_unsubmitted;
+    bool m_waiting;    // Whether a thread is blocked in the kernel for completions
+    // Requests whose streams have gone away before they complete
+    std::vector<std::unique_ptr<Request>> m_orphans;
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+
+private:
+    IoUring()
+        : m_fd(-1)
+        , m_sq_ring(MAP_FAILED)
+        , m_cq_ring(MAP_FAILED)
+        , m_sq_ring_size(0)
+        , m_cq_ring_size(0)
+        , m_sqes_size(0)
+        , m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+        , m_capacity(0)
+        , m_in_flight(0)
+        , m_unsubmitted(0)
+        , m_waiting(false)
+    {
+    }
+
+    // While a thread waits in the kernel, only it reaps, so that the completions it waits for
+    // cannot be taken from under it
+    void reap() noexcept
+    {
+        if (m_waiting)
+            return;
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+            auto request = reinterpret_cast<Request*>(static_cast<uintptr_t>(cqe.user_data));
+            request->result = cqe.res;
+            request->done = true;
+            --m_in_flight;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        auto is_done = [](const std::unique_ptr<Request>& r) { return r->done; };
+        if (!m_orphans.empty())
+            m_orphans.erase(std::remove_if(m_orphans.begin(), m_orphans.end(), is_done),
+                            m_orphans.end());
+    }
+
+    // Submits all queued entries without waiting for any of them
+    void enter()
+    {
+        while (true)
+        {
+            long rc = ::syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, 0, 0, nullptr, 0);
+            if (rc >= 0)
+            {
+                m_unsubmitted -= std::min<unsigned>(static_cast<unsigned>(rc), m_unsubmitted);
+                break;
+            }
+            if (errno == EINTR)
+                continue;
+            // The kernel is short of resources; the entries are submitted by a later call
+            if (errno == EAGAIN || errno == EBUSY)
+                break;
+            THROW_POSIX_EXCEPTION(errno, "io_uring_enter");
+        }
+        reap();
+    }
+
+    // Blocks until `done()` holds. The mutex, held by `lock`, is released while waiting.
+    template <class Predicate>
+    void wait_until(std::unique_lock<std::mutex>& lock, Predicate done)
+    {
+        if (m_unsubmitted > 0)
+            enter();
+        while (!done())
+        {
+            if (m_waiting)
+            {
+                m_completed.wait(lock);
+                continue;
+            }
+            // Entries left over by a failed submission are submitted along
+            unsigned to_submit = m_unsubmitted;
+            m_waiting = true;
+            lock.unlock();
+            long rc;
+            do
+            {
+                rc = ::syscall(
+                    __NR_io_uring_enter, m_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            } while (rc < 0 && errno == EINTR);
+            int error = rc < 0 ? errno : 0;
+            lock.lock();
+            if (rc > 0)
+                m_unsubmitted -= std::min<unsigned>(static_cast<unsigned>(rc), m_unsubmitted);
+            m_waiting = false;
+            reap();
+            m_completed.notify_all();
+            if (error && error != EAGAIN && error != EBUSY)
+                THROW_POSIX_EXCEPTION(error, "io_uring_enter");
+        }
+    }
+
+public:
+    ~IoUring()
+    {
+        // The kernel may still write into the buffers of orphaned requests
+        while (m_fd >= 0 && m_in_flight > 0)
+        {
+            long rc = ::syscall(
+                __NR_io_uring_enter, m_fd, m_unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (rc < 0 && errno != EINTR)
+                break;
+            m_unsubmitted = 0;
+            reap();
+        }
+        if (m_sqes != MAP_FAILED)
+            ::munmap(m_sqes, m_sqes_size);
+        if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+            ::munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring != MAP_FAILED)
+            ::munmap(m_sq_ring, m_sq_ring_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    // Returns null if the kernel does not support io_uring
+    static std::shared_ptr<IoUring> create(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0)
+        {
+            VERBOSE_LOG("io_uring_setup fails: %s",
+                        OSService::stringify_system_error(errno).c_str());
+            return {};
+        }
+
+        std::shared_ptr<IoUring> ring(new IoUring());
+        ring->m_fd = fd;
+        ring->m_capacity = params.sq_entries;
+        ring->m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap)
+            ring->m_sq_ring_size = ring->m_cq_ring_size
+                = std::max(ring->m_sq_ring_size, ring->m_cq_ring_size);
+
+        ring->m_sq_ring = ::mmap(nullptr,
+                                 ring->m_sq_ring_size,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE,
+                                 fd,
+                                 IORING_OFF_SQ_RING);
+        if (ring->m_sq_ring == MAP_FAILED)
+            return {};
+        if (single_mmap)
+            ring->m_cq_ring = ring->m_sq_ring;
+        else
+            ring->m_cq_ring = ::mmap(nullptr,
+                                     ring->m_cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE,
+                                     fd,
+                                     IORING_OFF_CQ_RING);
+        if (ring->m_cq_ring == MAP_FAILED)
+            return {};
+        ring->m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        ring->m_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr,
+                                                         ring->m_sqes_size,
+                                                         PROT_READ | PROT_WRITE,
+                                                         MAP_SHARED | MAP_POPULATE,
+                                                         fd,
+                                                         IORING_OFF_SQES));
+        if (ring->m_sqes == MAP_FAILED)
+            return {};
+
+        auto sq = static_cast<byte*>(ring->m_sq_ring);
+        auto cq = static_cast<byte*>(ring->m_cq_ring);
+        ring->m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->m_sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->m_cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return ring;
+    }
+
+    std::mutex& mutex() noexcept { return m_mutex; }
+
+    bool has_room() const noexcept { return m_in_flight < m_capacity; }
+
+    void wait_for_room(std::unique_lock<std::mutex>& lock)
+    {
+        wait_until(lock, [this]() { return has_room(); });
+    }
+
+    // Must only be called when there is room
+    void queue_write(int fd, Request* request) noexcept
+    {
+        unsigned tail = *m_sq_tail;
+        unsigned index = tail & *m_sq_mask;
+        io_uring_sqe* sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(&request->iov);
+        sqe->len = 1;
+        sqe->off = request->offset;
+        sqe->user_data = reinterpret_cast<uintptr_t>(request);
+        m_sq_array[index] = index;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++m_in_flight;
+        ++m_unsubmitted;
+    }
+
+    void submit_if_batched()
+    {
+        if (m_unsubmitted >= SUBMIT_BATCH)
+            enter();
+    }
+
+    void wait_for(std::unique_lock<std::mutex>& lock,
+                  const std::vector<std::unique_ptr<Request>>& requests)
+    {
+        wait_until(lock, [&requests]() {
+            return std::all_of(requests.begin(),
+                               requests.end(),
+                               [](const std::unique_ptr<Request>& r) { return r->done; });
+        });
+    }
+
+    // Takes over requests that are still in flight, to free them once they complete
+    void abandon(std::vector<std::unique_ptr<Request>>& requests)
+    {
+        for (auto&& request : requests)
+        {
+            if (!request->done)
+                m_orphans.push_back(std::move(request));
+        }
+        requests.clear();
+    }
+};
+
+/**
+ * A UnixFileStream whose writes go through io_uring and complete asynchronously.
+ *
+ * Pending writes are waited for before any other operation touches the file, and before a lock is
+ * released, so other handles never observe stale contents. Errors of asynchronous writes are
+ * reported by the next operation on the stream.
+ */
+class IoUringFileStream final : public UnixFileStream
+{
+private:
+    static const size_t MAX_PENDING_WRITES = 64;
+
+    std::shared_ptr<IoUring> m_ring;
+    // Both guarded by the ring mutex, as the stream may be written by several threads at once
+    std::vector<std::unique_ptr<IoUring::Request>> m_pending;
+    int m_deferred_error;
+    // Held for a whole drain, so that nothing reads or overwrites what it is still finishing
+    std::mutex m_drain_mutex;
+
+private:
+    void drain()
+    {
+        std::lock_guard<std::mutex> drain_guard(m_drain_mutex);
+        // Writes queued from now on go after these, so the completed ones stay pending until they
+        // are finished, for overlapping writes to wait on. Only drains remove them.
+        std::vector<IoUring::Request*> completed;
+        int error;
+        {
+            std::unique_lock<std::mutex> lock(m_ring->mutex());
+            if (!m_pending.empty())
+                m_ring->wait_for(lock, m_pending);
+            for (auto&& request : m_pending)
+                completed.push_back(request.get());
+            error = m_deferred_error;
+            m_deferred_error = 0;
+        }
+        for (IoUring::Request* request : completed)
+        {
+            int result = request->result;
+            // Requests are cancelled when the thread that submitted them exits
+            if (result == -ECANCELED || result == -EINTR || result == -EAGAIN)
+                result = 0;
+            if (result < 0)
+            {
+                if (!error)
+                    error = -result;
+                continue;
+            }
+            // Short writes are finished synchronously
+            auto written = static_cast<length_type>(result);
+            add_io_count(IOCounter::UNDERLYING_BYTES_WRITTEN, written);
+            if (written < request->buffer.size())
+            {
+                try
+                {
+                    UnixFileStream::write(request->buffer.data() + written,
+                                          request->offset + written,
+                                          request->buffer.size() - written);
+                }
+                catch (const ExceptionBase& e)
+                {
+                    if (!error)
+                        error = e.error_number();
+                }
+            }
+        }
+        std::vector<std::unique_ptr<IoUring::Request>> finished;
+        {
+            std::lock_guard<std::mutex> guard(m_ring->mutex());
+            auto end = m_pending.begin() + static_cast<ptrdiff_t>(completed.size());
+            finished.assign(std::make_move_iterator(m_pending.begin()),
+                            std::make_move_iterator(end));
+            m_pending.erase(m_pending.begin(), end);
+        }
+        if (error)
+            THROW_POSIX_EXCEPTION(error, "io_uring write");
+    }
+
+    void drain_nothrow() noexcept
+    {
+        try
+        {
+            drain();
+        }
+        catch (const std::exception& e)
+        {
+            auto ebase = dynamic_cast<const ExceptionBase*>(&e);
+            {
+                std::lock_guard<std::mutex> guard(m_ring->mutex());
+                m_deferred_error = ebase ? ebase->error_number() : EIO;
+            }
+            WARN_LOG("Asynchronous write fails: %s", e.what());
+        }
+    }
+
+public:
+    explicit IoUringFileStream(int fd, std::shared_ptr<IoUring> ring)
+        : UnixFileStream(fd), m_ring(std::move(ring)), m_deferred_error(0)
+    {
+        m_pending.reserve(MAX_PENDING_WRITES);
+    }
+
+    ~IoUringFileStream()
+    {
+        drain_nothrow();
+        std::lock_guard<std::mutex> guard(m_ring->mutex());
+        m_ring->abandon(m_pending);
+    }
+
+    void close() noexcept override
+    {
+        drain_nothrow();
+        UnixFileStream::close();
+    }
+
+    void lock(bool exclusive) override
+    {
+        drain();
+        UnixFileStream::lock(exclusive);
+    }
+
+    void unlock() noexcept override
+    {
+        drain_nothrow();
+        UnixFileStream::unlock();
+    }
+
+    void fsync() override
+    {
+        drain();
+        UnixFileStream::fsync();
+    }
+
+    void fstat(struct stat* out) override
+    {
+        drain();
+        UnixFileStream::fstat(out);
+    }
+
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        drain();
+        return UnixFileStream::read(output, offset, length);
+    }
+
+    length_type sequential_read(void* output, length_type length) override
+    {
+        drain();
+        return UnixFileStream::sequential_read(output, length);
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        if (length == 0)
+            return;
+        std::unique_ptr<IoUring::Request> request(new IoUring::Request(input, offset, length));
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_ring->mutex());
+                bool overlapped = std::any_of(
+                    m_pending.begin(),
+                    m_pending.end(),
+                    [&](const std::unique_ptr<IoUring::Request>& r) {
+                        return r->overlaps(offset, length);
+                    });
+                if (!overlapped && m_pending.size() < MAX_PENDING_WRITES)
+                {
+                    // Waiting releases the lock, so the pending writes are checked again
+                    if (!m_ring->has_room())
+                    {
+                        m_ring->wait_for_room(lock);
+                        continue;
+                    }
+                    m_ring->queue_write(m_fd, request.get());
+                    m_pending.push_back(std::move(request));
+                    m_ring->submit_if_batched();
+                    return;
+                }
+            }
+            drain();
+        }
+    }
+
+    void sequential_write(const void* input, length_type length) override
+    {
+        drain();
+        UnixFileStream::sequential_write(input, length);
+    }
+
+    void flush() override { drain(); }
+
+    void resize(length_type new_length) override
+    {
+        drain();
+        UnixFileStream::resize(new_length);
+    }
+
+    length_type hole_length(offset_type offset) override
+    {
+        // Pending writes may be filling the hole, and waiting for them would cost more than reading
+        {
+            std::lock_guard<std::mutex> guard(m_ring->mutex());
+            if (!m_pending.empty())
+                return 0;
+        }
+        return UnixFileStream::hole_length(offset);
+    }
+
+    bool punch_hole(offset_type offset, length_type length) override
+    {
+        drain();
+        return UnixFileStream::punch_hole(offset, length);
+    }
+
+    length_type size() const override
+    {
+        const_cast<IoUringFileStream*>(this)->drain();
+        return UnixFileStream::size();
+    }
+
+    void utimens(const struct fuse_timespec ts[2]) override
+    {
+        drain();
+        UnixFileStream::utimens(ts);
+    }
+};
+#endif
+
 class UnixDirectoryTraverser : public DirectoryTraverser
 {
 private:
@@ -260,7 +1058,7 @@ std::string OSService::norm_path(StringRef path) const
     return m_dir_name + path;
 }
 
-OSService::OSService() { m_dir_fd = AT_FDCWD; }
+OSService::OSService() : m_map_read_only_files(false) { m_dir_fd = AT_FDCWD; }
 
 OSService::~OSService()
 {
@@ -268,7 +1066,7 @@ OSService::~OSService()
         ::close(m_dir_fd);
 }
 
-OSService::OSService(StringRef path)
+OSService::OSService(StringRef path) : m_map_read_only_files(false)
 {
     char buffer[PATH_MAX + 1] = {0};
     char* rc = ::realpath(path.c_str(), buffer);
@@ -291,9 +1089,45 @@ OSService::open_file_stream(StringRef path, int flags, unsigned mode) const
     if (fd < 0)
         THROW_POSIX_EXCEPTION(
             errno, strprintf("Opening %s with flags %#o", norm_path(path).c_str(), flags));
+    if (m_map_read_only_files && (flags & O_ACCMODE) == O_RDONLY)
+        return std::make_shared<MappedFileStream>(fd);
+#if HAS_IO_URING
+    if (m_io_uring)
+        return std::make_shared<IoUringFileStream>(fd, m_io_uring);
+#endif
     return std::make_shared<UnixFileStream>(fd);
 }
 
+std::shared_ptr<const OSService> OSService::open_directory(StringRef path) const
+{
+    int fd = ::openat(m_dir_fd, path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        THROW_POSIX_EXCEPTION(errno, "Opening directory " + norm_path(path));
+    std::shared_ptr<OSService> result(new OSService());
+    result->m_dir_fd = fd;
+    result->m_dir_name = norm_path(path) + '/';
+    result->m_io_uring = m_io_uring;
+    result->m_map_read_only_files = m_map_read_only_files;
+    return result;
+}
+
+bool OSService::enable_mapped_reads()
+{
+    m_map_read_only_files = true;
+    return true;
+}
+
+bool OSService::enable_io_uring(unsigned queue_depth)
+{
+#if HAS_IO_URING
+    m_io_uring = IoUring::create(queue_depth);
+    return m_io_uring != nullptr;
+#else
+    (void)queue_depth;
+    return false;
+#endif
+}
+
 void OSService::remove_file(StringRef path) const
 {
     int rc = ::unlinkat(m_dir_fd, path.c_str(), 0);
@@ -357,6 +1191,26 @@ void OSService::rename(StringRef a, StringRef b) const
             errno, strprintf("Renaming from %s to %s", norm_path(a).c_str(), norm_path(b).c_str()));
 }
 
+void OSService::rename_at(StringRef a, const OSService& dest_dir, StringRef b) const
+{
+    int rc = ::renameat(m_dir_fd, a.c_str(), dest_dir.m_dir_fd, b.c_str());
+    if (rc < 0)
+        THROW_POSIX_EXCEPTION(errno,
+                              strprintf("Renaming from %s to %s",
+                                        norm_path(a).c_str(),
+                                        dest_dir.norm_path(b).c_str()));
+}
+
+void OSService::link_at(StringRef source, const OSService& dest_dir, StringRef dest) const
+{
+    int rc = ::linkat(m_dir_fd, source.c_str(), dest_dir.m_dir_fd, dest.c_str(), 0);
+    if (rc < 0)
+        THROW_POSIX_EXCEPTION(errno,
+                              strprintf("link src=%s dest=%s",
+                                        norm_path(source).c_str(),
+                                        dest_dir.norm_path(dest).c_str()));
+}
+
 bool OSService::stat(StringRef path, struct fuse_stat* stat) const
 {
     int rc = ::fstatat(m_dir_fd, path.c_str(), stat, AT_SYMLINK_NOFOLLOW);
@@ -433,6 +1287,80 @@ std::unique_ptr<DirectoryTraverser> OSService::create_traverser(StringRef dir) c
     return securefs::make_unique<UnixDirectoryTraverser>(norm_path(dir));
 }
 
+namespace
+{
+    int signal_pipe[2] = {-1, -1};
+    std::mutex signal_callbacks_mutex;
+    std::vector<std::pair<int, std::function<void()>>> signal_callbacks;
+
+    void on_listened_signal(int signal_number)
+    {
+        int saved_errno = errno;
+        auto c = static_cast<unsigned char>(signal_number);
+        (void)::write(signal_pipe[1], &c, 1);
+        errno = saved_errno;
+    }
+
+    void run_signal_callbacks()
+    {
+        while (true)
+        {
+            unsigned char c;
+            auto rc = ::read(signal_pipe[0], &c, 1);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                break;
+            std::function<void()> callback;
+            {
+                std::lock_guard<std::mutex> lock(signal_callbacks_mutex);
+                for (auto&& pair : signal_callbacks)
+                {
+                    if (pair.first == c)
+                        callback = pair.second;
+                }
+            }
+            if (!callback)
+                continue;
+            try
+            {
+                callback();
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to handle signal %d: %s", static_cast<int>(c), e.what());
+            }
+        }
+    }
+}    // namespace
+
+void OSService::call_on_signal(int signal_number, std::function<void()> callback)
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        if (::pipe(signal_pipe) < 0)
+            THROW_POSIX_EXCEPTION(errno, "pipe");
+        std::thread(&run_signal_callbacks).detach();
+    });
+    {
+        std::lock_guard<std::mutex> lock(signal_callbacks_mutex);
+        for (auto&& pair : signal_callbacks)
+        {
+            if (pair.first == signal_number)
+                return;
+        }
+        signal_callbacks.emplace_back(signal_number, std::move(callback));
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &on_listened_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (::sigaction(signal_number, &action, nullptr) < 0)
+        THROW_POSIX_EXCEPTION(errno, "sigaction");
+}
+
 uint32_t OSService::getuid() noexcept { return ::getuid(); }
 uint32_t OSService::getgid() noexcept { return ::getgid(); }
 
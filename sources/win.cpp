@@ -787,6 +787,10 @@ OSService::open_file_stream(StringRef path, int flags, unsigned mode) const
     return std::make_shared<WindowsFileStream>(norm_path(path), flags, mode);
 }
 
+bool OSService::enable_mapped_reads() { return false; }
+
+bool OSService::enable_io_uring(unsigned) { return false; }
+
 void OSService::remove_file(StringRef path) const
 {
     CHECK_CALL(DeleteFileW(norm_path(path).c_str()));
@@ -909,6 +913,19 @@ void OSService::rename(StringRef a, StringRef b) const
         THROW_WINDOWS_EXCEPTION_WITH_TWO_PATHS(GetLastError(), L"MoveFileExW", wa, wb);
 }
 
+void OSService::rename_at(StringRef a, const OSService& dest_dir, StringRef b) const
+{
+    auto wa = norm_path(a);
+    auto wb = dest_dir.norm_path(b);
+    if (!MoveFileExW(wa.c_str(), wb.c_str(), MOVEFILE_REPLACE_EXISTING))
+        THROW_WINDOWS_EXCEPTION_WITH_TWO_PATHS(GetLastError(), L"MoveFileExW", wa, wb);
+}
+
+void OSService::link_at(StringRef, const OSService&, StringRef) const
+{
+    throwVFSException(ENOSYS);
+}
+
 int OSService::raise_fd_limit()
 {
     return 65535;
@@ -992,6 +1009,8 @@ std::unique_ptr<DirectoryTraverser> OSService::create_traverser(StringRef dir) c
     return securefs::make_unique<WindowsDirectoryTraverser>(norm_path(dir) + L"\\*");
 }
 
+std::shared_ptr<const OSService> OSService::open_directory(StringRef) const { return {}; }
+
 uint32_t OSService::getuid() noexcept { return 0; }
 
 uint32_t OSService::getgid() noexcept { return 0; }
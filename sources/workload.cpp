@@ -0,0 +1,596 @@
+#include "workload.h"
+#include "benchmark.h"
+#include "constants.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "lite_operations.h"
+#include "logger.h"
+#include "operations.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string.h>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const size_t SMALL_FILE_SIZE = 4096, COPY_CHUNK_SIZE = 128 << 10, PAGE_SIZE = 4096;
+    const unsigned FILES_PER_SOURCE_DIRECTORY = 100, STAT_PASSES = 3, WRITES_PER_FSYNC = 100;
+
+    void check(int rc, const char* call, const std::string& path)
+    {
+        if (rc < 0)
+            throw_runtime_error(strprintf("%s %s: %s",
+                                          call,
+                                          path.c_str(),
+                                          OSService::stringify_system_error(-rc).c_str()));
+    }
+
+    int collect_name(void* buf, const char* name, const struct fuse_stat*, fuse_off_t)
+    {
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            static_cast<std::vector<std::string>*>(buf)->emplace_back(name);
+        return 0;
+    }
+
+    // The calls of one thread in one scenario
+    class Worker
+    {
+    private:
+        const fuse_operations& m_ops;
+        std::mutex* m_serial;
+        std::vector<byte> m_buffer;
+
+        // The full format is always mounted single threaded, so FUSE serializes its calls
+        std::unique_lock<std::mutex> serialize()
+        {
+            return m_serial ? std::unique_lock<std::mutex>(*m_serial)
+                            : std::unique_lock<std::mutex>();
+        }
+
+    public:
+        const WorkloadOptions& options;
+        std::string base;    // The directory of this thread
+        std::mt19937 random;
+        LatencyRecorder recorder;
+
+        explicit Worker(const fuse_operations& ops,
+                        std::mutex* serial,
+                        const WorkloadOptions& options,
+                        std::string base,
+                        uint32_t seed)
+            : m_ops(ops), m_serial(serial), options(options), base(std::move(base)), random(seed)
+        {
+        }
+
+        // A buffer of at least `size` bytes of random data
+        byte* buffer(size_t size)
+        {
+            if (m_buffer.size() < size)
+            {
+                m_buffer.resize(size);
+                generate_random(m_buffer.data(), m_buffer.size());
+            }
+            return m_buffer.data();
+        }
+
+        // Times a single operation that transfers `length` bytes
+        template <class Func>
+        void measure(length_type length, Func&& func)
+        {
+            recorder.measure(length, std::forward<Func>(func));
+        }
+
+        void mkdir(const std::string& path)
+        {
+            auto lock = serialize();
+            check(m_ops.mkdir(path.c_str(), 0755), "mkdir", path);
+        }
+
+        uint64_t create(const std::string& path)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.flags = O_RDWR | O_CREAT | O_EXCL;
+            check(m_ops.create(path.c_str(), S_IFREG | 0644, &info), "create", path);
+            return info.fh;
+        }
+
+        uint64_t open(const std::string& path, int flags)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.flags = flags;
+            check(m_ops.open(path.c_str(), &info), "open", path);
+            return info.fh;
+        }
+
+        void release(const std::string& path, uint64_t fh)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.fh = fh;
+            check(m_ops.release(path.c_str(), &info), "release", path);
+        }
+
+        void
+        write(const std::string& path, uint64_t fh, const void* data, size_t size, offset_type off)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.fh = fh;
+            int rc = m_ops.write(path.c_str(),
+                                 static_cast<const char*>(data),
+                                 size,
+                                 static_cast<fuse_off_t>(off),
+                                 &info);
+            check(rc, "write", path);
+            if (static_cast<size_t>(rc) != size)
+                throw_runtime_error("Short write to " + path);
+        }
+
+        size_t read(const std::string& path, uint64_t fh, void* data, size_t size, offset_type off)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.fh = fh;
+            int rc = m_ops.read(path.c_str(),
+                                static_cast<char*>(data),
+                                size,
+                                static_cast<fuse_off_t>(off),
+                                &info);
+            check(rc, "read", path);
+            return static_cast<size_t>(rc);
+        }
+
+        void fsync(const std::string& path, uint64_t fh)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            info.fh = fh;
+            check(m_ops.fsync(path.c_str(), 0, &info), "fsync", path);
+        }
+
+        void getattr(const std::string& path)
+        {
+            auto lock = serialize();
+            struct fuse_stat st;
+            check(m_ops.getattr(path.c_str(), &st), "getattr", path);
+        }
+
+        void unlink(const std::string& path)
+        {
+            auto lock = serialize();
+            check(m_ops.unlink(path.c_str()), "unlink", path);
+        }
+
+        void rmdir(const std::string& path)
+        {
+            auto lock = serialize();
+            check(m_ops.rmdir(path.c_str()), "rmdir", path);
+        }
+
+        std::vector<std::string> list(const std::string& path)
+        {
+            auto lock = serialize();
+            struct fuse_file_info info;
+            memset(&info, 0, sizeof(info));
+            check(m_ops.opendir(path.c_str(), &info), "opendir", path);
+            std::vector<std::string> names;
+            int rc = m_ops.readdir(path.c_str(), &names, &collect_name, 0, &info);
+            check(m_ops.releasedir(path.c_str(), &info), "releasedir", path);
+            check(rc, "readdir", path);
+            return names;
+        }
+
+        void write_file(const std::string& path, length_type size)
+        {
+            uint64_t fh = create(path);
+            for (offset_type off = 0; off < size; off += COPY_CHUNK_SIZE)
+            {
+                auto length
+                    = static_cast<size_t>(std::min<length_type>(COPY_CHUNK_SIZE, size - off));
+                write(path, fh, buffer(length), length, off);
+            }
+            release(path, fh);
+        }
+
+        // Directories are named "d*" and files "f*"
+        void make_tree(const std::string& path, unsigned depth)
+        {
+            mkdir(path);
+            for (unsigned i = 0; i < options.tree_fanout; ++i)
+                write_file(strprintf("%s/f%u", path.c_str(), i), SMALL_FILE_SIZE);
+            if (depth == 0)
+                return;
+            for (unsigned i = 0; i < options.tree_fanout; ++i)
+                make_tree(strprintf("%s/d%u", path.c_str(), i), depth - 1);
+        }
+    };
+
+    struct Scenario
+    {
+        const char* name;
+        std::function<void(Worker&)> prepare, run;
+    };
+
+    std::string source_file_name(const std::string& base, unsigned i)
+    {
+        return strprintf("%s/s%u/f%u", base.c_str(), i / FILES_PER_SOURCE_DIRECTORY, i);
+    }
+
+    void walk_tree(Worker& w, const std::string& path)
+    {
+        std::vector<std::string> names;
+        w.measure(0, [&]() { names = w.list(path); });
+        for (const std::string& name : names)
+        {
+            if (name[0] == 'd')
+                walk_tree(w, path + '/' + name);
+        }
+    }
+
+    void remove_tree(Worker& w, const std::string& path)
+    {
+        for (const std::string& name : w.list(path))
+        {
+            std::string child = path + '/' + name;
+            if (name[0] == 'd')
+                remove_tree(w, child);
+            else
+                w.measure(0, [&]() { w.unlink(child); });
+        }
+        w.measure(0, [&]() { w.rmdir(path); });
+    }
+
+    const std::vector<Scenario>& all_scenarios()
+    {
+        static const std::vector<Scenario> scenarios{
+            {"create_storm",
+             [](Worker& w) { w.mkdir(w.base); },
+             [](Worker& w) {
+                 for (unsigned i = 0; i < w.options.num_files; ++i)
+                 {
+                     std::string path = strprintf("%s/f%u", w.base.c_str(), i);
+                     w.measure(SMALL_FILE_SIZE, [&]() {
+                         uint64_t fh = w.create(path);
+                         w.write(path, fh, w.buffer(SMALL_FILE_SIZE), SMALL_FILE_SIZE, 0);
+                         w.release(path, fh);
+                     });
+                 }
+             }},
+            {"stat_storm",
+             [](Worker& w) {
+                 w.mkdir(w.base);
+                 for (unsigned i = 0; i < w.options.num_files; ++i)
+                 {
+                     if (i % FILES_PER_SOURCE_DIRECTORY == 0)
+                         w.mkdir(strprintf(
+                             "%s/s%u", w.base.c_str(), i / FILES_PER_SOURCE_DIRECTORY));
+                     w.write_file(source_file_name(w.base, i), SMALL_FILE_SIZE);
+                 }
+             },
+             [](Worker& w) {
+                 for (unsigned pass = 0; pass < STAT_PASSES; ++pass)
+                 {
+                     for (unsigned i = 0; i < w.options.num_files; ++i)
+                     {
+                         std::string path = source_file_name(w.base, i);
+                         w.measure(0, [&]() { w.getattr(path); });
+                     }
+                 }
+             }},
+            {"sequential_copy",
+             [](Worker& w) {
+                 w.mkdir(w.base);
+                 w.write_file(w.base + "/source", w.options.copy_size);
+             },
+             [](Worker& w) {
+                 std::string source = w.base + "/source", destination = w.base + "/copy";
+                 uint64_t in = w.open(source, O_RDONLY);
+                 uint64_t out = w.create(destination);
+                 std::vector<byte> chunk(COPY_CHUNK_SIZE);
+                 for (offset_type off = 0; off < w.options.copy_size; off += COPY_CHUNK_SIZE)
+                 {
+                     w.measure(COPY_CHUNK_SIZE, [&]() {
+                         size_t length = w.read(source, in, chunk.data(), chunk.size(), off);
+                         w.write(destination, out, chunk.data(), length, off);
+                     });
+                 }
+                 w.release(source, in);
+                 w.release(destination, out);
+             }},
+            {"random_io",
+             [](Worker& w) {
+                 w.mkdir(w.base);
+                 w.write_file(w.base + "/database", w.options.database_size);
+             },
+             [](Worker& w) {
+                 std::string path = w.base + "/database";
+                 uint64_t fh = w.open(path, O_RDWR);
+                 std::vector<byte> page(PAGE_SIZE);
+                 auto num_pages
+                     = std::max<length_type>(w.options.database_size / PAGE_SIZE, 1);
+                 unsigned num_writes = 0;
+                 for (unsigned i = 0; i < w.options.num_random_ops; ++i)
+                 {
+                     offset_type off = w.random() % num_pages * PAGE_SIZE;
+                     // Mostly reads, as in a typical OLTP mix
+                     if (w.random() % 10 < 7)
+                     {
+                         w.measure(PAGE_SIZE,
+                                   [&]() { w.read(path, fh, page.data(), PAGE_SIZE, off); });
+                         continue;
+                     }
+                     w.measure(PAGE_SIZE, [&]() {
+                         w.write(path, fh, w.buffer(PAGE_SIZE), PAGE_SIZE, off);
+                     });
+                     if (++num_writes % WRITES_PER_FSYNC == 0)
+                         w.measure(0, [&]() { w.fsync(path, fh); });
+                 }
+                 w.release(path, fh);
+             }},
+            {"readdir_tree",
+             [](Worker& w) { w.make_tree(w.base, w.options.tree_depth); },
+             [](Worker& w) { walk_tree(w, w.base); }},
+            {"remove_tree",
+             [](Worker& w) { w.make_tree(w.base, w.options.tree_depth); },
+             [](Worker& w) { remove_tree(w, w.base); }},
+        };
+        return scenarios;
+    }
+
+    // Lets the threads start their timed phase together
+    class StartLine
+    {
+    private:
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        unsigned m_waiting;
+        Clock::time_point m_start;
+
+    public:
+        explicit StartLine(unsigned num_threads) : m_waiting(num_threads) {}
+
+        void arrive()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (--m_waiting == 0)
+            {
+                m_start = Clock::now();
+                m_cond.notify_all();
+                return;
+            }
+            m_cond.wait(lock, [this]() { return m_waiting == 0; });
+        }
+
+        Clock::time_point start() const noexcept { return m_start; }
+    };
+
+    Json::Value run_scenario(const fuse_operations& ops,
+                             std::mutex* serial,
+                             const WorkloadOptions& options,
+                             const Scenario& scenario)
+    {
+        std::vector<Worker> workers;
+        for (unsigned i = 0; i < options.num_threads; ++i)
+            workers.emplace_back(
+                ops, serial, options, strprintf("/%s-%u", scenario.name, i), options.seed + i);
+
+        StartLine start_line(options.num_threads);
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        std::vector<Clock::time_point> finish_times(options.num_threads);
+        std::vector<std::thread> threads;
+        // The lite filesystems are cached per thread, so every scenario gets fresh threads
+        for (unsigned i = 0; i < options.num_threads; ++i)
+        {
+            threads.emplace_back([&, i]() {
+                bool prepared = false;
+                try
+                {
+                    scenario.prepare(workers[i]);
+                    prepared = true;
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    error = std::current_exception();
+                }
+                start_line.arrive();
+                try
+                {
+                    if (prepared)
+                        scenario.run(workers[i]);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    error = std::current_exception();
+                }
+                finish_times[i] = Clock::now();
+            });
+        }
+        for (std::thread& t : threads)
+            t.join();
+        if (error)
+            std::rethrow_exception(error);
+
+        auto finish = *std::max_element(finish_times.begin(), finish_times.end());
+        LatencyRecorder total;
+        for (const Worker& w : workers)
+            total.merge(w.recorder);
+        return total.summarize(std::chrono::duration<double>(finish - start_line.start()).count());
+    }
+
+    void remove_recursively(const OSService& root, const std::string& dir)
+    {
+        root.recursive_traverse(
+            dir,
+            [&root](StringRef parent, StringRef name) { root.remove_file(parent + "/" + name); },
+            [&root](StringRef parent, StringRef name) {
+                root.remove_directory(parent + "/" + name);
+            });
+        root.remove_directory(dir);
+    }
+
+    // A scratch filesystem whose operations are called as if mounted
+    class ScratchMount
+    {
+        DISABLE_COPY_MOVE(ScratchMount)
+
+    private:
+        std::string m_dir;
+        operations::MountOptions m_options;
+        struct fuse_context m_context;
+
+    public:
+        struct fuse_operations ops;
+        std::mutex serial;
+
+        explicit ScratchMount(const WorkloadOptions& options, bool lite)
+        {
+            if (!options.storage.in_memory)
+            {
+                m_dir = options.directory + '/'
+                    + OSService::temp_name("securefs-workload", ".dir");
+                OSService::get_default().mkdir(m_dir, 0755);
+            }
+            m_options.version = lite ? 4 : 2;
+            m_options.root = open_storage(m_dir, options.storage);
+            m_options.master_key.resize(lite ? 3 * KEY_LENGTH : KEY_LENGTH);
+            generate_random(m_options.master_key.data(), m_options.master_key.size());
+            m_options.flags = options.flags;
+            if (options.cipher == AEADAlgorithm::CHACHA20_POLY1305)
+                m_options.flags.value() |= kOptionChaCha20Poly1305;
+            m_options.block_size = options.block_size;
+            m_options.iv_size = options.iv_size;
+
+            if (lite)
+            {
+                lite::init_fuse_operations(&ops, false);
+            }
+            else
+            {
+                operations::init_fuse_operations(&ops, false);
+                // As the create command does
+                operations::FileSystemContext fs(m_options);
+                auto root = fs.table.create_as(fs.root_id, FileBase::DIRECTORY);
+                root->set_uid(OSService::getuid());
+                root->set_gid(OSService::getgid());
+                root->set_mode(S_IFDIR | 0755);
+                root->set_nlink(1);
+                root->flush();
+            }
+
+            memset(&m_context, 0, sizeof(m_context));
+            m_context.uid = OSService::getuid();
+            m_context.gid = OSService::getgid();
+            m_context.umask = 022;
+            m_context.private_data = &m_options;
+            operations::override_fuse_context(&m_context);
+            struct fuse_conn_info conn;
+            memset(&conn, 0, sizeof(conn));
+            m_context.private_data = ops.init(&conn);
+        }
+
+        ~ScratchMount()
+        {
+            ops.destroy(m_context.private_data);
+            operations::override_fuse_context(nullptr);
+            if (m_dir.empty())
+                return;
+            try
+            {
+                remove_recursively(OSService::get_default(), m_dir);
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to remove %s: %s", m_dir.c_str(), e.what());
+            }
+        }
+    };
+}    // namespace
+
+const std::vector<std::string>& workload_scenario_names()
+{
+    static const std::vector<std::string> names = []() {
+        std::vector<std::string> result;
+        for (const Scenario& s : all_scenarios())
+            result.emplace_back(s.name);
+        return result;
+    }();
+    return names;
+}
+
+Json::Value run_workloads(const WorkloadOptions& options)
+{
+    auto contains = [](const std::vector<std::string>& list, const std::string& value) {
+        return list.empty() || std::find(list.begin(), list.end(), value) != list.end();
+    };
+    for (const std::string& format : options.formats)
+    {
+        if (format != "full" && format != "lite")
+            throwInvalidArgumentException(strprintf("Unknown format %s", format.c_str()));
+    }
+    for (const std::string& name : options.scenarios)
+    {
+        if (!contains(workload_scenario_names(), name))
+            throwInvalidArgumentException(strprintf("Unknown scenario %s", name.c_str()));
+    }
+    if (options.num_threads == 0)
+        throwInvalidArgumentException("The number of threads must be positive");
+
+    Json::Value report;
+    Json::Value& config = report["config"];
+    config["num_threads"] = options.num_threads;
+    config["num_files"] = options.num_files;
+    config["copy_size"] = static_cast<Json::UInt64>(options.copy_size);
+    config["database_size"] = static_cast<Json::UInt64>(options.database_size);
+    config["num_random_ops"] = options.num_random_ops;
+    config["tree_depth"] = options.tree_depth;
+    config["tree_fanout"] = options.tree_fanout;
+    config["block_size"] = options.block_size;
+    config["iv_size"] = options.iv_size;
+    config["flags"] = options.flags;
+    config["cipher"] = aead_algorithm_name(options.cipher);
+    config["seed"] = options.seed;
+    config["storage"] = options.storage.in_memory ? "memory" : "disk";
+    config["storage_latency_us"] = options.storage.latency_us;
+    config["storage_megabytes_per_second"] = options.storage.megabytes_per_second;
+
+    Json::Value& results = report["results"];
+    for (const char* format : {"full", "lite"})
+    {
+        if (!contains(options.formats, format))
+            continue;
+        bool lite = strcmp(format, "lite") == 0;
+        ScratchMount mount(options, lite);
+        for (const Scenario& scenario : all_scenarios())
+        {
+            if (contains(options.scenarios, scenario.name))
+                results[format][scenario.name] = run_scenario(
+                    mount.ops, lite ? nullptr : &mount.serial, options, scenario);
+        }
+    }
+    return report;
+}
+}    // namespace securefs
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "aead.h"
+#include "myutils.h"
+#include "storage.h"
+
+#include <json/json.h>
+
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+/**
+ * Parameters of the end-to-end workloads, which call the filesystem operations of each format
+ * in-process, the way FUSE would, on a scratch filesystem. The sizes and counts are per thread.
+ */
+struct WorkloadOptions
+{
+    std::string directory;    // Where the scratch filesystems are created and later removed
+    StorageOptions storage;    // Of the scratch filesystems, which ignore `directory` if in memory
+    std::vector<std::string> formats;    // Any of "full" and "lite"; empty for both
+    std::vector<std::string> scenarios;    // Names from `workload_scenario_names()`; empty for all
+    unsigned num_threads = 4;
+    unsigned num_files = 1000;    // Of the create and stat storms
+    length_type copy_size = 16 << 20;
+    length_type database_size = 16 << 20;
+    unsigned num_random_ops = 5000;
+    unsigned tree_depth = 4, tree_fanout = 4;    // Each directory also holds `tree_fanout` files
+    unsigned block_size = 4096;
+    unsigned iv_size = 12;
+    uint32_t flags = 0;    // Mount options such as `kOptionCaseFoldFileName`, added to both formats
+    AEADAlgorithm cipher = AEADAlgorithm::AES_GCM;
+    uint32_t seed = 0;    // Of the random offsets, so that runs are comparable
+};
+
+/**
+ * The scenarios, in the order they run:
+ *
+ * create_storm: creates small files in a single directory, as unpacking an archive does.
+ * stat_storm: stats every file of a source tree a few times over, as `git status` does.
+ * sequential_copy: copies a large file in 128 KiB chunks.
+ * random_io: reads and writes 4 KiB pages of a database file at random, with periodic fsync.
+ * readdir_tree: lists every directory of a deep tree.
+ * remove_tree: removes a deep tree, as `rm -rf` does.
+ */
+const std::vector<std::string>& workload_scenario_names();
+
+/**
+ * Runs the selected scenarios on each selected format with all threads at once, and returns the
+ * results keyed by format then by scenario. Each result reports the number of operations, the
+ * elapsed seconds, the throughput in operations per second and MB/s, and percentiles of the per
+ * operation latency in microseconds. Preparing the files a scenario works on is not timed. The
+ * calls on the full format are serialized, since it is always mounted single threaded.
+ */
+Json::Value run_workloads(const WorkloadOptions& options);
+}    // namespace securefs
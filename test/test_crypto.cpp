@@ -1,8 +1,15 @@
 #include <catch.hpp>
 
+#include "aead.h"
 #include "crypto.h"
 #include "lite_fs.h"
 
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 static void test_siv_encryption(const void* key,
@@ -303,19 +310,103 @@ static void test_scrypt(const char* password,
                         size_t dkLen,
                         const char* expected)
 {
-    std::vector<byte> output(dkLen);
-    securefs::libscrypt_scrypt(reinterpret_cast<const byte*>(password),
-                               strlen(password),
-                               reinterpret_cast<const byte*>(salt),
-                               strlen(salt),
-                               N,
-                               r,
-                               p,
-                               output.data(),
-                               dkLen);
-    CAPTURE(password);
-    CAPTURE(salt);
-    CHECK(memcmp(expected, output.data(), dkLen) == 0);
+    for (bool allow_simd : {false, true})
+    {
+        std::vector<byte> output(dkLen);
+        securefs::libscrypt_scrypt(reinterpret_cast<const byte*>(password),
+                                   strlen(password),
+                                   reinterpret_cast<const byte*>(salt),
+                                   strlen(salt),
+                                   N,
+                                   r,
+                                   p,
+                                   output.data(),
+                                   dkLen,
+                                   allow_simd);
+        CAPTURE(password);
+        CAPTURE(salt);
+        CAPTURE(allow_simd);
+        CHECK(memcmp(expected, output.data(), dkLen) == 0);
+    }
+}
+
+TEST_CASE("ChaCha20-Poly1305 RFC")
+{
+    // https://tools.ietf.org/html/rfc8439#section-2.8.2
+    byte key[32];
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = static_cast<byte>(0x80 + i);
+    const byte iv[] = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    const byte aad[] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    const char* plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only "
+                            "one tip for the future, sunscreen would be it.";
+    const char* expected_ciphertext
+        = "\xd3\x1a\x8d\x34\x64\x8e\x60\xdb\x7b\x86\xaf\xbc\x53\xef\x7e\xc2\xa4\xad\xed\x51\x29"
+          "\x6e\x08\xfe\xa9\xe2\xb5\xa7\x36\xee\x62\xd6\x3d\xbe\xa4\x5e\x8c\xa9\x67\x12\x82\xfa"
+          "\xfb\x69\xda\x92\x72\x8b\x1a\x71\xde\x0a\x9e\x06\x0b\x29\x05\xd6\xa5\xb6\x7e\xcd\x3b"
+          "\x36\x92\xdd\xbd\x7f\x2d\x77\x8b\x8c\x98\x03\xae\xe3\x28\x09\x1b\x58\xfa\xb3\x24\xe4"
+          "\xfa\xd6\x75\x94\x55\x85\x80\x8b\x48\x31\xd7\xbc\x3f\xf4\xde\xf0\x8e\x4b\x7a\x9d\xe5"
+          "\x76\xd2\x65\x86\xce\xc6\x4b\x61\x16";
+    const char* expected_mac
+        = "\x1a\xe1\x0b\x59\x4f\x09\xe2\x6a\x7e\x90\x2e\xcb\xd0\x60\x06\x91";
+    size_t length = strlen(plaintext);
+    REQUIRE(length == 114);
+
+    auto context = securefs::make_aead_context(securefs::AEADAlgorithm::CHACHA20_POLY1305);
+    context->set_key(key, sizeof(key));
+    std::vector<byte> ciphertext(length), decrypted(length);
+    byte mac[16];
+    context->encrypt(ciphertext.data(),
+                     mac,
+                     sizeof(mac),
+                     iv,
+                     sizeof(iv),
+                     aad,
+                     sizeof(aad),
+                     reinterpret_cast<const byte*>(plaintext),
+                     length);
+    CHECK(memcmp(ciphertext.data(), expected_ciphertext, length) == 0);
+    CHECK(memcmp(mac, expected_mac, sizeof(mac)) == 0);
+
+    REQUIRE(context->decrypt(decrypted.data(),
+                             mac,
+                             sizeof(mac),
+                             iv,
+                             sizeof(iv),
+                             aad,
+                             sizeof(aad),
+                             ciphertext.data(),
+                             length));
+    CHECK(memcmp(decrypted.data(), plaintext, length) == 0);
+
+    ciphertext[17] ^= 1;
+    CHECK(!context->decrypt(decrypted.data(),
+                            mac,
+                            sizeof(mac),
+                            iv,
+                            sizeof(iv),
+                            aad,
+                            sizeof(aad),
+                            ciphertext.data(),
+                            length));
+    REQUIRE(context->decrypt_unverified(
+        decrypted.data(), iv, sizeof(iv), ciphertext.data(), length));
+    CHECK(decrypted[17] == (plaintext[17] ^ 1));
+    CHECK_THROWS(context->decrypt_unverified(decrypted.data(), iv, 16, ciphertext.data(), length));
+
+    // Long inputs go through the vectorized keystream where available; it must agree with the
+    // keystream computed one block at a time
+    securefs::ChaCha20Poly1305Context chacha;
+    chacha.set_key(key, sizeof(key));
+    std::vector<byte> zeros(64 * 9 + 5), whole(zeros.size()), pieces(zeros.size());
+    chacha.chacha20(iv, 1, zeros.data(), whole.data(), zeros.size());
+    for (size_t i = 0; i < zeros.size(); i += 64)
+        chacha.chacha20(iv,
+                        static_cast<uint32_t>(1 + i / 64),
+                        zeros.data() + i,
+                        pieces.data() + i,
+                        std::min<size_t>(64, zeros.size() - i));
+    CHECK(whole == pieces);
 }
 
 TEST_CASE("scrypt")
@@ -363,3 +454,71 @@ TEST_CASE("scrypt")
     "\x21\x01\xcb\x9b\x6a\x51\x1a\xae\xad\xdb\xbe\x09\xcf\x70\xf8\x81\xec\x56\x8d\x57\x4a\x2f\xfd\x4d\xab\xe5\xee\x98\x20\xad\xaa\x47\x8e\x56\xfd\x8f\x4b\xa5\xd0\x9f\xfa\x1c\x6d\x92\x7c\x40\xf4\xc3\x37\x30\x40\x49\xe8\xa9\x52\xfb\xcb\xf4\x5c\x6f\xa7\x7a\x41\xa4");
      **/
 }
+
+TEST_CASE("IV generation")
+{
+    std::set<std::string> ivs;
+    std::mutex mutex;
+    auto generate = [&]() {
+        for (int i = 0; i < 2000; ++i)
+        {
+            std::string iv(12, 0);
+            securefs::generate_iv(&iv[0], iv.size());
+            std::lock_guard<std::mutex> guard(mutex);
+            ivs.insert(iv);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back(generate);
+    for (auto&& t : threads)
+        t.join();
+    // Crossing batch boundaries and across threads, no IV is repeated
+    CHECK(ivs.size() == 8000);
+
+    std::vector<byte> large(100000);
+    securefs::generate_iv(large.data(), large.size());
+    CHECK(!securefs::is_all_zeros(large.data() + large.size() - 16, 16));
+}
+
+TEST_CASE("IV generation throughput", "[.benchmark]")
+{
+    const int count = 1000000;
+    byte iv[12];
+    auto measure = [&](void (*function)(void*, size_t)) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i)
+            function(iv, sizeof(iv));
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double random_seconds = measure(&securefs::generate_random);
+    double iv_seconds = measure(&securefs::generate_iv);
+    printf("12-byte IVs: generate_random %.1f ns/op, generate_iv %.1f ns/op\n",
+           random_seconds / count * 1e9,
+           iv_seconds / count * 1e9);
+}
+
+TEST_CASE("scrypt throughput", "[.benchmark]")
+{
+    byte output[32];
+    auto measure = [&](bool allow_simd) {
+        auto start = std::chrono::steady_clock::now();
+        securefs::libscrypt_scrypt(reinterpret_cast<const byte*>("password"),
+                                   8,
+                                   reinterpret_cast<const byte*>("salt"),
+                                   4,
+                                   65536,
+                                   8,
+                                   1,
+                                   output,
+                                   sizeof(output),
+                                   allow_simd);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double scalar_seconds = measure(false);
+    double simd_seconds = measure(true);
+    printf("scrypt N=65536 r=8 p=1: scalar %.3f s, SIMD %.3f s (%s)\n",
+           scalar_seconds,
+           simd_seconds,
+           securefs::libscrypt_has_simd() ? "available" : "unavailable");
+}
@@ -1,13 +1,24 @@
 #include "catch.hpp"
 #include "crypto.h"
+#include "dir_cache.h"
 #include "exceptions.h"
+#include "fd_pool.h"
 #include "file_table.h"
 #include "files.h"
+#include "lite_fs.h"
+#include "lite_operations.h"
+#include "operations.h"
+#include "stats.h"
+#include "storage.h"
+#include "trace.h"
+#include "workload.h"
 
 #include <algorithm>
+#include <chrono>
 #include <errno.h>
 #include <set>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 TEST_CASE("File table")
@@ -78,3 +89,418 @@ TEST_CASE("File table")
         table.close(dir);
     }
 }
+
+TEST_CASE("Inline storage of tiny files")
+{
+    using namespace securefs;
+    auto base_dir = OSService::temp_name("tmp/inline_files", ".dir");
+    OSService::get_default().ensure_directory(base_dir, 0755);
+
+    key_type master_key(0x2b);
+    id_type file_id, link_id;
+    generate_random(file_id.data(), file_id.size());
+    generate_random(link_id.data(), link_id.size());
+    const std::string tiny = "tiny contents", target = "some/where/else";
+    std::vector<byte> large(1000);
+    generate_random(large.data(), large.size());
+
+    auto root = std::make_shared<OSService>(base_dir);
+    auto data_size = [&](const id_type& id) {
+        struct fuse_stat st;
+        REQUIRE(root->stat(hexify(id.data(), 1) + '/' + hexify(id.data() + 1, id.size() - 1), &st));
+        return st.st_size;
+    };
+
+    {
+        FileTable table(2, root, master_key, 0, 4096, 12, 256);
+        auto file = dynamic_cast<RegularFile*>(table.create_as(file_id, FileBase::REGULAR_FILE));
+        file->initialize_empty(S_IFREG | 0644, 0, 0);
+        file->write(tiny.data(), 0, tiny.size());
+        auto link = dynamic_cast<Symlink*>(table.create_as(link_id, FileBase::SYMLINK));
+        link->initialize_empty(S_IFLNK | 0755, 0, 0);
+        link->set(target);
+        table.close(file);
+        table.close(link);
+    }
+    CHECK(data_size(file_id) == 0);
+    CHECK(data_size(link_id) == 0);
+
+    {
+        auto fd_pool = std::make_shared<FileDescriptorPool>(16);
+        FileTable table(2, root, master_key, 0, 4096, 12, 256, fd_pool);
+        auto file = table.open_as(file_id, FileBase::REGULAR_FILE)->cast_as<RegularFile>();
+        REQUIRE(file->is_inline());
+        REQUIRE(file->size() == tiny.size());
+        std::string buffer(tiny.size(), 0);
+        REQUIRE(file->read(&buffer[0], 0, buffer.size()) == tiny.size());
+        CHECK(buffer == tiny);
+        struct fuse_stat st;
+        file->stat(&st);
+        CHECK(st.st_size == static_cast<fuse_off_t>(tiny.size()));
+        // Only the meta file is open while the contents fit inline
+        CHECK(fd_pool->num_open_descriptors() == 1);
+        file->write(large.data(), tiny.size(), large.size());
+        CHECK(!file->is_inline());
+        CHECK(fd_pool->num_open_descriptors() == 2);
+
+        auto link = table.open_as(link_id, FileBase::SYMLINK)->cast_as<Symlink>();
+        CHECK(link->is_inline());
+        CHECK(link->get() == target);
+        table.close(file);
+        table.close(link);
+    }
+    CHECK(data_size(file_id) == tiny.size() + large.size());
+
+    {
+        FileTable table(2, root, master_key, 0, 4096, 12, 256);
+        auto file = table.open_as(file_id, FileBase::REGULAR_FILE)->cast_as<RegularFile>();
+        CHECK(!file->is_inline());
+        REQUIRE(file->size() == tiny.size() + large.size());
+        std::vector<byte> buffer(large.size());
+        REQUIRE(file->read(buffer.data(), tiny.size(), buffer.size()) == buffer.size());
+        CHECK(buffer == large);
+        table.close(file);
+    }
+}
+
+TEST_CASE("Trace recording and replay")
+{
+    using namespace securefs;
+    auto make_options = [](const std::string& dir) {
+        OSService::get_default().ensure_directory(dir, 0755);
+        operations::MountOptions opt;
+        opt.version = 4;
+        opt.root = std::make_shared<OSService>(dir);
+        opt.master_key.resize(3 * KEY_LENGTH);
+        generate_random(opt.master_key.data(), opt.master_key.size());
+        opt.flags = 0;
+        opt.block_size = 4096;
+        opt.iv_size = 12;
+        return opt;
+    };
+    auto trace_name = OSService::temp_name("tmp/trace", ".bin");
+    std::vector<char> buffer(10000, 'x');
+
+    // The lite filesystems are cached per thread, so each mount gets its own thread
+    std::thread([&]() {
+        auto opt = make_options(OSService::temp_name("tmp/traced", ".dir"));
+        struct fuse_operations ops;
+        lite::init_fuse_operations(&ops, false);
+        auto trace_stream = OSService::get_default().open_file_stream(
+            trace_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        trace_fuse_operations(&ops, std::make_shared<TraceWriter>(trace_stream));
+
+        struct fuse_context context;
+        memset(&context, 0, sizeof(context));
+        context.private_data = &opt;
+        operations::override_fuse_context(&context);
+        DEFER(operations::override_fuse_context(nullptr));
+        struct fuse_conn_info conn;
+        memset(&conn, 0, sizeof(conn));
+        context.private_data = ops.init(&conn);
+
+        struct fuse_file_info info;
+        memset(&info, 0, sizeof(info));
+        info.flags = O_RDWR;
+        REQUIRE(ops.mkdir("/dir", 0755) == 0);
+        REQUIRE(ops.create("/dir/file", S_IFREG | 0644, &info) == 0);
+        REQUIRE(ops.write("/dir/file", buffer.data(), buffer.size(), 100, &info)
+                == static_cast<int>(buffer.size()));
+        REQUIRE(ops.read("/dir/file", buffer.data(), 50, 5000, &info) == 50);
+        REQUIRE(ops.release("/dir/file", &info) == 0);
+        struct fuse_stat st;
+        REQUIRE(ops.getattr("/dir/missing", &st) == -ENOENT);
+        std::thread([&]() {
+            struct fuse_stat st;
+            REQUIRE(ops.getattr("/dir/file", &st) == 0);
+        }).join();
+        ops.destroy(context.private_data);
+    }).join();
+
+    {
+        TraceReader reader(OSService::get_default().open_file_stream(trace_name, O_RDONLY, 0));
+        std::vector<TraceRecord> records;
+        TraceRecord record;
+        while (reader.next(&record))
+            records.push_back(record);
+        REQUIRE(records.size() == 7);
+        CHECK(records[0].op == TraceOp::MKDIR);
+        CHECK(records[0].mode == 0755);
+        CHECK(records[1].op == TraceOp::CREATE);
+        CHECK(records[1].path == "/dir/file");
+        CHECK(records[2].op == TraceOp::WRITE);
+        CHECK(records[2].offset == 100);
+        CHECK(records[2].size == buffer.size());
+        CHECK(records[2].fh == records[1].fh);
+        CHECK(records[3].op == TraceOp::READ);
+        CHECK(records[3].result == 50);
+        CHECK(records[5].op == TraceOp::GETATTR);
+        CHECK(records[5].result == -ENOENT);
+        CHECK(records[5].start_ns >= records[4].start_ns);
+        CHECK(records[6].op == TraceOp::GETATTR);
+        CHECK(records[6].thread != records[5].thread);
+    }
+
+    auto replay = [&](const ReplayOptions& options) {
+        Json::Value report;
+        std::thread([&]() {
+            auto opt = make_options(OSService::temp_name("tmp/replayed", ".dir"));
+            struct fuse_operations ops;
+            lite::init_fuse_operations(&ops, false);
+            TraceReader reader(
+                OSService::get_default().open_file_stream(trace_name, O_RDONLY, 0));
+            report = replay_trace(reader, ops, &opt, options);
+        }).join();
+        CHECK(report["replayed"].asUInt64() == 7);
+        CHECK(report["skipped"].asUInt64() == 0);
+        CHECK(report["operations"]["write"]["count"].asUInt64() == 1);
+        CHECK(report["operations"]["getattr"]["count"].asUInt64() == 2);
+        return report;
+    };
+
+    // The getattr of the second thread may overtake the creation of the file
+    CHECK(replay(ReplayOptions())["workers"].asUInt64() == 2);
+
+    ReplayOptions options;
+    options.concurrent = false;
+    options.timed = true;
+    auto report = replay(options);
+    CHECK(report["workers"].asUInt64() == 1);
+    CHECK(report["operations"]["getattr"]["errors"].asUInt64() == 1);
+    for (const std::string& name : report["operations"].getMemberNames())
+        CHECK(report["operations"][name]["mismatches"].asUInt64() == 0);
+}
+
+TEST_CASE("In-process workloads")
+{
+    securefs::WorkloadOptions options;
+    options.directory = "tmp";
+    options.num_threads = 2;
+    options.num_files = 50;
+    options.copy_size = 512 << 10;
+    options.database_size = 256 << 10;
+    options.num_random_ops = 100;
+    options.tree_depth = 2;
+    options.tree_fanout = 2;
+    auto report = securefs::run_workloads(options);
+
+    for (const char* format : {"full", "lite"})
+    {
+        const Json::Value& results = report["results"][format];
+        REQUIRE(results.size() == securefs::workload_scenario_names().size());
+        CHECK(results["create_storm"]["ops"].asUInt() == 100);
+        CHECK(results["stat_storm"]["ops"].asUInt() == 300);
+        CHECK(results["sequential_copy"]["ops"].asUInt() == 8);
+        CHECK(results["sequential_copy"]["mb_per_sec"].asDouble() > 0);
+        CHECK(results["random_io"]["ops"].asUInt() >= 200);
+        CHECK(results["readdir_tree"]["ops"].asUInt() == 14);
+        // Seven directories and fourteen files per thread
+        CHECK(results["remove_tree"]["ops"].asUInt() == 42);
+        CHECK(results["stat_storm"]["latency_us"]["p99"].asDouble()
+              <= results["stat_storm"]["latency_us"]["max"].asDouble());
+    }
+
+    options.scenarios = {"rm_rf"};
+    CHECK_THROWS(securefs::run_workloads(options));
+}
+
+TEST_CASE("Memory and throttled storage")
+{
+    using namespace securefs;
+    MemoryOSService storage;
+    storage.mkdir("dir", 0755);
+    CHECK_THROWS(storage.mkdir("dir", 0755));
+    {
+        auto stream = storage.open_file_stream("dir/a", O_RDWR | O_CREAT | O_EXCL, 0644);
+        stream->write("hello", 10, 5);
+        CHECK(stream->size() == 15);
+        char buffer[20];
+        CHECK(stream->read(buffer, 8, sizeof(buffer)) == 7);
+        CHECK(memcmp(buffer, "\0\0hello", 7) == 0);
+    }
+    CHECK_THROWS(storage.open_file_stream("dir/a", O_RDWR | O_CREAT | O_EXCL, 0644));
+    CHECK_THROWS(storage.open_file_stream("dir/missing", O_RDONLY, 0));
+    CHECK_THROWS(storage.open_file_stream("dir/a", O_RDONLY, 0)->write("x", 0, 1));
+
+    struct fuse_stat st;
+    storage.link("dir/a", "dir/b");
+    REQUIRE(storage.stat("dir/b", &st));
+    CHECK(st.st_nlink == 2);
+    CHECK(st.st_size == 15);
+    storage.open_file_stream("c", O_WRONLY | O_CREAT, 0600)->write("c", 0, 1);
+    storage.rename("c", "dir/b");
+    REQUIRE(storage.stat("dir/a", &st));
+    CHECK(st.st_nlink == 1);
+    CHECK(!storage.stat("c", &st));
+    CHECK_THROWS(storage.rename("dir", "dir/sub"));
+    storage.rename_at("dir/b", storage, "c");
+    CHECK_THROWS(storage.rename_at("c", MemoryOSService(), "dir/b"));
+    storage.rename_at("c", storage, "dir/b");
+    CHECK_THROWS(storage.remove_directory("dir"));
+
+    storage.symlink("target", "dir/link");
+    char target[10];
+    CHECK(storage.readlink("dir/link", target, sizeof(target)) == 6);
+    std::set<std::string> names;
+    auto traverser = storage.create_traverser("dir");
+    std::string name;
+    while (traverser->next(&name, &st))
+        names.insert(name);
+    std::set<std::string> expected_names{".", "..", "a", "b", "link"};
+    CHECK(names == expected_names);
+    for (const char* n : {"dir/a", "dir/b", "dir/link"})
+        storage.remove_file(n);
+    storage.remove_directory("dir");
+    CHECK(!storage.stat("dir", &st));
+
+    StorageThrottle throttle(std::chrono::microseconds(2000), 1e6);
+    auto start = std::chrono::steady_clock::now();
+    throttle.delay(0);
+    throttle.delay(10000);
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::microseconds(14000));
+
+    // Both formats work on top of the in-memory storage
+    WorkloadOptions options;
+    options.storage.in_memory = true;
+    options.num_threads = 2;
+    options.num_files = 20;
+    options.copy_size = 256 << 10;
+    options.database_size = 64 << 10;
+    options.num_random_ops = 50;
+    options.tree_depth = 1;
+    options.tree_fanout = 2;
+    auto report = run_workloads(options);
+    CHECK(report["config"]["storage"].asString() == "memory");
+    CHECK(report["results"]["full"]["remove_tree"]["ops"].asUInt() == 18);
+    CHECK(report["results"]["lite"]["stat_storm"]["ops"].asUInt() == 120);
+}
+
+TEST_CASE("Directory handle cache")
+{
+    using namespace securefs;
+    auto dir = OSService::temp_name("tmp/dircache", ".dir");
+    OSService::get_default().ensure_directory(dir, 0755);
+    auto root = std::make_shared<OSService>(dir);
+    key_type name_key, content_key, xattr_key;
+    generate_random(name_key.data(), name_key.size());
+    generate_random(content_key.data(), content_key.size());
+    generate_random(xattr_key.data(), xattr_key.size());
+    auto cache = std::make_shared<DirectoryHandleCache>(2);
+    lite::FileSystem fs(
+        root, name_key, content_key, xattr_key, 4096, 12, 0, nullptr, nullptr, cache);
+
+    fs.mkdir("/a", 0755);
+    fs.mkdir("/a/b", 0755);
+    fs.mkdir("/a/b/c", 0755);
+    fs.open("/a/b/c/file", O_RDWR | O_CREAT, 0644)->write("hello", 0, 5);
+    auto hits = cache_hits(CacheKind::DIRECTORY_HANDLES);
+    struct fuse_stat st;
+    REQUIRE(fs.stat("/a/b/c/file", &st));
+    CHECK(st.st_size == 5);
+    CHECK(cache_hits(CacheKind::DIRECTORY_HANDLES) > hits);
+    CHECK(cache->size() == 2);
+    CHECK(!fs.stat("/a/b/c/missing", &st));
+    CHECK(!fs.stat("/missing/file", &st));
+    CHECK_THROWS(fs.mkdir("/missing/dir", 0755));
+
+    fs.rename("/a/b/c/file", "/a/b/c/renamed");
+    fs.link("/a/b/c/renamed", "/a/linked");
+    fs.symlink("/a/linked", "/a/b/c/link");
+    char target[100];
+    CHECK(fs.readlink("/a/b/c/link", target, sizeof(target)) == 9);
+    CHECK(strcmp(target, "/a/linked") == 0);
+    // Between the handles of two different directories
+    fs.rename("/a/b/c/link", "/a/b/link");
+    CHECK(fs.readlink("/a/b/link", target, sizeof(target)) == 9);
+    fs.rename("/a/b/link", "/a/b/c/link");
+
+    // Paths under a renamed directory no longer resolve through its handle
+    fs.rename("/a/b", "/a/moved");
+    CHECK(!fs.stat("/a/b/c/renamed", &st));
+    CHECK_THROWS(fs.open("/a/b/c/new", O_RDWR | O_CREAT, 0644));
+    REQUIRE(fs.stat("/a/moved/c/renamed", &st));
+    CHECK(st.st_nlink == 2);
+    fs.mkdir("/a/b", 0755);
+    fs.mkdir("/a/b/c", 0755);
+    CHECK(!fs.stat("/a/b/c/renamed", &st));
+
+    fs.unlink("/a/moved/c/renamed");
+    fs.unlink("/a/moved/c/link");
+    fs.rmdir("/a/moved/c");
+    CHECK(!fs.stat("/a/moved/c", &st));
+    fs.mkdir("/a/moved/c", 0755);
+    CHECK(!fs.stat("/a/moved/c/renamed", &st));
+    CHECK(cache->size() <= cache->capacity());
+}
+
+TEST_CASE("Shared open files of the lite format")
+{
+    using namespace securefs;
+    auto dir = OSService::temp_name("tmp/openfiles", ".dir");
+    OSService::get_default().ensure_directory(dir, 0755);
+    key_type name_key, content_key, xattr_key;
+    generate_random(name_key.data(), name_key.size());
+    generate_random(content_key.data(), content_key.size());
+    generate_random(xattr_key.data(), xattr_key.size());
+    auto table = std::make_shared<lite::OpenFileTable>();
+    lite::FileSystem fs(std::make_shared<OSService>(dir),
+                        name_key,
+                        content_key,
+                        xattr_key,
+                        4096,
+                        12,
+                        0,
+                        nullptr,
+                        nullptr,
+                        nullptr,
+                        table);
+
+    auto a = fs.open("/a", O_RDWR | O_CREAT | O_EXCL, 0644);
+    CHECK_THROWS(fs.open("/a", O_RDWR | O_CREAT | O_EXCL, 0644));
+    auto b = fs.open("/a", O_RDWR, 0644);
+    CHECK(a.get() == b.get());
+    CHECK(table->size() == 1);
+    a->write("hello", 0, 5);
+    char buffer[5];
+    CHECK(b->read(buffer, 0, sizeof(buffer)) == 5);
+    CHECK(memcmp(buffer, "hello", 5) == 0);
+    a.reset();
+    CHECK(table->size() == 1);
+    CHECK(fs.open("/a", O_RDONLY, 0).get() == b.get());
+    b.reset();
+    CHECK(table->size() == 0);
+
+    // A read only file is not shared with writers, which take its place
+    auto reader = fs.open("/a", O_RDONLY, 0);
+    auto writer = fs.open("/a", O_WRONLY | O_TRUNC, 0);
+    CHECK(reader.get() != writer.get());
+    CHECK(fs.open("/a", O_RDONLY, 0).get() == writer.get());
+    writer.reset();
+    CHECK(table->size() == 0);
+    reader.reset();
+
+    // Renamed files are still shared, and new files at the old path are not
+    auto renamed = fs.open("/a", O_RDWR, 0);
+    fs.rename("/a", "/b");
+    CHECK(fs.open("/b", O_RDWR, 0).get() == renamed.get());
+    auto created = fs.open("/a", O_RDWR | O_CREAT, 0644);
+    CHECK(created.get() != renamed.get());
+    CHECK(created->size() == 0);
+    CHECK(table->size() == 2);
+
+    // Evicted descriptors no longer keep the inodes alive, so a pool turns sharing off
+    lite::FileSystem pooled_fs(std::make_shared<OSService>(dir),
+                               name_key,
+                               content_key,
+                               xattr_key,
+                               4096,
+                               12,
+                               0,
+                               std::make_shared<FileDescriptorPool>(4),
+                               nullptr,
+                               nullptr,
+                               table);
+    auto first = pooled_fs.open("/c", O_RDWR | O_CREAT, 0644);
+    CHECK(pooled_fs.open("/c", O_RDWR, 0).get() != first.get());
+    CHECK(table->size() == 2);
+}
@@ -1,14 +1,21 @@
 #include "catch.hpp"
 
+#include "benchmark.h"
+#include "cipher_cache.h"
+#include "crypto.h"
+#include "fd_pool.h"
 #include "lite_stream.h"
 #include "platform.h"
+#include "stats.h"
 #include "streams.h"
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <random>
 #include <stdint.h>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 using securefs::OSService;
@@ -188,7 +195,7 @@ TEST_CASE("Test streams")
     {
         auto meta_posix_stream = OSService::get_default().open_file_stream(
             OSService::temp_name("tmp/", "metastream"), O_RDWR | O_CREAT | O_EXCL, 0644);
-        auto aes_gcm_stream = securefs::make_cryptstream_aes_gcm(
+        auto aes_gcm_stream = securefs::make_cryptstream_aead(
             posix_stream, meta_posix_stream, key, key, id, true, 4096, 12);
         std::vector<byte> header(aes_gcm_stream.second->max_header_length() - 1, 5);
         aes_gcm_stream.second->write_header(header.data(), header.size());
@@ -205,7 +212,7 @@ TEST_CASE("Test streams")
     {
         auto underlying_stream = OSService::get_default().open_file_stream(
             OSService::temp_name("tmp/", "litestream"), O_RDWR | O_CREAT | O_EXCL, 0644);
-        securefs::lite::AESGCMCryptStream lite_stream(underlying_stream, key);
+        securefs::lite::AEADCryptStream lite_stream(underlying_stream, key);
         const byte test_data[] = "Hello, world";
         byte output[4096];
         lite_stream.write(test_data, 0, sizeof(test_data));
@@ -214,3 +221,763 @@ TEST_CASE("Test streams")
         test(lite_stream, 3001);
     }
 }
+
+namespace
+{
+class CallCountingStream : public securefs::StreamBase
+{
+private:
+    std::shared_ptr<securefs::StreamBase> m_stream;
+
+public:
+    unsigned num_reads = 0, num_writes = 0;
+
+    explicit CallCountingStream(std::shared_ptr<securefs::StreamBase> stream)
+        : m_stream(std::move(stream))
+    {
+    }
+
+    securefs::length_type
+    read(void* output, securefs::offset_type offset, securefs::length_type length) override
+    {
+        ++num_reads;
+        return m_stream->read(output, offset, length);
+    }
+
+    void
+    write(const void* input, securefs::offset_type offset, securefs::length_type length) override
+    {
+        ++num_writes;
+        m_stream->write(input, offset, length);
+    }
+
+    securefs::length_type size() const override { return m_stream->size(); }
+    void flush() override { m_stream->flush(); }
+    void resize(securefs::length_type length) override { m_stream->resize(length); }
+};
+}    // namespace
+
+TEST_CASE("Aligned lite stream")
+{
+    securefs::key_type key(0x5a);
+    auto underlying_stream = OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", "alignedstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    // Each group has one metadata block and (256 - 16) / (12 + 16) = 8 data blocks
+    securefs::lite::AEADCryptStream lite_stream(underlying_stream, key, 256, 12, true, true);
+    test(lite_stream, 3001);
+
+    std::vector<byte> data(256 * 20 + 17), buffer(data.size());
+    securefs::generate_random(data.data(), data.size());
+    lite_stream.resize(0);
+    lite_stream.write(data.data(), 0, data.size());
+    REQUIRE(lite_stream.size() == data.size());
+    // Two full groups, then one metadata block, four data blocks and a partial one
+    CHECK(underlying_stream->size() == 2 * 9 * 256 + 256 + 4 * 256 + 17);
+    REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == data.size());
+    CHECK(buffer == data);
+
+    // Blocks truncated within a group must read back as zeros once the stream grows again
+    lite_stream.resize(256 * 17 + 5);
+    lite_stream.resize(data.size());
+    REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == data.size());
+    CHECK(memcmp(buffer.data(), data.data(), 256 * 17 + 5) == 0);
+    CHECK(securefs::is_all_zeros(buffer.data() + 256 * 17 + 5, buffer.size() - 256 * 17 - 5));
+
+    CHECK_THROWS(securefs::lite::AEADCryptStream(underlying_stream, key, 32, 12, true, true));
+
+    // Whole groups are written and read with one call each, and so are batches near the start
+    // of a group
+    auto counting = std::make_shared<CallCountingStream>(OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", "alignedstream"), O_RDWR | O_CREAT | O_EXCL, 0644));
+    securefs::lite::AEADCryptStream counted_stream(counting, key, 256, 12, true, true);
+    counting->num_writes = 0;
+    counted_stream.write(data.data(), 0, 256 * 16);
+    CHECK(counting->num_writes == 2);
+    counting->num_reads = 0;
+    REQUIRE(counted_stream.read(buffer.data(), 0, 256 * 16) == 256 * 16);
+    CHECK(counting->num_reads == 2);
+    CHECK(memcmp(buffer.data(), data.data(), 256 * 16) == 0);
+    counting->num_reads = 0;
+    REQUIRE(counted_stream.read(buffer.data(), 256, 256 * 4) == 256 * 4);
+    CHECK(counting->num_reads == 1);
+    CHECK(memcmp(buffer.data(), data.data() + 256, 256 * 4) == 0);
+}
+
+TEST_CASE("I/O amplification counters")
+{
+    using securefs::IOCounter;
+    using securefs::io_count;
+    securefs::key_type key(0x3c);
+    securefs::id_type id(0x7d);
+    std::vector<byte> data(4096 * 4);
+    securefs::generate_random(data.data(), data.size());
+
+    securefs::lite::AEADCryptStream lite_stream(
+        OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "amplification"), O_RDWR | O_CREAT | O_EXCL, 0644),
+        key);
+    lite_stream.write(data.data(), 0, data.size());
+
+    uint64_t before[static_cast<size_t>(IOCounter::COUNT)];
+    for (size_t i = 0; i < static_cast<size_t>(IOCounter::COUNT); ++i)
+        before[i] = io_count(static_cast<IOCounter>(i));
+    auto delta = [&](IOCounter counter) {
+        return io_count(counter) - before[static_cast<size_t>(counter)];
+    };
+
+    securefs::enable_per_file_io_counts(3);
+    DEFER(securefs::enable_per_file_io_counts(0));
+    {
+        securefs::IOAttribution attribution("/amplified");
+        // A small write in the middle of a block reencrypts the whole block
+        lite_stream.write(data.data(), 4096 + 10, 100);
+    }
+    CHECK(delta(IOCounter::LOGICAL_BYTES_WRITTEN) == 100);
+    CHECK(delta(IOCounter::BLOCKS_REWRITTEN) == 1);
+    CHECK(delta(IOCounter::BYTES_DECRYPTED) == 4096);
+    CHECK(delta(IOCounter::BYTES_ENCRYPTED) == 4096);
+    CHECK(delta(IOCounter::UNDERLYING_BYTES_READ) >= 4096);
+    CHECK(delta(IOCounter::UNDERLYING_BYTES_WRITTEN) >= 4096);
+    // The paths without traffic are the first to go once too many are counted
+    for (int i = 0; i < 3000; ++i)
+        securefs::IOAttribution attribution(("/idle" + std::to_string(i)).c_str());
+    CHECK(securefs::format_statistics().find("\"/amplified\"") != std::string::npos);
+
+    // The metadata of the full format is rehashed as a whole on flush
+    auto full_stream = securefs::make_cryptstream_aead(
+                           OSService::get_default().open_file_stream(
+                               OSService::temp_name("tmp/", "amplification"),
+                               O_RDWR | O_CREAT | O_EXCL,
+                               0644),
+                           OSService::get_default().open_file_stream(
+                               OSService::temp_name("tmp/", "amplification"),
+                               O_RDWR | O_CREAT | O_EXCL,
+                               0644),
+                           key,
+                           key,
+                           id,
+                           true,
+                           4096,
+                           12)
+                           .first;
+    full_stream->write(data.data(), 0, data.size());
+    auto rehashed = io_count(IOCounter::META_BYTES_REHASHED);
+    full_stream->flush();
+    CHECK(io_count(IOCounter::META_BYTES_REHASHED) - rehashed >= 4 * (12 + 16));
+}
+
+TEST_CASE("Sparse streams")
+{
+    securefs::key_type key(0x2d);
+    securefs::id_type id(0x4e);
+    std::vector<byte> data(4096 * 64 + 300), buffer(data.size());
+    securefs::generate_random(data.data(), data.size());
+    // The middle is zeroed after being written, and the tail is past a gap left by extension
+    const size_t zero_begin = 4096 * 3 + 10, zero_end = 4096 * 60 + 20;
+
+    for (bool aligned : {false, true})
+    {
+        auto underlying = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "sparsestream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, 12, true, aligned);
+        lite_stream.write(data.data(), 0, data.size());
+        std::vector<byte> zeros(zero_end - zero_begin, 0);
+        lite_stream.write(zeros.data(), zero_begin, zeros.size());
+        lite_stream.write(data.data(), data.size() + 4096 * 40, 100);
+
+        std::vector<byte> expected(data.size() + 4096 * 40 + 100, 0);
+        std::copy(data.begin(), data.end(), expected.begin());
+        std::fill(expected.begin() + zero_begin, expected.begin() + zero_end, 0);
+        std::copy(data.begin(), data.begin() + 100, expected.end() - 100);
+
+        std::vector<byte> output(expected.size());
+        REQUIRE(lite_stream.read(output.data(), 0, output.size()) == expected.size());
+        CHECK(output == expected);
+
+        // Only verifiable where the filesystem reports holes
+        if (underlying->punch_hole(underlying->size(), 0))
+            CHECK(underlying->hole_length(4096 * 32) > 0);
+    }
+
+    auto data_stream = OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", "sparsestream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    auto meta_stream = OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", "sparsemeta"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    const unsigned block_size = 4096, iv_size = 12, mac_size = 16;
+    auto crypt = securefs::make_cryptstream_aead(
+        data_stream, meta_stream, key, key, id, true, block_size, iv_size);
+    crypt.first->write(data.data(), 0, 4096 * 2);
+    crypt.first->resize(data.size());
+    REQUIRE(crypt.first->read(buffer.data(), 0, buffer.size()) == data.size());
+    CHECK(memcmp(buffer.data(), data.data(), 4096 * 2) == 0);
+    CHECK(securefs::is_all_zeros(buffer.data() + 4096 * 2, buffer.size() - 4096 * 2));
+
+    // A hole must still be recorded as sparse in the metadata, whose per block entries of an IV
+    // and a MAC end the meta stream
+    const size_t num_blocks = (data.size() + block_size - 1) / block_size, corrupted_block = 10;
+    byte garbage = 1;
+    meta_stream->write(
+        &garbage, meta_stream->size() - (num_blocks - corrupted_block) * (iv_size + mac_size), 1);
+    CHECK_THROWS(crypt.first->read(buffer.data(), block_size * 8, block_size * 8));
+}
+
+TEST_CASE("Unauthenticated decryption")
+{
+    securefs::key_type key(0x3c);
+    securefs::id_type id(0x71);
+    std::vector<byte> data(4096 * 3 + 100), buffer(data.size());
+    securefs::generate_random(data.data(), data.size());
+
+    // Only 12 byte IVs take the CTR path, others fall back to the full decryption
+    for (unsigned iv_size : {12, 16})
+    {
+        auto underlying = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "unauthstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        {
+            securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, iv_size, true);
+            lite_stream.write(data.data(), 0, data.size());
+        }
+        {
+            securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, iv_size, false);
+            REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == data.size());
+            CHECK(buffer == data);
+        }
+
+        auto data_stream = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "unauthstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        auto meta_stream = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "unauthmeta"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        {
+            auto crypt = securefs::make_cryptstream_aead(
+                data_stream, meta_stream, key, key, id, true, 4096, iv_size);
+            crypt.first->write(data.data(), 0, data.size());
+        }
+        {
+            auto crypt = securefs::make_cryptstream_aead(
+                data_stream, meta_stream, key, key, id, false, 4096, iv_size);
+            REQUIRE(crypt.first->read(buffer.data(), 0, buffer.size()) == data.size());
+            CHECK(buffer == data);
+        }
+
+        // Tampered contents are returned as is rather than rejected
+        byte ciphertext;
+        REQUIRE(data_stream->read(&ciphertext, 5000, 1) == 1);
+        ciphertext ^= 0x80;
+        data_stream->write(&ciphertext, 5000, 1);
+        auto crypt = securefs::make_cryptstream_aead(
+            data_stream, meta_stream, key, key, id, false, 4096, iv_size);
+        REQUIRE(crypt.first->read(buffer.data(), 0, buffer.size()) == data.size());
+        CHECK(memcmp(buffer.data(), data.data(), 4096) == 0);
+        if (iv_size == 12)
+            CHECK(buffer[5000] == static_cast<byte>(data[5000] ^ 0x80));
+    }
+}
+
+TEST_CASE("ChaCha20-Poly1305 streams")
+{
+    securefs::key_type key(0x6d);
+    securefs::id_type id(0x29);
+    {
+        auto data_stream = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "chachastream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        auto meta_stream = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "chachameta"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        auto crypt = securefs::make_cryptstream_aead(
+            data_stream,
+            meta_stream,
+            key,
+            key,
+            id,
+            true,
+            4096,
+            12,
+            32,
+            securefs::AEADAlgorithm::CHACHA20_POLY1305);
+        std::vector<byte> header(crypt.second->max_header_length(), 9);
+        crypt.second->write_header(header.data(), header.size());
+        test(*crypt.first, 1000);
+        REQUIRE(crypt.second->read_header(header.data(), header.size()));
+        CHECK(securefs::is_all_equal(header.begin(), header.end(), 9));
+    }
+    {
+        auto underlying = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "chachalite"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        securefs::lite::AEADCryptStream lite_stream(
+            underlying, key, 4096, 12, true, false, {}, securefs::AEADAlgorithm::CHACHA20_POLY1305);
+        test(lite_stream, 3001);
+
+        const byte data[] = "ChaCha20-Poly1305";
+        byte output[sizeof(data)];
+        lite_stream.resize(0);
+        lite_stream.write(data, 0, sizeof(data));
+        lite_stream.flush();
+
+        // The same file cannot be read with the other cipher
+        securefs::lite::AEADCryptStream gcm_stream(underlying, key, 4096, 12, true);
+        CHECK_THROWS(gcm_stream.read(output, 0, sizeof(output)));
+
+        CHECK_THROWS(securefs::lite::AEADCryptStream(underlying,
+                                                     key,
+                                                     4096,
+                                                     16,
+                                                     true,
+                                                     false,
+                                                     {},
+                                                     securefs::AEADAlgorithm::CHACHA20_POLY1305));
+    }
+}
+
+TEST_CASE("Cipher context cache")
+{
+    auto cache = std::make_shared<securefs::CipherContextCache<securefs::AEADContext>>(2);
+    securefs::key_type key(0x2b);
+    std::vector<std::shared_ptr<securefs::FileStream>> underlying_streams;
+    std::vector<byte> data(5000);
+    securefs::generate_random(data.data(), data.size());
+
+    for (int i = 0; i < 3; ++i)
+    {
+        underlying_streams.push_back(OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "cachedstream"), O_RDWR | O_CREAT | O_EXCL, 0644));
+        securefs::lite::AEADCryptStream lite_stream(
+            underlying_streams.back(), key, 4096, 12, true, false, cache);
+        lite_stream.write(data.data(), 0, data.size());
+        REQUIRE(cache->size() == std::min(i, 2));
+    }
+    // Only the two most recently closed are kept
+    REQUIRE(cache->size() == 2);
+
+    for (int i : {2, 1, 0})
+    {
+        securefs::lite::AEADCryptStream lite_stream(
+            underlying_streams[i], key, 4096, 12, true, false, cache);
+        // The first stream has been evicted, so its contexts are derived anew
+        CHECK(cache->size() == (i == 0 ? 2 : 1));
+        std::vector<byte> buffer(data.size());
+        REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == data.size());
+        CHECK(buffer == data);
+    }
+    CHECK(cache->size() == 2);
+    CHECK(cache->take("no such header") == nullptr);
+}
+
+TEST_CASE("File descriptor pool")
+{
+    auto base_dir = OSService::temp_name("tmp/fd_pool", ".dir");
+    OSService::get_default().ensure_directory(base_dir, 0755);
+    auto root = std::make_shared<OSService>(base_dir);
+    auto pool = std::make_shared<securefs::FileDescriptorPool>(3);
+
+    std::vector<std::shared_ptr<securefs::FileStream>> streams;
+    for (int i = 0; i < 8; ++i)
+    {
+        streams.push_back(pool->open(root, std::to_string(i), O_RDWR | O_CREAT | O_EXCL, 0644));
+        std::string contents(100 + i, static_cast<char>('a' + i));
+        streams.back()->write(contents.data(), 0, contents.size());
+        REQUIRE(pool->num_open_descriptors() <= pool->capacity());
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        std::string contents(200, 0);
+        REQUIRE(streams[i]->size() == 100 + i);
+        REQUIRE(streams[i]->read(&contents[0], 0, contents.size()) == 100 + i);
+        contents.resize(100 + i);
+        CHECK(contents == std::string(100 + i, static_cast<char>('a' + i)));
+        REQUIRE(pool->num_open_descriptors() <= pool->capacity());
+    }
+
+    test(*streams[0], 1000);
+
+    // A stream whose file has been replaced must not silently reopen the new one
+    for (int i = 3; i < 8; ++i)
+        streams[i]->size();
+    root->rename("2", "renamed");
+    root->open_file_stream("2", O_RDWR | O_CREAT | O_EXCL, 0644);
+    try
+    {
+        streams[2]->size();
+        FAIL("Reopening a replaced file should fail");
+    }
+    catch (const securefs::ExceptionBase& e)
+    {
+        CHECK(e.error_number() == ESTALE);
+    }
+
+    // A stream whose path is announced to move keeps its descriptor for good
+    pool->pin_path(root->norm_path("3"));
+    root->rename("3", "renamed3");
+    for (int i = 4; i < 8; ++i)
+        streams[i]->size();
+    CHECK(streams[3]->size() == 103);
+
+    // Locks nest, and the descriptor stays open until the last one is released
+    streams[0]->lock(false);
+    streams[0]->lock(false);
+    streams[0]->unlock();
+    streams[1]->lock(false);
+    for (int i = 4; i < 8; ++i)
+        streams[i]->size();
+    // Streams 0, 1 and 3 cannot be evicted, on top of the one just used
+    CHECK(pool->num_open_descriptors() == 4);
+    streams[0]->unlock();
+    for (int i = 4; i < 8; ++i)
+        streams[i]->size();
+    CHECK(pool->num_open_descriptors() == 3);
+    streams[1]->unlock();
+}
+
+TEST_CASE("Memory mapped read-only stream")
+{
+    auto base_dir = OSService::temp_name("tmp/mapped", ".dir");
+    OSService::get_default().ensure_directory(base_dir, 0755);
+    auto root = std::make_shared<OSService>(base_dir);
+    securefs::key_type key(0x71);
+
+    std::vector<byte> data(4096 * 10 + 300), buffer(data.size());
+    securefs::generate_random(data.data(), data.size());
+    for (bool aligned : {false, true})
+    {
+        {
+            auto underlying = root->open_file_stream("lite", O_RDWR | O_CREAT | O_TRUNC, 0644);
+            securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, 12, true, aligned);
+            lite_stream.write(data.data(), 0, data.size());
+            // A hole in the middle
+            lite_stream.write(data.data(), data.size() + 4096 * 3, 100);
+        }
+
+        auto mapped_root = std::make_shared<OSService>(base_dir);
+        if (!mapped_root->enable_mapped_reads())
+        {
+            WARN("Memory mapped reads are not supported on this platform");
+            return;
+        }
+        auto underlying = mapped_root->open_file_stream("lite", O_RDONLY, 0);
+        securefs::length_type length = 100;
+        REQUIRE(underlying->mapped_view(0, length) != nullptr);
+        REQUIRE(length == 100);
+        length = 100;
+        CHECK(underlying->mapped_view(underlying->size(), length) == nullptr);
+        CHECK_THROWS(underlying->write(data.data(), 0, 1));
+
+        securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, 12, true, aligned);
+        REQUIRE(lite_stream.size() == data.size() + 4096 * 3 + 100);
+        REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == buffer.size());
+        CHECK(buffer == data);
+        std::vector<byte> hole(4096 * 3 + 200);
+        REQUIRE(lite_stream.read(hole.data(), data.size(), hole.size()) == 4096 * 3 + 100);
+        CHECK(securefs::is_all_zeros(hole.data(), 4096 * 3));
+        CHECK(memcmp(hole.data() + 4096 * 3, data.data(), 100) == 0);
+        // Random accesses
+        for (int i = 0; i < 50; ++i)
+        {
+            auto offset = (i * 7919) % (data.size() - 1000);
+            REQUIRE(lite_stream.read(buffer.data(), offset, 1000) == 1000);
+            CHECK(memcmp(buffer.data(), data.data() + offset, 1000) == 0);
+        }
+    }
+
+    // Truncation behind the back of the mapping must not crash the process
+    auto mapped_root = std::make_shared<OSService>(base_dir);
+    mapped_root->enable_mapped_reads();
+    auto mapped = mapped_root->open_file_stream("lite", O_RDONLY, 0);
+    securefs::length_type view_length = 4096 * 4;
+    const byte* view = mapped->mapped_view(0, view_length);
+    REQUIRE(view != nullptr);
+    root->open_file_stream("lite", O_RDWR, 0)->resize(4096);
+    CHECK(securefs::is_all_zeros(view + 4096 * 2, 4096));
+    CHECK(mapped->read(buffer.data(), 0, 4096 * 4) == 4096);
+    CHECK(mapped->size() == 4096);
+    view_length = 100;
+    CHECK(mapped->mapped_view(0, view_length) == nullptr);
+}
+
+TEST_CASE("io_uring file stream")
+{
+    auto base_dir = OSService::temp_name("tmp/io_uring", ".dir");
+    OSService::get_default().ensure_directory(base_dir, 0755);
+    auto root = std::make_shared<OSService>(base_dir);
+    if (!root->enable_io_uring(32))
+    {
+        WARN("io_uring is not supported on this platform");
+        return;
+    }
+
+    {
+        auto stream = root->open_file_stream("random", O_RDWR | O_CREAT | O_EXCL, 0644);
+        test(*stream, 3000);
+    }
+    {
+        auto underlying = root->open_file_stream("lite", O_RDWR | O_CREAT | O_EXCL, 0644);
+        securefs::key_type key(0x3c);
+        securefs::lite::AEADCryptStream lite_stream(underlying, key);
+        test(lite_stream, 1000);
+    }
+    {
+        // Many block writes in flight at once, followed by a read of all of them
+        auto stream = root->open_file_stream("sequential", O_RDWR | O_CREAT | O_EXCL, 0644);
+        std::vector<byte> data(4096 * 300);
+        securefs::generate_random(data.data(), data.size());
+        for (size_t off = 0; off < data.size(); off += 4096)
+            stream->write(data.data() + off, off, 4096);
+        std::vector<byte> buffer(data.size());
+        REQUIRE(stream->read(buffer.data(), 0, buffer.size()) == data.size());
+        CHECK(buffer == data);
+        stream->fsync();
+    }
+    {
+        // Streams of several threads share the ring, and wait for it to have room in turn
+        std::vector<byte> data(4096 * 200);
+        securefs::generate_random(data.data(), data.size());
+        std::vector<std::thread> threads;
+        std::vector<int> matches(4, 0);
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            threads.emplace_back([&, i]() {
+                auto stream = root->open_file_stream(
+                    "shared_ring" + std::to_string(i), O_RDWR | O_CREAT | O_EXCL, 0644);
+                for (size_t off = 0; off < data.size(); off += 4096)
+                    stream->write(data.data() + off, off, 4096);
+                stream->flush();
+                std::vector<byte> buffer(data.size());
+                matches[i] = stream->read(buffer.data(), 0, buffer.size()) == data.size()
+                    && buffer == data;
+            });
+        }
+        for (auto&& t : threads)
+            t.join();
+        CHECK(matches == std::vector<int>(matches.size(), 1));
+    }
+}
+
+TEST_CASE("Parallel writes to one lite stream")
+{
+    securefs::key_type key(0x5a);
+    // The regions do not start on block boundaries, so neighbours share blocks
+    const size_t num_writers = 4, region_size = 4096 * 8 + 1000, chunk_size = 1500;
+    const size_t appended_size = 4096 * 6 + 77;
+    std::vector<byte> data(num_writers * region_size + appended_size);
+    securefs::generate_random(data.data(), data.size());
+
+    for (bool aligned : {false, true})
+    {
+        auto underlying = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "parallelstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, 12, true, aligned);
+        std::vector<byte> zeros(num_writers * region_size, 0);
+        lite_stream.write(zeros.data(), 0, zeros.size());
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < num_writers; ++i)
+        {
+            threads.emplace_back([&, i]() {
+                for (size_t off = i * region_size; off < (i + 1) * region_size; off += chunk_size)
+                {
+                    auto len = std::min(chunk_size, (i + 1) * region_size - off);
+                    lite_stream.write(data.data() + off, off, len);
+                }
+            });
+        }
+        // Extends the stream while the others write, so the end keeps moving
+        threads.emplace_back([&]() {
+            for (size_t off = zeros.size(); off < data.size(); off += chunk_size)
+                lite_stream.write(
+                    data.data() + off, off, std::min(chunk_size, data.size() - off));
+        });
+        // Every block read must be authentic, whatever the progress of the writers
+        threads.emplace_back([&]() {
+            std::vector<byte> buffer(data.size());
+            for (int round = 0; round < 20; ++round)
+                lite_stream.read(buffer.data(), 0, buffer.size());
+        });
+        for (auto&& t : threads)
+            t.join();
+
+        REQUIRE(lite_stream.size() == data.size());
+        std::vector<byte> buffer(data.size());
+        REQUIRE(lite_stream.read(buffer.data(), 0, buffer.size()) == data.size());
+        CHECK(buffer == data);
+    }
+}
+
+template <class Function>
+static double measure_seconds(Function&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+namespace
+{
+// Goes through the per-block path, as every call did before runs of blocks were batched
+class UnbatchedLiteStream : public securefs::lite::AEADCryptStream
+{
+public:
+    using securefs::lite::AEADCryptStream::AEADCryptStream;
+
+protected:
+    securefs::length_type read_blocks(securefs::offset_type start_block,
+                                      securefs::length_type num_blocks,
+                                      void* output) override
+    {
+        return BlockBasedStream::read_blocks(start_block, num_blocks, output);
+    }
+
+    void write_blocks(securefs::offset_type start_block,
+                      securefs::length_type num_blocks,
+                      const void* input) override
+    {
+        BlockBasedStream::write_blocks(start_block, num_blocks, input);
+    }
+};
+}    // namespace
+
+TEST_CASE("Lite stream throughput", "[.benchmark]")
+{
+    securefs::key_type key(0x19);
+    std::vector<byte> data(1 << 20);
+    securefs::generate_random(data.data(), data.size());
+    const size_t total_size = 64 << 20;
+
+    for (bool aligned : {false, true})
+    {
+        // The same 1 MiB calls, block by block and then batched
+        for (bool batched : {false, true})
+        {
+            auto underlying = OSService::get_default().open_file_stream(
+                OSService::temp_name("tmp/", "benchstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+            std::unique_ptr<securefs::lite::AEADCryptStream> lite_stream;
+            if (batched)
+                lite_stream.reset(new securefs::lite::AEADCryptStream(
+                    underlying, key, 4096, 12, true, aligned));
+            else
+                lite_stream.reset(
+                    new UnbatchedLiteStream(underlying, key, 4096, 12, true, aligned));
+
+            double write_seconds = measure_seconds([&]() {
+                for (size_t off = 0; off < total_size; off += data.size())
+                    lite_stream->write(data.data(), off, data.size());
+            });
+            double read_seconds = measure_seconds([&]() {
+                for (size_t off = 0; off < total_size; off += data.size())
+                    REQUIRE(lite_stream->read(data.data(), off, data.size()) == data.size());
+            });
+            printf("Lite stream (%s layout, %s): write %.2f GB/s, read %.2f GB/s\n",
+                   aligned ? "aligned" : "packed",
+                   batched ? "batched" : "block by block",
+                   total_size / write_seconds / 1e9,
+                   total_size / read_seconds / 1e9);
+        }
+    }
+}
+
+TEST_CASE("Unauthenticated read throughput", "[.benchmark]")
+{
+    securefs::key_type key(0x47);
+    std::vector<byte> data(1 << 20);
+    securefs::generate_random(data.data(), data.size());
+    const size_t total_size = 64 << 20;
+
+    auto underlying = OSService::get_default().open_file_stream(
+        OSService::temp_name("tmp/", "benchstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+    {
+        securefs::lite::AEADCryptStream lite_stream(underlying, key);
+        for (size_t off = 0; off < total_size; off += data.size())
+            lite_stream.write(data.data(), off, data.size());
+    }
+    for (bool check : {true, false})
+    {
+        securefs::lite::AEADCryptStream lite_stream(underlying, key, 4096, 12, check);
+        double read_seconds = measure_seconds([&]() {
+            for (size_t off = 0; off < total_size; off += data.size())
+                REQUIRE(lite_stream.read(data.data(), off, data.size()) == data.size());
+        });
+        printf("Lite stream reads %s authentication: %.2f GB/s\n",
+               check ? "with" : "without",
+               total_size / read_seconds / 1e9);
+    }
+}
+
+TEST_CASE("Content cipher throughput", "[.benchmark]")
+{
+    securefs::key_type key(0x52);
+    std::vector<byte> data(1 << 20);
+    securefs::generate_random(data.data(), data.size());
+    const size_t total_size = 64 << 20;
+
+    for (auto algorithm :
+         {securefs::AEADAlgorithm::AES_GCM, securefs::AEADAlgorithm::CHACHA20_POLY1305})
+    {
+        auto underlying = OSService::get_default().open_file_stream(
+            OSService::temp_name("tmp/", "benchstream"), O_RDWR | O_CREAT | O_EXCL, 0644);
+        securefs::lite::AEADCryptStream lite_stream(
+            underlying, key, 4096, 12, true, false, {}, algorithm);
+        double write_seconds = measure_seconds([&]() {
+            for (size_t off = 0; off < total_size; off += data.size())
+                lite_stream.write(data.data(), off, data.size());
+        });
+        double read_seconds = measure_seconds([&]() {
+            for (size_t off = 0; off < total_size; off += data.size())
+                REQUIRE(lite_stream.read(data.data(), off, data.size()) == data.size());
+        });
+        printf("Lite stream with %s: write %.2f GB/s, read %.2f GB/s\n",
+               securefs::aead_algorithm_name(algorithm),
+               total_size / write_seconds / 1e9,
+               total_size / read_seconds / 1e9);
+    }
+}
+
+TEST_CASE("Benchmark report")
+{
+    securefs::BenchmarkOptions options;
+    options.directory = "tmp";
+    options.file_size = 256 << 10;
+    options.num_entries = 100;
+    auto report = securefs::run_benchmarks(options);
+
+    for (const char* layer : {"full", "lite", "hmac"})
+    {
+        const Json::Value& results = report["results"][layer];
+        REQUIRE(results.size() == 5);
+        CHECK(results["sequential_write"]["ops"].asUInt() == 4);
+        CHECK(results["random_read_4k"]["ops"].asUInt() == 64);
+        CHECK(results["partial_block_write"]["mb_per_sec"].asDouble() > 0);
+        CHECK(results["sequential_read"]["latency_us"]["p99"].asDouble()
+              <= results["sequential_read"]["latency_us"]["max"].asDouble());
+    }
+    CHECK(report["results"]["btree"]["lookup"]["ops"].asUInt() == 100);
+
+    options.layers = {"btree", "disk"};
+    CHECK_THROWS(securefs::run_benchmarks(options));
+}
+
+TEST_CASE("Kernel baseline comparison")
+{
+    Json::Value baseline;
+    baseline["hkdf"]["ns_per_op"] = 1000.0;
+    baseline["case_fold"]["ns_per_op"] = 200.0;
+    baseline["is_all_zeros"]["ns_per_op"] = 0.0;
+
+    Json::Value results;
+    results["hkdf"]["ns_per_op"] = 1300.0;
+    results["case_fold"]["ns_per_op"] = 200.0;
+    results["is_all_zeros"]["ns_per_op"] = 50.0;
+    results["base32_encode"]["ns_per_op"] = 80.0;
+
+    auto regressed = securefs::compare_with_baseline(results, baseline, 0.15);
+    REQUIRE(regressed.size() == 1);
+    CHECK(regressed[0] == "hkdf");
+    CHECK(results["hkdf"]["regressed"].asBool());
+    CHECK(results["hkdf"]["ratio_to_baseline"].asDouble() == Approx(1.3));
+    CHECK(!results["case_fold"].isMember("regressed"));
+    CHECK(results["case_fold"]["ratio_to_baseline"].asDouble() == Approx(1.0));
+    CHECK(results["is_all_zeros"]["baseline"].asString() == "invalid");
+    CHECK(results["base32_encode"]["baseline"].asString() == "missing");
+
+    // Such as the output of a run of the storage layers
+    Json::Value layers;
+    layers["results"]["full"]["sequential_write"]["ops"] = 4;
+    CHECK(securefs::compare_with_baseline(results, layers, 0.15).empty());
+    CHECK_THROWS(securefs::compare_with_baseline(results, Json::Value(3), 0.15));
+    CHECK_THROWS(securefs::compare_with_baseline(results, Json::Value("hkdf"), 0.15));
+}
@@ -1,10 +1,21 @@
 #include "case_fold.h"
 #include "catch.hpp"
 #include "crypto.h"
+#include "logger.h"
 #include "myutils.h"
 #include "platform.h"
+#include "spans.h"
+#include "stats.h"
 
 #include <cryptopp/base32.h>
+#include <json/json.h>
+
+#include <atomic>
+#include <chrono>
+#include <signal.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
 
 TEST_CASE("Test endian")
 {
@@ -102,6 +113,26 @@ TEST_CASE("our base32 against CryptoPP")
     }
 }
 
+TEST_CASE("All zeros")
+{
+    std::vector<byte> buffer(300, 0);
+    for (size_t begin = 0; begin < 9; ++begin)
+    {
+        for (size_t end = begin; end < buffer.size(); end += 7)
+        {
+            REQUIRE(securefs::is_all_zeros(buffer.data() + begin, end - begin));
+            if (end == begin)
+                continue;
+            buffer[end - 1] = 1;
+            REQUIRE(!securefs::is_all_zeros(buffer.data() + begin, end - begin));
+            buffer[end - 1] = 0;
+            buffer[begin] = 0x80;
+            REQUIRE(!securefs::is_all_zeros(buffer.data() + begin, end - begin));
+            buffer[begin] = 0;
+        }
+    }
+}
+
 TEST_CASE("case fold")
 {
     using securefs::case_fold;
@@ -112,3 +143,151 @@ TEST_CASE("case fold")
                 "AabC\xce\xa3\xce\xaf\xcf\x83\xcf\x85\xcf\x86\xce\xbf\xcf\x82\xef\xac\x81\xc3\x86")
             == "aabc\xcf\x83\xce\xaf\xcf\x83\xcf\x85\xcf\x86\xce\xbf\xcf\x83\xef\xac\x81\xc3\xa6");
 }
+
+TEST_CASE("Latency histogram")
+{
+    securefs::LatencyHistogram histogram;
+    CHECK(histogram.percentile_ns(0.5) == 0);
+    for (uint64_t ns : {0, 1, 3, 900, 1000, 1023, 1024, 5000000})
+        histogram.record(ns);
+    CHECK(histogram.count() == 8);
+    CHECK(histogram.max_ns() == 5000000);
+    CHECK(histogram.bucket(0) == 2);
+    CHECK(histogram.bucket(1) == 1);
+    CHECK(histogram.bucket(9) == 3);
+    CHECK(histogram.bucket(10) == 1);
+    CHECK(histogram.percentile_ns(0.5) == 1024);
+    CHECK(histogram.percentile_ns(1.0) == (1u << 23));
+
+    securefs::LatencyHistogram merged;
+    merged.record(2000);
+    merged.merge(histogram);
+    CHECK(merged.count() == 9);
+    CHECK(merged.max_ns() == 5000000);
+    CHECK(merged.bucket(9) == 3);
+    CHECK(merged.bucket(10) == 2);
+
+    auto hits = securefs::cache_hits(securefs::CacheKind::FD_POOL);
+    securefs::record_cache_access(securefs::CacheKind::FD_POOL, true);
+    CHECK(securefs::cache_hits(securefs::CacheKind::FD_POOL) == hits + 1);
+    {
+        securefs::OperationTimer timer(securefs::Operation::FSYNC);
+    }
+    // The shard of an exited thread still counts
+    std::thread([]() { securefs::OperationTimer timer(securefs::Operation::FSYNC); }).join();
+    securefs::LatencyHistogram fsyncs;
+    securefs::collect_operation_histogram(securefs::Operation::FSYNC, fsyncs);
+    CHECK(fsyncs.count() >= 2);
+    CHECK(securefs::format_statistics().find("\"fsync\"") != std::string::npos);
+}
+
+TEST_CASE("Asynchronous logger")
+{
+    const int NUM_THREADS = 4, NUM_RECORDS = 1000;
+    auto path = securefs::OSService::temp_name("tmp/", ".log");
+    std::unique_ptr<securefs::Logger> logger(securefs::Logger::create_file_logger(path));
+    logger->start_async();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; ++t)
+    {
+        threads.emplace_back([&logger, t]() {
+            for (int i = 0; i < NUM_RECORDS; ++i)
+                logger->log(securefs::kLogInfo, "thread %d record %d", t, i);
+        });
+    }
+    for (auto&& t : threads)
+        t.join();
+    logger->log(securefs::kLogInfo, "long %s", std::string(1000, 'x').c_str());
+    logger->stop_async();
+    logger->log(securefs::kLogInfo, "synchronous");
+    auto dropped = logger->dropped_count();
+    logger.reset();
+
+    std::string contents;
+    auto stream = securefs::OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+    contents.resize(stream->size());
+    stream->read(&contents[0], 0, contents.size());
+
+    // Each thread's records are in order, and the missing ones are all counted as dropped
+    size_t written = 0;
+    for (int t = 0; t < NUM_THREADS; ++t)
+    {
+        size_t pos = 0;
+        int last = -1;
+        while ((pos = contents.find(securefs::strprintf("thread %d record ", t), pos))
+               != std::string::npos)
+        {
+            pos += securefs::strprintf("thread %d record ", t).size();
+            int index = atoi(contents.c_str() + pos);
+            REQUIRE(index > last);
+            last = index;
+            ++written;
+        }
+    }
+    CHECK(written + dropped == NUM_THREADS * NUM_RECORDS);
+    CHECK(contents.find("synchronous\n") != std::string::npos);
+    CHECK(contents.find("xxx... [truncated]\n") != std::string::npos);
+    if (dropped > 0)
+        CHECK(contents.find("log records were dropped") != std::string::npos);
+}
+
+TEST_CASE("Span tracing")
+{
+    auto path = securefs::OSService::temp_name("tmp/", ".json");
+    {
+        securefs::ScopedSpan untraced("untraced");
+    }
+    securefs::start_span_tracing(
+        securefs::OSService::get_default().open_file_stream(path, O_RDWR | O_CREAT | O_TRUNC, 0644),
+        2);
+    // On a fresh thread, so that the sampling starts from its first outermost span
+    std::thread([]() {
+        for (int i = 0; i < 4; ++i)
+        {
+            securefs::ScopedSpan outer("outer");
+            securefs::ScopedSpan inner("inner");
+        }
+    }).join();
+    securefs::stop_span_tracing();
+    {
+        securefs::ScopedSpan untraced("untraced");
+    }
+
+    std::string contents;
+    auto stream = securefs::OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+    contents.resize(stream->size());
+    stream->read(&contents[0], 0, contents.size());
+    Json::Value trace;
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    REQUIRE(reader->parse(contents.data(), contents.data() + contents.size(), &trace, nullptr));
+    const Json::Value& events = trace["traceEvents"];
+    REQUIRE(events.size() == 5);
+    for (unsigned i = 0; i < 4; i += 2)
+    {
+        const Json::Value& inner = events[i];
+        const Json::Value& outer = events[i + 1];
+        CHECK(inner["name"].asString() == "inner");
+        CHECK(outer["name"].asString() == "outer");
+        CHECK(outer["ph"].asString() == "X");
+        CHECK(inner["tid"] == outer["tid"]);
+        CHECK(inner["ts"].asDouble() >= outer["ts"].asDouble());
+        CHECK(inner["dur"].asDouble() <= outer["dur"].asDouble());
+    }
+    CHECK(events[4]["ph"].asString() == "M");
+}
+
+#ifndef WIN32
+TEST_CASE("Callbacks on signal")
+{
+    std::atomic<int> calls{0};
+    securefs::OSService::call_on_signal(SIGURG, [&calls]() { ++calls; });
+    // Only the first callback for a signal is kept
+    securefs::OSService::call_on_signal(SIGURG, [&calls]() { calls += 100; });
+    REQUIRE(::raise(SIGURG) == 0);
+    for (int i = 0; i < 500 && calls.load() == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(calls.load() == 1);
+    // The callback outlives this test, so it must not run once `calls` is gone
+    ::signal(SIGURG, SIG_IGN);
+}
+#endif